@@ -259,12 +259,13 @@ AADEQUE_NAME(_reserve)(AADEQUE_T *a, AADEQUE_SIZE_T n) {
 			 * Before:  |-->  o--|
 			 * After:   |-->     |      o--|
 			 */
-			memcpy(&(a->els[a->off + a->cap - oldcap]),
-			       &(a->els[a->off]),
-			       sizeof(AADEQUE_VALUE_T) * (a->cap - oldcap));
+			AADEQUE_SIZE_T first = oldcap - a->off, grow = a->cap - oldcap;
+			memmove(&(a->els[a->off + grow]),
+			        &(a->els[a->off]),
+			        sizeof(AADEQUE_VALUE_T) * first);
 			#ifdef AADEQUE_CLEAR_UNUSED_MEM
 			memset(&(a->els[a->off]), 0,
-			       sizeof(AADEQUE_VALUE_T) * (a->cap - oldcap));
+			       sizeof(AADEQUE_VALUE_T) * (grow < first ? grow : first));
 			#endif
 			a->off += a->cap - oldcap;
 		}
@@ -0,0 +1,909 @@
+/*
+ * Microbenchmarks for the value runtime and the compiler passes. Build and run:
+ *
+ *     make bench
+ *     ./di-bench [FILTER]
+ *
+ * All objects are compiled with -O2 and DI_ALLOC_COUNT, so the allocation
+ * functions in di.h count their calls. Only the benchmarks whose names contain
+ * FILTER are run. Each benchmark is repeated until its measured part has run
+ * for at least MIN_SECONDS, or until the runs, setup included, have taken
+ * MAX_SECONDS. The results are printed as tab-separated values, one line per
+ * benchmark and size, with a header line:
+ *
+ *     benchmark  size  ops  ns/op  allocs/op  bytes/op
+ *
+ * where allocs/op counts di_alloc() and di_realloc() calls and bytes/op the
+ * bytes requested by them. What an 'op' is is described for each benchmark
+ * below. For lex, parse and annotate, the size is the number of functions in
+ * a generated module. For annotate_long, it's the number of bindings in a
+ * function.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "di.h"
+#include "di_lexer.h"
+#include "di_parser.h"
+#include "di_annotate.h"
+#include "json.h"
+#include "di_serialize.h"
+#include "di_prettyprint.h"
+#include "di_fun.h"
+#include "di_regex.h"
+
+#ifndef DI_ALLOC_COUNT
+#error "di-bench must be compiled with -DDI_ALLOC_COUNT (use 'make bench')"
+#endif
+
+#define MIN_SECONDS 0.2
+
+// The most time the runs of a benchmark and size can take, including the
+// setup, which isn't measured. At least one run is done.
+#define MAX_SECONDS 2.0
+
+/*+-----------+*
+ *| Measuring |*
+ *+-----------+*/
+
+// The measured part of each run is enclosed in start() and stop(ops). The run
+// starts at run_t0, so the setup is what's done before start().
+static double run_t0, t0, total_time;
+static di_alloc_counters_t c0;
+static unsigned long long total_ops, total_allocs, total_bytes;
+
+static double now(void) {
+	return (double)clock() / CLOCKS_PER_SEC;
+}
+
+static void start(void) {
+	c0 = di_alloc_counters;
+	t0 = now();
+}
+
+// For a run with an expensive setup and a cheap measured part, which repeats
+// the measured part until this returns true: when it has taken about as long
+// as the setup, or MIN_SECONDS.
+static bool measured_enough(void) {
+	double elapsed = now() - t0;
+	return elapsed >= t0 - run_t0 || elapsed >= MIN_SECONDS;
+}
+
+static void stop(unsigned long long ops) {
+	total_time += now() - t0;
+	total_allocs += di_alloc_counters.allocs - c0.allocs +
+	                di_alloc_counters.reallocs - c0.reallocs;
+	total_bytes += di_alloc_counters.bytes - c0.bytes;
+	total_ops += ops;
+}
+
+/*+---------------------+*
+ *| Keys and structures |*
+ *+---------------------+*/
+
+// Int keys or heap string keys, kept alive by a reference each.
+static di_t *make_keys(di_size_t n, bool strings) {
+	di_t *keys = malloc(n * sizeof(di_t));
+	char buf[32];
+	di_size_t i;
+	for (i = 0; i < n; i++) {
+		if (strings) {
+			snprintf(buf, sizeof(buf), "key_%u", i);
+			keys[i] = di_string_from_cstring(buf);
+		} else {
+			keys[i] = di_from_int(i);
+		}
+		di_incref(keys[i]);
+	}
+	return keys;
+}
+
+static void free_keys(di_t *keys, di_size_t n) {
+	di_size_t i;
+	for (i = 0; i < n; i++)
+		di_decref_and_free(keys[i]);
+	free(keys);
+}
+
+static di_t make_dict(di_t *keys, di_size_t n) {
+	di_t d = di_dict_empty();
+	di_size_t i;
+	for (i = 0; i < n; i++)
+		d = di_dict_set(d, keys[i], di_from_int(i));
+	return d;
+}
+
+static di_t make_array(di_size_t n) {
+	di_t a = di_array_empty();
+	di_size_t i;
+	for (i = 0; i < n; i++)
+		di_array_push(&a, di_from_int(i));
+	return a;
+}
+
+// A tree of dicts and arrays with about n leaves, with strings at the bottom.
+static di_t make_tree(di_size_t n) {
+	if (n <= 4) {
+		di_t a = di_array_empty();
+		while (n-- > 0)
+			di_array_push(&a, di_string_from_cstring("a leaf string"));
+		return a;
+	}
+	di_t d = di_dict_empty();
+	d = di_dict_set(d, di_string_from_cstring("left"), make_tree(n / 2));
+	d = di_dict_set(d, di_string_from_cstring("right"),
+	                make_tree(n - n / 2));
+	d = di_dict_set(d, di_string_from_cstring("n"), di_from_int(n));
+	return d;
+}
+
+/*+------+*
+ *| Dict |*
+ *+------+*/
+
+// Op: inserting a key into an initially empty dict, until it has size keys.
+static void dict_set(di_size_t size, bool strings) {
+	di_t *keys = make_keys(size, strings);
+	start();
+	di_t d = make_dict(keys, size);
+	stop(size);
+	di_cleanup(d);
+	free_keys(keys, size);
+}
+static void dict_set_int(di_size_t size) { dict_set(size, false); }
+static void dict_set_str(di_size_t size) { dict_set(size, true); }
+
+// Op: looking up an existing key in a dict of size keys.
+static void dict_get(di_size_t size, bool strings) {
+	di_t *keys = make_keys(size, strings);
+	di_t d = make_dict(keys, size);
+	di_size_t i;
+	unsigned long long sum = 0;
+	start();
+	for (i = 0; i < size; i++)
+		sum += di_to_int(di_dict_get(d, keys[i]));
+	stop(size);
+	if (sum != (unsigned long long)size * (size - 1) / 2)
+		abort();
+	di_cleanup(d);
+	free_keys(keys, size);
+}
+static void dict_get_int(di_size_t size) { dict_get(size, false); }
+static void dict_get_str(di_size_t size) { dict_get(size, true); }
+
+// Op: deleting a key from a dict, until all size keys are deleted.
+static void dict_delete(di_size_t size, bool strings) {
+	di_t *keys = make_keys(size, strings);
+	di_t d = make_dict(keys, size);
+	di_size_t i;
+	start();
+	for (i = 0; i < size; i++)
+		d = di_dict_delete(d, keys[i]);
+	stop(size);
+	di_cleanup(d);
+	free_keys(keys, size);
+}
+static void dict_delete_int(di_size_t size) { dict_delete(size, false); }
+static void dict_delete_str(di_size_t size) { dict_delete(size, true); }
+
+// Op: visiting an entry when iterating over a dict with size keys. If sparse,
+// the dict had ten times as many keys and the others were deleted.
+static void dict_iter(di_size_t size, bool sparse) {
+	di_size_t n = sparse ? 10 * size : size;
+	di_t *keys = make_keys(n, true);
+	di_t d = make_dict(keys, n);
+	di_size_t i, pos, rounds = 1 + 1000000 / size;
+	for (i = 0; sparse && i < n; i++)
+		if (i % 10)
+			d = di_dict_delete(d, keys[i]);
+	unsigned long long visited = 0;
+	di_t value;
+	start();
+	for (i = 0; i < rounds; i++)
+		for (pos = 0; (pos = di_dict_iter(d, pos, NULL, &value));)
+			visited += di_is_int(value);
+	stop(visited);
+	if (visited != rounds * size)
+		abort();
+	di_cleanup(d);
+	free_keys(keys, n);
+}
+static void dict_iter_dense(di_size_t size) { dict_iter(size, false); }
+static void dict_iter_sparse(di_size_t size) { dict_iter(size, true); }
+
+// Op: setting a key in a shared dict of size keys, which clones it.
+static void dict_set_shared(di_size_t size) {
+	di_t *keys = make_keys(size, true);
+	di_t d = make_dict(keys, size);
+	di_incref(d);
+	di_size_t i, n = size < 1000 ? 1000 : 10;
+	start();
+	for (i = 0; i < n; i++)
+		di_cleanup(di_dict_set(d, keys[0], di_true()));
+	stop(n);
+	di_decref_and_free(d);
+	free_keys(keys, size);
+}
+
+// Op: setting a key in a dict of size keys while keeping the old version, as
+// for snapshots.
+static void dict_set_versions(di_size_t size) {
+	di_t *keys = make_keys(size, true);
+	di_t d = make_dict(keys, size);
+	di_size_t i, n = 1000;
+	start();
+	for (i = 0; i < n; i++) {
+		di_incref(d);
+		di_t next = di_dict_set(d, keys[i % size], di_from_int(-1 - i));
+		di_decref_and_free(d);
+		d = next;
+	}
+	stop(n);
+	di_cleanup(d);
+	free_keys(keys, size);
+}
+
+/*+-------+*
+ *| Array |*
+ *+-------+*/
+
+// Op: pushing an element onto an array, until it has size elements.
+static void array_push(di_size_t size) {
+	start();
+	di_t a = make_array(size);
+	stop(size);
+	di_cleanup(a);
+}
+
+// Op: unshifting an element onto an array, until it has size elements.
+static void array_unshift(di_size_t size) {
+	di_t a = di_array_empty();
+	di_size_t i;
+	start();
+	for (i = 0; i < size; i++)
+		di_array_unshift(&a, di_from_int(i));
+	stop(size);
+	di_cleanup(a);
+}
+
+// Op: popping an element from an array of size elements, until it's empty.
+static void array_pop(di_size_t size) {
+	di_t a = make_array(size);
+	di_size_t i;
+	start();
+	for (i = 0; i < size; i++)
+		di_array_pop(&a);
+	stop(size);
+	di_cleanup(a);
+}
+
+// Op: shifting an element from an array of size elements, until it's empty.
+static void array_shift(di_size_t size) {
+	di_t a = make_array(size);
+	di_size_t i;
+	start();
+	for (i = 0; i < size; i++)
+		di_array_shift(&a);
+	stop(size);
+	di_cleanup(a);
+}
+
+// Op: setting an element in a shared array of size elements, which clones it.
+static void array_set_shared(di_size_t size) {
+	di_t a = make_array(size);
+	di_incref(a);
+	di_size_t i, n = size < 1000 ? 1000 : 10;
+	start();
+	for (i = 0; i < n; i++)
+		di_cleanup(di_array_set(a, 0, di_true()));
+	stop(n);
+	di_decref_and_free(a);
+}
+
+// Op: setting an element in an array of size elements while keeping the old
+// version, as for snapshots.
+static void array_set_versions(di_size_t size) {
+	di_t a = make_array(size);
+	di_size_t i, n = 1000;
+	start();
+	for (i = 0; i < n; i++) {
+		di_incref(a);
+		di_t next = di_array_set(a, i % size, di_from_int(-1 - i));
+		di_decref_and_free(a);
+		a = next;
+	}
+	stop(n);
+	di_cleanup(a);
+}
+
+// A packed array of the ints 0 to n - 1.
+static di_t make_packed_array(di_size_t n) {
+	int32_t *ints = malloc(n * sizeof(int32_t));
+	di_size_t i;
+	for (i = 0; i < n; i++)
+		ints[i] = (int32_t)i;
+	di_t a = di_array_from_ints(ints, n);
+	free(ints);
+	return a;
+}
+
+// Op: adding an element to the sum of an array of size ints.
+static void array_sum(di_size_t size, bool packed) {
+	di_t a = packed ? make_packed_array(size) : make_array(size);
+	di_size_t i, n = 100;
+	start();
+	for (i = 0; i < n; i++)
+		if (!di_is_number(di_array_sum(a)))
+			abort();
+	stop(n * size);
+	di_cleanup(a);
+}
+static void array_sum_generic(di_size_t size) { array_sum(size, false); }
+static void array_sum_packed(di_size_t size) { array_sum(size, true); }
+
+// Op: adding 1 to an element of an unshared array of size ints.
+static void array_map(di_size_t size, bool packed) {
+	di_t a = packed ? make_packed_array(size) : make_array(size);
+	di_size_t i, n = 100;
+	start();
+	for (i = 0; i < n; i++)
+		a = di_array_map_op(a, '+', di_from_int(1));
+	stop(n * size);
+	di_cleanup(a);
+}
+static void array_map_generic(di_size_t size) { array_map(size, false); }
+static void array_map_packed(di_size_t size) { array_map(size, true); }
+
+/*+--------+*
+ *| String |*
+ *+--------+*/
+
+// Op: appending 8 bytes to a string, until it has 8 * size bytes.
+static void string_append(di_size_t size) {
+	di_t s = di_string_empty();
+	di_size_t i;
+	start();
+	for (i = 0; i < size; i++)
+		s = di_string_append_chars(s, "01234567", 8);
+	stop(size);
+	di_cleanup(s);
+}
+
+// Op: concatenating two new 20 byte strings.
+static void string_concat(di_size_t size) {
+	di_size_t i;
+	start();
+	for (i = 0; i < size; i++)
+		di_cleanup(di_string_concat(
+			di_string_from_cstring("the first string    "),
+			di_string_from_cstring("the second string   ")));
+	stop(size);
+}
+
+// Op: taking a 16 byte substring of a shared string of size bytes.
+static void string_substr(di_size_t size) {
+	di_t s = di_string_create_presized(size);
+	memset(di_string_chars(s), 'x', size);
+	di_incref(s);
+	di_size_t i;
+	start();
+	for (i = 0; i < size; i++)
+		di_cleanup(di_string_substr(s, i % (size - 16), 16));
+	stop(size);
+	di_decref_and_free(s);
+}
+
+/*+---------+*
+ *| Regexes |*
+ *+---------+*/
+
+#define LOG_PATTERN "^(\\S+) (\\w+) \\[([^\\]]*)\\] (.*)$"
+
+// Log lines, kept alive by a reference each.
+static di_t *make_log_lines(di_size_t n) {
+	static const char *levels[] = {"INFO", "WARN", "ERROR", "DEBUG"};
+	di_t *lines = malloc(n * sizeof(di_t));
+	char buf[128];
+	di_size_t i;
+	for (i = 0; i < n; i++) {
+		snprintf(buf, sizeof(buf), "2024-05-%02u %s [worker-%u] request %u "
+		         "served in %u ms", i % 28 + 1, levels[i % 4], i % 16, i,
+		         i * 7 % 1000);
+		lines[i] = di_string_from_cstring(buf);
+		di_incref(lines[i]);
+	}
+	return lines;
+}
+
+static void free_lines(di_t *lines, di_size_t n) {
+	di_size_t i;
+	for (i = 0; i < n; i++)
+		di_decref_and_free(lines[i]);
+	free(lines);
+}
+
+// Op: matching a log line and taking out the groups, as views.
+static void regex_match(di_size_t size) {
+	di_t *lines = make_log_lines(size);
+	di_t re = di_regex_compile(di_string_from_cstring(LOG_PATTERN), NULL);
+	di_incref(re);
+	di_size_t i;
+	start();
+	for (i = 0; i < size; i++)
+		di_cleanup(di_regex_match(re, lines[i]));
+	stop(size);
+	di_decref_and_free(re);
+	free_lines(lines, size);
+}
+
+// Op: testing if a log line matches, without taking out the groups.
+static void regex_test(di_size_t size) {
+	di_t *lines = make_log_lines(size);
+	di_t re = di_regex_compile(di_string_from_cstring("\\bERROR\\b"), NULL);
+	di_size_t i, n = 0;
+	start();
+	for (i = 0; i < size; i++)
+		n += di_regex_test(re, lines[i]);
+	stop(size);
+	if (n != size / 4 + (size % 4 > 2))
+		abort();
+	di_cleanup(re);
+	free_lines(lines, size);
+}
+
+// Op: looking up one of size patterns, built at runtime, in the cache.
+static void regex_cached(di_size_t size) {
+	di_t *patterns = malloc(size * sizeof(di_t));
+	char buf[32];
+	di_size_t i;
+	for (i = 0; i < size; i++) {
+		snprintf(buf, sizeof(buf), "^request (\\d+) #%u", i);
+		patterns[i] = di_string_from_cstring(buf);
+		di_incref(patterns[i]);
+	}
+	di_size_t n = 1000;
+	start();
+	for (i = 0; i < n; i++)
+		di_decref_and_free(di_regex_cached(patterns[i % size]));
+	stop(n);
+	free_lines(patterns, size);
+}
+
+// Op: compiling a pattern, which is what a match without a regex value or
+// the cache would cost on top of the match.
+static void regex_compile(di_size_t size) {
+	di_t pattern = di_string_from_cstring(LOG_PATTERN);
+	di_incref(pattern);
+	di_size_t i;
+	start();
+	for (i = 0; i < size; i++)
+		di_cleanup(di_regex_compile(pattern, NULL));
+	stop(size);
+	di_decref_and_free(pattern);
+}
+
+/*+----------------------+*
+ *| Equality and freeing |*
+ *+----------------------+*/
+
+// Op: comparing two equal, separately built trees with size leaves.
+static void equal_deep(di_size_t size) {
+	di_t a = make_tree(size), b = make_tree(size);
+	di_size_t i, n = 10;
+	start();
+	for (i = 0; i < n; i++)
+		if (!di_equal(a, b))
+			abort();
+	stop(n);
+	di_cleanup(a);
+	di_cleanup(b);
+}
+
+// Op: comparing an element of two equal, separately built arrays of size ints.
+static void equal_flat(di_size_t size) {
+	di_t a = make_array(size), b = make_array(size);
+	di_size_t i, n = 100;
+	start();
+	for (i = 0; i < n; i++)
+		if (!di_equal(a, b))
+			abort();
+	stop(n * size);
+	di_cleanup(a);
+	di_cleanup(b);
+}
+
+// Op: comparing two different trees with size leaves whose hashes are cached.
+static void equal_hashed(di_size_t size) {
+	di_t a = make_tree(size), b = make_tree(size + 1);
+	di_size_t i, n = 0;
+	di_hash(a);
+	di_hash(b);
+	start();
+	do {
+		for (i = 0; i < 1000; i++)
+			if (di_equal(a, b))
+				abort();
+		n += 1000;
+	} while (!measured_enough());
+	stop(n);
+	di_cleanup(a);
+	di_cleanup(b);
+}
+
+// Op: replacing a tree of size leaves in a dict by another one, equal to it.
+static void dict_set_deep(di_size_t size) {
+	di_t d = di_dict_empty(), key = di_string_from_cstring("tree");
+	di_size_t i, n = 100;
+	d = di_dict_set(d, key, make_tree(size));
+	start();
+	for (i = 0; i < n; i++)
+		d = di_dict_set(d, key, make_tree(size));
+	stop(n);
+	di_cleanup(d);
+}
+
+// Op: freeing a leaf of a tree with size leaves.
+static void free_tree(di_size_t size) {
+	di_t a = make_tree(size);
+	start();
+	di_cleanup(a);
+	stop(size);
+}
+
+// Op: marking a leaf of a tree with size leaves as shared between threads, and
+// freeing it as a shared value.
+static void share_tree(di_size_t size) {
+	di_t a = make_tree(size);
+	start();
+	a = di_share(a);
+	di_decref_and_free(a);
+	stop(size);
+}
+
+/*+-----------+*
+ *| Functions |*
+ *+-----------+*/
+
+static di_t fold_add(di_t acc, di_t x) {
+	return di_from_int(di_to_int(acc) + di_to_int(x));
+}
+
+// A closure adding its argument times the int in its environment.
+static di_t fold_add_scaled(di_env_t env, di_t acc, di_t x) {
+	return di_from_int(di_to_int(acc) + di_to_int(env[0]) * di_to_int(x));
+}
+
+// Op: calling a function value with two arguments, folding an array of size
+// ints with a plain function or with a closure.
+static void fold(di_size_t size, di_t fun) {
+	di_t a = make_array(size);
+	di_size_t i, j, n = 100;
+	start();
+	for (j = 0; j < n; j++) {
+		di_t acc = di_from_int(0);
+		for (i = 0; i < size; i++)
+			acc = di_call2(fun, acc, di_array_get(a, i));
+	}
+	stop(n * size);
+	di_cleanup(a);
+}
+static void fold_fun(di_size_t size) {
+	DI_FUN_STATIC(add_fun, fold_add, 2);
+	fold(size, di_from_static_fun(&add_fun));
+}
+static void fold_closure(di_size_t size) {
+	di_t env[1] = {di_from_int(2)};
+	di_t fun = di_fun_create((di_funptr0_t)fold_add_scaled, 2, env, 1);
+	fold(size, fun);
+	di_cleanup(fun);
+}
+
+/*+-------+*
+ *| Tasks |*
+ *+-------+*/
+
+static di_t task_identity(di_t x) {
+	return x;
+}
+
+// Op: spawning a task returning an int and waiting for it, with size tasks
+// queued at a time.
+static void spawn_wait(di_size_t size) {
+	DI_FUN_STATIC(identity_fun, task_identity, 1);
+	di_t fun = di_from_static_fun(&identity_fun);
+	di_t *tasks = malloc(size * sizeof(di_t));
+	di_size_t i;
+	di_tasks_start(0);
+	start();
+	for (i = 0; i < size; i++) {
+		di_t args = di_array_empty();
+		di_array_push(&args, di_from_int(i));
+		tasks[i] = di_spawn(fun, args);
+	}
+	for (i = 0; i < size; i++)
+		di_wait(tasks[i]);
+	stop(size);
+	free(tasks);
+}
+
+/*+------+*
+ *| JSON |*
+ *+------+*/
+
+// Op: encoding a leaf of a tree with size leaves.
+static void json_encode_tree(di_size_t size) {
+	di_t a = make_tree(size);
+	start();
+	di_t json = json_encode(a);
+	stop(size);
+	di_cleanup(json);
+	di_cleanup(a);
+}
+
+// Op: decoding a leaf of a tree with size leaves.
+static void json_decode_tree(di_size_t size) {
+	di_t a = make_tree(size);
+	di_t json = json_encode(a);
+	di_cleanup(a);
+	start();
+	a = json_decode(json);
+	stop(size);
+	di_cleanup(a);
+}
+
+/*+---------------+*
+ *| Serialization |*
+ *+---------------+*/
+
+// Op: decoding a leaf of a tree with size leaves.
+static void deserialize_tree(di_size_t size, bool lazy) {
+	di_t a = make_tree(size);
+	di_t data = di_serialize(a);
+	di_cleanup(a);
+	di_incref(data);
+	start();
+	a = lazy ? di_deserialize_lazy(data) : di_deserialize(data);
+	stop(size);
+	di_cleanup(a);
+	di_decref_and_free(data);
+}
+static void deserialize_copy(di_size_t size) { deserialize_tree(size, false); }
+static void deserialize_lazy(di_size_t size) { deserialize_tree(size, true); }
+
+// Op: decoding an element of a packed array of size ints.
+static void deserialize_packed(di_size_t size, bool lazy) {
+	int32_t *ints = malloc(size * sizeof(int32_t));
+	di_size_t i;
+	for (i = 0; i < size; i++)
+		ints[i] = (int32_t)i;
+	di_t data = di_serialize(di_array_from_ints(ints, size));
+	free(ints);
+	di_incref(data);
+	di_size_t n = 0;
+	start();
+	do {
+		di_cleanup(lazy ? di_deserialize_lazy(data) : di_deserialize(data));
+		n += size;
+	} while (!measured_enough());
+	stop(n);
+	di_decref_and_free(data);
+}
+static void deserialize_packed_copy(di_size_t size) {
+	deserialize_packed(size, false);
+}
+static void deserialize_packed_lazy(di_size_t size) {
+	deserialize_packed(size, true);
+}
+
+/*+-----------------+*
+ *| Compiler passes |*
+ *+-----------------+*/
+
+// Generates a module with n functions, each using most kinds of expressions.
+static di_t make_source(di_size_t n) {
+	di_t s = di_string_empty();
+	char buf[1024];
+	di_size_t i;
+	for (i = 0; i < n; i++) {
+		int len = snprintf(buf, sizeof(buf),
+			"f%u(a, b) = do\n"
+			"    x%u = a + b * %u\n"
+			"    ys = [x%u, \"str%u value\", %u.25, true, null]\n"
+			"    d = {\"key%u\": ys, \"other\": {\"n\": a - 1}}\n"
+			"    e = d{\"extra\": b}  # comment %u\n"
+			"    r = if a > b and b != 0 then e else d\n"
+			"    case r of\n"
+			"        {\"key%u\": v} -> [v, x%u / 2]\n"
+			"        _ -> [x%u mod 3]\n",
+			i, i, i * 7 % 1000, i, i, i % 100, i, i, i, i, i);
+		s = di_string_append_chars(s, buf, len);
+	}
+	s = di_string_append_chars(s, "result = [", 10);
+	for (i = 0; i < n; i++) {
+		int len = snprintf(buf, sizeof(buf), "%sf%u(%u, %u)",
+		                   i ? ", " : "", i, i, i + 1);
+		s = di_string_append_chars(s, buf, len);
+	}
+	s = di_string_append_chars(s, "]\nresult\n", 9);
+	return s;
+}
+
+// Generates a module with one function with n bindings, each using one or two
+// of the earlier ones.
+static di_t make_long_source(di_size_t n) {
+	di_t s = di_string_from_cstring("f(a, b) = do\n    x0 = a + b\n");
+	char buf[256];
+	di_size_t i;
+	for (i = 1; i < n; i++) {
+		int len = snprintf(buf, sizeof(buf),
+			"    x%u = if x%u > %u then [x%u, x%u] else {\"k\": x%u, \"a\": a}\n",
+			i, i - 1, i, i - 1, i / 2, i / 3);
+		s = di_string_append_chars(s, buf, len);
+	}
+	int len = snprintf(buf, sizeof(buf), "    [x%u, b]\nf(1, 2)\n", n - 1);
+	return di_string_append_chars(s, buf, len);
+}
+
+// Op: lexing a token.
+static void lex(di_size_t size) {
+	di_t source = make_source(size);
+	di_incref(source);
+	di_t eof = di_string_from_cstring("eof");
+	di_t token = di_null();
+	unsigned long long tokens = 0;
+	start();
+	di_t lexer = di_lexer_create(source);
+	do {
+		token = di_lex(&lexer, token);
+		tokens++;
+	} while (!di_equal(di_dict_get(token, di_string_from_cstring("op")),
+	                   eof));
+	di_cleanup(token);
+	di_cleanup(lexer);
+	stop(tokens);
+	di_decref_and_free(source);
+}
+
+// Op: lexing a token into a token buffer.
+static void lex_all(di_size_t size) {
+	di_t source = make_source(size);
+	di_incref(source);
+	di_tokens_t tokens;
+	start();
+	di_lex_all(&tokens, source);
+	di_size_t n = tokens.length;
+	di_tokens_free(&tokens);
+	stop(n);
+	di_decref_and_free(source);
+}
+
+// Op: parsing a function.
+static void parse(di_size_t size) {
+	di_t source = make_source(size);
+	start();
+	di_t tree = di_parse(source);
+	stop(size);
+	di_cleanup(tree);
+}
+
+// Op: annotating a function.
+static void annotate(di_size_t size) {
+	di_t tree = di_parse(make_source(size));
+	start();
+	tree = di_annotate(tree);
+	stop(size);
+	di_cleanup(tree);
+}
+
+// Op: annotating a binding in a long function.
+static void annotate_long(di_size_t size) {
+	di_t tree = di_parse(make_long_source(size));
+	start();
+	tree = di_annotate(tree);
+	stop(size);
+	di_cleanup(tree);
+}
+
+// Op: pretty-printing a function.
+static void prettyprint(di_size_t size) {
+	di_t tree = di_parse(make_source(size));
+	di_writer_t w;
+	start();
+	di_writer_init_string(&w);
+	di_write_prettyprint(&w, tree);
+	di_t s = di_writer_finish_string(&w);
+	stop(size);
+	di_cleanup(s);
+	di_cleanup(tree);
+}
+
+/*+------+*
+ *| Main |*
+ *+------+*/
+
+typedef struct {
+	const char *name;
+	void (*run)(di_size_t size);
+	di_size_t sizes[4]; // zero-terminated
+} benchmark_t;
+
+static const benchmark_t benchmarks[] = {
+	{"dict_set_int",     dict_set_int,     {16, 1024, 65536}},
+	{"dict_set_str",     dict_set_str,     {16, 1024, 65536}},
+	{"dict_get_int",     dict_get_int,     {16, 1024, 65536}},
+	{"dict_get_str",     dict_get_str,     {16, 1024, 65536}},
+	{"dict_delete_int",  dict_delete_int,  {16, 1024, 65536}},
+	{"dict_delete_str",  dict_delete_str,  {16, 1024, 65536}},
+	{"dict_iter",        dict_iter_dense,  {16, 1024, 65536}},
+	{"dict_iter_sparse", dict_iter_sparse, {16, 1024, 65536}},
+	{"dict_set_shared",  dict_set_shared,  {16, 1024, 65536}},
+	{"dict_set_versions", dict_set_versions, {16, 1024, 65536}},
+	{"array_push",       array_push,       {16, 1024, 65536}},
+	{"array_unshift",    array_unshift,    {16, 1024, 65536}},
+	{"array_pop",        array_pop,        {16, 1024, 65536}},
+	{"array_shift",      array_shift,      {16, 1024, 65536}},
+	{"array_set_shared", array_set_shared, {16, 1024, 65536}},
+	{"array_set_versions", array_set_versions, {16, 1024, 65536}},
+	{"array_sum",        array_sum_generic, {16, 1024, 65536}},
+	{"array_sum_packed", array_sum_packed, {16, 1024, 65536}},
+	{"array_map",        array_map_generic, {16, 1024, 65536}},
+	{"array_map_packed", array_map_packed, {16, 1024, 65536}},
+	{"string_append",    string_append,    {16, 1024, 65536}},
+	{"string_concat",    string_concat,    {1024}},
+	{"string_substr",    string_substr,    {1024, 65536}},
+	{"regex_match",      regex_match,      {1024}},
+	{"regex_test",       regex_test,       {1024}},
+	{"regex_cached",     regex_cached,     {1, 16, 64}},
+	{"regex_compile",    regex_compile,    {16}},
+	{"equal_deep",       equal_deep,       {16, 1024, 65536}},
+	{"equal_flat",       equal_flat,       {16, 1024, 65536}},
+	{"equal_hashed",     equal_hashed,     {16, 1024, 65536}},
+	{"dict_set_deep",    dict_set_deep,    {16, 1024, 65536}},
+	{"free_tree",        free_tree,        {16, 1024, 65536}},
+	{"share_tree",       share_tree,       {16, 1024, 65536}},
+	{"fold_fun",         fold_fun,         {16, 1024, 65536}},
+	{"fold_closure",     fold_closure,     {16, 1024, 65536}},
+	{"spawn_wait",       spawn_wait,       {1, 16, 1024}},
+	{"json_encode",      json_encode_tree, {16, 1024, 65536}},
+	{"json_decode",      json_decode_tree, {16, 1024, 65536}},
+	{"deserialize",      deserialize_copy, {16, 1024, 65536}},
+	{"deserialize_lazy", deserialize_lazy, {16, 1024, 65536}},
+	{"deserialize_packed", deserialize_packed_copy, {1024, 65536}},
+	{"deserialize_packed_lazy", deserialize_packed_lazy, {1024, 65536}},
+	{"lex",              lex,              {10, 200}},
+	{"lex_all",          lex_all,          {10, 200}},
+	{"parse",            parse,            {10, 200}},
+	{"annotate",         annotate,         {10, 200}},
+	{"annotate_long",    annotate_long,    {100, 1000, 4000}},
+	{"prettyprint",      prettyprint,      {10, 200}},
+};
+
+int main(int argc, char **argv) {
+	const char *filter = argc > 1 ? argv[1] : "";
+	size_t i, j;
+	printf("benchmark\tsize\tops\tns/op\tallocs/op\tbytes/op\n");
+	for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+		const benchmark_t *b = &benchmarks[i];
+		if (!strstr(b->name, filter))
+			continue;
+		for (j = 0; j < 4 && b->sizes[j]; j++) {
+			total_time = 0;
+			total_ops = total_allocs = total_bytes = 0;
+			double t = now();
+			do {
+				run_t0 = now();
+				b->run(b->sizes[j]);
+			} while (total_time < MIN_SECONDS &&
+			         now() - t < MAX_SECONDS);
+			printf("%s\t%u\t%llu\t%.1f\t%.2f\t%.1f\n", b->name,
+			       b->sizes[j], total_ops, total_time * 1e9 / total_ops,
+			       (double)total_allocs / total_ops,
+			       (double)total_bytes / total_ops);
+			fflush(stdout);
+		}
+	}
+	return 0;
+}
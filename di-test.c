@@ -13,8 +13,19 @@ extern int tests_run;
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "di.h"
+#include "di_fun.h"
+#include "json.h"
+#include "di_prettyprint.h"
+#include "di_writer.h"
+#include "di_serialize.h"
+#include "di_parser.h"
+#include "di_annotate.h"
+#include "di_compile.h"
+#include "di_regex.h"
 
 typedef char *(*testfun)(void);
 int tests_run;
@@ -93,12 +104,1454 @@ static char * array_push_clone_test(void) {
 	return NULL;
 }
 
+static char * array_unshift_test(void) {
+	di_t a = di_array_empty();
+	int i;
+	for (i = 0; i < 100; i++)
+		di_array_unshift(&a, di_from_int(i));
+	mu_assert("unshift length", di_array_length(a) == 100);
+	for (i = 0; i < 100; i++)
+		mu_assert("unshift order", di_to_int(di_array_get(a, i)) == 99 - i);
+	di_cleanup(a);
+	return NULL;
+}
+
+// Creates an array of the ints 0..n-1 and a string, so that there are elements
+// with ref-counters as well.
+static di_t make_int_array(int n) {
+	di_t a = di_array_empty();
+	int i;
+	for (i = 0; i < n; i++)
+		di_array_push(&a, di_from_int(i));
+	di_array_push(&a, di_string_from_cstring("a long string"));
+	return a;
+}
+
+static char * array_slice_test(void) {
+	di_t a = make_int_array(10);
+	di_incref(a);
+	di_t s = di_array_slice(a, 2, 5); // a view, since a is shared
+	mu_assert("slice is array", di_is_array(s));
+	mu_assert("slice length", di_array_length(s) == 5);
+	mu_assert("slice get", di_to_int(di_array_get(s, 0)) == 2);
+	di_incref(s);
+	di_t s2 = di_array_slice(s, 1, 3);
+	di_decref(s);
+	mu_assert("slice of slice", di_array_length(s2) == 3 &&
+	          di_to_int(di_array_get(s2, 0)) == 3);
+	di_t c = di_array_slice(make_int_array(10), 3, 3); // cropped in place
+	mu_assert("slice equals copy", di_equal(s2, c) && di_equal(c, s2));
+	s2 = di_array_set(s2, 0, di_from_int(42)); // copied on update
+	mu_assert("slice set", di_to_int(di_array_get(s2, 0)) == 42);
+	mu_assert("parent is unchanged", di_to_int(di_array_get(a, 3)) == 3);
+	di_array_push(&s, di_null());
+	mu_assert("slice push", di_array_length(s) == 6 &&
+	          di_is_null(di_array_get(s, 5)));
+	mu_assert("parent length", di_array_length(a) == 11);
+	di_t tail = di_array_slice(a, 9, 2);
+	di_decref(a); // tail is the only reference to a now
+	di_array_push(&tail, di_true()); // takes over a
+	mu_assert("slice push in-place", di_array_length(tail) == 3 &&
+	          di_is_string(di_array_get(tail, 1)));
+	di_cleanup(tail);
+	di_cleanup(c);
+	di_cleanup(s);
+	di_cleanup(s2);
+	return NULL;
+}
+
+static char * array_concat_test(void) {
+	di_t a1 = make_int_array(3), a2 = make_int_array(4);
+	di_t a = di_array_concat(a1, a2);
+	mu_assert("concat length", di_array_length(a) == 9);
+	mu_assert("concat elements", di_to_int(di_array_get(a, 4)) == 0 &&
+	          di_is_string(di_array_get(a, 8)));
+	mu_assert("concat moves elements",
+	          di_to_pointer(di_array_get(a, 8))->refc == 1);
+	// Concat with a shared array and a slice of it.
+	di_incref(a);
+	di_t b = di_array_concat(di_array_slice(a, 0, 4), a);
+	mu_assert("concat shared length", di_array_length(b) == 13);
+	mu_assert("concat shared elements", di_equal(di_array_get(b, 12),
+	                                             di_array_get(a, 8)));
+	mu_assert("concat doesn't modify shared", di_array_length(a) == 9);
+	di_cleanup(b);
+	di_decref_and_free(a);
+	return NULL;
+}
+
+static char * string_hash_test(void) {
+	di_t s1 = di_string_from_cstring("some-long-key");
+	di_t s2 = di_string_from_cstring("some-long-key");
+	di_t s3 = di_string_from_cstring("some-long-kez");
+	mu_assert("equal strings have equal hashes", di_hash(s1) == di_hash(s2));
+	mu_assert("the hash is cached", di_hash(s1) == di_hash(s1));
+	mu_assert("equal strings are equal", di_equal(s1, s2));
+	mu_assert("strings of the same length differ", !di_equal(s1, s3));
+	s1 = di_string_append_chars(s1, "!", 1);
+	mu_assert("append invalidates the hash", di_hash(s1) != di_hash(s2));
+	mu_assert("appended string differs", !di_equal(s1, s2));
+	di_cleanup(s1);
+	di_cleanup(s2);
+	di_cleanup(s3);
+	return NULL;
+}
+
+static char * dict_string_keys_test(void) {
+	char buf[32];
+	int i, n = 1000;
+	di_t d = di_dict_empty();
+	for (i = 0; i < n; i++) {
+		snprintf(buf, sizeof(buf), "key-%05d", i); // all of the same length
+		d = di_dict_set(d, di_string_from_cstring(buf), di_from_int(i));
+	}
+	mu_assert("dict has all keys", di_dict_size(d) == n);
+	for (i = 0; i < n; i++) {
+		snprintf(buf, sizeof(buf), "key-%05d", i);
+		di_t key = di_string_from_cstring(buf);
+		di_t v = di_dict_get(d, key);
+		di_cleanup(key);
+		mu_assert("dict get finds the key", di_is_int(v) && di_to_int(v) == i);
+	}
+	// Replace and delete using other allocations of the same key.
+	di_t k = di_string_from_cstring("key-00042");
+	di_incref(k);
+	d = di_dict_set(d, k, di_true());
+	mu_assert("dict set replaces", di_dict_size(d) == n);
+	mu_assert("dict set replaced value", di_is_true(di_dict_get(d, k)));
+	d = di_dict_delete(d, k);
+	mu_assert("dict delete", di_dict_size(d) == n - 1);
+	mu_assert("dict deleted key", !di_dict_contains(d, k));
+	di_decref_and_free(k);
+	di_cleanup(d);
+	return NULL;
+}
+
+static char * dict_order_test(void) {
+	int i, n = 1000;
+	di_t d = di_dict_empty();
+	for (i = n; i > 0; i--)
+		d = di_dict_set(d, di_from_int(i), di_from_int(-i));
+	// Iteration is in insertion order
+	di_size_t pos;
+	di_t key, value;
+	bool ordered = true;
+	for (pos = 0, i = n; (pos = di_dict_iter(d, pos, &key, &value)); i--)
+		ordered = ordered && di_to_int(key) == i && di_to_int(value) == -i;
+	mu_assert("insertion order", ordered && i == 0);
+
+	// Still in order after deleting most entries, which shrinks the table
+	for (i = 1; i <= n; i++)
+		if (i % 10)
+			d = di_dict_delete(d, di_from_int(i));
+	mu_assert("deleted", di_dict_size(d) == n / 10);
+	for (pos = 0, i = n; (pos = di_dict_iter(d, pos, &key, NULL)); i -= 10)
+		ordered = ordered && di_to_int(key) == i;
+	mu_assert("order after delete", ordered && i == 0);
+	mu_assert("get after delete", di_to_int(di_dict_get(d, di_from_int(500))) == -500 &&
+	          !di_dict_contains(d, di_from_int(501)));
+
+	// A key added again comes last, also in a clone of a shared dict
+	d = di_dict_set(d, di_from_int(7), di_true());
+	di_incref(d);
+	di_t e = di_dict_set(d, di_from_int(8), di_false());
+	for (pos = 0; (pos = di_dict_iter(e, pos, &key, &value));)
+		if (di_is_true(value))
+			break;
+	mu_assert("readded last", pos && di_to_int(key) == 7 &&
+	          (pos = di_dict_iter(e, pos, &key, NULL)) && di_to_int(key) == 8 &&
+	          !di_dict_iter(e, pos, NULL, NULL));
+	mu_assert("original kept", di_dict_size(d) == n / 10 + 1 &&
+	          di_dict_size(e) == n / 10 + 2);
+	di_cleanup(e);
+	di_decref_and_free(d);
+	return NULL;
+}
+
+static char * shaped_dict_test(void) {
+	di_t a = di_string_from_cstring("a");
+	di_t b = di_atom_from_cstring("long atom");
+	di_t d = di_dict_set(di_dict_empty(), a, di_from_int(1));
+	d = di_dict_set(d, b, di_from_int(2));
+	d = di_dict_set(d, di_string_from_cstring("c"), di_from_int(3));
+	mu_assert("shaped dict size", di_dict_size(d) == 3);
+	mu_assert("shaped dict get",
+	          di_to_int(di_dict_get(d, di_string_from_cstring("long atom"))) == 2);
+	di_t key, value;
+	di_size_t pos = 0;
+	int i = 1;
+	while ((pos = di_dict_iter(d, pos, &key, &value)))
+		mu_assert("shaped dict in insertion order", di_to_int(value) == i++);
+	// Another dict with the same keys, set in another order, is equal.
+	di_t e = di_dict_set(di_dict_empty(), di_string_from_cstring("c"),
+	                     di_from_int(3));
+	e = di_dict_set(e, a, di_from_int(1));
+	e = di_dict_set(e, b, di_from_int(2));
+	mu_assert("shaped dicts equal", di_equal(d, e));
+	// A shared dict is copied on write.
+	di_incref(d);
+	di_t d2 = di_dict_delete(d, a);
+	mu_assert("delete from a shared dict", di_dict_size(d2) == 2);
+	mu_assert("the shared dict is unchanged", di_dict_size(d) == 3);
+	mu_assert("delete keeps the order",
+	          di_dict_iter(d2, 0, &key, &value) && di_to_int(value) == 2);
+	di_cleanup(d2);
+	di_decref(d);
+	// A non-string key turns it into a hash table.
+	d = di_dict_set(d, di_from_int(42), di_true());
+	mu_assert("int key", di_is_true(di_dict_get(d, di_from_int(42))));
+	d = di_dict_delete(d, di_from_int(42));
+	mu_assert("equal to the shaped dict", di_equal(d, e) && di_equal(e, d));
+	// A missing key is freed too.
+	d = di_dict_delete(d, di_string_from_cstring("a missing key"));
+	mu_assert("pop a missing key", di_is_null(di_dict_pop(
+	          &d, di_string_from_cstring("a missing key"))) &&
+	          di_dict_size(d) == 3);
+	e = di_dict_delete(e, di_string_from_cstring("a missing key"));
+	mu_assert("pop a missing key from a shaped dict", di_is_null(di_dict_pop(
+	          &e, di_string_from_cstring("a missing key"))) &&
+	          di_dict_size(e) == 3);
+	// So does a ninth key.
+	char buf[2] = "0";
+	for (i = 0; i < 9; i++, buf[0]++)
+		e = di_dict_set(e, di_string_from_cstring(buf), di_from_int(i));
+	mu_assert("many keys", di_dict_size(e) == 12 &&
+	          di_to_int(di_dict_get(e, di_string_from_cstring("8"))) == 8 &&
+	          di_to_int(di_dict_get(e, a)) == 1);
+	di_cleanup(e);
+	di_cleanup(d);
+	return NULL;
+}
+
+static char * persistent_array_test(void) {
+	int i, n = 3 * DI_PERSISTENT_MIN;
+	di_t a = di_array_empty();
+	for (i = 0; i < n; i++)
+		di_array_push(&a, di_from_int(i));
+	// Updating a shared array gives a new one, sharing most of its memory.
+	di_incref(a);
+	di_t b = di_array_set(a, 42, di_true());
+	mu_assert("the shared array is unchanged",
+	          di_to_int(di_array_get(a, 42)) == 42);
+	mu_assert("persistent set", di_is_true(di_array_get(b, 42)) &&
+	          di_to_int(di_array_get(b, 43)) == 43);
+	di_incref(b);
+	di_t c = b;
+	for (i = 0; i < n; i++)
+		di_array_push(&c, di_from_int(n + i));
+	di_decref(b);
+	mu_assert("persistent push", di_array_length(c) == 2 * n &&
+	          di_array_length(b) == n &&
+	          di_to_int(di_array_get(c, 2 * n - 1)) == 2 * n - 1);
+	for (i = 0; i < 2 * n - 1; i++) {
+		di_incref(c);
+		di_t d = c;
+		di_t v = di_array_pop(&d);
+		di_decref(c);
+		di_cleanup(c);
+		di_size_t j = 2 * n - 1 - i;
+		mu_assert("persistent pop", di_equal(v, j == 42 ? di_true()
+		                                                : di_from_int(j)));
+		c = d;
+	}
+	mu_assert("popped all but one", di_array_length(c) == 1 &&
+	          di_is_int(di_array_get(c, 0)));
+	di_cleanup(c);
+	mu_assert("versions compare by contents", !di_equal(a, b));
+	b = di_array_set(b, 42, di_from_int(42));
+	mu_assert("equal to the flat array", di_equal(a, b) && di_equal(b, a));
+	// Other updates give a flat array.
+	di_incref(b);
+	di_t s = di_array_slice(b, 10, 20);
+	di_decref(b);
+	mu_assert("slice", di_array_length(s) == 20 &&
+	          di_to_int(di_array_get(s, 0)) == 10);
+	di_cleanup(s);
+	di_array_unshift(&b, di_from_int(-1));
+	mu_assert("unshift", di_array_length(b) == n + 1 &&
+	          di_to_int(di_array_get(b, n)) == n - 1);
+	di_cleanup(b);
+	// Pushing to an unshared slice of a shared array releases the slice.
+	di_t strs = di_array_empty();
+	for (i = 0; i < n; i++)
+		di_array_push(&strs, di_string_from_cstring("a long string"));
+	di_incref(strs);
+	s = di_array_slice(strs, 1, n - 10);
+	di_array_push(&s, di_from_int(1));
+	mu_assert("slice to vector", di_array_length(s) == n - 9 &&
+	          di_to_pointer(strs)->refc == 1);
+	di_cleanup(s);
+	di_decref_and_free(strs);
+	// A shared array modified in place after it's no longer shared.
+	di_t t1 = di_array_set(a, 0, di_true());
+	di_decref(a);
+	a = di_array_set(a, 1, di_true());
+	di_incref(a);
+	di_t t2 = di_array_set(a, 2, di_true());
+	mu_assert("versions of a modified array",
+	          di_is_true(di_array_get(t1, 0)) && di_is_int(di_array_get(t1, 1)) &&
+	          di_is_int(di_array_get(t2, 0)) && di_is_true(di_array_get(t2, 1)));
+	di_cleanup(t1);
+	di_cleanup(t2);
+	di_decref(a);
+	di_cleanup(a);
+	return NULL;
+}
+
+static char * persistent_dict_test(void) {
+	int i, n = 3 * DI_PERSISTENT_MIN;
+	di_t d = di_dict_empty();
+	for (i = 0; i < n; i++)
+		d = di_dict_set(d, di_from_int(i), di_from_int(i));
+	di_incref(d);
+	di_t e = di_dict_set(d, di_from_int(42), di_true());
+	mu_assert("the shared dict is unchanged",
+	          di_to_int(di_dict_get(d, di_from_int(42))) == 42);
+	mu_assert("persistent set", di_is_true(di_dict_get(e, di_from_int(42))) &&
+	          di_dict_size(e) == n);
+	// Delete every other key, from a new version each time.
+	for (i = 0; i < n; i += 2) {
+		di_incref(e);
+		di_t f = di_dict_delete(e, di_from_int(i));
+		di_decref(e);
+		di_cleanup(e);
+		e = f;
+	}
+	mu_assert("persistent delete", di_dict_size(e) == n / 2 &&
+	          !di_dict_contains(e, di_from_int(42)) &&
+	          di_to_int(di_dict_get(e, di_from_int(43))) == 43);
+	di_size_t pos = 0, count = 0;
+	di_t key, value;
+	while ((pos = di_dict_iter(e, pos, &key, &value))) {
+		mu_assert("iterate", di_to_int(key) % 2 == 1 && di_equal(key, value));
+		count++;
+	}
+	mu_assert("iterate all", count == n / 2);
+	di_t v = di_dict_pop(&e, di_from_int(43));
+	mu_assert("pop", di_to_int(v) == 43 && di_is_null(di_dict_get(e, v)));
+	e = di_dict_delete(e, di_string_from_cstring("a missing key"));
+	mu_assert("pop a missing key", di_is_null(di_dict_pop(
+	          &e, di_string_from_cstring("a missing key"))) &&
+	          di_dict_size(e) == n / 2);
+	for (i = 0; i < n; i += 2)
+		e = di_dict_set(e, di_from_int(i), di_from_int(i));
+	e = di_dict_set(e, di_from_int(43), di_from_int(43));
+	mu_assert("equal to the hash table", di_equal(d, e) && di_equal(e, d));
+	for (i = 0; i < n; i++)
+		e = di_dict_delete(e, di_from_int(i));
+	mu_assert("deleted all", di_dict_size(e) == 0 &&
+	          !di_dict_iter(e, 0, NULL, NULL));
+	di_cleanup(e);
+	// Keys with equal hashes are kept in a collision node.
+	di_t k1 = di_string_from_cstring("collision-169050"),
+	     k2 = di_string_from_cstring("collision-178685");
+	di_incref(k1);
+	di_incref(k2);
+	mu_assert("equal hashes", di_hash(k1) == di_hash(k2));
+	e = di_dict_set(d, k1, di_from_int(1));
+	e = di_dict_set(e, k2, di_from_int(2));
+	mu_assert("colliding keys", di_dict_size(e) == n + 2 &&
+	          di_to_int(di_dict_get(e, k1)) == 1 &&
+	          di_to_int(di_dict_get(e, k2)) == 2);
+	e = di_dict_delete(e, k1);
+	mu_assert("colliding key deleted", !di_dict_contains(e, k1) &&
+	          di_to_int(di_dict_get(e, k2)) == 2);
+	e = di_dict_delete(e, k2);
+	mu_assert("both colliding keys deleted", di_dict_size(e) == n &&
+	          !di_dict_contains(e, k2));
+	di_cleanup(e);
+	di_decref_and_free(k1);
+	di_decref_and_free(k2);
+	// A shared dict modified in place after it's no longer shared.
+	di_t t1 = di_dict_set(d, di_from_int(0), di_true());
+	di_decref(d);
+	d = di_dict_set(d, di_from_int(1), di_true());
+	di_incref(d);
+	di_t t2 = di_dict_set(d, di_from_int(2), di_true());
+	mu_assert("versions of a modified dict",
+	          di_is_true(di_dict_get(t1, di_from_int(0))) &&
+	          di_is_int(di_dict_get(t1, di_from_int(1))) &&
+	          di_is_int(di_dict_get(t2, di_from_int(0))) &&
+	          di_is_true(di_dict_get(t2, di_from_int(1))));
+	di_cleanup(t1);
+	di_cleanup(t2);
+	di_decref(d);
+	di_cleanup(d);
+	return NULL;
+}
+
+static char * packed_array_test(void) {
+	int32_t ints[100];
+	int i;
+	for (i = 0; i < 100; i++)
+		ints[i] = i - 50;
+	di_t a = di_array_from_ints(ints, 100);
+	mu_assert("packed get", di_array_length(a) == 100 &&
+	          di_to_int(di_array_get(a, 0)) == -50);
+	mu_assert("packed sum", di_equal(di_array_sum(a), di_from_int(-50)));
+	mu_assert("packed min and max",
+	          di_equal(di_array_min(a), di_from_int(-50)) &&
+	          di_equal(di_array_max(a), di_from_int(49)));
+	di_t values[100];
+	for (i = 0; i < 100; i++)
+		values[i] = di_from_int(i - 50);
+	di_t b = di_array_from_values(values, 100);
+	mu_assert("packed from values", di_equal(a, b));
+	// Updates keep the array packed unless another kind of value is stored.
+	di_incref(a);
+	di_t c = di_array_set(a, 0, di_from_int(7));
+	mu_assert("packed set copies shared", di_equal(a, b) &&
+	          di_to_int(di_array_get(c, 0)) == 7);
+	di_array_push(&c, di_from_int(1000));
+	mu_assert("packed push", di_array_length(c) == 101 &&
+	          di_equal(di_array_sum(c), di_from_int(-50 + 57 + 1000)));
+	c = di_array_set(c, 1, di_true());
+	mu_assert("generic after set", di_is_true(di_array_get(c, 1)) &&
+	          di_to_int(di_array_get(c, 100)) == 1000);
+	di_cleanup(c);
+	// Slicing and concatenating.
+	di_t s = di_array_slice(a, 10, 5);
+	mu_assert("packed slice", di_array_length(s) == 5 &&
+	          di_to_int(di_array_get(s, 0)) == -40);
+	di_t s2 = di_array_concat(s, di_array_from_ints(ints, 2));
+	mu_assert("packed concat", di_array_length(s2) == 7 &&
+	          di_to_int(di_array_get(s2, 6)) == -49);
+	di_cleanup(s2);
+	// Arithmetic. Results which don't fit in an int are doubles.
+	b = di_array_map_op(b, '*', di_from_int(2));
+	mu_assert("map ints", di_to_int(di_array_get(b, 1)) == -98 &&
+	          di_equal(di_array_sum(b), di_from_int(-100)));
+	b = di_array_map_op(b, '*', di_from_int(INT32_MAX));
+	mu_assert("map overflow", di_is_double(di_array_get(b, 0)) &&
+	          di_is_int(di_array_get(b, 50)));
+	di_cleanup(b);
+	di_t d = di_array_map_op(a, '/', di_from_int(4));
+	mu_assert("map divide", di_array_length(d) == 100 && di_array_length(a) &&
+	          di_to_double(di_array_get(d, 0)) == -12.5);
+	di_decref(a);
+	di_cleanup(a);
+	mu_assert("double sum", di_to_double(di_array_sum(d)) == -12.5 &&
+	          di_to_double(di_array_max(d)) == 12.25);
+	// A generic array with the same doubles gives the same results.
+	di_t g = di_array_empty();
+	for (i = 0; i < 100; i++)
+		di_array_push(&g, di_array_get(d, i));
+	mu_assert("generic equals packed", di_equal(g, d) && di_equal(d, g));
+	mu_assert("generic sum", di_equal(di_array_sum(g), di_array_sum(d)));
+	di_cleanup(g);
+	di_cleanup(d);
+	// Byte arrays.
+	di_t bin = di_array_from_bytes("\x00\xff\x10", 3);
+	mu_assert("bytes", di_to_int(di_array_get(bin, 1)) == 255 &&
+	          !memcmp(di_array_bytes(bin), "\x00\xff\x10", 3));
+	bin = di_array_set(bin, 0, di_from_int(1));
+	mu_assert("set byte", !memcmp(di_array_bytes(bin), "\x01\xff\x10", 3));
+	bin = di_array_set(bin, 0, di_from_int(256));
+	mu_assert("byte overflow", !di_array_bytes(bin) &&
+	          di_to_int(di_array_get(bin, 0)) == 256);
+	di_cleanup(bin);
+	return 0;
+}
+
+static char * view_test(void) {
+	di_t owner = di_string_from_cstring("0123456789 and some more text");
+	di_incref(owner);
+	const char *chars = di_string_chars(owner);
+	di_t s = di_string_view(owner, chars + 15, 14);
+	mu_assert("string view", di_string_chars(s) == chars + 15 &&
+	          di_equal(s, di_string_from_cstring("some more text")));
+	s = di_string_append_chars(s, "!", 1);
+	mu_assert("modified view is copied", di_string_chars(s) != chars + 15 &&
+	          !strcmp(chars + 15, "some more text") &&
+	          di_equal(s, di_string_from_cstring("some more text!")));
+	di_cleanup(s);
+	s = di_string_view(owner, chars + 25, 4);
+	mu_assert("short view is copied", di_is_shortstring(s) &&
+	          di_equal(s, di_string_from_cstring("text")));
+	s = di_string_subview(owner, 11, 8);
+	mu_assert("subview", di_string_chars(s) == chars + 11 &&
+	          !di_string_is_terminated(s) &&
+	          di_equal(s, di_string_from_cstring("and some")));
+	di_t t = di_string_subview(di_borrow(s), 4, 4);
+	mu_assert("short subview is copied", di_is_shortstring(t) &&
+	          di_equal(t, di_string_from_cstring("some")));
+	t = di_string_subview(di_string_from_cstring(" more text"), 1, 9);
+	mu_assert("subview of a fresh string", di_equal(t,
+	          di_string_from_cstring("more text")));
+	di_cleanup(t);
+	t = di_string_subview(owner, 15, 14);
+	mu_assert("subview at the end", di_string_is_terminated(t));
+	di_cleanup(t);
+	s = di_string_append_chars(s, "!", 1);
+	mu_assert("modified subview is copied", di_string_is_terminated(s) &&
+	          di_equal(s, di_string_from_cstring("and some!")));
+	di_cleanup(s);
+
+	static const int32_t ints[4] = {1, 2, 3, 4};
+	di_t a = di_array_view_ints(owner, ints, 4);
+	unsigned kind;
+	mu_assert("array view", di_array_packed_data(a, &kind) == ints &&
+	          kind == DI_PACKED_INT &&
+	          di_equal(a, di_array_from_ints(ints, 4)));
+	a = di_array_slice(a, 1, 2);
+	mu_assert("sliced view", di_array_packed_data(a, &kind) == ints + 1 &&
+	          di_equal(a, di_array_from_ints(ints + 1, 2)));
+	di_incref(a);
+	di_t b = di_array_set(a, 0, di_from_int(9));
+	mu_assert("modified view is copied", ints[1] == 2 &&
+	          di_to_int(di_array_get(a, 0)) == 2 &&
+	          di_to_int(di_array_get(b, 0)) == 9);
+	di_cleanup(b);
+	di_decref(a);
+	di_array_push(&a, di_from_int(5));
+	mu_assert("pushed to view", di_array_length(a) == 3 &&
+	          di_array_packed_data(a, &kind) != ints + 1);
+	di_cleanup(a);
+	di_decref_and_free(owner);
+	return 0;
+}
+
+static char * equal_hash_test(void) {
+	int32_t ints[3000];
+	di_t a = di_array_empty(), b = di_array_empty();
+	int i;
+	for (i = 0; i < 3000; i++) {
+		ints[i] = i;
+		di_array_push(&a, di_from_int(i));
+		di_array_push(&b, i == 2999 ? di_string_from_cstring("a string") :
+		                              di_from_int(i));
+	}
+	di_t p = di_array_from_ints(ints, 3000);
+	mu_assert("same object", di_equal(a, di_borrow(a)));
+	mu_assert("generic equals packed", di_equal(a, p) &&
+	          di_hash(a) == di_hash(p));
+	mu_assert("unequal", !di_equal(a, b) && di_hash(a) != di_hash(b));
+	// A modified array gets a new hash. Versions of a large array are
+	// vectors, which hash like the flat array.
+	uint64_t h = di_hash(b);
+	b = di_array_set(b, 2999, di_from_int(2999));
+	mu_assert("hash reset", di_hash(b) != h && di_equal(a, b) &&
+	          di_hash(a) == di_hash(b));
+	di_incref(b);
+	di_t v = di_array_set(b, 0, di_from_int(0));
+	mu_assert("vector", di_equal(v, a) && di_hash(v) == di_hash(a));
+	v = di_array_set(v, 0, di_from_int(1));
+	mu_assert("vector hash reset", !di_equal(v, a) && di_hash(v) != h);
+	di_cleanup(v);
+	di_incref(a);
+	di_t s = di_array_slice(a, 1, 10), t = di_array_slice(b, 1, 10);
+	mu_assert("slices", di_equal(s, t) && di_hash(s) == di_hash(t));
+	di_cleanup(s);
+	di_cleanup(t);
+	di_decref(a);
+	di_decref(b);
+	// Dicts hash the same regardless of the order of the entries.
+	di_t d1 = di_dict_empty(), d2 = di_dict_empty();
+	for (i = 0; i < 20; i++) {
+		d1 = di_dict_set(d1, di_from_int(i), di_from_int(i));
+		d2 = di_dict_set(d2, di_from_int(19 - i), di_from_int(19 - i));
+	}
+	mu_assert("dict hash", di_equal(d1, d2) && di_hash(d1) == di_hash(d2));
+	d2 = di_dict_set(d2, di_from_int(3), di_from_int(4));
+	mu_assert("dict hash reset", !di_equal(d1, d2) &&
+	          di_hash(d1) != di_hash(d2));
+	// Setting a key to an equal copy of its value replaces it.
+	d1 = di_dict_set(d1, di_from_int(0), a);
+	d1 = di_dict_set(d1, di_from_int(0), b);
+	mu_assert("replaced by copy", di_raw_value(di_dict_get(d1, di_from_int(0)))
+	          == di_raw_value(b));
+	di_cleanup(d1);
+	di_cleanup(d2);
+	di_cleanup(p);
+	return 0;
+}
+
+// Each thread gets a reference to a shared document, reads it, makes its own
+// versions of it and releases them and the shared one.
+static void *share_thread(void *arg) {
+	di_t doc = *(di_t *)arg;
+	di_t big = di_dict_get(doc, di_string_from_cstring("big"));
+	di_t table = di_dict_get(doc, di_string_from_cstring("table"));
+	int i;
+	for (i = 0; i < 100; i++) {
+		di_t mine = di_dict_set(doc, di_string_from_cstring("i"),
+		                        di_from_int(i));
+		di_t v = di_array_set(big, i, di_string_from_cstring("a string"));
+		v = di_array_set(v, i + 1, di_from_int(-1));
+		mine = di_dict_set(mine, di_string_from_cstring("big"), v);
+		mine = di_dict_set(mine, di_string_from_cstring("table"),
+		                   di_dict_set(table, di_from_int(i),
+		                               di_from_int(-1)));
+		if (!di_equal(doc, di_borrow(doc)) || di_equal(doc, mine))
+			return "unequal";
+		di_hash(mine);
+		di_cleanup(mine);
+	}
+	di_decref_and_free(doc);
+	di_thread_cleanup();
+	return NULL;
+}
+
+static char * share_test(void) {
+	di_t big = di_array_empty(), table = di_dict_empty(),
+	     doc = di_dict_empty();
+	int i;
+	for (i = 0; i < 2000; i++) {
+		di_array_push(&big, di_string_from_cstring("a longer string"));
+		table = di_dict_set(table, di_from_int(i),
+		                    di_string_from_cstring("another string"));
+	}
+	doc = di_dict_set(doc, di_string_from_cstring("big"), big);
+	doc = di_dict_set(doc, di_string_from_cstring("table"), table);
+	doc = di_dict_set(doc, di_string_from_cstring("small"), di_dict_empty());
+	mu_assert("not shared", !di_is_shared(doc) && !di_is_shared(big));
+	doc = di_share(doc);
+	mu_assert("shared", di_is_shared(doc) && di_is_shared(big) &&
+	          di_is_shared(di_array_get(big, 1999)) &&
+	          di_is_shared(di_dict_get(table, di_from_int(1999))));
+	mu_assert("counted reference", di_to_pointer(doc)->refc == 1);
+	uint64_t hash = di_hash(doc);
+	pthread_t threads[4];
+	for (i = 0; i < 4; i++) {
+		di_incref(doc);
+		pthread_create(&threads[i], NULL, share_thread, &doc);
+	}
+	for (i = 0; i < 4; i++) {
+		void *result;
+		pthread_join(threads[i], &result);
+		mu_assert("thread", result == NULL);
+	}
+	mu_assert("released", di_to_pointer(doc)->refc == 1);
+	mu_assert("unchanged", di_hash(doc) == hash &&
+	          di_raw_value(di_dict_get(doc, di_string_from_cstring("big"))) ==
+	          di_raw_value(big) && di_array_length(big) == 2000);
+	// A version of a shared value isn't shared and is updated in place.
+	di_t v = di_dict_set(doc, di_string_from_cstring("i"), di_from_int(1));
+	mu_assert("version not shared", !di_is_shared(v));
+	di_t w = di_dict_set(v, di_string_from_cstring("i"), di_from_int(2));
+	mu_assert("updated in place", di_raw_value(v) == di_raw_value(w));
+	di_cleanup(w);
+	di_decref_and_free(doc);
+	return NULL;
+}
+
+static di_t add_ints(di_t a, di_t b) {
+	return di_from_int(di_to_int(a) + di_to_int(b));
+}
+
+// A closure adding the int in its environment to its argument.
+static di_t add_env(di_env_t env, di_t x) {
+	return di_from_int(di_to_int(env[1]) + di_to_int(x));
+}
+
+// A closure returning the first value in its environment.
+static di_t get_env(di_env_t env) {
+	di_incref(env[0]);
+	return env[0];
+}
+
+static char * fun_test(void) {
+	// A function without an environment isn't allocated.
+	DI_FUN_STATIC(add_fun, add_ints, 2);
+	di_t add = di_from_static_fun(&add_fun);
+	mu_assert("static fun", di_is_fun(add) && !di_is_pointer(add) &&
+	          di_fun_arity(add) == 2);
+	mu_assert("call2", di_to_int(di_call2(add, di_from_int(1),
+	                                        di_from_int(2))) == 3);
+	di_t args[2] = {di_from_int(3), di_from_int(4)};
+	mu_assert("apply", di_to_int(di_apply(add, args, 2)) == 7);
+	mu_assert("equal to itself", di_equal(add, add) &&
+	          di_raw_value(di_share(add)) == di_raw_value(add));
+	// A closure holds references to its environment, stored inline.
+	di_t s = di_string_from_cstring("a heap string");
+	di_incref(s);
+	di_t env[2] = {s, di_from_int(10)};
+	di_t inc = di_fun_create((di_funptr0_t)add_env, 1, env, 2);
+	di_t get = di_fun_create((di_funptr0_t)get_env, 0, env, 2);
+	mu_assert("closure", di_is_fun(inc) && di_fun_arity(inc) == 1 &&
+	          di_to_pointer(s)->refc == 3);
+	mu_assert("call1", di_to_int(di_call1(inc, di_from_int(5))) == 15);
+	mu_assert("apply closure", di_to_int(di_apply(inc, args, 1)) == 13);
+	di_t got = di_call0(get);
+	mu_assert("call0", di_raw_value(got) == di_raw_value(s) &&
+	          di_to_pointer(s)->refc == 4);
+	di_decref(got);
+	di_cleanup(inc);
+	di_cleanup(get);
+	mu_assert("env released", di_to_pointer(s)->refc == 1);
+	di_decref_and_free(s);
+	return NULL;
+}
+
+// Sums the integers from lo to hi - 1 by splitting the range in two tasks,
+// which are waited for by the task itself.
+static di_t sum_fun;
+
+static di_t sum_task(di_t lo, di_t hi) {
+	int l = di_to_int(lo), h = di_to_int(hi);
+	if (h - l <= 10) {
+		int i, sum = 0;
+		for (i = l; i < h; i++)
+			sum += i;
+		return di_from_int(sum);
+	}
+	int m = l + (h - l) / 2;
+	di_t args = di_array_empty();
+	di_array_push(&args, lo);
+	di_array_push(&args, di_from_int(m));
+	di_t left = di_spawn(sum_fun, args);
+	args = di_array_empty();
+	di_array_push(&args, di_from_int(m));
+	di_array_push(&args, hi);
+	di_t right = di_spawn(sum_fun, args);
+	return di_from_int(di_to_int(di_wait(left)) + di_to_int(di_wait(right)));
+}
+
+static di_t push_task(di_t array) {
+	di_array_push(&array, di_from_int(-1));
+	return array;
+}
+
+static char * task_test(void) {
+	di_tasks_start(4);
+	sum_fun = di_share(di_fun_create((di_funptr0_t)sum_task, 2, NULL, 0));
+	di_t args = di_array_empty();
+	di_array_push(&args, di_from_int(0));
+	di_array_push(&args, di_from_int(1000));
+	di_t task = di_spawn(sum_fun, args);
+	mu_assert("task", di_is_task(task));
+	mu_assert("result", di_equal(di_wait(task), di_from_int(499500)));
+	// An array which only the task refers to is updated in place. One which
+	// the spawning thread keeps is shared and left as it is.
+	di_t push_fun = di_share(di_fun_create((di_funptr0_t)push_task, 1, NULL,
+	                                       0));
+	di_t a = di_array_empty();
+	int i;
+	for (i = 0; i < 100; i++)
+		di_array_push(&a, di_string_from_cstring("a string"));
+	di_incref(a);
+	args = di_array_empty();
+	di_array_push(&args, a);
+	di_t b = di_wait(di_spawn(push_fun, args));
+	mu_assert("kept", di_is_shared(a) && di_array_length(a) == 100 &&
+	          di_array_length(b) == 101 && !di_is_shared(b));
+	di_decref_and_free(a);
+	args = di_array_empty();
+	di_array_push(&args, b);
+	di_cleanup(b);
+	di_t c = di_wait(di_spawn(push_fun, args));
+	mu_assert("in place", di_raw_value(c) == di_raw_value(b) &&
+	          di_array_length(c) == 102);
+	di_cleanup(c);
+	// A task which isn't waited for is freed when it's done.
+	args = di_array_empty();
+	di_array_push(&args, di_array_empty());
+	di_cleanup(di_spawn(push_fun, args));
+	di_tasks_stop();
+	di_decref_and_free(push_fun);
+	di_decref_and_free(sum_fun);
+	return NULL;
+}
+
+static char * atom_test(void) {
+	di_t a1 = di_atom_from_cstring("identifier");
+	di_t a2 = di_atom_from_cstring("identifier");
+	di_t s = di_string_from_cstring("identifier");
+	mu_assert("atom is string", di_is_string(a1));
+	mu_assert("atom is interned", di_raw_value(a1) == di_raw_value(a2));
+	mu_assert("atom equals string", di_equal(a1, s) && di_equal(s, a1));
+	mu_assert("atom has the string's hash", di_hash(a1) == di_hash(s));
+	mu_assert("atom length", di_string_length(a1) == 10);
+	mu_assert("short atom is a short string",
+	          di_equal(di_atom_from_cstring("op"), di_string_from_cstring("op")));
+	di_t d = di_dict_set(di_dict_empty(), a1, di_true());
+	mu_assert("dict get by string", di_is_true(di_dict_get(d, s)));
+	di_t a3 = di_string_append_chars(a1, "!", 1);
+	mu_assert("append copies the atom",
+	          di_equal(a2, s) && di_string_length(a3) == 11);
+	di_cleanup(a3);
+	di_cleanup(d);
+	di_cleanup(s);
+	return NULL;
+}
+
+static void *arena_free_thread(void *arg) {
+	di_cleanup(*(di_t *)arg);
+	di_thread_cleanup();
+	return NULL;
+}
+
+static char * arena_test(void) {
+	di_t outside = di_string_from_cstring("allocated with malloc");
+	di_incref(outside);
+	di_arena_t *arena = di_arena_create();
+	mu_assert("no previous arena", di_arena_enter(arena) == NULL);
+	di_t d = di_dict_empty();
+	di_t a = di_array_empty();
+	char buf[32];
+	int i;
+	for (i = 0; i < 1000; i++) {
+		snprintf(buf, sizeof(buf), "key-%05d", i);
+		d = di_dict_set(d, di_string_from_cstring(buf), di_from_int(i));
+		di_array_push(&a, di_string_from_cstring(buf));
+	}
+	di_array_push(&a, outside);
+	mu_assert("arena dict", di_dict_size(d) == 1000 &&
+	          di_to_int(di_dict_get(d, di_array_get(a, 999))) == 999);
+	di_t s = di_string_append_chars(di_array_pop(&a), "!", 1);
+	mu_assert("shared string is copied", di_string_length(s) == 22 &&
+	          di_string_length(outside) == 21);
+	di_cleanup(s);
+	// Another thread frees the array, and its memory is left to the arena.
+	pthread_t thread;
+	pthread_create(&thread, NULL, arena_free_thread, &a);
+	pthread_join(thread, NULL);
+	a = di_array_empty();
+	di_array_push(&a, di_string_from_cstring("allocated after the free"));
+	mu_assert("arena after free in another thread",
+	          di_to_int(di_dict_get(d, di_string_from_cstring("key-00999"))) ==
+	          999 && di_string_length(di_array_get(a, 0)) == 24);
+	mu_assert("leave the arena", di_arena_enter(NULL) == arena);
+	di_t b = di_string_from_cstring("allocated after the arena");
+	di_arena_destroy(arena); // no need to free d and a
+	mu_assert("values outside arena survive", di_string_length(b) == 25 &&
+	          di_string_length(outside) == 21);
+	di_cleanup(b);
+	di_decref_and_free(outside);
+	return NULL;
+}
+
+static char * borrowed_test(void) {
+	di_t a = make_int_array(3);
+	di_t r = di_borrow(a);
+	mu_assert("borrowed", di_is_borrowed(r) && !di_is_borrowed(a));
+	mu_assert("borrowed is array", di_is_array(r) &&
+	          di_array_length(r) == 4 && di_equal(a, r));
+	mu_assert("unborrow", di_raw_value(di_unborrow(r)) == di_raw_value(a));
+	di_incref(r);
+	di_cleanup(r); // no-op
+	mu_assert("refc untouched", di_to_pointer(a)->refc == 0);
+	// A borrowed array is shared, so it's copied on update.
+	di_t c = di_array_set(r, 0, di_true());
+	mu_assert("borrowed is copied", !di_equal(a, c) &&
+	          di_to_int(di_array_get(a, 0)) == 0);
+	di_cleanup(c);
+	// Results referring to the object hold regular references to it.
+	di_incref(a);
+	di_t s = di_array_slice(r, 1, 2);
+	mu_assert("slice of borrowed", di_array_length(s) == 2 &&
+	          di_to_pointer(a)->refc == 2);
+	di_cleanup(s);
+	di_t d = di_dict_set(di_dict_empty(), di_string_from_cstring("a"), r);
+	di_t v = di_dict_get(d, di_string_from_cstring("a"));
+	mu_assert("stored unborrowed", !di_is_borrowed(v) &&
+	          di_to_pointer(a)->refc == 2);
+	di_cleanup(d);
+	mu_assert("references released", di_to_pointer(a)->refc == 1);
+	di_decref_and_free(a);
+	return NULL;
+}
+
+static int released = 0;
+static void release_chars(char *chars, di_size_t length) {
+	released++;
+	free(chars);
+}
+
+static char * external_string_test(void) {
+	const char *text = "an external string";
+	char *chars = malloc(strlen(text) + 1);
+	strcpy(chars, text);
+	di_t s = di_string_from_external(chars, strlen(text), release_chars);
+	di_t t = di_string_from_cstring(text);
+	mu_assert("external is string", di_is_string(s) &&
+	          di_string_length(s) == strlen(text));
+	mu_assert("external chars not copied", di_string_chars(s) == chars);
+	mu_assert("external equals", di_equal(s, t) && di_equal(t, s));
+	mu_assert("external hash", di_hash(s) == di_hash(t));
+	di_incref(s);
+	di_t sub = di_string_substr(s, 3, 8);
+	mu_assert("external substr", di_equal(sub, di_string_from_cstring("external")));
+	di_cleanup(sub);
+	di_decref(s);
+	s = di_string_append_chars(s, "!", 1); // copied and released
+	mu_assert("external append", released == 1 &&
+	          di_string_length(s) == strlen(text) + 1);
+	di_cleanup(s);
+	di_cleanup(t);
+	return NULL;
+}
+
+// Nested arrays which would overflow the stack if freed recursively.
+static char * free_deep_test(void) {
+	di_t a = di_array_empty();
+	int i;
+	for (i = 0; i < 200000; i++) {
+		di_t b = di_array_empty();
+		di_array_push(&b, a);
+		a = b;
+	}
+	di_cleanup(a);
+	mu_assert("nothing queued", !di_drain_frees(1));
+	return NULL;
+}
+
+static char * free_deferred_test(void) {
+	di_t d = di_dict_empty();
+	int i;
+	for (i = 0; i < 1000; i++)
+		d = di_dict_set(d, di_from_int(i), make_int_array(10));
+	di_defer_frees(true);
+	di_cleanup(d);
+	mu_assert("deferred work", di_drain_frees(100));
+	mu_assert("all work done", !di_drain_frees(0));
+	di_defer_frees(false);
+	return NULL;
+}
+
+static char * writer_test(void) {
+	di_writer_t w;
+	di_writer_init_string(&w);
+	int i;
+	for (i = 0; i < 1000; i++)
+		di_writef(&w, "%d,", i);
+	di_write_spaces(&w, 100);
+	di_write_int(&w, -2147483647 - 1);
+	di_t s = di_writer_finish_string(&w);
+	mu_assert("string length", di_string_length(s) == 3890 + 100 + 11);
+	mu_assert("string start", !strncmp(di_string_chars(s), "0,1,2,", 6));
+	mu_assert("nul-terminated", !strcmp(di_string_chars(s) + 3990, "-2147483648"));
+	di_cleanup(s);
+
+	// To a file, larger than the buffer
+	FILE *f = tmpfile();
+	di_writer_init_file(&w, f);
+	for (i = 0; i < 100000; i++)
+		di_write_cstring(&w, "abcdefghij");
+	mu_assert("position", di_writer_position(&w) == 1000000);
+	mu_assert("written to file", di_writer_finish(&w));
+	mu_assert("file size", ftell(f) == 1000000);
+	fclose(f);
+
+	di_t a = di_array_empty();
+	di_array_push(&a, di_string_from_cstring("a \"quoted\"\n"));
+	s = di_to_source(a, 0);
+	mu_assert("source", di_equal(s, di_string_from_cstring("[\n  \"a \\\"quoted\\\"\\n\"\n]")));
+	di_cleanup(s);
+	di_cleanup(a);
+	return NULL;
+}
+
+// Decodes json and encodes the result. Returns a C string which must be freed
+// or NULL if decoding or encoding fails.
+static char * json_roundtrip(const char *json) {
+	di_t value = json_decode(di_string_from_cstring(json));
+	if (di_is_undefined(value))
+		return NULL;
+	di_t encoded = json_encode(value);
+	di_cleanup(value);
+	if (di_is_undefined(encoded))
+		return NULL;
+	di_size_t len = di_string_length(encoded);
+	char *result = malloc(len + 1);
+	memcpy(result, di_string_chars(encoded), len);
+	result[len] = '\0';
+	di_cleanup(encoded);
+	return result;
+}
+
+static char * json_decode_test(void) {
+	const char *valid[][2] = {
+		{" [1, -2, 2.5, true, false, null] ", "[1,-2,2.5,true,false,null]"},
+		{"{\"a\": {\"b\": []}, \"c\": {}}", "{\"a\":{\"b\":[]},\"c\":{}}"},
+		{"{\"a\": 1, \"a\": 2}", "{\"a\":2}"},
+		// Key order is kept, also in dicts which aren't shaped
+		{"{\"zulu\": 1, \"yankee\": 2, \"x-ray\": 3, \"whiskey\": 4, "
+		 "\"victor\": 5, \"uniform\": 6, \"tango\": 7, \"sierra\": 8, "
+		 "\"romeo\": 9, \"quebec\": 10}",
+		 "{\"zulu\":1,\"yankee\":2,\"x-ray\":3,\"whiskey\":4,\"victor\":5,"
+		 "\"uniform\":6,\"tango\":7,\"sierra\":8,\"romeo\":9,\"quebec\":10}"},
+		{"\"\\u00e9\\ud83d\\ude00\\n\"", "\"\xc3\xa9\xf0\x9f\x98\x80\\n\""},
+		{"2147483648", "2147483648.0"},
+		{"1e3", "1000.0"},
+	};
+	const char *invalid[] = {
+		"", "[1,]", "{\"a\"}", "{\"a\":1,}", "01", "1.", "tru", "[1]]",
+		"\"abc", "\"\\ud800\"", "\"\xc0\xaf\"", "\"a\tb\"", "1 2",
+	};
+	size_t i;
+	for (i = 0; i < sizeof(valid) / sizeof(valid[0]); i++) {
+		char *result = json_roundtrip(valid[i][0]);
+		mu_assert("valid json decodes", result && !strcmp(result, valid[i][1]));
+		free(result);
+	}
+	for (i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+		di_t value = json_decode(di_string_from_cstring(invalid[i]));
+		mu_assert("invalid json fails", di_is_undefined(value));
+	}
+	return NULL;
+}
+
+static char * json_encode_test(void) {
+	di_t a = di_array_empty();
+	di_array_push(&a, di_from_double(0.1));
+	di_array_push(&a, di_from_double(1.0 / 3));
+	di_array_push(&a, di_from_int(-2147483647 - 1));
+	di_array_push(&a, di_string_from_cstring("quote \" \x01 and a longer tail"));
+	di_t json = json_encode(a);
+	const char *expected = "[0.1,0.3333333333333333,-2147483648,"
+	                       "\"quote \\\" \\u0001 and a longer tail\"]";
+	mu_assert("encoded", di_equal(json, di_string_from_cstring(expected)));
+	di_cleanup(json);
+
+	// To a file, larger than the chunk size
+	FILE *f = tmpfile();
+	int i;
+	for (i = 0; i < 20000; i++)
+		di_array_push(&a, di_from_int(i));
+	mu_assert("encoded to file", json_encode_file(a, f));
+	rewind(f);
+	char buf[32];
+	mu_assert("file contents", fread(buf, 1, 4, f) == 4 && !memcmp(buf, "[0.1", 4));
+	fseek(f, -7, SEEK_END);
+	mu_assert("file end", fread(buf, 1, 7, f) == 7 && !memcmp(buf, ",19999]", 7));
+	fclose(f);
+
+	di_t d = di_dict_set(di_dict_empty(), di_from_int(1), di_null());
+	mu_assert("int key fails", di_is_undefined(json_encode(d)));
+	di_cleanup(d);
+	d = di_dict_set(di_dict_empty(), di_string_from_cstring("x"),
+	                di_from_double(0.0 / 0.0));
+	mu_assert("nan fails", di_is_undefined(json_encode(d)));
+	di_cleanup(d);
+	di_cleanup(a);
+	return NULL;
+}
+
+static char * serialize_test(void) {
+	di_t key = di_string_from_cstring("a longer key");
+	di_incref(key);
+	di_t d = di_dict_empty();
+	d = di_dict_set(d, di_atom_from_cstring("syntax"), di_atom_from_cstring("apply"));
+	d = di_dict_set(d, di_atom_from_cstring("position"), di_from_int(-12345678));
+	d = di_dict_set(d, key, di_from_double(1.0));
+	d = di_dict_set(d, di_from_int(7), di_true());
+	di_t a = di_array_empty();
+	di_array_push(&a, d);
+	di_array_push(&a, di_string_from_cstring("a longer key")); // repeated
+	di_array_push(&a, di_null());
+	di_array_push(&a, di_false());
+	di_array_push(&a, di_array_empty());
+	di_t data = di_serialize(a);
+	mu_assert("serialized", di_is_string(data));
+	di_incref(data);
+	di_t b = di_deserialize(data);
+	mu_assert("deserialized", di_equal(a, b));
+	di_t d2 = di_array_get(b, 0);
+	mu_assert("double stays double",
+	          di_is_double(di_dict_get(d2, key)));
+	mu_assert("int stays int",
+	          di_is_int(di_dict_get(d2, di_atom_from_cstring("position"))));
+	di_t k, v;
+	di_size_t i;
+	for (i = 0; (i = di_dict_iter(d2, i, &k, &v));) {
+		if (di_equal(k, di_atom_from_cstring("position")))
+			mu_assert("atom stays atom", di_is_atom(k));
+		if (di_equal(k, key))
+			mu_assert("repeated string is shared",
+			          di_to_pointer(k) ==
+			          di_to_pointer(di_array_get(b, 1)));
+	}
+	di_cleanup(b);
+
+	// Invalid data
+	di_size_t len = di_string_length(data);
+	for (i = 0; i < len; i++)
+		mu_assert("truncated fails", di_is_undefined(
+		          di_deserialize_chars(di_string_chars(data), i, NULL)));
+	di_t longer = di_string_append_chars(di_string_from_chars(
+	              di_string_chars(data), len), "\0", 1);
+	mu_assert("trailing data fails", di_is_undefined(di_deserialize(longer)));
+	mu_assert("bad tag fails", di_is_undefined(
+	          di_deserialize(di_string_from_cstring("\x7f"))));
+	mu_assert("bad reference fails", di_is_undefined(
+	          di_deserialize(di_string_from_chars("\x07\x01\x06\x00", 4))));
+	mu_assert("huge length fails", di_is_undefined(
+	          di_deserialize(di_string_from_chars("\x07\xff\xff\x03", 4))));
+	di_size_t used;
+	di_t first = di_deserialize_chars("\x03\x04\x00", 3, &used);
+	mu_assert("value followed by other data",
+	          di_equal(first, di_from_int(2)) && used == 2);
+	mu_assert("unterminated string fails", di_is_undefined(di_deserialize(
+	          di_string_from_chars("\x05\x07" "abcdefg\x01", 10))));
+	di_t unknown = di_deserialize(
+	               di_string_from_chars("\x09\x0c" "not interned", 15));
+	mu_assert("atom not interned is a string",
+	          di_string_length(unknown) == 12 &&
+	          !memcmp(di_string_chars(unknown), "not interned", 12) &&
+	          !di_is_atom(unknown));
+	di_cleanup(unknown);
+	mu_assert("bad packed kind fails", di_is_undefined(di_deserialize(
+	          di_string_from_chars("\x0a\x04\x01\x00\x00", 5))));
+	mu_assert("bad padding fails", di_is_undefined(di_deserialize(
+	          di_string_from_chars("\x0a\x01\x01\x04\x00\x00\x00\x00\x01"
+	                               "\x00\x00\x00", 12))));
+	mu_assert("truncated packed array fails", di_is_undefined(di_deserialize(
+	          di_string_from_chars("\x0a\x01\x02\x00\x01\x00\x00\x00", 8))));
+	di_t nan = di_deserialize(di_string_from_chars(
+	           "\x04\xff\xff\xff\xff\xff\xff\xff\xff", 9));
+	mu_assert("nan stays a double", di_is_double(nan) &&
+	          di_to_double(nan) != di_to_double(nan));
+	di_decref_and_free(data);
+
+	// Packed arrays and lazy decoding
+	int32_t ints[3] = {1, -2, 3};
+	double doubles[2] = {0.5, 2.0};
+	di_t p = di_array_empty();
+	di_array_push(&p, di_array_from_ints(ints, 3));
+	di_array_push(&p, di_array_from_doubles(doubles, 2));
+	di_array_push(&p, di_array_from_bytes("bytes", 5));
+	di_array_push(&p, di_string_from_cstring("a longer string"));
+	data = di_serialize(p);
+	di_incref(data);
+	b = di_deserialize(data);
+	unsigned kind;
+	mu_assert("packed arrays stay packed", di_equal(p, b) &&
+	          di_array_packed_data(di_array_get(b, 0), &kind) &&
+	          kind == DI_PACKED_INT &&
+	          di_array_packed_data(di_array_get(b, 1), &kind) &&
+	          kind == DI_PACKED_DOUBLE);
+	di_cleanup(b);
+	const char *start = di_string_chars(data);
+	const char *end = start + di_string_length(data);
+	b = di_deserialize_lazy(data);
+	const char *bytes = di_array_bytes(di_array_get(b, 2));
+	di_t str = di_array_get(b, 3);
+	const char *chars = di_string_chars(str);
+	mu_assert("lazy", di_equal(p, b) && bytes >= start && bytes < end &&
+	          chars >= start && chars < end);
+	di_t updated = di_array_set(di_array_get(b, 2), 0, di_from_int('B'));
+	mu_assert("update copies", !memcmp(bytes, "bytes", 5) &&
+	          !memcmp(di_array_bytes(updated), "Bytes", 5));
+	di_cleanup(updated);
+	di_cleanup(b);
+	di_decref_and_free(data);
+	di_cleanup(p);
+
+	di_t fun = di_fun_create((di_funptr0_t)push_task, 1, NULL, 0);
+	di_array_push(&a, fun);
+	mu_assert("function fails", di_is_undefined(di_serialize(a)));
+	di_cleanup(a);
+	di_decref_and_free(key);
+	return NULL;
+}
+
+static char * lex_all_test(void) {
+	// Layout, explicit "in", regex after "=" and division after ")"
+	const char *source = "f(x) = let y = x\n"
+	                     "           z = 2 in\n"
+	                     "  do (y / z) ~ \"s\"\n"
+	                     "     /a\\/b/\n"
+	                     "g = [true, null, 1.5]\n";
+	di_t src = di_string_from_cstring(source);
+	di_incref(src);
+	di_tokens_t tokens;
+	di_lex_all(&tokens, src);
+	mu_assert("eof last", tokens.length > 0 &&
+	          di_equal(tokens.ops[tokens.length - 1], di_atom_from_cstring("eof")));
+
+	// The same tokens as di_lex() returns
+	di_t lexer = di_lexer_create(src);
+	di_t token = di_null();
+	di_size_t i;
+	for (i = 0; i < tokens.length; i++) {
+		token = di_lex(&lexer, token);
+		di_t data = di_dict_get(token, di_atom_from_cstring("data"));
+		mu_assert("op", di_equal(di_dict_get(token, di_atom_from_cstring("op")),
+		                         tokens.ops[i]));
+		mu_assert("line", di_to_int(di_dict_get(token, di_atom_from_cstring("line")))
+		          == (int)tokens.lines[i]);
+		mu_assert("column",
+		          di_to_int(di_dict_get(token, di_atom_from_cstring("column")))
+		          == (int)tokens.columns[i]);
+		mu_assert("data", di_equal(di_is_null(data) ? di_null() : data,
+		                           di_token_data(&tokens, i)));
+	}
+	di_cleanup(token);
+	di_cleanup(lexer);
+
+	// Inserted tokens start where the next token does
+	mu_assert("let", di_equal(tokens.ops[5], di_atom_from_cstring("let")) &&
+	          tokens.offsets[5] == 7);
+	mu_assert("inserted ;", di_equal(tokens.ops[9], di_atom_from_cstring(";")) &&
+	          tokens.offsets[9] == 28 && tokens.lines[9] == 2);
+	mu_assert("regex", di_equal(di_token_data(&tokens, 23),
+	                            di_string_from_cstring("a\\/b")));
+	mu_assert("division", di_equal(tokens.ops[17], di_atom_from_cstring("/")));
+	mu_assert("null has no data", tokens.data[31] == DI_NO_DATA &&
+	          di_equal(tokens.ops[31], di_atom_from_cstring("lit")));
+	di_tokens_free(&tokens);
+
+	di_decref_and_free(src);
+
+	// Identifiers aren't interned
+	src = di_string_from_cstring("not long_identifier");
+	di_incref(src);
+	di_lex_all(&tokens, src);
+	mu_assert("keyword", di_equal(tokens.ops[0], di_atom_from_cstring("not")));
+	di_t ident = di_string_from_cstring("long_identifier");
+	mu_assert("identifier string",
+	          di_equal(tokens.ops[1], di_atom_from_cstring("ident")) &&
+	          di_equal(di_token_data(&tokens, 1), ident) &&
+	          !di_is_atom(di_token_data(&tokens, 1)));
+	di_cleanup(ident);
+	di_tokens_free(&tokens);
+	di_decref_and_free(src);
+
+	// The parser reads the buffer
+	src = di_string_from_cstring("f(x) = do\n"
+	                             "  y = (x / 2)\n"
+	                             "  [y, true, null, \"s\"]\n"
+	                             "g = f(1)\n");
+	di_incref(src);
+	di_lex_all(&tokens, src);
+	di_t tree = di_parse_tokens(&tokens);
+	di_tokens_free(&tokens);
+	di_t expected = di_parse(src);
+	mu_assert("parse", di_equal(tree, expected));
+	mu_assert("tree", di_is_dict(tree));
+	di_cleanup(tree);
+	di_cleanup(expected);
+	di_decref_and_free(src);
+	return NULL;
+}
+
+// Compiles a program to C. Returns a string.
+static di_t compile_source(const char *source) {
+	di_writer_t w;
+	di_writer_init_string(&w);
+	di_compile(&w, di_annotate(di_parse(di_string_from_cstring(source))));
+	return di_writer_finish_string(&w);
+}
+
+static char * compile_test(void) {
+	// A single access doesn't need an incref, even of a bound variable
+	di_t c = compile_source("f(x, y) = x + y\n"
+	                        "z = f(1, 2)\n"
+	                        "f(z, 3)\n");
+	const char *chars = di_string_chars(c);
+	mu_assert("function", strstr(chars, "static di_t f_f(di_t a0, di_t a1) {"));
+	mu_assert("main", strstr(chars, "#ifndef DI_NO_MAIN"));
+	mu_assert("no incref", !strstr(chars, "di_incref"));
+	di_cleanup(c);
+
+	// More accesses do, and the last access gives up the reference
+	c = compile_source("xs = [1, 2, 3]\n"
+	                   "[xs, xs]\n");
+	chars = di_string_chars(c);
+	mu_assert("presized", strstr(chars, "di_array_from_values((di_t[]){"
+	                                    "di_from_int(1), di_from_int(2), "
+	                                    "di_from_int(3)}, 3)"));
+	char *incref = strstr(chars, "di_incref(v_xs);");
+	char *decref = strstr(chars, "di_decref(v_xs);");
+	mu_assert("incref", incref);
+	mu_assert("decref", decref && decref > incref);
+	mu_assert("decref before use",
+	          strstr(decref, "{v_xs, v_xs}") && !strstr(decref, "di_free"));
+	di_cleanup(c);
+
+	c = compile_source("{\"a\": \"b\"}{\"c\": []}\n");
+	chars = di_string_chars(c);
+	mu_assert("dict", strstr(chars, "di_dict_from_entries((di_t[]){lit[0], lit[1]}, 1)"));
+	mu_assert("update", strstr(chars, "di_dict_set("));
+	mu_assert("empty array", strstr(chars, "di_array_empty()"));
+	di_cleanup(c);
+	return NULL;
+}
+
+static char * regex_test(void) {
+	di_t re = di_regex_compile(di_string_from_cstring("(\\w+)=(\\d+)?"),
+	                           NULL);
+	mu_assert("regex", di_is_regex(re) && di_to_regex(re)->groups == 2);
+	di_incref(re);
+	di_t line = di_string_from_cstring("level: warning_count= from disk");
+	di_incref(line);
+	const char *chars = di_string_chars(line);
+	di_t m = di_regex_match(re, line);
+	mu_assert("match", di_is_array(m) && di_array_length(m) == 3);
+	di_t whole = di_array_get(m, 0), key = di_array_get(m, 1);
+	mu_assert("groups are views", di_string_chars(whole) == chars + 7 &&
+	          di_string_chars(key) == chars + 7 &&
+	          di_equal(key, di_string_from_cstring("warning_count")) &&
+	          di_string_length(whole) == 14);
+	mu_assert("unset group", di_is_null(di_array_get(m, 2)));
+	di_decref(line);
+	di_cleanup(line); // the views keep it
+	mu_assert("views keep the subject",
+	          di_equal(di_array_get(m, 1),
+	                   di_string_from_cstring("warning_count")));
+	di_cleanup(m);
+	m = di_regex_match(re, di_string_from_cstring("port=8080"));
+	di_t expected = json_decode(di_string_from_cstring(
+		"[\"port=8080\", \"port\", \"8080\"]"));
+	mu_assert("short groups", di_equal(m, expected));
+	di_cleanup(m);
+	di_cleanup(expected);
+	mu_assert("no match", di_is_null(di_regex_match(re,
+	          di_string_from_cstring("no equals sign here"))));
+	mu_assert("test", di_regex_test(re, di_string_from_cstring("a=1")) &&
+	          !di_regex_test(re, di_string_from_cstring("=")));
+	mu_assert("printed as a literal", di_equal(di_to_source(re, 0),
+	          di_string_from_cstring("/(\\w+)=(\\d+)?/")));
+	di_decref_and_free(re);
+
+	di_t error = di_null();
+	re = di_regex_compile(di_string_from_cstring("a(b"), &error);
+	mu_assert("invalid", di_is_null(re) && di_is_string(error) &&
+	          strstr(di_string_chars(error), "/a(b/"));
+	di_cleanup(error);
+
+	// The cache returns the same shared regex for equal patterns.
+	di_t a = di_regex_cached(di_string_from_cstring("^GET (\\S+)"));
+	di_t b = di_regex_cached(di_string_from_cstring("^GET (\\S+)"));
+	mu_assert("cached", di_is_regex(a) && di_to_pointer(a) == di_to_pointer(b)
+	          && di_is_shared(a) && di_is_shared(di_regex_pattern(a)));
+	di_decref_and_free(b);
+	char pattern[16];
+	int i;
+	for (i = 0; i < DI_REGEX_CACHE_SIZE; i++) {
+		snprintf(pattern, sizeof(pattern), "x%d+", i);
+		di_decref_and_free(di_regex_cached(di_string_from_cstring(pattern)));
+	}
+	b = di_regex_cached(di_string_from_cstring("^GET (\\S+)"));
+	mu_assert("evicted", di_to_pointer(a) != di_to_pointer(b) &&
+	          di_equal(di_regex_pattern(a), di_regex_pattern(b)));
+	m = di_regex_match(a, di_string_from_cstring("GET /index.html HTTP/1.1"));
+	mu_assert("evicted regex still works", di_equal(di_array_get(m, 1),
+	          di_string_from_cstring("/index.html")));
+	di_cleanup(m);
+	di_decref_and_free(a);
+	di_decref_and_free(b);
+
+	// Regex literals in compiled code are compiled when the module is loaded
+	di_t c = compile_source("case \"a = 1\" of /^\\w+ = / -> 1; _ -> 2 end\n");
+	chars = di_string_chars(c);
+	mu_assert("regex literal", strstr(chars, "re[0] = di_regex_compile(lit["));
+	mu_assert("regex pattern", strstr(chars, "di_rt_regex(re[0], "));
+	di_cleanup(c);
+	return NULL;
+}
+
+#ifdef DI_POOL_ALLOC
+static char * pool_test(void) {
+	char *p = di_alloc(40);
+	strcpy(p, "pooled");
+	mu_assert("realloc within size class", di_realloc(p, 48, 40) == p);
+	char *q = di_realloc(p, 200, 48);
+	mu_assert("realloc to larger class", !strcmp(q, "pooled"));
+	char *r = di_realloc(q, 1000, 200);
+	mu_assert("realloc out of the pool", !strcmp(r, "pooled"));
+	r = di_realloc(r, 100, 1000);
+	mu_assert("realloc into the pool", !strcmp(r, "pooled"));
+	di_free(r, 100);
+	mu_assert("freed block is reused", di_alloc(100) == r);
+	di_free(r, 100);
+	return NULL;
+}
+#endif
+
+#ifdef DI_STATS
+// A count in di_stats() for a type of object.
+static int type_stat(const char *type, const char *counter) {
+	di_t stats = di_stats();
+	di_t t = di_dict_get(di_dict_get(di_dict_get(stats,
+	                     di_string_from_cstring("types")),
+	                     di_string_from_cstring(type)),
+	                     di_string_from_cstring(counter));
+	int n = di_is_int(t) ? di_to_int(t) : 0;
+	di_cleanup(stats);
+	return n;
+}
+
+static char * stats_test(void) {
+	// A dict with an int key is a hash table.
+	di_t d = di_dict_set(di_dict_empty(), di_from_int(0), di_from_int(0));
+	int cloned = type_stat("dict", "cloned"), reused = type_stat("dict", "reused");
+	int noops = type_stat("dict", "noop_sets");
+	d = di_dict_set(d, di_from_int(1), di_from_int(1));
+	mu_assert("reused", type_stat("dict", "reused") == reused + 1);
+	di_incref(d);
+	di_t d2 = di_dict_set(d, di_from_int(2), di_from_int(2));
+	mu_assert("cloned", type_stat("dict", "cloned") == cloned + 1 &&
+	          type_stat("dict", "reused") == reused + 1);
+	d2 = di_dict_set(d2, di_from_int(2), di_from_int(2));
+	mu_assert("no-op", type_stat("dict", "noop_sets") == noops + 1);
+	di_cleanup(d2);
+	di_decref_and_free(d);
+
+	cloned = type_stat("string", "cloned");
+	reused = type_stat("string", "reused");
+	int freed = type_stat("string", "freed");
+	di_t s = di_string_from_cstring("a heap string");
+	s = di_string_append_chars(s, "!", 1);
+	di_incref(s);
+	di_t s2 = di_string_append_chars(s, "!", 1);
+	mu_assert("string", type_stat("string", "reused") == reused + 1 &&
+	          type_stat("string", "cloned") == cloned + 1);
+	di_cleanup(s2);
+	di_decref_and_free(s);
+	mu_assert("freed", type_stat("string", "freed") == freed + 2);
+
+	di_t stats = di_stats();
+	mu_assert("bytes", di_to_int(di_dict_get(stats,
+	          di_string_from_cstring("peak_bytes"))) >=
+	          di_to_int(di_dict_get(stats,
+	          di_string_from_cstring("live_bytes"))));
+	di_cleanup(stats);
+	return NULL;
+}
+#endif
+
 testfun tests[] = {
 	string_test,
         string_from_cstring_test,
 	array_set_test,
 	array_push_inplace_test,
-	array_push_clone_test
+	array_push_clone_test,
+	array_unshift_test,
+	array_slice_test,
+	array_concat_test,
+	string_hash_test,
+	dict_string_keys_test,
+	dict_order_test,
+	shaped_dict_test,
+	persistent_array_test,
+	persistent_dict_test,
+	packed_array_test,
+	view_test,
+	equal_hash_test,
+	share_test,
+	fun_test,
+	task_test,
+	atom_test,
+	arena_test,
+	borrowed_test,
+	external_string_test,
+	free_deep_test,
+	free_deferred_test,
+	writer_test,
+	json_decode_test,
+	json_encode_test,
+	serialize_test,
+	lex_all_test,
+	compile_test,
+	regex_test,
+#ifdef DI_POOL_ALLOC
+	pool_test,
+#endif
+#ifdef DI_STATS
+	stats_test,
+#endif
 };
 
 char * run_tests(void) {
@@ -1,6 +1,10 @@
+#define _POSIX_C_SOURCE 200809L // posix_memalign
 #include "di.h"
+#include "di_fun.h"
+#include "di_regex.h"
 #include "di_debug.h"
 #include <stdio.h>
+#include <pthread.h>
 
 /*------------------------------------------*
  * Dummy error handling: DIE(message) macro *
@@ -27,6 +31,400 @@ void di_error(di_t message) {
 	exit(1);
 }
 
+#ifdef DI_ALLOC_COUNT
+di_alloc_counters_t di_alloc_counters;
+#endif
+
+/*+------------+*
+ *| Statistics |*
+ *+------------+*/
+
+#ifdef DI_STATS
+__thread di_stats_counters_t di_thread_stats;
+long long di_live_bytes = 0, di_peak_bytes = 0;
+
+// The counts of the threads which have called di_thread_cleanup().
+static di_stats_counters_t stats_totals;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void add_tag_stats(di_tag_stats_t *sum, const di_tag_stats_t *c) {
+	sum->created   += c->created;
+	sum->freed     += c->freed;
+	sum->cloned    += c->cloned;
+	sum->reused    += c->reused;
+	sum->noop_sets += c->noop_sets;
+}
+
+static void add_stats(di_stats_counters_t *sum, const di_stats_counters_t *c) {
+	sum->allocs   += c->allocs;
+	sum->reallocs += c->reallocs;
+	sum->frees    += c->frees;
+	sum->bytes    += c->bytes;
+	int i;
+	for (i = 0; i < DI_STATS_TAGS; i++)
+		add_tag_stats(&sum->tags[i], &c->tags[i]);
+}
+
+// Adds the counts of the calling thread to the totals.
+static void flush_stats(void) {
+	pthread_mutex_lock(&stats_lock);
+	add_stats(&stats_totals, &di_thread_stats);
+	pthread_mutex_unlock(&stats_lock);
+	memset(&di_thread_stats, 0, sizeof(di_thread_stats));
+}
+
+// A count as a number. Counts which don't fit in an int are doubles.
+static di_t count(unsigned long long n) {
+	return n <= INT32_MAX ? di_from_int((int32_t)n) : di_from_double(n);
+}
+
+static inline di_t key(const char *name) {
+	return di_atom_from_cstring(name);
+}
+
+static const struct { char tag; const char *name; } stats_types[] = {
+	{DI_STRING, "string"}, {DI_EXTSTRING, "extstring"}, {DI_ARRAY, "array"},
+	{DI_SLICE, "slice"}, {DI_VECTOR, "vector"}, {DI_PACKED, "packed"},
+	{DI_DICT, "dict"}, {DI_SHAPED, "shaped"}, {DI_HAMT, "hamt"},
+	{DI_FUN, "fun"}, {DI_TASK, "task"}, {DI_REGEX, "regex"}
+};
+#endif
+
+di_t di_stats(void) {
+#ifdef DI_STATS
+	// The counts are copied and the building of the dict isn't counted.
+	di_stats_counters_t c, own = di_thread_stats;
+	pthread_mutex_lock(&stats_lock);
+	c = stats_totals;
+	pthread_mutex_unlock(&stats_lock);
+	add_stats(&c, &own);
+	di_t stats = di_dict_empty(), types = di_dict_empty();
+	stats = di_dict_set(stats, key("allocs"), count(c.allocs));
+	stats = di_dict_set(stats, key("reallocs"), count(c.reallocs));
+	stats = di_dict_set(stats, key("frees"), count(c.frees));
+	stats = di_dict_set(stats, key("bytes"), count(c.bytes));
+	long long live = __atomic_load_n(&di_live_bytes, __ATOMIC_RELAXED);
+	stats = di_dict_set(stats, key("live_bytes"), count(live > 0 ? live : 0));
+	stats = di_dict_set(stats, key("peak_bytes"),
+	                    count(__atomic_load_n(&di_peak_bytes,
+	                                          __ATOMIC_RELAXED)));
+	size_t i;
+	for (i = 0; i < sizeof(stats_types) / sizeof(stats_types[0]); i++) {
+		const di_tag_stats_t *t = &c.tags[(int)stats_types[i].tag];
+		if (!t->created && !t->freed && !t->cloned && !t->reused &&
+		    !t->noop_sets)
+			continue;
+		di_t d = di_dict_empty();
+		d = di_dict_set(d, key("created"), count(t->created));
+		d = di_dict_set(d, key("freed"), count(t->freed));
+		d = di_dict_set(d, key("cloned"), count(t->cloned));
+		d = di_dict_set(d, key("reused"), count(t->reused));
+		d = di_dict_set(d, key("noop_sets"), count(t->noop_sets));
+		types = di_dict_set(types, key(stats_types[i].name), d);
+	}
+	stats = di_dict_set(stats, key("types"), types);
+	di_thread_stats = own;
+	return stats;
+#else
+	return di_null();
+#endif
+}
+
+/*+--------+*
+ *| Arenas |*
+ *+--------+*/
+
+static void di_forget_frees(di_arena_t *arena);
+
+// Arena memory is allocated in chunks. Each chunk is twice the size of the
+// previous one, up to a limit. Larger allocations get a chunk of their own.
+// Chunks are aligned to DI_ARENA_REGION bytes and their sizes are multiples of
+// it, so the regions of each chunk are marked in di_arena_map. Freed blocks of
+// up to DI_ARENA_MAX_REUSE bytes are kept in free lists, one per size, and
+// reused by later allocations in the same arena. (Values are often
+// short-lived, e.g. dicts that are replaced when they grow.)
+#define DI_ARENA_MIN_CHUNK DI_ARENA_REGION
+#define DI_ARENA_MAX_CHUNK (16 * 1024 * 1024)
+#define DI_ARENA_ALIGN 16
+#define DI_ARENA_MAX_REUSE 1024
+
+typedef struct di_arena_chunk {
+	struct di_arena_chunk *prev;
+	char *start, *end;
+} di_arena_chunk_t;
+
+struct di_arena {
+	pthread_t owner;              // the thread which created it
+	di_arena_chunk_t *chunk;      // the current chunk
+	char *top;                    // the free memory of the current chunk
+	size_t chunk_size;            // the size of the next chunk
+	void *free_lists[DI_ARENA_MAX_REUSE / DI_ARENA_ALIGN + 1];
+#ifdef DI_STATS
+	long long live;               // the bytes not freed in the arena
+#endif
+};
+
+__thread di_arena_t *di_current_arena = NULL;
+di_arena_t **di_arena_map[(size_t)1 << (DI_ARENA_ADDRESS_BITS -
+                                        DI_ARENA_REGION_BITS -
+                                        DI_ARENA_LEAF_BITS)];
+
+static inline size_t arena_align(size_t size) {
+	return (size + DI_ARENA_ALIGN - 1) & ~(size_t)(DI_ARENA_ALIGN - 1);
+}
+
+// Sets the arena of the regions of a chunk of size bytes in di_arena_map, or
+// clears it if arena is NULL. Another thread may add a leaf meanwhile.
+static void arena_map_chunk(di_arena_chunk_t *chunk, size_t size,
+                            di_arena_t *arena) {
+	size_t region = (uintptr_t)chunk >> DI_ARENA_REGION_BITS;
+	size_t end = region + size / DI_ARENA_REGION;
+	assert(end >> DI_ARENA_LEAF_BITS <
+	       sizeof(di_arena_map) / sizeof(di_arena_map[0]));
+	for (; region < end; region++) {
+		di_arena_t ***slot = &di_arena_map[region >> DI_ARENA_LEAF_BITS];
+		di_arena_t **leaf = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+		if (!leaf) {
+			di_arena_t **new_leaf = calloc(DI_ARENA_LEAF,
+			                               sizeof(di_arena_t *));
+			if (!new_leaf) DIE("Out of memory");
+			if (__atomic_compare_exchange_n(slot, &leaf, new_leaf, false,
+			                                __ATOMIC_ACQ_REL,
+			                                __ATOMIC_ACQUIRE))
+				leaf = new_leaf;
+			else
+				free(new_leaf);
+		}
+		__atomic_store_n(&leaf[region & (DI_ARENA_LEAF - 1)], arena,
+		                 __ATOMIC_RELAXED);
+	}
+}
+
+// True if the calling thread created the arena. A block of an arena which is
+// freed by another thread is left as it is until the arena is destroyed.
+static inline bool arena_is_own(di_arena_t *arena) {
+	return pthread_equal(arena->owner, pthread_self());
+}
+
+di_arena_t *di_arena_create(void) {
+	di_arena_t *arena = malloc(sizeof(di_arena_t));
+	if (!arena) DIE("Out of memory");
+	arena->owner = pthread_self();
+	arena->chunk = NULL;
+	arena->top = NULL;
+	arena->chunk_size = DI_ARENA_MIN_CHUNK;
+	memset(arena->free_lists, 0, sizeof(arena->free_lists));
+#ifdef DI_STATS
+	arena->live = 0;
+#endif
+	return arena;
+}
+
+di_arena_t *di_arena_enter(di_arena_t *arena) {
+	di_arena_t *prev = di_current_arena;
+	di_current_arena = arena;
+	return prev;
+}
+
+void di_arena_destroy(di_arena_t *arena) {
+	di_forget_frees(arena);
+	if (di_current_arena == arena)
+		di_current_arena = NULL;
+#ifdef DI_STATS
+	di_stats_live(-arena->live); // freed all at once
+#endif
+	while (arena->chunk) {
+		di_arena_chunk_t *prev = arena->chunk->prev;
+		arena_map_chunk(arena->chunk,
+		                arena->chunk->end - (char *)arena->chunk, NULL);
+		free(arena->chunk);
+		arena->chunk = prev;
+	}
+	free(arena);
+}
+
+void *di_arena_alloc(di_arena_t *arena, size_t size) {
+#ifdef DI_STATS
+	arena->live += size;
+#endif
+	size = arena_align(size);
+	if (size <= DI_ARENA_MAX_REUSE && arena->free_lists[size / DI_ARENA_ALIGN]) {
+		void **block = arena->free_lists[size / DI_ARENA_ALIGN];
+		arena->free_lists[size / DI_ARENA_ALIGN] = *block;
+		return block;
+	}
+	if (!arena->chunk || arena->chunk->end - arena->top < (ptrdiff_t)size) {
+		// Start a new chunk, with the header in its first bytes.
+		size_t header = arena_align(sizeof(di_arena_chunk_t));
+		size_t chunk_size = arena->chunk_size;
+		if (chunk_size < header + size)
+			chunk_size = (header + size + DI_ARENA_REGION - 1) &
+			             ~(DI_ARENA_REGION - 1);
+		else if (arena->chunk_size < DI_ARENA_MAX_CHUNK)
+			arena->chunk_size *= 2;
+		void *mem;
+		if (posix_memalign(&mem, DI_ARENA_REGION, chunk_size))
+			DIE("Out of memory");
+		di_arena_chunk_t *chunk = mem;
+		chunk->start = (char *)chunk + header;
+		chunk->end = (char *)chunk + chunk_size;
+		chunk->prev = arena->chunk;
+		arena_map_chunk(chunk, chunk_size, arena);
+		arena->chunk = chunk;
+		arena->top = chunk->start;
+	}
+	void *ptr = arena->top;
+	arena->top += size;
+	return ptr;
+}
+
+void *di_arena_realloc(di_arena_t *arena, void *ptr, size_t size,
+                       size_t oldsize) {
+	char *p = ptr;
+	if (!arena_is_own(arena)) {
+		// Moved to memory of the calling thread.
+		void *new_ptr = di_alloc(size);
+		if (!new_ptr) DIE("Out of memory");
+		memcpy(new_ptr, ptr, size < oldsize ? size : oldsize);
+		return new_ptr;
+	}
+	if (p + arena_align(oldsize) == arena->top &&
+	    p + arena_align(size) <= arena->chunk->end) {
+		// The last allocation. Grow or shrink it in place.
+		arena->top = p + arena_align(size);
+	} else if (arena_align(size) != arena_align(oldsize)) {
+		void *new_ptr = di_arena_alloc(arena, size);
+		memcpy(new_ptr, ptr, size < oldsize ? size : oldsize);
+		di_arena_free(arena, ptr, oldsize);
+		return new_ptr;
+	}
+#ifdef DI_STATS
+	arena->live += (long long)size - (long long)oldsize;
+#endif
+	return ptr;
+}
+
+void di_arena_free(di_arena_t *arena, void *ptr, size_t size) {
+	if (!arena_is_own(arena))
+		return;
+#ifdef DI_STATS
+	arena->live -= size;
+#endif
+	size = arena_align(size);
+	if ((char *)ptr + size == arena->top) {
+		arena->top = ptr; // the last allocation
+	} else if (size <= DI_ARENA_MAX_REUSE) {
+		void **block = ptr;
+		*block = arena->free_lists[size / DI_ARENA_ALIGN];
+		arena->free_lists[size / DI_ARENA_ALIGN] = block;
+	}
+}
+
+/*+-------+*
+ *| Pools |*
+ *+-------+*/
+
+#ifdef DI_POOL_ALLOC
+
+// Blocks are rounded up to a multiple of DI_POOL_GRANULE bytes. That gives
+// size classes which fit the smallest dicts, arrays and long strings closely.
+// Each class has a free list and a slab that new blocks are carved from. Slabs
+// are never returned to the system.
+#define DI_POOL_GRANULE 16
+#define DI_POOL_SLAB (64 * 1024)
+#define DI_POOL_CLASSES (DI_POOL_MAX / DI_POOL_GRANULE + 1)
+
+typedef struct di_pool {
+	void *free; // a linked list of free blocks
+	char *top, *end; // unused memory in the current slab
+} di_pool_t;
+
+static __thread di_pool_t pools[DI_POOL_CLASSES];
+
+static inline unsigned pool_class(size_t size) {
+	return (size + DI_POOL_GRANULE - 1) / DI_POOL_GRANULE;
+}
+
+void *di_pool_alloc(size_t size) {
+	unsigned class = pool_class(size);
+	di_pool_t *pool = &pools[class];
+	if (pool->free) {
+		void **block = pool->free;
+		pool->free = *block;
+		return block;
+	}
+	size_t block_size = class * DI_POOL_GRANULE;
+	if (block_size == 0)
+		block_size = DI_POOL_GRANULE;
+	if (pool->end - pool->top < (ptrdiff_t)block_size) {
+		pool->top = malloc(DI_POOL_SLAB);
+		if (!pool->top) DIE("Out of memory");
+		pool->end = pool->top + DI_POOL_SLAB;
+	}
+	void *block = pool->top;
+	pool->top += block_size;
+	return block;
+}
+
+void di_pool_free(void *ptr, size_t size) {
+	di_pool_t *pool = &pools[pool_class(size)];
+	void **block = ptr;
+	*block = pool->free;
+	pool->free = block;
+}
+
+// Resizes a block, where at least one of the sizes is in the pool range.
+void *di_pool_realloc(void *ptr, size_t size, size_t oldsize) {
+	if (size <= DI_POOL_MAX && oldsize <= DI_POOL_MAX &&
+	    pool_class(size) == pool_class(oldsize))
+		return ptr; // it fits in the same block
+	void *new_ptr = di_alloc(size);
+	if (!new_ptr) DIE("Out of memory");
+	memcpy(new_ptr, ptr, size < oldsize ? size : oldsize);
+	di_free(ptr, oldsize);
+	return new_ptr;
+}
+
+#endif
+
+/*+-------------------+*
+ *| Borrowed pointers |*
+ *+-------------------+*/
+
+// Helper. True if v points to an object which the function it's passed to may
+// free or reuse, i.e. it's a regular pointer with refc 0. A borrowed pointer
+// counts as a reference, so its object is always shared.
+static inline bool di_is_unshared_pointer(di_t v) {
+	return di_is_owned_pointer(v) && di_tagged_refc(di_to_pointer(v)) == 0;
+}
+
+// Helper. Increments the reference-counter of a value to be stored in an array
+// or a dict, or to be returned while the caller keeps its reference. Returns
+// it as a regular pointer.
+static inline di_t di_keep(di_t v) {
+	if (di_is_pointer(v))
+		di_tagged_incref(di_to_pointer(v));
+	return di_unborrow(v);
+}
+
+// Helper. Returns an argument unchanged, as a regular pointer. If it's
+// borrowed, the returned reference is a new one.
+static inline di_t di_return_arg(di_t v) {
+	return di_is_borrowed(v) ? di_keep(v) : v;
+}
+
+// Helper. Copies an object of size bytes, except for the header, which is
+// initialized with the same tag. (Another thread may update the
+// reference-counter of a shared object meanwhile.)
+static void *clone_object(const di_tagged_t *p, size_t size) {
+	di_tagged_t *clone = di_alloc(size);
+	if (!clone) DIE("Out of memory");
+	memcpy(clone + 1, p + 1, size - sizeof(di_tagged_t));
+	di_init_tagged(clone, p->tag);
+	DI_STAT(p->tag, cloned);
+	return clone;
+}
+
 /*+--------+*
  *| String |*
  *+--------+*/
@@ -36,8 +434,10 @@ di_size_t di_string_length(di_t v) {
 	assert(di_is_string(v));
 	if (di_is_shortstring(v))
 		return di_shortstring_length(v);
+	else if (di_is_atom(v))
+		return dynstr_length(di_to_atom(v));
 	else
-		return dynstr_length((dynstr_t *)di_to_pointer(v));
+		return dynstr_length((dynstr_t *)di_to_pointer(v)); // or an extstring
 }
 
 // Creates a string of length length containing undefined bytes.
@@ -47,6 +447,7 @@ di_t di_string_create_presized(di_size_t length) {
 		return di_shortstring_create_undef(length);
 	dynstr_t * s = dynstr_create(length);
 	s->len = length;
+	s->hash = 0;
 	s->chars[length] = '\0'; // dynstr are nul terminated
 	di_tagged_t * tagged = (di_tagged_t *)s;
 	di_init_tagged(tagged, DI_STRING);
@@ -59,13 +460,15 @@ di_t di_string_create_presized(di_size_t length) {
 // (Low-level, for interal use)
 di_t di_string_resize(di_t s, di_size_t length) {
 	assert(di_is_string(s));
-	assert(!di_is_pointer(s) || di_to_pointer(s)->refc == 0);
+	assert(!di_is_pointer(s) || di_is_unshared_pointer(s));
 	di_size_t old_length = di_string_length(s);
 	if (old_length == length) {
 		return s; // No resize is necessary.
 	}
-	if (di_is_shortstring(s) || length <= 6) {
-		// It is a shortstring or it will be a shortstring.
+	if (!di_is_pointer(s) || di_to_pointer(s)->tag != DI_STRING ||
+	    length <= 6) {
+		// It is a shortstring, an atom or an external string, or it will
+		// be a shortstring.
 		// Create a new string and copy the chars to it
 		di_t s2 = di_string_create_presized(length);
 		di_size_t min_length =
@@ -75,6 +478,7 @@ di_t di_string_resize(di_t s, di_size_t length) {
 		return s2;
 	} else {
 		// The string is a dynstr and we need a dynstr. Resize it.
+		DI_STAT(DI_STRING, reused);
 		dynstr_t * dynstr = (dynstr_t *)di_to_pointer(s);
 		if (old_length < length) {
 			dynstr = dynstr_reserve(dynstr, length - old_length);
@@ -83,6 +487,7 @@ di_t di_string_resize(di_t s, di_size_t length) {
 			dynstr->len = length;
 			dynstr = dynstr_compact(dynstr);
 		}
+		dynstr->hash = 0; // the contents are about to change
 		return di_from_pointer((di_tagged_t *)dynstr);
 	}
 }
@@ -94,17 +499,86 @@ di_t di_string_from_chars(const char *chars, di_size_t length) {
 	return s;
 }
 
+di_t di_string_from_external(char *chars, di_size_t length,
+                             void (*release)(char *chars, di_size_t length)) {
+	if (length <= 6) {
+		di_t s = di_string_from_chars(chars, length);
+		release(chars, length);
+		return s;
+	}
+	assert(chars[length] == '\0');
+	di_extstring_t *s = di_alloc(sizeof(di_extstring_t));
+	if (!s) DIE("Out of memory");
+	di_init_tagged(&s->header, DI_EXTSTRING);
+	s->hash = 0;
+	s->len = length;
+	s->chars = chars;
+	s->release = release;
+	s->owner = di_null();
+	return di_from_pointer(&s->header);
+}
+
+di_t di_string_view(di_t owner, const char *chars, di_size_t length) {
+	if (length <= 6) {
+		di_t s = di_string_from_chars(chars, length);
+		di_cleanup(owner);
+		return s;
+	}
+	assert(chars[length] == '\0');
+	di_extstring_t *s = di_alloc(sizeof(di_extstring_t));
+	if (!s) DIE("Out of memory");
+	di_init_tagged(&s->header, DI_EXTSTRING);
+	s->hash = 0;
+	s->len = length;
+	s->chars = (char *)chars;
+	s->release = NULL;
+	s->owner = di_keep(owner);
+	return di_from_pointer(&s->header);
+}
+
+di_t di_string_subview(di_t s, di_size_t start, di_size_t length) {
+	assert(di_is_string(s));
+	assert(start + length <= di_string_length(s));
+	const char *chars = di_string_chars(s) + start;
+	if (length <= 6) {
+		di_t sub = di_string_from_chars(chars, length);
+		di_cleanup(s);
+		return sub;
+	}
+	bool terminated = start + length == di_string_length(s) &&
+	                  di_string_is_terminated(s);
+	// A view of a view refers to the value the chars are in, so that views
+	// don't form chains.
+	di_t owner = s;
+	if (di_is_pointer(s) && di_to_pointer(s)->tag == DI_EXTSTRING &&
+	    !di_is_null(((di_extstring_t *)di_to_pointer(s))->owner))
+		owner = ((di_extstring_t *)di_to_pointer(s))->owner;
+	di_extstring_t *sub = di_alloc(sizeof(di_extstring_t));
+	if (!sub) DIE("Out of memory");
+	di_init_tagged(&sub->header, DI_EXTSTRING);
+	if (!terminated)
+		sub->header.flags |= DI_UNTERMINATED;
+	sub->hash = 0;
+	sub->len = length;
+	sub->chars = (char *)chars;
+	sub->release = NULL;
+	sub->owner = di_keep(owner);
+	di_cleanup(s);
+	return di_from_pointer(&sub->header);
+}
+
 // Appends length chars to s.
 di_t di_string_append_chars(di_t s, const char *chars, di_size_t length) {
 	assert(di_is_string(s));
 	di_size_t old_length = di_string_length(s);
 	di_t s2;
-	if (di_is_shortstring(s) || di_to_pointer(s)->refc == 0) {
-		// Resize and reuse the string
+	if (!di_is_pointer(s) || di_is_unshared_pointer(s)) {
+		// Resize and reuse the string (or copy it if it's an atom)
 		s2 = di_string_resize(s, old_length + length);
 	}
 	else {
 		// Create a new string and copy all chars to it
+		DI_STAT(di_to_pointer(s)->tag, cloned);
 		s2 = di_string_create_presized(old_length + length);
 		memcpy(di_string_chars(s2), di_string_chars(s), old_length);
 	}
@@ -127,8 +601,8 @@ di_t di_string_substr(di_t s, di_size_t start, di_size_t length) {
 	assert(start >= 0 && length >= 0);
 	assert(start + length <= di_string_length(s));
 	if (start == 0 && length == di_string_length(s))
-		return s; // The whole string
-	if (di_is_pointer(s) && di_to_pointer(s)->refc == 0) {
+		return di_return_arg(s); // The whole string
+	if (di_is_unshared_pointer(s) && di_to_pointer(s)->tag == DI_STRING) {
 		// reuse the string, move chars to the beginning and shrink
 		if (start != 0) {
 			// Move the chars to the beginning
@@ -138,6 +612,8 @@ di_t di_string_substr(di_t s, di_size_t start, di_size_t length) {
 		return di_string_resize(s, length);
 	}
 	// Otherwise, copy the chars to a new string
+	if (di_is_pointer(s) && !di_is_unshared_pointer(s))
+		DI_STAT(di_to_pointer(s)->tag, cloned);
 	return di_string_from_chars(&di_string_chars(s)[start], length);
 }
 
@@ -145,18 +621,30 @@ di_t di_string_substr(di_t s, di_size_t start, di_size_t length) {
  *| Array |*
  *+-------+*/
 
-/* Use aadeque_t for the array implementation */
-#define AADEQUE_HEADER di_tagged_t header;
+/* Use aadeque_t for the array implementation. The hash of the contents is
+ * cached as for strings (0 = not computed yet) and is reset when the array is
+ * modified. The twin is a vector with the same contents, made when the array
+ * is updated while it's shared. See below.
+ */
+#define AADEQUE_HEADER di_tagged_t header; uint32_t hash; struct di_vector *twin;
 #define AADEQUE_VALUE_T di_t
 #define AADEQUE_EQUALS(a, b) di_equal(a, b)
 #define AADEQUE_SIZE_T di_size_t
 #include "aadeque.h"
 
+// A slice is a view into a part of a real array (never into another slice).
+// The slice holds a reference to the array.
+typedef struct di_slice {
+	di_tagged_t header;
+	aadeque_t  *parent;
+	di_size_t   offset, length;
+} di_slice_t;
+
 // Helper. Clones an unboxed array.
 static inline aadeque_t *di_aadeque_clone(aadeque_t * arr) {
-	// Clone the old one and reset refc.
-	arr = aadeque_clone(arr);
-	arr->header.refc = 0;
+	// Clone the old one, with refc 0.
+	arr = clone_object(&arr->header, aadeque_sizeof(arr->cap));
+	arr->twin = NULL;
 	// Incref all elements in arr.
 	di_size_t i;
 	for (i = 0; i < aadeque_len(arr); i++)
@@ -164,71 +652,791 @@ static inline aadeque_t *di_aadeque_clone(aadeque_t * arr) {
 	return arr;
 }
 
+// Helper. Initializes the header of a new unboxed array.
+static inline aadeque_t *di_aadeque_init(aadeque_t *arr) {
+	di_init_tagged(&arr->header, DI_ARRAY);
+	arr->hash = 0;
+	arr->twin = NULL;
+	return arr;
+}
+
+// Helper. Crops an unboxed array to the given interval, releasing the
+// elements outside it.
+static aadeque_t *di_aadeque_crop(aadeque_t *arr, di_size_t start,
+                                  di_size_t length) {
+	di_size_t i;
+	for (i = 0; i < start; i++)
+		di_decref_and_free(aadeque_get(arr, i));
+	for (i = start + length; i < aadeque_len(arr); i++)
+		di_decref_and_free(aadeque_get(arr, i));
+	return aadeque_crop(arr, start, length);
+}
+
+// Helper. Frees a slice and releases its reference to the parent.
+static void di_slice_destroy(di_slice_t *slice) {
+	assert(slice->header.refc == 0);
+	aadeque_t *parent = slice->parent;
+	di_free(slice, sizeof(di_slice_t));
+	di_decref_and_free(di_from_pointer((di_tagged_t *)parent));
+}
+
+// Helper. True if an array's memory can be reused, i.e. it's an array with
+// refc 0 or a slice with refc 0 being the only reference to its parent.
+static inline bool di_array_is_unshared(di_t a) {
+	if (!di_is_unshared_pointer(a))
+		return false;
+	di_tagged_t *p = di_to_pointer(a);
+	return p->tag != DI_SLICE ||
+	       di_tagged_refc(&((di_slice_t *)p)->parent->header) == 1;
+}
+
+/*+---------------+*
+ *| Packed arrays |*
+ *+---------------+*/
+
+// An array of only ints, only doubles or only bytes (ints 0 to 255) can be
+// stored unboxed, in 4, 8 or 1 bytes per element. Copying it is a memcpy and
+// freeing it doesn't visit the elements. An update which stores another kind of
+// value turns it into a generic array. A shared packed array is always copied
+// when it's updated, since copying it is cheap. Doubles are stored with the
+// same bits as in the di_t, so packed arrays are equal iff their bytes are.
+//
+// The elements are stored after the header, except in a view, where they're in
+// the memory of the owner. A view is copied like a shared array when it's
+// updated.
+
+typedef struct di_packed {
+	di_tagged_t header;
+	di_size_t   length, cap;
+	unsigned    kind;
+	uint32_t    hash;     // as for other arrays
+	double     *data;     // int32_t, double or uint8_t elements
+	di_t        owner;    // the value the elements of a view are in, or null
+	double      inline_data[];
+} di_packed_t;
+
+static const size_t packed_width[] = {0, sizeof(int32_t), sizeof(double), 1};
+
+static inline size_t packed_bytes(unsigned kind, di_size_t cap) {
+	return sizeof(di_packed_t) + (size_t)cap * packed_width[kind];
+}
+
+static di_packed_t *packed_create(unsigned kind, di_size_t cap) {
+	di_packed_t *p = di_alloc(packed_bytes(kind, cap));
+	if (!p) DIE("Out of memory");
+	di_init_tagged(&p->header, DI_PACKED);
+	p->length = 0;
+	p->cap    = cap;
+	p->kind   = kind;
+	p->hash   = 0;
+	p->data   = p->inline_data;
+	p->owner  = di_null();
+	return p;
+}
+
+static inline bool di_is_packed(di_t a) {
+	return di_to_pointer(a)->tag == DI_PACKED;
+}
+
+// True if v can be stored in the packed array.
+static inline bool packed_accepts(const di_packed_t *p, di_t v) {
+	switch (p->kind) {
+	case DI_PACKED_INT:    return di_is_int(v);
+	case DI_PACKED_DOUBLE: return di_is_double(v);
+	default:               return di_is_int(v) && (uint32_t)di_to_int(v) < 256;
+	}
+}
+
+static inline di_t packed_get(const di_packed_t *p, di_size_t i) {
+	assert(i < p->length);
+	switch (p->kind) {
+	case DI_PACKED_INT:    return di_from_int(((const int32_t *)p->data)[i]);
+	case DI_PACKED_DOUBLE: return di_from_double(p->data[i]);
+	default:               return di_from_int(((const uint8_t *)p->data)[i]);
+	}
+}
+
+static inline void packed_put(di_packed_t *p, di_size_t i, di_t v) {
+	assert(packed_accepts(p, v));
+	switch (p->kind) {
+	case DI_PACKED_INT:    ((int32_t *)p->data)[i] = di_to_int(v); break;
+	case DI_PACKED_DOUBLE: p->data[i] = di_to_double(v); break;
+	default:               ((uint8_t *)p->data)[i] = (uint8_t)di_to_int(v);
+	}
+}
+
+// Helper. Returns the packed array a with room for at least extra more
+// elements, ready for in-place update. If a is shared or a view, it's copied.
+static di_packed_t *packed_for_update(di_t a, di_size_t extra) {
+	di_packed_t *p = (di_packed_t *)di_to_pointer(a);
+	size_t width = packed_width[p->kind];
+	di_size_t need = p->length + extra, cap = p->cap;
+	if (cap < need) {
+		if (need > (di_size_t)-1 / 2) DIE("Array too large");
+		cap = cap < 8 ? 8 : cap;
+		while (cap < need)
+			cap *= 2;
+	}
+	bool unshared = di_is_unshared_pointer(a);
+	if (!unshared || !di_is_null(p->owner)) {
+		DI_STAT(DI_PACKED, cloned);
+		di_packed_t *copy = packed_create(p->kind, cap);
+		memcpy(copy->data, p->data, (size_t)p->length * width);
+		copy->length = p->length;
+		if (unshared)
+			di_cleanup(a); // a view
+		return copy;
+	}
+	if (cap != p->cap) {
+		p = di_realloc(p, packed_bytes(p->kind, cap),
+		               packed_bytes(p->kind, p->cap));
+		if (!p) DIE("Out of memory");
+		p->cap = cap;
+		p->data = p->inline_data;
+	}
+	DI_STAT(DI_PACKED, reused);
+	p->hash = 0;
+	return p;
+}
+
+// Helper. Copies the elements of a packed array to a new generic array. The
+// packed array is freed if it's unshared.
+static aadeque_t *packed_to_aadeque(di_t a) {
+	di_packed_t *p = (di_packed_t *)di_to_pointer(a);
+	aadeque_t *arr = di_aadeque_init(aadeque_create(p->length));
+	di_size_t i;
+	for (i = 0; i < p->length; i++)
+		aadeque_set(arr, i, packed_get(p, i));
+	di_cleanup(a);
+	return arr;
+}
+
+// Helper. Creates a packed array from n elements of the given width.
+static di_t packed_from_data(unsigned kind, const void *data, di_size_t n) {
+	di_packed_t *p = packed_create(kind, n);
+	memcpy(p->data, data, (size_t)n * packed_width[kind]);
+	p->length = n;
+	return di_from_pointer(&p->header);
+}
+
+// Helper. Creates a packed array of n elements of the given width, in the
+// memory of owner.
+static di_t packed_view(di_t owner, unsigned kind, const void *data,
+                        di_size_t n) {
+	assert((uintptr_t)data % packed_width[kind] == 0);
+	di_packed_t *p = packed_create(kind, 0);
+	p->data = (double *)data;
+	p->owner = di_keep(owner);
+	p->length = n;
+	return di_from_pointer(&p->header);
+}
+
+/*+--------------------+*
+ *| Persistent vectors |*
+ *+--------------------+*/
+
+// A large array which is updated while it's shared is turned into a vector, a
+// tree where the elements are in the leaves and the index of an element is the
+// path to it, DI_VECTOR_BITS bits per level. An update copies the nodes on
+// the path to the element and shares the rest with the old vector. A node which
+// no other vector refers to is updated in place. Getting, setting, pushing and
+// popping work on the vector. Other updates turn it back into a flat array.
+#define DI_VECTOR_BITS 5
+#define DI_VECTOR_WIDTH (1 << DI_VECTOR_BITS)
+#define DI_VECTOR_MASK (DI_VECTOR_WIDTH - 1)
+
+// The reference-counter of a node of a vector or a HAMT. In the nodes of a
+// shared value, it has the NODE_SHARED bit set and it's updated atomically as
+// for shared objects. The bit is never cleared.
+#define NODE_SHARED 0x80000000u
+
+static inline bool node_is_shared(unsigned *refc) {
+	return __atomic_load_n(refc, __ATOMIC_RELAXED) & NODE_SHARED;
+}
+
+static inline void node_incref(unsigned *refc) {
+	if (node_is_shared(refc))
+		__atomic_add_fetch(refc, 1, __ATOMIC_RELAXED);
+	else
+		(*refc)++;
+}
+
+// Returns the number of references left.
+static inline unsigned node_decref(unsigned *refc) {
+	if (node_is_shared(refc))
+		return __atomic_sub_fetch(refc, 1, __ATOMIC_ACQ_REL) & ~NODE_SHARED;
+	return --*refc;
+}
+
+// True if there is only one reference to the node.
+static inline bool node_is_unique(unsigned *refc) {
+	if (node_is_shared(refc))
+		return __atomic_load_n(refc, __ATOMIC_ACQUIRE) == (NODE_SHARED | 1);
+	return *refc == 1;
+}
+
+typedef struct di_vnode {
+	unsigned refc; // the number of vectors and nodes pointing to it
+	union {
+		struct di_vnode *children[DI_VECTOR_WIDTH]; // unused ones are NULL
+		di_t values[DI_VECTOR_WIDTH];               // unused ones are null
+	} u;
+} di_vnode_t;
+
+typedef struct di_vector {
+	di_tagged_t header;
+	di_size_t   length;
+	unsigned    shift; // the index bits below the root's; 0 if it's a leaf
+	uint32_t    hash;  // as for flat arrays
+	di_vnode_t *root;  // NULL if the vector is empty
+} di_vector_t;
+
+static di_vnode_t *vnode_create(bool leaf) {
+	di_vnode_t *node = di_alloc(sizeof(di_vnode_t));
+	if (!node) DIE("Out of memory");
+	node->refc = 1;
+	int i;
+	for (i = 0; i < DI_VECTOR_WIDTH; i++) {
+		if (leaf)
+			node->u.values[i] = di_null();
+		else
+			node->u.children[i] = NULL;
+	}
+	return node;
+}
+
+// Drops a reference to a node. Frees it if it was the last one.
+static void vnode_release(di_vnode_t *node, unsigned shift) {
+	if (node_decref(&node->refc) > 0)
+		return;
+	int i;
+	for (i = 0; i < DI_VECTOR_WIDTH; i++) {
+		if (shift == 0)
+			di_decref_and_free(node->u.values[i]);
+		else if (node->u.children[i])
+			vnode_release(node->u.children[i], shift - DI_VECTOR_BITS);
+	}
+	di_free(node, sizeof(di_vnode_t));
+}
+
+// Returns the node in *slot, ready for in-place update. If it's shared, it's
+// copied into *slot first.
+static di_vnode_t *vnode_for_update(di_vnode_t **slot, unsigned shift) {
+	di_vnode_t *node = *slot;
+	if (node_is_unique(&node->refc))
+		return node;
+	di_vnode_t *copy = di_alloc(sizeof(di_vnode_t));
+	if (!copy) DIE("Out of memory");
+	memcpy(copy, node, sizeof(di_vnode_t));
+	copy->refc = 1;
+	int i;
+	for (i = 0; i < DI_VECTOR_WIDTH; i++) {
+		if (shift == 0)
+			di_incref(copy->u.values[i]);
+		else if (copy->u.children[i])
+			node_incref(&copy->u.children[i]->refc);
+	}
+	// Another thread may have released its reference since the check, so
+	// this one can be the last.
+	vnode_release(node, shift);
+	*slot = copy;
+	return copy;
+}
+
+static inline bool di_is_vector(di_t a) {
+	return di_to_pointer(a)->tag == DI_VECTOR;
+}
+
+static inline di_t vector_get(const di_vector_t *vec, di_size_t i) {
+	assert(i < vec->length);
+	const di_vnode_t *node = vec->root;
+	unsigned shift;
+	for (shift = vec->shift; shift > 0; shift -= DI_VECTOR_BITS)
+		node = node->u.children[(i >> shift) & DI_VECTOR_MASK];
+	return node->u.values[i & DI_VECTOR_MASK];
+}
+
+static di_vector_t *vector_create(void) {
+	di_vector_t *vec = di_alloc(sizeof(di_vector_t));
+	if (!vec) DIE("Out of memory");
+	di_init_tagged(&vec->header, DI_VECTOR);
+	vec->length = 0;
+	vec->shift  = 0;
+	vec->hash   = 0;
+	vec->root   = NULL;
+	return vec;
+}
+
+// Returns the leaf for index i, ready for in-place update. The nodes on the
+// path to it are copied if they're shared and created if they don't exist.
+static di_vnode_t *vector_leaf_for_update(di_vector_t *vec, di_size_t i) {
+	di_vnode_t **slot = &vec->root;
+	unsigned shift;
+	for (shift = vec->shift; ; shift -= DI_VECTOR_BITS) {
+		if (!*slot)
+			*slot = vnode_create(shift == 0);
+		di_vnode_t *node = vnode_for_update(slot, shift);
+		if (shift == 0)
+			return node;
+		slot = &node->u.children[(i >> shift) & DI_VECTOR_MASK];
+	}
+}
+
+static void vector_set(di_vector_t *vec, di_size_t i, di_t v) {
+	assert(i < vec->length);
+	di_vnode_t *leaf = vector_leaf_for_update(vec, i);
+	di_t old_value = leaf->u.values[i & DI_VECTOR_MASK];
+	leaf->u.values[i & DI_VECTOR_MASK] = di_keep(v);
+	di_decref_and_free(old_value);
+}
+
+static void vector_push(di_vector_t *vec, di_t v) {
+	if (vec->root &&
+	    vec->length == (uint64_t)1 << (vec->shift + DI_VECTOR_BITS)) {
+		// The tree is full. Add a level on top.
+		di_vnode_t *root = vnode_create(false);
+		root->u.children[0] = vec->root;
+		vec->root = root;
+		vec->shift += DI_VECTOR_BITS;
+	}
+	di_vnode_t *leaf = vector_leaf_for_update(vec, vec->length);
+	leaf->u.values[vec->length & DI_VECTOR_MASK] = di_keep(v);
+	vec->length++;
+}
+
+// Releases the nodes below node holding only indices from i and up, i.e. the
+// ones which are empty when the last element is at i - 1. The nodes on the path
+// to i must be unshared.
+static void vnode_prune(di_vnode_t *node, unsigned shift, di_size_t i) {
+	if (shift == 0)
+		return;
+	di_vnode_t **slot = &node->u.children[(i >> shift) & DI_VECTOR_MASK];
+	if ((i & (((di_size_t)1 << shift) - 1)) == 0) {
+		vnode_release(*slot, shift - DI_VECTOR_BITS);
+		*slot = NULL;
+	} else {
+		vnode_prune(*slot, shift - DI_VECTOR_BITS, i);
+	}
+}
+
+// Removes the last element and returns it, still holding its reference.
+static di_t vector_pop(di_vector_t *vec) {
+	assert(vec->length > 0);
+	di_size_t i = --vec->length;
+	di_vnode_t *leaf = vector_leaf_for_update(vec, i);
+	di_t v = leaf->u.values[i & DI_VECTOR_MASK];
+	leaf->u.values[i & DI_VECTOR_MASK] = di_null();
+	if (i == 0) {
+		vnode_release(vec->root, vec->shift);
+		vec->root  = NULL;
+		vec->shift = 0;
+		return v;
+	}
+	vnode_prune(vec->root, vec->shift, i);
+	while (vec->shift > 0 && !vec->root->u.children[1]) {
+		// Only the first child is left. Make it the root.
+		di_vnode_t *root = vec->root->u.children[0];
+		vec->root->u.children[0] = NULL;
+		vnode_release(vec->root, vec->shift);
+		vec->root = root;
+		vec->shift -= DI_VECTOR_BITS;
+	}
+	return v;
+}
+
+// Returns a vector with refc == 0 for in-place update. If a is shared, the new
+// vector shares its nodes.
+static di_vector_t *vector_for_update(di_t a) {
+	di_vector_t *vec = (di_vector_t *)di_to_pointer(a);
+	if (di_is_unshared_pointer(a)) {
+		DI_STAT(DI_VECTOR, reused);
+		vec->hash = 0;
+		return vec;
+	}
+	di_vector_t *clone = clone_object(&vec->header, sizeof(di_vector_t));
+	clone->hash = 0;
+	if (clone->root)
+		node_incref(&clone->root->refc);
+	return clone;
+}
+
+// Converts a vector to a flat array with refc == 0. Frees the vector if it's
+// unshared.
+static aadeque_t *vector_to_aadeque(di_t a) {
+	di_vector_t *vec = (di_vector_t *)di_to_pointer(a);
+	aadeque_t *arr = di_aadeque_init(aadeque_create(vec->length));
+	di_size_t i;
+	for (i = 0; i < vec->length; i++) {
+		di_t v = vector_get(vec, i);
+		di_incref(v);
+		aadeque_set(arr, i, v);
+	}
+	di_cleanup(a);
+	return arr;
+}
+
+// Creates a vector with the elements of a flat array or a slice. It's only done
+// for a shared array, so it counts as a clone.
+static di_vector_t *vector_from_array(di_t a) {
+	DI_STAT(di_to_pointer(a)->tag, cloned);
+	// Fill the leaves. Then build the levels above them.
+	di_vector_t *vec = vector_create();
+	di_size_t i, n = di_array_length(a);
+	di_size_t count = (n + DI_VECTOR_MASK) >> DI_VECTOR_BITS;
+	di_vnode_t **nodes = malloc(count * sizeof(di_vnode_t *));
+	if (!nodes) DIE("Out of memory");
+	for (i = 0; i < n; i++) {
+		if ((i & DI_VECTOR_MASK) == 0)
+			nodes[i >> DI_VECTOR_BITS] = vnode_create(true);
+		di_t v = di_array_get(a, i);
+		di_incref(v);
+		nodes[i >> DI_VECTOR_BITS]->u.values[i & DI_VECTOR_MASK] = v;
+	}
+	while (count > 1) {
+		for (i = 0; i < count; i++) {
+			di_vnode_t *child = nodes[i];
+			di_size_t parent = i >> DI_VECTOR_BITS;
+			if ((i & DI_VECTOR_MASK) == 0)
+				nodes[parent] = vnode_create(false);
+			nodes[parent]->u.children[i & DI_VECTOR_MASK] = child;
+		}
+		count = (count + DI_VECTOR_MASK) >> DI_VECTOR_BITS;
+		vec->shift += DI_VECTOR_BITS;
+	}
+	vec->root = nodes[0];
+	vec->length = n;
+	free(nodes);
+	return vec;
+}
+
+// Helper. Releases the twin of an array which is about to be modified.
+static inline void di_aadeque_drop_twin(aadeque_t *arr) {
+	if (arr->twin) {
+		di_decref_and_free(di_from_pointer(&arr->twin->header));
+		arr->twin = NULL;
+	}
+}
+
+// Helper. Returns the array a as a vector with refc == 0, ready for in-place
+// update, or NULL if it's to be updated as a flat array. A large shared array
+// gets a twin vector, kept with the array, which the new vector shares its
+// nodes with. Thus, updating the same shared array again is cheap too. An array
+// shared between threads isn't written to, so it doesn't get a twin.
+static di_vector_t *di_vector_for_update_slow(di_t a) {
+	di_tagged_t *p = di_to_pointer(a);
+	if (p->tag == DI_VECTOR)
+		return vector_for_update(a);
+	if (di_array_is_unshared(a) || di_array_length(a) < DI_PERSISTENT_MIN)
+		return NULL;
+	if (p->tag != DI_ARRAY) {
+		// A slice or a packed array. An unshared slice of a shared array
+		// is released, with its reference to the array.
+		di_vector_t *vec = vector_from_array(a);
+		di_cleanup(a);
+		return vec;
+	}
+	aadeque_t *arr = (aadeque_t *)p;
+	if (!arr->twin) {
+		if (p->flags & DI_SHARED)
+			return vector_from_array(a);
+		arr->twin = vector_from_array(a);
+		arr->twin->header.refc = 1; // owned by the array
+	}
+	return vector_for_update(di_from_pointer(&arr->twin->header));
+}
+
+static inline di_vector_t *di_vector_for_update(di_t a) {
+	if (di_to_pointer(a)->tag == DI_ARRAY && di_is_unshared_pointer(a))
+		return NULL; // the common case
+	return di_vector_for_update_slow(a);
+}
+
+// Helper. Returns an unboxed array with the contents of a, with refc 0 and
+// ready for in-place update. If a is unshared, its memory is reused. Otherwise
+// it's copied. A slice, a vector or a packed array is turned into a real array.
+static aadeque_t *di_aadeque_for_update_slow(di_t a) {
+	di_tagged_t *p = di_to_pointer(a);
+	if (p->tag == DI_VECTOR)
+		return vector_to_aadeque(a);
+	if (p->tag == DI_PACKED)
+		return packed_to_aadeque(a);
+	if (p->tag == DI_ARRAY) {
+		aadeque_t *arr = (aadeque_t *)p;
+		if (!di_is_unshared_pointer(a))
+			return di_aadeque_clone(arr);
+		DI_STAT(DI_ARRAY, reused);
+		di_aadeque_drop_twin(arr);
+		return arr;
+	}
+	di_slice_t *slice = (di_slice_t *)p;
+	aadeque_t *arr = slice->parent;
+	di_size_t i;
+	if (di_array_is_unshared(a)) {
+		// Take over the parent and crop it to the slice.
+		DI_STAT(DI_SLICE, reused);
+		di_aadeque_drop_twin(arr);
+		arr = di_aadeque_crop(arr, slice->offset, slice->length);
+		arr->header.refc = 0;
+		di_free(slice, sizeof(di_slice_t));
+		return arr;
+	}
+	// Copy the elements to a new array
+	DI_STAT(DI_SLICE, cloned);
+	arr = di_aadeque_init(aadeque_slice(arr, slice->offset, slice->length));
+	for (i = 0; i < aadeque_len(arr); i++)
+		di_incref(aadeque_get(arr, i));
+	if (di_is_unshared_pointer(a))
+		di_slice_destroy(slice);
+	return arr;
+}
+
+static inline aadeque_t *di_aadeque_for_update(di_t a) {
+	aadeque_t *arr = (aadeque_t *)di_to_pointer(a);
+	if (arr->header.tag != DI_ARRAY || !di_is_unshared_pointer(a) || arr->twin)
+		arr = di_aadeque_for_update_slow(a);
+	else
+		DI_STAT(DI_ARRAY, reused);
+	arr->hash = 0;
+	return arr;
+}
+
 di_t di_array_empty(void) {
-	di_tagged_t * a = (di_tagged_t *)aadeque_create_empty();
-	di_init_tagged(a, DI_ARRAY);
-	return di_from_pointer(a);
+	aadeque_t *a = di_aadeque_init(aadeque_create_empty());
+	return di_from_pointer(&a->header);
+}
+
+di_t di_array_from_values(const di_t *values, di_size_t n) {
+	if (n == 0)
+		return di_array_empty();
+	// Pack the values if they're all ints or all doubles.
+	di_size_t i;
+	unsigned kind = di_is_int(values[0]) ? DI_PACKED_INT
+	              : di_is_double(values[0]) ? DI_PACKED_DOUBLE : 0;
+	for (i = 1; kind && i < n; i++)
+		if (di_is_int(values[i]) != (kind == DI_PACKED_INT) ||
+		    !di_is_number(values[i]))
+			kind = 0;
+	if (kind) {
+		di_packed_t *p = packed_create(kind, n);
+		p->length = n;
+		for (i = 0; i < n; i++)
+			packed_put(p, i, values[i]);
+		return di_from_pointer(&p->header);
+	}
+	struct aadeque *a = aadeque_from_array((di_t *)values, n);
+	for (i = 0; i < n; i++)
+		a->els[i] = di_keep(a->els[i]);
+	di_aadeque_init(a);
+	return di_from_pointer(&a->header);
 }
 
 di_size_t di_array_length(di_t a) {
 	assert(di_is_array(a));
-	return aadeque_len((aadeque_t *)di_to_pointer(a));
+	di_tagged_t *p = di_to_pointer(a);
+	if (p->tag == DI_SLICE)
+		return ((di_slice_t *)p)->length;
+	if (p->tag == DI_VECTOR)
+		return ((di_vector_t *)p)->length;
+	if (p->tag == DI_PACKED)
+		return ((di_packed_t *)p)->length;
+	return aadeque_len((aadeque_t *)p);
 }
 
 di_t di_array_get(di_t a, di_size_t i) {
 	assert(di_is_array(a));
-	return aadeque_get((aadeque_t *)di_to_pointer(a), i);
+	di_tagged_t *p = di_to_pointer(a);
+	if (p->tag == DI_SLICE) {
+		di_slice_t *slice = (di_slice_t *)p;
+		assert(i < slice->length);
+		return aadeque_get(slice->parent, slice->offset + i);
+	}
+	if (p->tag == DI_VECTOR)
+		return vector_get((di_vector_t *)p, i);
+	if (p->tag == DI_PACKED)
+		return packed_get((di_packed_t *)p, i);
+	return aadeque_get((aadeque_t *)p, i);
 }
 
 di_t di_array_set(di_t a, di_size_t i, di_t v) {
 	assert(di_is_array(a));
 	assert(i >= 0);
 	assert(i < di_array_length(a));
-	aadeque_t * arr = (aadeque_t *)di_to_pointer(a);
-	if (arr->header.refc > 0)
-        arr = di_aadeque_clone(arr);
+	di_packed_t *packed = (di_packed_t *)di_to_pointer(a);
+	if (packed->header.tag == DI_PACKED && packed_accepts(packed, v)) {
+		di_packed_t *p = packed_for_update(a, 0);
+		packed_put(p, i, v);
+		return di_from_pointer(&p->header);
+	}
+	di_vector_t *vec = di_vector_for_update(a);
+	if (vec) {
+		vector_set(vec, i, v);
+		return di_from_pointer(&vec->header);
+	}
+	aadeque_t * arr = di_aadeque_for_update(a);
 	// Decrement refc and possibly free the old value
 	di_t oldv = aadeque_get(arr, i);
 	di_decref_and_free(oldv);
 	// Add and incref the new value
-	aadeque_set(arr, i, v);
-	di_incref(v);
+	aadeque_set(arr, i, di_keep(v));
 	return di_from_pointer((di_tagged_t *)arr);
 }
 
 // Returns an array of length length, starting at start. The interval must be
 // within valid indices of the array. Frees or reuses the memory of array if its
-// ref-counter is zero.
+// ref-counter is zero. If the array is shared, a slice pointing into it is
+// returned, so no elements are copied.
 di_t di_array_slice(di_t array, di_size_t start, di_size_t length) {
-    // TODO
-    return array;
+	assert(di_is_array(array));
+	assert(start + length <= di_array_length(array));
+	if (start == 0 && length == di_array_length(array))
+		return di_return_arg(array); // The whole array
+	if (length == 0) {
+		di_cleanup(array);
+		return di_array_empty();
+	}
+	di_tagged_t *p = di_to_pointer(array);
+	bool unshared = di_is_unshared_pointer(array);
+	if (p->tag == DI_PACKED) {
+		// Crop it in place or copy the range.
+		di_packed_t *packed = (di_packed_t *)p;
+		size_t width = packed_width[packed->kind];
+		char *data = (char *)packed->data;
+		if (!unshared)
+			return packed_from_data(packed->kind, data + start * width,
+			                        length);
+		if (di_is_null(packed->owner))
+			memmove(data, data + start * width, (size_t)length * width);
+		else
+			packed->data = (double *)(data + start * width); // a view
+		packed->length = length;
+		packed->hash = 0;
+		return array;
+	}
+	if (p->tag == DI_VECTOR) {
+		// Copy the elements to a flat array
+		aadeque_t *arr = di_aadeque_init(aadeque_create(length));
+		di_size_t i;
+		for (i = 0; i < length; i++) {
+			di_t v = vector_get((di_vector_t *)p, start + i);
+			di_incref(v);
+			aadeque_set(arr, i, v);
+		}
+		di_cleanup(array);
+		return di_from_pointer(&arr->header);
+	}
+	if (unshared && p->tag == DI_SLICE) {
+		// Narrow the slice
+		di_slice_t *slice = (di_slice_t *)p;
+		slice->offset += start;
+		slice->length = length;
+		return array;
+	}
+	if (unshared) {
+		// Crop the array in place
+		di_aadeque_drop_twin((aadeque_t *)p);
+		aadeque_t *arr = di_aadeque_crop((aadeque_t *)p, start, length);
+		arr->hash = 0;
+		return di_from_pointer((di_tagged_t *)arr);
+	}
+	// Shared. Create a view into it, or into its parent if it's a slice.
+	di_slice_t *slice = di_alloc(sizeof(di_slice_t));
+	if (!slice) DIE("Out of memory");
+	di_init_tagged(&slice->header, DI_SLICE);
+	if (p->tag == DI_SLICE) {
+		slice->parent = ((di_slice_t *)p)->parent;
+		slice->offset = ((di_slice_t *)p)->offset + start;
+	} else {
+		slice->parent = (aadeque_t *)p;
+		slice->offset = start;
+	}
+	slice->length = length;
+	di_tagged_incref(&slice->parent->header);
+	return di_from_pointer(&slice->header);
 }
 
 // Concatenates two arrays. Returns the new array. Frees or reuses the memory of
 // a1 and a2 if their ref-counters are zero.
 di_t di_array_concat(di_t a1, di_t a2) {
-    // TODO
-    di_cleanup(a2);
-    return a1;
+	assert(di_is_array(a1));
+	assert(di_is_array(a2));
+	di_size_t len1 = di_array_length(a1), len2 = di_array_length(a2), i;
+	if (len2 == 0) {
+		di_cleanup(a2);
+		return di_return_arg(a1);
+	}
+	if (len1 == 0) {
+		di_cleanup(a1);
+		return di_return_arg(a2);
+	}
+	if (di_is_packed(a1) && di_is_packed(a2) &&
+	    ((di_packed_t *)di_to_pointer(a1))->kind ==
+	    ((di_packed_t *)di_to_pointer(a2))->kind) {
+		di_packed_t *p = packed_for_update(a1, len2),
+		            *p2 = (di_packed_t *)di_to_pointer(a2);
+		size_t width = packed_width[p->kind];
+		memcpy((char *)p->data + (size_t)len1 * width, p2->data,
+		       (size_t)len2 * width);
+		p->length += len2;
+		di_cleanup(a2);
+		return di_from_pointer(&p->header);
+	}
+	aadeque_t *arr = di_aadeque_for_update(a1);
+	if (di_array_is_unshared(a2)) {
+		// Move the elements. They keep their ref-counters.
+		aadeque_t *arr2 = di_aadeque_for_update(a2);
+		arr = aadeque_append(arr, arr2);
+		aadeque_destroy(arr2);
+	} else {
+		arr = aadeque_make_space_after(arr, len2);
+		for (i = 0; i < len2; i++) {
+			di_t v = di_array_get(a2, i);
+			di_incref(v);
+			aadeque_set(arr, len1 + i, v);
+		}
+		di_cleanup(a2);
+	}
+	return di_from_pointer((di_tagged_t *)arr);
 }
 
 void di_array_push(di_t * aptr, di_t v) {
 	di_t a = *aptr;
 	assert(di_is_array(a));
-	aadeque_t * arr = (aadeque_t *)di_to_pointer(a);
-	if (arr->header.refc > 0)
-        arr = di_aadeque_clone(arr);
-	aadeque_push(&arr, v);
-	di_incref(v);
+	di_packed_t *packed = (di_packed_t *)di_to_pointer(a);
+	if (packed->header.tag == DI_PACKED && packed_accepts(packed, v)) {
+		di_packed_t *p = packed_for_update(a, 1);
+		packed_put(p, p->length++, v);
+		*aptr = di_from_pointer(&p->header);
+		return;
+	}
+	di_vector_t *vec = di_vector_for_update(a);
+	if (vec) {
+		vector_push(vec, v);
+		*aptr = di_from_pointer(&vec->header);
+		return;
+	}
+	aadeque_t * arr = di_aadeque_for_update(a);
+	aadeque_push(&arr, di_keep(v));
 	*aptr = di_from_pointer((di_tagged_t *)arr);
 }
 
 di_t di_array_pop(di_t * aptr) {
 	di_t a = *aptr;
 	assert(di_is_array(a));
-	aadeque_t * arr = (aadeque_t *)di_to_pointer(a);
-	if (arr->header.refc > 0)
-        arr = di_aadeque_clone(arr);
+	if (di_is_packed(a)) {
+		di_packed_t *p = packed_for_update(a, 0);
+		di_t v = packed_get(p, p->length - 1);
+		p->length--;
+		*aptr = di_from_pointer(&p->header);
+		return v;
+	}
+	di_vector_t *vec = di_vector_for_update(a);
+	if (vec) {
+		di_t v = vector_pop(vec);
+		di_decref(v);
+		*aptr = di_from_pointer(&vec->header);
+		return v;
+	}
+	aadeque_t * arr = di_aadeque_for_update(a);
 	di_t v = aadeque_pop(&arr);
 	di_decref(v);
 	*aptr = di_from_pointer((di_tagged_t *)arr);
@@ -238,64 +1446,1376 @@ di_t di_array_pop(di_t * aptr) {
 void di_array_unshift(di_t * aptr, di_t v) {
 	di_t a = *aptr;
 	assert(di_is_array(a));
-	aadeque_t * arr = (aadeque_t *)di_to_pointer(a);
-	if (arr->header.refc > 0)
-        arr = di_aadeque_clone(arr);
-	aadeque_unshift(&arr, v);
-	di_incref(v);
+	aadeque_t * arr = di_aadeque_for_update(a);
+	aadeque_unshift(&arr, di_keep(v));
 	*aptr = di_from_pointer((di_tagged_t *)arr);
 }
 
 di_t di_array_shift(di_t * aptr) {
 	di_t a = *aptr;
 	assert(di_is_array(a));
-	aadeque_t * arr = (aadeque_t *)di_to_pointer(a);
-	if (arr->header.refc > 0)
-		arr = di_aadeque_clone(arr);
+	aadeque_t * arr = di_aadeque_for_update(a);
 	di_t v = aadeque_shift(&arr);
 	di_decref(v);
 	*aptr = di_from_pointer((di_tagged_t *)arr);
 	return v;
 }
 
-/*+------+*
- *| Dict |*
- *+------+*/
+/*-------------------------*
+ * Packed and numeric data *
+ *-------------------------*/
 
-/* Use oaht_t for the dict implementation */
-static inline uint64_t lousy_hash(di_t v) {
-	if (!di_is_pointer(v))
-		return v.as_int64;
-	if (di_is_string(v))
-		return di_string_length(v) * 0x479 + 0xff98823;
-	DIE("Only strings and numbers are allowed as dict keys");
+di_t di_array_from_ints(const int32_t *ints, di_size_t n) {
+	return n ? packed_from_data(DI_PACKED_INT, ints, n) : di_array_empty();
 }
-#define OAHT_HEADER di_tagged_t header;
-#define OAHT_KEY_T di_t
-#define OAHT_KEY_EQUALS(a, b) di_equal(a, b)
-#define OAHT_VALUE_T di_t
-#define OAHT_SIZE_T di_size_t
-#define OAHT_MIN_CAPACITY 4
-#define OAHT_NO_STORE_HASH 1
+
+di_t di_array_from_doubles(const double *doubles, di_size_t n) {
+	return n ? packed_from_data(DI_PACKED_DOUBLE, doubles, n)
+	         : di_array_empty();
+}
+
+di_t di_array_from_bytes(const char *bytes, di_size_t n) {
+	return n ? packed_from_data(DI_PACKED_BYTE, bytes, n) : di_array_empty();
+}
+
+di_t di_array_view_ints(di_t owner, const int32_t *ints, di_size_t n) {
+	if (n)
+		return packed_view(owner, DI_PACKED_INT, ints, n);
+	di_cleanup(owner);
+	return di_array_empty();
+}
+
+di_t di_array_view_doubles(di_t owner, const double *doubles, di_size_t n) {
+	if (n)
+		return packed_view(owner, DI_PACKED_DOUBLE, doubles, n);
+	di_cleanup(owner);
+	return di_array_empty();
+}
+
+di_t di_array_view_bytes(di_t owner, const char *bytes, di_size_t n) {
+	if (n)
+		return packed_view(owner, DI_PACKED_BYTE, bytes, n);
+	di_cleanup(owner);
+	return di_array_empty();
+}
+
+const char *di_array_bytes(di_t a) {
+	assert(di_is_array(a));
+	di_packed_t *p = (di_packed_t *)di_to_pointer(a);
+	if (p->header.tag != DI_PACKED || p->kind != DI_PACKED_BYTE)
+		return NULL;
+	return (const char *)p->data;
+}
+
+const void *di_array_packed_data(di_t a, unsigned *kind) {
+	assert(di_is_array(a));
+	di_packed_t *p = (di_packed_t *)di_to_pointer(a);
+	if (p->header.tag != DI_PACKED)
+		return NULL;
+	*kind = p->kind;
+	return p->data;
+}
+
+// The kernels below work on DI_LANES elements at a time, using the vector
+// extensions of GCC and Clang if available, and then on the remaining ones.
+// Doubles are added in DI_LANES separate sums, which are added at the end, so
+// the result doesn't depend on whether vectors are used. Generic arrays are
+// added in the same order, so it doesn't depend on the layout either.
+#define DI_LANES 4
+
+#if (defined(__GNUC__) && __GNUC__ >= 9 || defined(__clang__)) && \
+    !defined(DI_NO_SIMD)
+#define DI_SIMD 1
+typedef int32_t di_vint_t    __attribute__((vector_size(4 * sizeof(int32_t))));
+typedef int64_t di_vlong_t   __attribute__((vector_size(4 * sizeof(int64_t))));
+typedef double  di_vdouble_t __attribute__((vector_size(4 * sizeof(double))));
+#endif
+
+static void not_a_number(void) {
+	di_error(di_string_from_cstring("Not a number"));
+}
+
+// Helper. An int if it fits in 32 bits, otherwise a double.
+static inline di_t number_from_int64(int64_t i) {
+	return i >= INT32_MIN && i <= INT32_MAX ? di_from_int((int32_t)i)
+	                                        : di_from_double((double)i);
+}
+
+static int64_t sum_ints(const int32_t *x, di_size_t n) {
+	int64_t sum = 0;
+	di_size_t i = 0, j;
+#ifdef DI_SIMD
+	// The high and low 16 bits are added separately, in blocks small enough
+	// for the sums not to overflow.
+	while (i + DI_LANES <= n) {
+		di_vint_t v, hi = {0}, lo = {0};
+		di_size_t end = n - i < 0x4000 * DI_LANES ? n : i + 0x4000 * DI_LANES;
+		for (; i + DI_LANES <= end; i += DI_LANES) {
+			memcpy(&v, &x[i], sizeof(v));
+			hi += v >> 16;
+			lo += v & 0xffff;
+		}
+		for (j = 0; j < DI_LANES; j++)
+			sum += (int64_t)hi[j] * 0x10000 + lo[j];
+	}
+#endif
+	for (; i < n; i++)
+		sum += x[i];
+	(void)j;
+	return sum;
+}
+
+static int64_t sum_bytes(const uint8_t *x, di_size_t n) {
+	int64_t sum = 0;
+	di_size_t i;
+	for (i = 0; i < n; i++)
+		sum += x[i];
+	return sum;
+}
+
+static double sum_doubles(const double *x, di_size_t n) {
+	double acc[DI_LANES] = {0};
+	di_size_t i = 0;
+#ifdef DI_SIMD
+	di_vdouble_t vacc = {0};
+	for (; i + DI_LANES <= n; i += DI_LANES) {
+		di_vdouble_t v;
+		memcpy(&v, &x[i], sizeof(v));
+		vacc += v;
+	}
+	memcpy(acc, &vacc, sizeof(acc));
+#endif
+	for (; i < n; i++)
+		acc[i % DI_LANES] += x[i];
+	return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+di_t di_array_sum(di_t a) {
+	assert(di_is_array(a));
+	di_size_t i, n = di_array_length(a);
+	di_packed_t *p = (di_packed_t *)di_to_pointer(a);
+	if (p->header.tag == DI_PACKED) {
+		switch (p->kind) {
+		case DI_PACKED_INT:
+			return number_from_int64(sum_ints((int32_t *)p->data, n));
+		case DI_PACKED_BYTE:
+			return number_from_int64(sum_bytes((uint8_t *)p->data, n));
+		default:
+			return di_from_double(sum_doubles(p->data, n));
+		}
+	}
+	// Ints are added exactly. If there are doubles, the sum is a double.
+	int64_t ints = 0;
+	double acc[DI_LANES] = {0};
+	bool doubles = false;
+	for (i = 0; i < n; i++) {
+		di_t v = di_array_get(a, i);
+		if (di_is_int(v)) {
+			ints += di_to_int(v);
+		} else if (di_is_double(v)) {
+			acc[i % DI_LANES] += di_to_double(v);
+			doubles = true;
+		} else {
+			not_a_number();
+		}
+	}
+	if (!doubles)
+		return number_from_int64(ints);
+	return di_from_double((acc[0] + acc[1]) + (acc[2] + acc[3]) + ints);
+}
+
+static void range_ints(const int32_t *x, di_size_t n, int32_t *min,
+                       int32_t *max) {
+	int32_t lo = x[0], hi = x[0];
+	di_size_t i = 0, j;
+#ifdef DI_SIMD
+	if (n >= DI_LANES) {
+		di_vint_t vlo, vhi, v, m;
+		memcpy(&vlo, x, sizeof(vlo));
+		vhi = vlo;
+		for (i = DI_LANES; i + DI_LANES <= n; i += DI_LANES) {
+			memcpy(&v, &x[i], sizeof(v));
+			m = v < vlo;
+			vlo = (v & m) | (vlo & ~m);
+			m = v > vhi;
+			vhi = (v & m) | (vhi & ~m);
+		}
+		for (j = 0; j < DI_LANES; j++) {
+			lo = vlo[j] < lo ? vlo[j] : lo;
+			hi = vhi[j] > hi ? vhi[j] : hi;
+		}
+	}
+#endif
+	for (; i < n; i++) {
+		lo = x[i] < lo ? x[i] : lo;
+		hi = x[i] > hi ? x[i] : hi;
+	}
+	(void)j;
+	*min = lo;
+	*max = hi;
+}
+
+static void range_bytes(const uint8_t *x, di_size_t n, int32_t *min,
+                        int32_t *max) {
+	uint8_t lo = x[0], hi = x[0];
+	di_size_t i;
+	for (i = 1; i < n; i++) {
+		lo = x[i] < lo ? x[i] : lo;
+		hi = x[i] > hi ? x[i] : hi;
+	}
+	*min = lo;
+	*max = hi;
+}
+
+// The smallest and the largest double, ignoring NaN unless it's the first one.
+static void range_doubles(const double *x, di_size_t n, double *min,
+                          double *max) {
+	double lo = x[0], hi = x[0];
+	di_size_t i = 0, j;
+#ifdef DI_SIMD
+	if (n >= DI_LANES && lo == lo) {
+		di_vdouble_t vlo = {lo, lo, lo, lo}, vhi = vlo, v;
+		di_vlong_t m;
+		for (; i + DI_LANES <= n; i += DI_LANES) {
+			memcpy(&v, &x[i], sizeof(v));
+			m = v < vlo;
+			vlo = (di_vdouble_t)(((di_vlong_t)v & m) |
+			                     ((di_vlong_t)vlo & ~m));
+			m = v > vhi;
+			vhi = (di_vdouble_t)(((di_vlong_t)v & m) |
+			                     ((di_vlong_t)vhi & ~m));
+		}
+		for (j = 0; j < DI_LANES; j++) {
+			lo = vlo[j] < lo ? vlo[j] : lo;
+			hi = vhi[j] > hi ? vhi[j] : hi;
+		}
+	}
+#endif
+	for (; i < n; i++) {
+		lo = x[i] < lo ? x[i] : lo;
+		hi = x[i] > hi ? x[i] : hi;
+	}
+	(void)j;
+	*min = lo;
+	*max = hi;
+}
+
+// Helper for di_array_min() and di_array_max().
+static di_t array_extreme(di_t a, bool max) {
+	assert(di_is_array(a));
+	di_size_t i, n = di_array_length(a);
+	if (n == 0)
+		return di_undefined();
+	di_packed_t *p = (di_packed_t *)di_to_pointer(a);
+	if (p->header.tag == DI_PACKED) {
+		int32_t lo, hi;
+		double dlo, dhi;
+		switch (p->kind) {
+		case DI_PACKED_INT:
+			range_ints((int32_t *)p->data, n, &lo, &hi);
+			return di_from_int(max ? hi : lo);
+		case DI_PACKED_BYTE:
+			range_bytes((uint8_t *)p->data, n, &lo, &hi);
+			return di_from_int(max ? hi : lo);
+		default:
+			range_doubles(p->data, n, &dlo, &dhi);
+			return di_from_double(max ? dhi : dlo);
+		}
+	}
+	di_t best = di_array_get(a, 0);
+	if (!di_is_number(best))
+		not_a_number();
+	for (i = 1; i < n; i++) {
+		di_t v = di_array_get(a, i);
+		if (!di_is_number(v))
+			not_a_number();
+		double x = di_to_number(v), y = di_to_number(best);
+		if (max ? x > y : x < y)
+			best = v;
+	}
+	return best;
+}
+
+di_t di_array_min(di_t a) {
+	return array_extreme(a, false);
+}
+
+di_t di_array_max(di_t a) {
+	return array_extreme(a, true);
+}
+
+static inline int64_t int_op(int64_t x, char op, int64_t y) {
+	return op == '+' ? x + y : op == '-' ? x - y : x * y;
+}
+
+static inline double double_op(double x, char op, double y) {
+	return op == '+' ? x + y : op == '-' ? x - y
+	     : op == '*' ? x * y : x / y;
+}
+
+// Helper. Applies op to each int and y, in place. The results must fit in an
+// int.
+static void map_ints(int32_t *x, di_size_t n, char op, int32_t y) {
+	di_size_t i = 0;
+#ifdef DI_SIMD
+	di_vint_t v, vy = {y, y, y, y};
+	for (; i + DI_LANES <= n; i += DI_LANES) {
+		memcpy(&v, &x[i], sizeof(v));
+		v = op == '+' ? v + vy : op == '-' ? v - vy : v * vy;
+		memcpy(&x[i], &v, sizeof(v));
+	}
+#endif
+	for (; i < n; i++)
+		x[i] = (int32_t)int_op(x[i], op, y);
+}
+
+// Helper. Applies op to each double and y, in place.
+static void map_doubles(double *x, di_size_t n, char op, double y) {
+	di_size_t i = 0;
+#ifdef DI_SIMD
+	di_vdouble_t v, vy = {y, y, y, y};
+	for (; i + DI_LANES <= n; i += DI_LANES) {
+		memcpy(&v, &x[i], sizeof(v));
+		v = op == '+' ? v + vy : op == '-' ? v - vy
+		  : op == '*' ? v * vy : v / vy;
+		memcpy(&x[i], &v, sizeof(v));
+	}
+#endif
+	for (; i < n; i++)
+		x[i] = double_op(x[i], op, y);
+}
+
+// Helper. The packed version of di_array_map_op(), or undefined if the results
+// don't fit in a packed array.
+static di_t packed_map_op(di_t a, char op, di_t y) {
+	di_packed_t *p = (di_packed_t *)di_to_pointer(a), *out;
+	di_size_t i, n = p->length;
+	bool ints = p->kind != DI_PACKED_DOUBLE && di_is_int(y) && op != '/';
+	if (ints) {
+		// The results are ints if the results for the smallest and the
+		// largest element are.
+		int32_t lo, hi;
+		if (p->kind == DI_PACKED_INT)
+			range_ints((int32_t *)p->data, n, &lo, &hi);
+		else
+			range_bytes((uint8_t *)p->data, n, &lo, &hi);
+		int64_t r1 = int_op(lo, op, di_to_int(y)),
+		        r2 = int_op(hi, op, di_to_int(y));
+		if (r1 < INT32_MIN || r1 > INT32_MAX ||
+		    r2 < INT32_MIN || r2 > INT32_MAX)
+			return di_undefined();
+	}
+	// Convert the elements to the kind of the results, unless they are of
+	// that kind already.
+	unsigned kind = ints ? DI_PACKED_INT : DI_PACKED_DOUBLE;
+	if (p->kind == kind) {
+		out = packed_for_update(a, 0);
+	} else {
+		out = packed_create(kind, n);
+		out->length = n;
+		for (i = 0; i < n; i++)
+			packed_put(out, i, kind == DI_PACKED_INT ? packed_get(p, i)
+			           : di_from_double(di_to_number(packed_get(p, i))));
+		di_cleanup(a);
+	}
+	if (ints)
+		map_ints((int32_t *)out->data, n, op, di_to_int(y));
+	else
+		map_doubles(out->data, n, op, di_to_number(y));
+	return di_from_pointer(&out->header);
+}
+
+di_t di_array_map_op(di_t a, char op, di_t operand) {
+	assert(di_is_array(a));
+	assert(op == '+' || op == '-' || op == '*' || op == '/');
+	if (!di_is_number(operand))
+		not_a_number();
+	if (di_array_length(a) == 0)
+		return di_return_arg(a);
+	if (di_is_packed(a)) {
+		di_t result = packed_map_op(a, op, operand);
+		if (!di_is_undefined(result))
+			return result;
+	}
+	aadeque_t *arr = di_aadeque_for_update(a);
+	di_size_t i;
+	for (i = 0; i < aadeque_len(arr); i++) {
+		di_t x = aadeque_get(arr, i), r;
+		if (!di_is_number(x))
+			not_a_number();
+		if (di_is_int(x) && di_is_int(operand) && op != '/')
+			r = number_from_int64(int_op(di_to_int(x), op,
+			                             di_to_int(operand)));
+		else
+			r = di_from_double(double_op(di_to_number(x), op,
+			                             di_to_number(operand)));
+		aadeque_set(arr, i, r);
+	}
+	return di_from_pointer(&arr->header);
+}
+
+/*+------+*
+ *| Dict |*
+ *+------+*/
+
+/*
+ * Hashing of dict keys. Strings are hashed in the style of xxHash64: four
+ * independent lanes of 8-byte words for long strings, then the remaining words
+ * and bytes, then a final avalanche. Immediate values are just mixed.
+ */
+#define HASH_P1 0x9E3779B185EBCA87llu
+#define HASH_P2 0xC2B2AE3D27D4EB4Fllu
+#define HASH_P3 0x165667B19E3779F9llu
+#define HASH_P4 0x85EBCA77C2B2AE63llu
+#define HASH_P5 0x27D4EB2F165667C5llu
+
+static inline uint64_t hash_rotl(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+static inline uint64_t hash_read64(const char *p) {
+	uint64_t w;
+	memcpy(&w, p, sizeof(w));
+	return w;
+}
+static inline uint32_t hash_read32(const char *p) {
+	uint32_t w;
+	memcpy(&w, p, sizeof(w));
+	return w;
+}
+static inline uint64_t hash_round(uint64_t acc, uint64_t word) {
+	acc += word * HASH_P2;
+	return hash_rotl(acc, 31) * HASH_P1;
+}
+static inline uint64_t hash_merge(uint64_t h, uint64_t lane) {
+	h ^= hash_round(0, lane);
+	return h * HASH_P1 + HASH_P4;
+}
+static inline uint64_t hash_avalanche(uint64_t h) {
+	h ^= h >> 33;
+	h *= HASH_P2;
+	h ^= h >> 29;
+	h *= HASH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+static uint64_t hash_chars(const char *p, di_size_t len) {
+	const char *end = p + len;
+	uint64_t h;
+	if (len >= 32) {
+		uint64_t v1 = HASH_P1 + HASH_P2, v2 = HASH_P2, v3 = 0,
+		         v4 = 0 - HASH_P1;
+		do {
+			v1 = hash_round(v1, hash_read64(p));
+			v2 = hash_round(v2, hash_read64(p + 8));
+			v3 = hash_round(v3, hash_read64(p + 16));
+			v4 = hash_round(v4, hash_read64(p + 24));
+			p += 32;
+		} while (end - p >= 32);
+		h = hash_rotl(v1, 1) + hash_rotl(v2, 7) +
+		    hash_rotl(v3, 12) + hash_rotl(v4, 18);
+		h = hash_merge(h, v1);
+		h = hash_merge(h, v2);
+		h = hash_merge(h, v3);
+		h = hash_merge(h, v4);
+	} else {
+		h = HASH_P5;
+	}
+	h += len;
+	for (; end - p >= 8; p += 8) {
+		h ^= hash_round(0, hash_read64(p));
+		h = hash_rotl(h, 27) * HASH_P1 + HASH_P4;
+	}
+	if (end - p >= 4) {
+		h ^= (uint64_t)hash_read32(p) * HASH_P1;
+		h = hash_rotl(h, 23) * HASH_P2 + HASH_P3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= (unsigned char)*p * HASH_P5;
+		h = hash_rotl(h, 11) * HASH_P1;
+	}
+	return hash_avalanche(h);
+}
+
+uint64_t di_hash_chars(const char *chars, di_size_t length) {
+	return hash_chars(chars, length);
+}
+
+// The hash cached in heap strings and atoms. Never 0, which means not computed.
+static inline uint32_t hash_string(const char *chars, di_size_t length) {
+	uint32_t h = (uint32_t)hash_chars(chars, length);
+	return h ? h : 1;
+}
+
+// A cached hash is read and written atomically, since the threads using a
+// shared value may compute it at the same time. They all store the same hash.
+static inline uint32_t load_hash(uint32_t *cache) {
+	return __atomic_load_n(cache, __ATOMIC_RELAXED);
+}
+
+static inline void store_hash(uint32_t *cache, uint32_t hash) {
+	__atomic_store_n(cache, hash, __ATOMIC_RELAXED);
+}
+
+static uint32_t hash_container(di_t v);
+
+// Returns the hash of a value. Heap strings, arrays and dicts cache their hash.
+uint64_t di_hash(di_t v) {
+	if (di_is_atom(v))
+		return di_to_atom(v)->hash; // same as for an equal heap string
+	if (!di_is_pointer(v))
+		return hash_avalanche(v.as_int64);
+	if (di_is_string(v)) {
+		dynstr_t *s = (dynstr_t *)di_to_pointer(v);
+		uint32_t hash = load_hash(&s->hash);
+		if (hash == 0) {
+			hash = hash_string(di_heap_string_chars(&s->header),
+			                   dynstr_length(s));
+			store_hash(&s->hash, hash);
+		}
+		return hash;
+	}
+	return hash_container(v);
+}
+
+/*+-------+*
+ *| Atoms |*
+ *+-------+*/
+
+// The intern table, an open addressing hashtable of immortal strings. It's
+// used by all threads, under a lock.
+static dynstr_t **atom_table = NULL;
+static di_size_t atom_table_mask = 0, atom_table_used = 0;
+static pthread_mutex_t atom_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns the slot where the string is or should be stored.
+static dynstr_t **atom_lookup(const char *chars, di_size_t length,
+                              uint32_t hash) {
+	di_size_t pos = hash & atom_table_mask;
+	while (atom_table[pos] != NULL) {
+		dynstr_t *a = atom_table[pos];
+		if (a->hash == hash && dynstr_length(a) == length &&
+		    !memcmp(dynstr_chars(a), chars, length))
+			break;
+		pos = (pos + 1) & atom_table_mask;
+	}
+	return &atom_table[pos];
+}
+
+// Doubles the size of the intern table (or creates it).
+static void atom_table_grow(void) {
+	dynstr_t **old = atom_table;
+	di_size_t i, old_size = old ? atom_table_mask + 1 : 0;
+	di_size_t size = old ? 2 * old_size : 256;
+	atom_table = calloc(size, sizeof(dynstr_t *));
+	if (!atom_table) DIE("Out of memory");
+	atom_table_mask = size - 1;
+	for (i = 0; i < old_size; i++) {
+		dynstr_t *a = old[i];
+		if (a)
+			*atom_lookup(dynstr_chars(a), dynstr_length(a), a->hash) = a;
+	}
+	free(old);
+}
+
+di_t di_atom(const char *chars, di_size_t length) {
+	if (length <= 6)
+		return di_shortstring_create(chars, length);
+	uint32_t hash = hash_string(chars, length);
+	pthread_mutex_lock(&atom_lock);
+	if (2 * (atom_table_used + 1) > atom_table_mask + 1)
+		atom_table_grow();
+	dynstr_t **slot = atom_lookup(chars, length, hash);
+	if (*slot == NULL) {
+		di_arena_t *arena = di_arena_enter(NULL); // atoms live forever
+		dynstr_t *a = dynstr_from_chars(chars, length);
+		di_arena_enter(arena);
+		di_init_tagged(&a->header, DI_STRING);
+		a->header.refc = 1; // never freed
+		a->hash = hash;
+		*slot = a;
+		atom_table_used++;
+	}
+	dynstr_t *a = *slot;
+	pthread_mutex_unlock(&atom_lock);
+	return di_from_atom(a);
+}
+
+di_t di_atom_find(const char *chars, di_size_t length) {
+	if (length <= 6)
+		return di_shortstring_create(chars, length);
+	uint32_t hash = hash_string(chars, length);
+	pthread_mutex_lock(&atom_lock);
+	dynstr_t *a = atom_table ? *atom_lookup(chars, length, hash) : NULL;
+	pthread_mutex_unlock(&atom_lock);
+	return a ? di_from_atom(a) : di_null();
+}
+
+/* Use oaht_t for the dict implementation */
+// The hash of the contents is cached as for arrays. The twin is a HAMT with the
+// same contents, made when the dict is updated while it's shared. See
+// Persistent dicts.
+//
+// The compact layout keeps the entries in insertion order, with their hashes,
+// so iteration, cloning, freeing and sharing only visit the live entries and
+// resizing doesn't rehash the keys.
+#define OAHT_HEADER di_tagged_t header; uint32_t hash; struct di_hamt *twin;
+#define OAHT_COMPACT 1
+#define OAHT_KEY_T di_t
+#define OAHT_KEY_EQUALS(a, b) di_equal(a, b)
+#define OAHT_VALUE_T di_t
+#define OAHT_SIZE_T di_size_t
+#define OAHT_MIN_CAPACITY 4
 #define OAHT_EMPTY_KEY di_empty()
 #define OAHT_EMPTY_KEY_BYTE NANBOX_EMPTY_BYTE
 #define OAHT_IS_EMPTY_KEY(key) di_is_empty(key)
 #define OAHT_DELETED_KEY di_deleted()
 #define OAHT_IS_DELETED_KEY(key) di_is_deleted(key)
-#define OAHT_HASH(val) lousy_hash(val)
+#define OAHT_HASH(val) di_hash(val)
 #define OAHT_HASH_T uint64_t
 #include "oaht.h"
 
+/*+--------------+*
+ *| Shaped dicts |*
+ *+--------------+*/
+
+// A small dict whose keys are short strings or atoms is stored as a shape and
+// an array of values, instead of as a hash table. A shape is an interned,
+// immortal sequence of keys. The shapes form a tree, where the children of a
+// shape have one more key, so dicts with the same keys set in the same order,
+// like tokens and AST nodes, share a shape and the values are found at the
+// same offsets. A shaped dict turns into a hash table when it gets any other
+// kind of key or more than DI_SHAPE_MAX_KEYS keys, or when there are already
+// DI_SHAPE_MAX_COUNT shapes.
+#define DI_SHAPE_MAX_KEYS 8
+#define DI_SHAPE_MAX_COUNT 4096
+#define DI_SHAPE_NOT_FOUND ((di_size_t)-1)
+
+typedef struct di_shape {
+	struct di_shape *parent;
+	di_size_t len;
+	di_t keys[DI_SHAPE_MAX_KEYS];
+} di_shape_t;
+
+typedef struct di_shaped {
+	di_tagged_t header;
+	di_shape_t *shape;
+	di_size_t cap;
+	uint32_t hash; // as for hash tables
+	di_t values[]; // cap values, of which shape->len are used
+} di_shaped_t;
+
+static di_shape_t root_shape;
+static di_size_t shape_count = 0;
+
+// The shapes except the root, in an open addressing hash table where a shape
+// is found by its parent and its last key. At most half full. The table is
+// used by all threads. Shapes are found without locking and added under a
+// lock. A slot is never changed once it's been filled.
+#define DI_SHAPE_TABLE_SIZE (2 * DI_SHAPE_MAX_COUNT)
+static di_shape_t *shape_table[DI_SHAPE_TABLE_SIZE];
+static pthread_mutex_t shape_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline bool di_is_shaped(di_t dict) {
+	return di_to_pointer(dict)->tag == DI_SHAPED;
+}
+
+// Keys which are immortal and equal only to keys with the same bits.
+static inline bool is_shape_key(di_t key) {
+	return di_is_shortstring(key) || di_is_atom(key);
+}
+
+static inline bool same_bits(di_t a, di_t b) {
+	return !memcmp(&a, &b, sizeof(di_t));
+}
+
+// True if setting a key to value when it's mapped to old_value is a no-op.
+// This is di_equal() without comparing arrays and dicts by contents, so that
+// replacing a large value doesn't cost a deep comparison. Replacing it with an
+// equal copy is then a normal update.
+static inline bool same_value(di_t old_value, di_t value) {
+	if (same_bits(old_value, value))
+		return true;
+	if (di_is_pointer(old_value) && di_is_pointer(value) &&
+	    di_to_pointer(old_value) == di_to_pointer(value))
+		return true;
+	return di_is_string(value) && di_equal(old_value, value);
+}
+
+// Returns the shape with the keys of shape followed by key, or NULL if there
+// would be too many keys or shapes.
+static di_shape_t *shape_add(di_shape_t *shape, di_t key) {
+	assert(is_shape_key(key));
+	if (shape->len == DI_SHAPE_MAX_KEYS)
+		return NULL;
+	uint64_t bits;
+	memcpy(&bits, &key, sizeof(bits));
+	di_size_t pos = hash_avalanche(bits ^ (uintptr_t)shape) &
+	                (DI_SHAPE_TABLE_SIZE - 1);
+	di_shape_t *child;
+	while ((child = __atomic_load_n(&shape_table[pos], __ATOMIC_ACQUIRE))) {
+		if (child->parent == shape && same_bits(child->keys[shape->len], key))
+			return child;
+		pos = (pos + 1) & (DI_SHAPE_TABLE_SIZE - 1);
+	}
+	pthread_mutex_lock(&shape_lock);
+	// Continue from pos, in case another thread has just added it.
+	while ((child = shape_table[pos]) != NULL) {
+		if (child->parent == shape && same_bits(child->keys[shape->len], key))
+			break;
+		pos = (pos + 1) & (DI_SHAPE_TABLE_SIZE - 1);
+	}
+	if (!child && shape_count < DI_SHAPE_MAX_COUNT) {
+		child = malloc(sizeof(di_shape_t)); // shapes live forever
+		if (!child) DIE("Out of memory");
+		memcpy(child->keys, shape->keys, shape->len * sizeof(di_t));
+		child->keys[shape->len] = key;
+		child->len    = shape->len + 1;
+		child->parent = shape;
+		__atomic_store_n(&shape_table[pos], child, __ATOMIC_RELEASE);
+		shape_count++;
+	}
+	pthread_mutex_unlock(&shape_lock);
+	return child;
+}
+
+// Returns the index of key in shape or DI_SHAPE_NOT_FOUND.
+static inline di_size_t shape_index(const di_shape_t *shape, di_t key) {
+	di_size_t i;
+	for (i = 0; i < shape->len; i++)
+		if (same_bits(shape->keys[i], key))
+			return i;
+	if (di_is_pointer(key) && di_is_string(key)) {
+		// A heap string can be equal to an atom.
+		for (i = 0; i < shape->len; i++)
+			if (di_equal(shape->keys[i], key))
+				return i;
+	}
+	return DI_SHAPE_NOT_FOUND;
+}
+
+static inline size_t shaped_size(di_size_t cap) {
+	return sizeof(di_shaped_t) + cap * sizeof(di_t);
+}
+
+static di_shaped_t *shaped_create(di_size_t cap) {
+	di_shaped_t *d = di_alloc(shaped_size(cap));
+	if (!d) DIE("Out of memory");
+	di_init_tagged(&d->header, DI_SHAPED);
+	d->shape = &root_shape;
+	d->cap = cap;
+	d->hash = 0;
+	return d;
+}
+
+// Clones or reuses a shaped dict. Returns a dict with refc == 0.
+static di_t shaped_clone_or_reuse(di_t dict) {
+	di_shaped_t *d = (di_shaped_t *)di_to_pointer(dict);
+	if (di_is_unshared_pointer(dict)) {
+		DI_STAT(DI_SHAPED, reused);
+		d->hash = 0;
+		return dict;
+	}
+	di_shaped_t *clone = clone_object(&d->header, shaped_size(d->cap));
+	clone->hash = 0;
+	di_size_t i;
+	for (i = 0; i < d->shape->len; i++)
+		di_incref(clone->values[i]);
+	return di_from_pointer(&clone->header);
+}
+
+// Converts a shaped dict to a hash table dict with refc == 0, with room for
+// one more entry. Frees or reuses the shaped dict if it's unshared.
+static di_t shaped_to_table(di_t dict) {
+	di_shaped_t *d = (di_shaped_t *)di_to_pointer(dict);
+	di_size_t i, n = d->shape->len;
+	bool unshared = di_is_unshared_pointer(dict);
+	struct oaht *ht = oaht_create_presized((n + 1) + (n + 1) / 2 + 1);
+	di_init_tagged(&ht->header, DI_DICT);
+	ht->hash = 0;
+	ht->twin = NULL;
+	for (i = 0; i < n; i++) {
+		if (!unshared)
+			di_incref(d->values[i]);
+		ht = oaht_set(ht, d->shape->keys[i], d->values[i]);
+	}
+	if (unshared)
+		di_free(d, shaped_size(d->cap)); // the values are moved
+	return di_from_pointer(&ht->header);
+}
+
+// di_dict_set for a shaped dict. Returns false without doing anything if the
+// dict needs to be converted to a hash table first.
+static bool shaped_set(di_t *dict, di_t key, di_t value) {
+	di_shaped_t *d = (di_shaped_t *)di_to_pointer(*dict);
+	di_size_t i = shape_index(d->shape, key);
+	if (i != DI_SHAPE_NOT_FOUND) {
+		if (same_value(d->values[i], value)) {
+			// no-op
+			DI_STAT(DI_SHAPED, noop_sets);
+			di_cleanup(key);
+			di_cleanup(value);
+			*dict = di_return_arg(*dict);
+			return true;
+		}
+		*dict = shaped_clone_or_reuse(*dict);
+		d = (di_shaped_t *)di_to_pointer(*dict);
+		// The key already in the dict is kept.
+		di_t old_value = d->values[i];
+		d->values[i] = di_keep(value);
+		di_decref_and_free(old_value);
+		di_cleanup(key);
+		return true;
+	}
+	if (!is_shape_key(key))
+		return false;
+	di_shape_t *shape = shape_add(d->shape, key);
+	if (!shape)
+		return false;
+	*dict = shaped_clone_or_reuse(*dict);
+	d = (di_shaped_t *)di_to_pointer(*dict);
+	if (d->cap < shape->len) {
+		di_size_t cap = d->cap ? 2 * d->cap : 4;
+		if (cap > DI_SHAPE_MAX_KEYS)
+			cap = DI_SHAPE_MAX_KEYS;
+		d = di_realloc(d, shaped_size(cap), shaped_size(d->cap));
+		if (!d) DIE("Out of memory");
+		d->cap = cap;
+	}
+	d->values[shape->len - 1] = di_keep(value);
+	d->shape = shape;
+	*dict = di_from_pointer(&d->header);
+	return true;
+}
+
+// di_dict_delete for a shaped dict. Returns false without doing anything if the
+// dict needs to be converted to a hash table first.
+static bool shaped_delete(di_t *dict, di_t key) {
+	di_shaped_t *d = (di_shaped_t *)di_to_pointer(*dict);
+	di_size_t i = shape_index(d->shape, key), j, n = d->shape->len;
+	if (i == DI_SHAPE_NOT_FOUND) {
+		di_cleanup(key);
+		*dict = di_return_arg(*dict); // no-op
+		return true;
+	}
+	// The shape of the remaining keys
+	di_shape_t *shape = &root_shape;
+	for (j = 0; j < n && shape; j++)
+		if (j != i)
+			shape = shape_add(shape, d->shape->keys[j]);
+	if (!shape)
+		return false;
+	*dict = shaped_clone_or_reuse(*dict);
+	d = (di_shaped_t *)di_to_pointer(*dict);
+	di_t old_value = d->values[i];
+	memmove(&d->values[i], &d->values[i + 1], (n - i - 1) * sizeof(di_t));
+	d->shape = shape;
+	di_cleanup(key);
+	di_decref_and_free(old_value);
+	return true;
+}
+
+/*+------------------+*
+ *| Persistent dicts |*
+ *+------------------+*/
+
+// A large hash table dict which is updated while it's shared is turned into a
+// hash array mapped trie (HAMT), where each level uses DI_HAMT_BITS bits of the
+// hash of a key to select an entry or a child node. Like for vectors, an update
+// copies the shared nodes on the path to the entry and shares the rest. The
+// nodes are compact, with bitmaps telling which of the positions hold entries
+// and which hold children. The entries come first, then the children. A child
+// node always holds at least two entries. The keys whose hashes are equal are
+// kept in a collision node below the last level. Only the low 32 bits of the
+// hashes are used, since the hashes cached in strings, arrays and dicts have
+// no more.
+#define DI_HAMT_BITS 5
+#define DI_HAMT_MASK ((1 << DI_HAMT_BITS) - 1)
+#define DI_HAMT_COLLISION_SHIFT 35 // 32 bits of hash, 2 bits on the last level
+
+typedef union di_hslot {
+	di_t v;
+	struct di_hnode *node;
+} di_hslot_t;
+
+typedef struct di_hnode {
+	unsigned  refc;    // the number of dicts and nodes pointing to it
+	di_size_t size;    // the number of entries in the subtree
+	uint32_t  datamap; // for a collision node, the number of entries
+	uint32_t  nodemap;
+	di_hslot_t slots[]; // keys and values of the entries, then the children
+} di_hnode_t;
+
+typedef struct di_hamt {
+	di_tagged_t header;
+	uint32_t    hash; // as for hash tables
+	di_hnode_t *root;
+} di_hamt_t;
+
+static inline bool di_is_hamt(di_t dict) {
+	return di_to_pointer(dict)->tag == DI_HAMT;
+}
+
+static inline unsigned popcount32(uint32_t x) {
+	x -= (x >> 1) & 0x55555555;
+	x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+	return (((x + (x >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+}
+
+static inline uint32_t hamt_hash(di_t key) {
+	return (uint32_t)di_hash(key);
+}
+
+static inline uint32_t hamt_bit(uint32_t hash, unsigned shift) {
+	return (uint32_t)1 << ((hash >> shift) & DI_HAMT_MASK);
+}
+
+static inline di_size_t hnode_entries(const di_hnode_t *node, unsigned shift) {
+	return shift >= DI_HAMT_COLLISION_SHIFT ? node->datamap
+	                                        : popcount32(node->datamap);
+}
+
+static inline di_size_t hnode_slots(const di_hnode_t *node, unsigned shift) {
+	return 2 * hnode_entries(node, shift) + popcount32(node->nodemap);
+}
+
+static inline size_t hnode_bytes(di_size_t slots) {
+	return sizeof(di_hnode_t) + slots * sizeof(di_hslot_t);
+}
+
+// The slot of the entry or the child for bit in a regular node.
+static inline di_size_t hnode_entry_pos(const di_hnode_t *node, uint32_t bit) {
+	return 2 * popcount32(node->datamap & (bit - 1));
+}
+static inline di_size_t hnode_child_pos(const di_hnode_t *node, uint32_t bit) {
+	return 2 * popcount32(node->datamap) +
+	       popcount32(node->nodemap & (bit - 1));
+}
+
+static di_hnode_t *hnode_create(di_size_t slots) {
+	di_hnode_t *node = di_alloc(hnode_bytes(slots));
+	if (!node) DIE("Out of memory");
+	node->refc    = 1;
+	node->size    = 0;
+	node->datamap = 0;
+	node->nodemap = 0;
+	return node;
+}
+
+// Drops a reference to a node. Frees it if it was the last one.
+static void hnode_release(di_hnode_t *node, unsigned shift) {
+	if (node_decref(&node->refc) > 0)
+		return;
+	di_size_t i, n = 2 * hnode_entries(node, shift),
+	          m = hnode_slots(node, shift);
+	for (i = 0; i < n; i++)
+		di_decref_and_free(node->slots[i].v);
+	for (; i < m; i++)
+		hnode_release(node->slots[i].node, shift + DI_HAMT_BITS);
+	di_free(node, hnode_bytes(m));
+}
+
+// Returns the node in *slot, ready for in-place update. If it's shared, it's
+// copied into *slot first.
+static di_hnode_t *hnode_for_update(di_hnode_t **slot, unsigned shift) {
+	di_hnode_t *node = *slot;
+	if (node_is_unique(&node->refc))
+		return node;
+	di_size_t i, n = 2 * hnode_entries(node, shift),
+	          m = hnode_slots(node, shift);
+	di_hnode_t *copy = di_alloc(hnode_bytes(m));
+	if (!copy) DIE("Out of memory");
+	memcpy(copy, node, hnode_bytes(m));
+	copy->refc = 1;
+	for (i = 0; i < n; i++)
+		di_incref(copy->slots[i].v);
+	for (; i < m; i++)
+		node_incref(&copy->slots[i].node->refc);
+	// Another thread may have released its reference since the check, so
+	// this one can be the last.
+	hnode_release(node, shift);
+	*slot = copy;
+	return copy;
+}
+
+// Replaces del slots at pos by ins undefined slots in the unshared node of m
+// slots in *slot, which is resized.
+static di_hnode_t *hnode_splice(di_hnode_t **slot, di_size_t m, di_size_t pos,
+                                di_size_t del, di_size_t ins) {
+	di_hnode_t *node = *slot;
+	if (ins > del) {
+		node = di_realloc(node, hnode_bytes(m - del + ins), hnode_bytes(m));
+		if (!node) DIE("Out of memory");
+	}
+	memmove(&node->slots[pos + ins], &node->slots[pos + del],
+	        (m - pos - del) * sizeof(di_hslot_t));
+	if (ins < del) {
+		node = di_realloc(node, hnode_bytes(m - del + ins), hnode_bytes(m));
+		if (!node) DIE("Out of memory");
+	}
+	*slot = node;
+	return node;
+}
+
+// Creates a node on the level of shift holding two entries with different
+// keys, whose references it takes over.
+static di_hnode_t *hnode_pair(unsigned shift, uint32_t hash1, di_t key1,
+                              di_t value1, uint32_t hash2, di_t key2,
+                              di_t value2) {
+	di_hnode_t *node;
+	if (shift >= DI_HAMT_COLLISION_SHIFT) {
+		node = hnode_create(4);
+		node->datamap = 2;
+	} else if (hamt_bit(hash1, shift) == hamt_bit(hash2, shift)) {
+		node = hnode_create(1);
+		node->nodemap = hamt_bit(hash1, shift);
+		node->slots[0].node = hnode_pair(shift + DI_HAMT_BITS, hash1, key1,
+		                                 value1, hash2, key2, value2);
+		node->size = 2;
+		return node;
+	} else {
+		node = hnode_create(4);
+		node->datamap = hamt_bit(hash1, shift) | hamt_bit(hash2, shift);
+		if (hamt_bit(hash1, shift) > hamt_bit(hash2, shift)) {
+			di_t key = key1, value = value1;
+			key1 = key2, value1 = value2;
+			key2 = key, value2 = value;
+		}
+	}
+	node->slots[0].v = key1;
+	node->slots[1].v = value1;
+	node->slots[2].v = key2;
+	node->slots[3].v = value2;
+	node->size = 2;
+	return node;
+}
+
+static di_t hamt_lookup(const di_hamt_t *h, di_t key, di_t default_value) {
+	uint32_t hash = hamt_hash(key);
+	const di_hnode_t *node = h->root;
+	unsigned shift;
+	di_size_t i;
+	for (shift = 0; shift < DI_HAMT_COLLISION_SHIFT; shift += DI_HAMT_BITS) {
+		uint32_t bit = hamt_bit(hash, shift);
+		if (node->datamap & bit) {
+			i = hnode_entry_pos(node, bit);
+			if (!di_equal(node->slots[i].v, key))
+				return default_value;
+			return node->slots[i + 1].v;
+		}
+		if (!(node->nodemap & bit))
+			return default_value;
+		node = node->slots[hnode_child_pos(node, bit)].node;
+	}
+	for (i = 0; i < 2 * node->datamap; i += 2)
+		if (di_equal(node->slots[i].v, key))
+			return node->slots[i + 1].v;
+	return default_value;
+}
+
+// Fetches the entry at position i, in the order of the trie.
+static void hamt_entry(const di_hamt_t *h, di_size_t i, di_t *key,
+                       di_t *value) {
+	const di_hnode_t *node = h->root;
+	unsigned shift = 0;
+	assert(i < node->size);
+	for (;;) {
+		di_size_t n = hnode_entries(node, shift), j;
+		if (i < n)
+			break;
+		i -= n;
+		for (j = 2 * n; i >= node->slots[j].node->size; j++)
+			i -= node->slots[j].node->size;
+		node = node->slots[j].node;
+		shift += DI_HAMT_BITS;
+	}
+	if (key) *key = node->slots[2 * i].v;
+	if (value) *value = node->slots[2 * i + 1].v;
+}
+
+// Sets key to value in the subtree in *slot, copying the shared nodes on the
+// path. Returns true if the key is added. If it already exists, only the value
+// is replaced, and the caller is responsible for the key.
+static bool hnode_put(di_hnode_t **slot, unsigned shift, uint32_t hash,
+                      di_t key, di_t value) {
+	di_hnode_t *node = hnode_for_update(slot, shift);
+	di_size_t n = hnode_entries(node, shift), m = hnode_slots(node, shift), i;
+	// A collision node has no bits of the hash left.
+	uint32_t bit = shift < DI_HAMT_COLLISION_SHIFT ? hamt_bit(hash, shift) : 0;
+	if (shift >= DI_HAMT_COLLISION_SHIFT) {
+		for (i = 0; i < 2 * n; i += 2)
+			if (di_equal(node->slots[i].v, key))
+				break;
+	} else if (node->nodemap & bit) {
+		di_hnode_t **child = &node->slots[hnode_child_pos(node, bit)].node;
+		bool added = hnode_put(child, shift + DI_HAMT_BITS, hash, key, value);
+		node->size += added;
+		return added;
+	} else {
+		i = hnode_entry_pos(node, bit);
+		if (!(node->datamap & bit))
+			i = 2 * n; // not found
+	}
+	if (i < 2 * n && di_equal(node->slots[i].v, key)) {
+		// The key already in the dict is kept.
+		di_t old_value = node->slots[i + 1].v;
+		node->slots[i + 1].v = di_keep(value);
+		di_decref_and_free(old_value);
+		return false;
+	}
+	if (i < 2 * n) {
+		// Another key at this position. Move both down to a new child.
+		di_t old_key = node->slots[i].v;
+		di_hnode_t *child = hnode_pair(shift + DI_HAMT_BITS,
+		                               hamt_hash(old_key), old_key,
+		                               node->slots[i + 1].v, hash,
+		                               di_keep(key), di_keep(value));
+		node = hnode_splice(slot, m, i, 2, 0);
+		node->datamap &= ~bit;
+		di_size_t j = hnode_child_pos(node, bit);
+		node = hnode_splice(slot, m - 2, j, 0, 1);
+		node->nodemap |= bit;
+		node->slots[j].node = child;
+	} else {
+		if (shift < DI_HAMT_COLLISION_SHIFT)
+			i = hnode_entry_pos(node, bit);
+		node = hnode_splice(slot, m, i, 0, 2);
+		if (shift < DI_HAMT_COLLISION_SHIFT)
+			node->datamap |= bit;
+		else
+			node->datamap++;
+		node->slots[i].v = di_keep(key);
+		node->slots[i + 1].v = di_keep(value);
+	}
+	node->size++;
+	return true;
+}
+
+// Deletes a key which exists from the subtree in *slot, copying the shared
+// nodes on the path. The key and the value in the dict are returned in
+// old_key and old_value, still holding their references.
+static void hnode_delete(di_hnode_t **slot, unsigned shift, uint32_t hash,
+                         di_t key, di_t *old_key, di_t *old_value) {
+	di_hnode_t *node = hnode_for_update(slot, shift);
+	di_size_t n = hnode_entries(node, shift), m = hnode_slots(node, shift), i;
+	// A collision node has no bits of the hash left.
+	uint32_t bit = shift < DI_HAMT_COLLISION_SHIFT ? hamt_bit(hash, shift) : 0;
+	node->size--;
+	if (shift < DI_HAMT_COLLISION_SHIFT && (node->nodemap & bit)) {
+		di_size_t j = hnode_child_pos(node, bit);
+		hnode_delete(&node->slots[j].node, shift + DI_HAMT_BITS, hash, key,
+		             old_key, old_value);
+		di_hnode_t *child = node->slots[j].node;
+		if (child->size > 1)
+			return;
+		// One entry is left in the child, on its own level as it can't
+		// be a child of its own. Move it up to this node.
+		assert(hnode_slots(child, shift + DI_HAMT_BITS) == 2);
+		assert(node_is_unique(&child->refc)); // just updated
+		di_t k = child->slots[0].v, v = child->slots[1].v;
+		di_free(child, hnode_bytes(2));
+		node = hnode_splice(slot, m, j, 1, 0);
+		node->nodemap &= ~bit;
+		node->datamap |= bit;
+		i = hnode_entry_pos(node, bit);
+		node = hnode_splice(slot, m - 1, i, 0, 2);
+		node->slots[i].v = k;
+		node->slots[i + 1].v = v;
+		return;
+	}
+	if (shift < DI_HAMT_COLLISION_SHIFT) {
+		i = hnode_entry_pos(node, bit);
+		node->datamap &= ~bit;
+	} else {
+		for (i = 0; !di_equal(node->slots[i].v, key); i += 2)
+			assert(i < 2 * n);
+		node->datamap--;
+	}
+	*old_key = node->slots[i].v;
+	*old_value = node->slots[i + 1].v;
+	hnode_splice(slot, m, i, 2, 0);
+}
+
+// An entry when building a node.
+typedef struct di_hentry {
+	uint32_t hash;
+	di_t key, value;
+} di_hentry_t;
+
+// Builds a node on the level of shift holding n entries with different keys,
+// taking over their references. The entries are reordered. The array tmp is
+// scratch space for n entries.
+static di_hnode_t *hnode_build(di_hentry_t *entries, di_hentry_t *tmp,
+                               di_size_t n, unsigned shift) {
+	di_hnode_t *node;
+	di_size_t i, b;
+	if (shift >= DI_HAMT_COLLISION_SHIFT) {
+		node = hnode_create(2 * n);
+		for (i = 0; i < n; i++) {
+			node->slots[2 * i].v = entries[i].key;
+			node->slots[2 * i + 1].v = entries[i].value;
+		}
+		node->datamap = node->size = n;
+		return node;
+	}
+	// Sort the entries into tmp by their positions in the node.
+	di_size_t start[DI_HAMT_MASK + 2] = {0}, pos[DI_HAMT_MASK + 1];
+	for (i = 0; i < n; i++)
+		start[((entries[i].hash >> shift) & DI_HAMT_MASK) + 1]++;
+	uint32_t datamap = 0, nodemap = 0;
+	for (b = 0; b <= DI_HAMT_MASK; b++) {
+		if (start[b + 1] == 1)
+			datamap |= (uint32_t)1 << b;
+		else if (start[b + 1] > 1)
+			nodemap |= (uint32_t)1 << b;
+		start[b + 1] += start[b];
+		pos[b] = start[b];
+	}
+	for (i = 0; i < n; i++)
+		tmp[pos[(entries[i].hash >> shift) & DI_HAMT_MASK]++] = entries[i];
+	node = hnode_create(2 * popcount32(datamap) + popcount32(nodemap));
+	node->datamap = datamap;
+	node->nodemap = nodemap;
+	node->size = n;
+	di_size_t d = 0, c = 2 * popcount32(datamap);
+	for (b = 0; b <= DI_HAMT_MASK; b++) {
+		di_size_t count = start[b + 1] - start[b];
+		if (count == 1) {
+			node->slots[d++].v = tmp[start[b]].key;
+			node->slots[d++].v = tmp[start[b]].value;
+		} else if (count > 1) {
+			node->slots[c++].node =
+				hnode_build(&tmp[start[b]], &entries[start[b]], count,
+				            shift + DI_HAMT_BITS);
+		}
+	}
+	return node;
+}
+
+// Returns a HAMT with refc == 0 for in-place update. For a shared HAMT, the new
+// one shares its nodes. For a shared hash table, the new one shares its nodes
+// with the table's twin, which is created if the table doesn't have one. Thus,
+// updating the same shared table again is cheap too. A table shared between
+// threads doesn't get a twin, as for arrays.
+static di_hamt_t *hamt_for_update(di_t dict) {
+	di_hamt_t *h;
+	if (di_is_hamt(dict)) {
+		h = (di_hamt_t *)di_to_pointer(dict);
+		if (!di_is_unshared_pointer(dict)) {
+			di_hamt_t *clone = clone_object(&h->header, sizeof(di_hamt_t));
+			node_incref(&clone->root->refc);
+			h = clone;
+		} else {
+			DI_STAT(DI_HAMT, reused);
+		}
+		h->hash = 0;
+		return h;
+	}
+	assert(!di_is_unshared_pointer(dict));
+	struct oaht *ht = (struct oaht *)di_to_pointer(dict);
+	if (ht->twin)
+		return hamt_for_update(di_from_pointer(&ht->twin->header));
+	DI_STAT(DI_DICT, cloned); // into a HAMT
+	h = di_alloc(sizeof(di_hamt_t));
+	if (!h) DIE("Out of memory");
+	di_init_tagged(&h->header, DI_HAMT);
+	h->hash = 0;
+	di_size_t i, n = 0;
+	di_hentry_t *entries = malloc(2 * oaht_len(ht) * sizeof(di_hentry_t));
+	if (!entries) DIE("Out of memory");
+	for (i = 0; (i = oaht_iter(ht, i, &entries[n].key, &entries[n].value));) {
+		di_incref(entries[n].key);
+		di_incref(entries[n].value);
+		entries[n].hash = hamt_hash(entries[n].key);
+		n++;
+	}
+	h->root = hnode_build(entries, &entries[n], n, 0);
+	free(entries);
+	if (ht->header.flags & DI_SHARED)
+		return h;
+	h->header.refc = 1; // owned by the table
+	ht->twin = h;
+	return hamt_for_update(di_from_pointer(&h->header));
+}
+
+// Helper. Releases the twin of a hash table which is about to be modified.
+static inline void di_oaht_drop_twin(struct oaht *ht) {
+	if (ht->twin) {
+		di_decref_and_free(di_from_pointer(&ht->twin->header));
+		ht->twin = NULL;
+	}
+}
+
+// True if dict is a HAMT or a hash table which is to become one when updated.
+static inline bool dict_is_persistent(di_t dict) {
+	di_tagged_t *p = di_to_pointer(dict);
+	return p->tag == DI_HAMT ||
+	       (p->tag == DI_DICT && !di_is_unshared_pointer(dict) &&
+	        oaht_len((struct oaht *)p) >= DI_PERSISTENT_MIN);
+}
+
+/*+-------+*
+ *| Dicts |*
+ *+-------+*/
+
 // creates an empty dict
 di_t di_dict_empty(void) {
-	di_tagged_t * dict = (di_tagged_t *)oaht_create();
-	di_init_tagged(dict, DI_DICT);
-	return di_from_pointer(dict);
+	return di_from_pointer(&shaped_create(4)->header);
+}
+
+di_t di_dict_from_entries(const di_t *entries, di_size_t n) {
+	di_size_t i;
+	if (n <= DI_SHAPE_MAX_KEYS) {
+		// Probably a shaped dict, unless it gets other kinds of keys.
+		di_t dict = di_from_pointer(&shaped_create(n)->header);
+		for (i = 0; i < n; i++)
+			dict = di_dict_set(dict, entries[2 * i], entries[2 * i + 1]);
+		return dict;
+	}
+	// Presized so that the table is less than 2/3 full after n inserts and
+	// is never resized.
+	struct oaht *ht = oaht_create_presized(n + n / 2 + 1);
+	di_init_tagged(&ht->header, DI_DICT);
+	ht->hash = 0;
+	ht->twin = NULL;
+	for (i = 0; i < n; i++) {
+		di_t key = entries[2 * i], value = entries[2 * i + 1];
+		struct oaht_entry *entry = oaht_find(ht, key, di_hash(key));
+		if (!entry) {
+			ht = oaht_set(ht, di_keep(key), di_keep(value));
+		}
+		else {
+			// Duplicate key. Like di_dict_set, the last value wins and
+			// the first key is kept.
+			di_decref_and_free(entry->value);
+			entry->value = di_keep(value);
+			di_cleanup(key);
+		}
+	}
+	return di_from_pointer(&ht->header);
+}
+
+// Returns the value for key or default_value if the key does not exist.
+static inline di_t dict_lookup(di_t dict, di_t key, di_t default_value) {
+	di_tagged_t *p = di_to_pointer(dict);
+	if (p->tag == DI_DICT)
+		return oaht_get((struct oaht *)p, key, default_value);
+	if (p->tag == DI_SHAPED) {
+		di_shaped_t *d = (di_shaped_t *)p;
+		di_size_t i = shape_index(d->shape, key);
+		return i == DI_SHAPE_NOT_FOUND ? default_value : d->values[i];
+	}
+	return hamt_lookup((di_hamt_t *)p, key, default_value);
 }
 
 // Returns the number of entries in the dict
 di_size_t di_dict_size(di_t dict) {
 	assert(di_is_dict(dict));
+	if (di_is_shaped(dict))
+		return ((di_shaped_t *)di_to_pointer(dict))->shape->len;
+	if (di_is_hamt(dict))
+		return ((di_hamt_t *)di_to_pointer(dict))->root->size;
 	struct oaht *ht = (struct oaht *)di_to_pointer(dict);
 	return oaht_len(ht);
 }
@@ -303,15 +2823,13 @@ di_size_t di_dict_size(di_t dict) {
 // True if the key exists in the dict.
 bool di_dict_contains(di_t dict, di_t key) {
 	assert(di_is_dict(dict));
-	struct oaht *ht = (struct oaht *)di_to_pointer(dict);
-	return oaht_contains(ht, key);
+	return !di_is_empty(dict_lookup(dict, key, di_empty()));
 }
 
 // Fetches a value from the dict. Null is returned if the key does not exist.
 di_t di_dict_get(di_t dict, di_t key) {
 	assert(di_is_dict(dict));
-	struct oaht *ht = (struct oaht *)di_to_pointer(dict);
-	return oaht_get(ht, key, di_null());
+	return dict_lookup(dict, key, di_null());
 }
 
 // Fetches the internal index given the previous internal index i. Key and value
@@ -319,6 +2837,22 @@ di_t di_dict_get(di_t dict, di_t key) {
 // are no more entries.
 di_size_t di_dict_iter(di_t dict, di_size_t i, di_t *key, di_t *value) {
 	assert(di_is_dict(dict));
+	if (di_is_shaped(dict)) {
+		// In insertion order
+		di_shaped_t *d = (di_shaped_t *)di_to_pointer(dict);
+		if (i >= d->shape->len)
+			return 0;
+		if (key) *key = d->shape->keys[i];
+		if (value) *value = d->values[i];
+		return i + 1;
+	}
+	if (di_is_hamt(dict)) {
+		di_hamt_t *h = (di_hamt_t *)di_to_pointer(dict);
+		if (i >= h->root->size)
+			return 0;
+		hamt_entry(h, i, key, value);
+		return i + 1;
+	}
 	struct oaht *ht = (struct oaht *)di_to_pointer(dict);
 	return oaht_iter(ht, i, key, value);
 }
@@ -327,12 +2861,20 @@ di_size_t di_dict_iter(di_t dict, di_size_t i, di_t *key, di_t *value) {
 static inline di_t di_dict_clone_or_reuse(di_t dict) {
 	assert(di_is_dict(dict));
 	di_tagged_t *tagged = di_to_pointer(dict);
-	if (tagged->refc == 0)
+	if (di_is_shaped(dict))
+		return shaped_clone_or_reuse(dict);
+	assert(!di_is_hamt(dict));
+	if (di_is_unshared_pointer(dict)) {
+		DI_STAT(DI_DICT, reused);
+		di_oaht_drop_twin((struct oaht *)tagged);
+		((struct oaht *)tagged)->hash = 0;
 		return dict; // no need to clone
+	}
 	// clone
 	struct oaht *ht = (struct oaht *)tagged;
-	ht = oaht_clone(ht);
-	ht->header.refc = 0;
+	ht = clone_object(&ht->header, oaht_bytes(ht));
+	ht->hash = 0;
+	ht->twin = NULL;
 	// Incref all keys and values.
 	di_size_t i;
 	di_t key, value;
@@ -348,35 +2890,46 @@ static inline di_t di_dict_clone_or_reuse(di_t dict) {
 // Associates key with value. Returns the new dict.
 di_t di_dict_set(di_t dict, di_t key, di_t value) {
 	assert(di_is_dict(dict));
-	// Unbox
-	struct oaht *ht = (struct oaht *)di_to_pointer(dict);
+	if (di_is_shaped(dict)) {
+		if (shaped_set(&dict, key, value))
+			return dict;
+		dict = shaped_to_table(dict);
+	}
 	// We use the special value 'empty' for a non-existing key.
 	// The 'empty' value is not allowed for users so it's safe to use.
-	di_t old_value = oaht_get(ht, key, di_empty());
-	if (!di_is_empty(old_value) && di_equal(old_value, value)) {
+	di_t old_value = dict_lookup(dict, key, di_empty());
+	if (!di_is_empty(old_value) && same_value(old_value, value)) {
 		// no-op
+		DI_STAT(di_to_pointer(dict)->tag, noop_sets);
 		di_cleanup(key);
 		di_cleanup(value);
                 /* if (was_array && !di_is_array(value)) { */
                 /*     printf("%s:%d: Dict set destroyed array\n", __FILE__, __LINE__); */
                 /* } */
-		return dict;
+		return di_return_arg(dict);
+	}
+	if (dict_is_persistent(dict)) {
+		di_hamt_t *h = hamt_for_update(dict);
+		if (!hnode_put(&h->root, 0, hamt_hash(key), key, value))
+			di_cleanup(key); // the key already in the dict is kept
+		return di_from_pointer(&h->header);
 	}
 	// If there are any references to it, make a clone.
 	dict = di_dict_clone_or_reuse(dict);
-	// Now we can edit dict. Unbox again.
-	ht = (struct oaht *)di_to_pointer(dict);
-	ht = oaht_set(ht, key, value);
+	// Now we can edit dict. Unbox.
+	struct oaht *ht = (struct oaht *)di_to_pointer(dict);
 	if (!di_is_empty(old_value)) {
-		// Replacing old value. Old value deleted. No new key added.
+		// Replacing old value. The key already in the dict is kept, so
+		// only the value is replaced. No new key added.
+		struct oaht_entry *entry = oaht_find(ht, key, di_hash(key));
+		entry->value = di_keep(value);
 		di_decref_and_free(old_value);
 		di_cleanup(key);
 	}
 	else {
 		// New key added. No value deleted.
-		di_incref(key);
+		ht = oaht_set(ht, di_keep(key), di_keep(value));
 	}
-	di_incref(value);
 	// Go back to boxed pointer.
 	dict = di_from_pointer((di_tagged_t *)ht);
 	return dict;
@@ -386,19 +2939,37 @@ di_t di_dict_set(di_t dict, di_t key, di_t value) {
 // Frees key if its refcounter is zero.
 di_t di_dict_delete(di_t dict, di_t key) {
 	assert(di_is_dict(dict));
-	// Unbox
-	struct oaht *ht = (struct oaht *)di_to_pointer(dict);
-	di_t old_value = oaht_get(ht, key, di_empty());
-	if (di_is_empty(old_value))
-		return dict; // no-op
+	if (di_is_shaped(dict)) {
+		if (shaped_delete(&dict, key))
+			return dict;
+		dict = shaped_to_table(dict);
+	}
+	di_t old_value = dict_lookup(dict, key, di_empty());
+	if (di_is_empty(old_value)) {
+		di_cleanup(key);
+		return di_return_arg(dict); // no-op
+	}
+	if (dict_is_persistent(dict)) {
+		di_hamt_t *h = hamt_for_update(dict);
+		di_t old_key;
+		hnode_delete(&h->root, 0, hamt_hash(key), key, &old_key, &old_value);
+		di_cleanup(key);
+		di_decref_and_free(old_key);
+		di_decref_and_free(old_value);
+		return di_from_pointer(&h->header);
+	}
 	// If there are any references to it, make a clone.
 	dict = di_dict_clone_or_reuse(dict);
-	// Unbox again
-	ht = (struct oaht *)di_to_pointer(dict);
+	// Unbox
+	struct oaht *ht = (struct oaht *)di_to_pointer(dict);
 
-	// Delete and decref key and value
+	// Delete and decref the key stored in the dict and the value. Free the
+	// key passed to us if it's a different one.
+	struct oaht_entry *entry = oaht_find(ht, key, di_hash(key));
+	di_t old_key = entry->key;
 	ht = oaht_delete(ht, key);
-	di_decref_and_free(key);
+	di_cleanup(key);
+	di_decref_and_free(old_key);
 	di_decref_and_free(old_value);
 
 	// Go back to boxed pointer.
@@ -410,25 +2981,49 @@ di_t di_dict_delete(di_t dict, di_t key) {
 // key or null if the dict didn't contain the key. Note that the dict is
 // provided as a pointer which is updated to point at the updated dict. To tell
 // if the key didn't exist or if it was mapped to the value null, compare the
-// size of the dict before and after.
+// size of the dict before and after. Frees key if its refcounter is zero.
 di_t di_dict_pop(di_t *dict, di_t key) {
 	assert(di_is_dict(*dict));
-	// Unbox
-	struct oaht *ht = (struct oaht *)di_to_pointer(*dict);
-	di_t old_value = oaht_get(ht, key, di_empty());
-	if (di_is_empty(old_value))
+	if (di_is_shaped(*dict)) {
+		di_size_t i = shape_index(
+			((di_shaped_t *)di_to_pointer(*dict))->shape, key);
+		di_cleanup(key); // the shape has its own
+		if (i == DI_SHAPE_NOT_FOUND)
+			return di_null(); // no-op
+		*dict = shaped_clone_or_reuse(*dict);
+		di_shaped_t *d = (di_shaped_t *)di_to_pointer(*dict);
+		// Like below, the value is replaced with null.
+		di_t old_value = d->values[i];
+		d->values[i] = di_null();
+		di_decref(old_value);
+		return old_value;
+	}
+	di_t old_value = dict_lookup(*dict, key, di_empty());
+	if (di_is_empty(old_value)) {
+		di_cleanup(key);
 		return di_null(); // no-op
+	}
+	if (dict_is_persistent(*dict)) {
+		// Like below, the value is replaced with null. It's kept alive
+		// during the replacement.
+		di_hamt_t *h = hamt_for_update(*dict);
+		di_incref(old_value);
+		hnode_put(&h->root, 0, hamt_hash(key), key, di_null());
+		di_cleanup(key); // the key in the dict is kept
+		di_decref(old_value);
+		*dict = di_from_pointer(&h->header);
+		return old_value;
+	}
 	// If there are any references to it, make a clone.
 	*dict = di_dict_clone_or_reuse(*dict);
-	// Unbox again
-	ht = (struct oaht *)di_to_pointer(*dict);
+	// Unbox
+	struct oaht *ht = (struct oaht *)di_to_pointer(*dict);
 
         // Instead of deleting the key, replace the value with null to make sure
-        // this works inside a dict iteration.
-	ht = oaht_set(ht, key, di_null());
-	// Delete and Decref key and value
-	//ht = oaht_delete(ht, key);
-	//di_decref_and_free(key);
+        // this works inside a dict iteration. The key in the dict is kept.
+	struct oaht_entry *entry = oaht_find(ht, key, di_hash(key));
+	entry->value = di_null();
+	di_cleanup(key);
 	di_decref(old_value);
 
 	// Go back to boxed pointer.
@@ -440,53 +3035,175 @@ di_t di_dict_pop(di_t *dict, di_t key) {
  * General *
  *---------*/
 
-// Helper for di_equal
+// Helper. Returns where the hash of an array or a dict is cached, or NULL for
+// a slice. A slice is a view, so it has nowhere to keep it.
+static inline uint32_t *hash_cache(di_tagged_t *p) {
+	switch (p->tag) {
+	case DI_ARRAY:  return &((aadeque_t *)p)->hash;
+	case DI_VECTOR: return &((di_vector_t *)p)->hash;
+	case DI_PACKED: return &((di_packed_t *)p)->hash;
+	case DI_DICT:   return &((struct oaht *)p)->hash;
+	case DI_SHAPED: return &((di_shaped_t *)p)->hash;
+	case DI_HAMT:   return &((di_hamt_t *)p)->hash;
+	default:        return NULL;
+	}
+}
+
+// Helper for di_hash. The hash of an array depends on the order of the
+// elements, but the hash of a dict doesn't depend on the order of the entries.
+// Either way, the layout doesn't matter, so equal values have equal hashes.
+static uint32_t hash_container(di_t v) {
+	if (di_is_fun(v) || di_is_task(v) || di_is_regex(v))
+		return (uint32_t)hash_avalanche((uintptr_t)di_to_pointer(v));
+	if (!di_is_array(v) && !di_is_dict(v))
+		DIE("Unexpected type");
+	uint32_t *cache = hash_cache(di_to_pointer(v));
+	if (cache && load_hash(cache))
+		return load_hash(cache);
+	uint64_t h;
+	di_size_t i;
+	if (di_is_array(v)) {
+		di_size_t n = di_array_length(v);
+		h = HASH_P5 + n;
+		for (i = 0; i < n; i++)
+			h = hash_merge(h, di_hash(di_array_get(v, i)));
+	} else {
+		di_t key, value;
+		h = HASH_P4 + di_dict_size(v);
+		for (i = 0; (i = di_dict_iter(v, i, &key, &value));)
+			h += hash_avalanche(hash_round(di_hash(key), di_hash(value)));
+	}
+	uint32_t hash = (uint32_t)hash_avalanche(h);
+	hash = hash ? hash : 1;
+	if (cache)
+		store_hash(cache, hash);
+	return hash;
+}
+
+// Helper for di_ptr_equal. Returns a pointer to element i of an array and sets
+// *n to the number of elements stored after each other from there, or returns
+// NULL if the array is packed.
+static const di_t *array_span(di_tagged_t *p, di_size_t i, di_size_t *n) {
+	aadeque_t *arr = (aadeque_t *)p;
+	di_size_t end;
+	switch (p->tag) {
+	case DI_ARRAY:
+		end = aadeque_len(arr);
+		break;
+	case DI_SLICE:
+		arr = ((di_slice_t *)p)->parent;
+		i  += ((di_slice_t *)p)->offset;
+		end = ((di_slice_t *)p)->offset + ((di_slice_t *)p)->length;
+		break;
+	case DI_VECTOR:
+		{
+			di_vector_t *vec = (di_vector_t *)p;
+			const di_vnode_t *node = vec->root;
+			unsigned shift;
+			for (shift = vec->shift; shift > 0; shift -= DI_VECTOR_BITS)
+				node = node->u.children[(i >> shift) & DI_VECTOR_MASK];
+			*n = DI_VECTOR_WIDTH - (i & DI_VECTOR_MASK);
+			if (*n > vec->length - i)
+				*n = vec->length - i;
+			return &node->u.values[i & DI_VECTOR_MASK];
+		}
+	default:
+		return NULL;
+	}
+	di_size_t idx = aadeque_idx(arr, i);
+	*n = arr->cap - idx < end - i ? arr->cap - idx : end - i;
+	return &arr->els[idx];
+}
+
+// Helper for di_equal. Atoms are compared as the strings they point to.
 bool di_ptr_equal(di_t v1, di_t v2) {
-	assert(di_is_pointer(v1));
-	assert(di_is_pointer(v2));
-	di_tagged_t *p1 = di_to_pointer(v1),
-	            *p2 = di_to_pointer(v2);
-	if (p1->tag != p2->tag)
+	assert(di_is_pointer(v1) || di_is_atom(v1));
+	assert(di_is_pointer(v2) || di_is_atom(v2));
+	di_tagged_t *p1 = di_is_atom(v1) ? &di_to_atom(v1)->header
+	                                 : di_to_pointer(v1),
+	            *p2 = di_is_atom(v2) ? &di_to_atom(v2)->header
+	                                 : di_to_pointer(v2);
+	if (p1 == p2)
+		return true; // e.g. a borrowed and an owned pointer
+	// Arrays and slices are compared by contents, like all kinds of strings
+	// and all kinds of dicts
+	int tag1 = p1->tag == DI_SLICE || p1->tag == DI_VECTOR ||
+	           p1->tag == DI_PACKED ? DI_ARRAY
+	         : p1->tag == DI_EXTSTRING ? DI_STRING
+	         : p1->tag == DI_SHAPED || p1->tag == DI_HAMT ? DI_DICT : p1->tag,
+	    tag2 = p2->tag == DI_SLICE || p2->tag == DI_VECTOR ||
+	           p2->tag == DI_PACKED ? DI_ARRAY
+	         : p2->tag == DI_EXTSTRING ? DI_STRING
+	         : p2->tag == DI_SHAPED || p2->tag == DI_HAMT ? DI_DICT : p2->tag;
+	if (tag1 != tag2)
 		return false;
-	switch (p1->tag) {
+	if (tag1 != DI_STRING) {
+		// If both hashes are cached, they must match.
+		uint32_t *c1 = hash_cache(p1), *c2 = hash_cache(p2);
+		uint32_t h1 = c1 ? load_hash(c1) : 0, h2 = c2 ? load_hash(c2) : 0;
+		if (h1 && h2 && h1 != h2)
+			return false;
+	}
+	switch (tag1) {
 	case DI_STRING:
 		{
 			dynstr_t *s1 = (dynstr_t *)p1,
 			         *s2 = (dynstr_t *)p2;
-			return dynstr_length(s1) == dynstr_length(s2) &&
-			       !memcmp(dynstr_chars(s1), dynstr_chars(s2),
-			               dynstr_length(s1));
+			if (dynstr_length(s1) != dynstr_length(s2))
+				return false;
+			// If both hashes are cached, they must match.
+			uint32_t h1 = load_hash(&s1->hash), h2 = load_hash(&s2->hash);
+			if (h1 && h2 && h1 != h2)
+				return false;
+			return !memcmp(di_heap_string_chars(p1),
+			               di_heap_string_chars(p2), dynstr_length(s1));
 		}
 	case DI_ARRAY:
 		{
-			aadeque_t *a1 = (aadeque_t *)p1,
-				  *a2 = (aadeque_t *)p2;
-			di_size_t i, n = aadeque_len(a1);
-			if (aadeque_len(a2) != n)
+			di_size_t i, n = di_array_length(v1);
+			if (di_array_length(v2) != n)
 				return false;
-			for (i = 0; i < n; i++)
-				if (!di_equal(aadeque_get(a1, i), aadeque_get(a2, i)))
+			di_packed_t *q1 = (di_packed_t *)p1, *q2 = (di_packed_t *)p2;
+			if (p1->tag == DI_PACKED && p2->tag == DI_PACKED &&
+			    q1->kind == q2->kind)
+				return !memcmp(q1->data, q2->data,
+				               (size_t)n * packed_width[q1->kind]);
+			// Compare the bits of the elements, a chunk at a time.
+			// Elements with equal bits are equal. Others are compared
+			// one by one, only if the bits of a chunk differ.
+			for (i = 0; i < n;) {
+				di_size_t n1, n2, j;
+				const di_t *e1 = array_span(p1, i, &n1),
+				           *e2 = array_span(p2, i, &n2);
+				if (!e1 || !e2)
+					break;
+				n1 = n1 < n2 ? n1 : n2;
+				if (memcmp(e1, e2, n1 * sizeof(di_t)))
+					for (j = 0; j < n1; j++)
+						if (!di_equal(e1[j], e2[j]))
+							return false;
+				i += n1;
+			}
+			for (; i < n; i++)
+				if (!di_equal(di_array_get(v1, i), di_array_get(v2, i)))
 					return false;
 			return true;
 		}
 	case DI_DICT:
 		{
-			struct oaht *d1 = (struct oaht *)p1,
-			            *d2 = (struct oaht *)p2;
 			di_size_t i;
-			if (oaht_len(d1) != oaht_len(d2))
+			di_t key, value;
+			if (di_dict_size(v1) != di_dict_size(v2))
 				return false;
-			for (i = 0; i <= d1->mask; i++) {
-				OAHT_KEY_T key = d1->els[i].key;
-				if (!OAHT_IS_EMPTY_KEY(key) &&
-				    !OAHT_IS_DELETED_KEY(key) &&
-				    !di_equal(d1->els[i].value,
-					        oaht_get(d2, key,
-					                 OAHT_EMPTY_KEY)))
+			for (i = 0; (i = di_dict_iter(v1, i, &key, &value));)
+				if (!di_equal(value, dict_lookup(v2, key, di_empty())))
 					return false;
-			}
 			return true;
 		}
+	case DI_FUN:
+	case DI_TASK:
+	case DI_REGEX:
+		return false; // equal only to itself
 	default:
 		DIE("Unexpected type");
 	}
@@ -496,43 +3213,315 @@ bool di_ptr_equal(di_t v1, di_t v2) {
  * Reference-counter stuff *
  *-------------------------*/
 
-// Non-inline helper for the inline function di_cleanup().
-void di_ptr_free(di_t v) {
-	assert(di_is_pointer(v));
-	di_tagged_t * ptr = di_to_pointer(v);
-	assert(ptr->refc == 0);
+// Arrays and dicts are freed using a queue of containers whose elements are
+// being released, instead of recursively, so freeing a deep structure doesn't
+// use any stack. The elements of an entry from pos onwards are still to be
+// released. In deferred mode, freeing a value only does DI_FREE_STEP units of
+// work, leaving the rest in the queue. (One unit is releasing an element or a
+// dict entry.)
+#define DI_FREE_STEP 64
+
+typedef struct di_free_entry {
+	di_tagged_t *ptr;
+	di_size_t    pos;
+} di_free_entry_t;
+
+static __thread di_free_entry_t *free_queue = NULL;
+static __thread di_size_t free_queue_len = 0, free_queue_cap = 0;
+static __thread bool free_draining = false, free_deferred = false;
+
+// Helper. Frees a string, a slice, a packed array, a function or a task, or puts
+// an array or a dict in the queue.
+static void free_object(di_tagged_t *ptr) {
+	DI_STAT(ptr->tag, freed);
 	switch (ptr->tag) {
 	case DI_STRING:
 		dynstr_destroy((dynstr_t *)ptr);
 		break;
-	case DI_ARRAY:
-		// decref and free all the elements
+	case DI_EXTSTRING:
 		{
-			di_size_t i;
-			for (i = 0; i < di_array_length(v); i++) {
-				di_t x = di_array_get(v, i);
-				di_decref_and_free(x);
-			}
-			aadeque_destroy((aadeque_t *)ptr);
+			di_extstring_t *s = (di_extstring_t *)ptr;
+			if (s->release)
+				s->release(s->chars, s->len);
+			di_decref_and_free(s->owner);
+			di_free(s, sizeof(di_extstring_t));
 			break;
 		}
-	case DI_DICT:
-		// decref and free all the keys and values
+	case DI_SLICE:
+		di_slice_destroy((di_slice_t *)ptr);
+		break;
+	case DI_PACKED:
+		{
+			di_packed_t *p = (di_packed_t *)ptr;
+			di_decref_and_free(p->owner);
+			di_free(p, packed_bytes(p->kind, p->cap));
+			break;
+		}
+	case DI_FUN:
 		{
-			struct oaht *d = (struct oaht *)ptr;
+			di_fun_t *f = (di_fun_t *)ptr;
 			di_size_t i;
-			for (i = 0; i <= d->mask; i++) {
-				OAHT_KEY_T key = d->els[i].key;
-				if (!OAHT_IS_EMPTY_KEY(key) &&
-				    !OAHT_IS_DELETED_KEY(key)) {
-					di_decref_and_free(key);
-					di_decref_and_free(d->els[i].value);
-				}
-			}
-			oaht_destroy(d);
+			for (i = 0; i < f->env_size; i++)
+				di_decref_and_free(f->env[i]);
+			di_free(f, sizeof(di_fun_t) + f->env_size * sizeof(di_t));
 			break;
 		}
+	case DI_TASK:
+		di_task_drop((di_task_t *)ptr);
+		break;
+	case DI_REGEX:
+		di_regex_free((di_regex_t *)ptr);
+		break;
+	case DI_ARRAY:
+	case DI_VECTOR:
+	case DI_DICT:
+	case DI_SHAPED:
+	case DI_HAMT:
+		if (free_queue_len == free_queue_cap) {
+			free_queue_cap = free_queue_cap ? 2 * free_queue_cap : 64;
+			free_queue = realloc(free_queue,
+			                     free_queue_cap * sizeof(di_free_entry_t));
+			if (!free_queue) DIE("Out of memory");
+		}
+		free_queue[free_queue_len].ptr = ptr;
+		free_queue[free_queue_len].pos = 0;
+		free_queue_len++;
+		break;
 	default:
 		DIE("Unexpected type");
 	}
 }
+
+// Non-inline helper for the inline function di_cleanup().
+void di_ptr_free(di_t v) {
+	assert(di_is_pointer(v));
+	di_tagged_t * ptr = di_to_pointer(v);
+	assert(ptr->refc == 0);
+	free_object(ptr);
+	if (!free_draining && free_queue_len > 0)
+		di_drain_frees(free_deferred ? DI_FREE_STEP : 0);
+}
+
+void di_defer_frees(bool defer) {
+	free_deferred = defer;
+}
+
+bool di_drain_frees(di_size_t budget) {
+	if (free_draining)
+		return true; // called while releasing an element
+	free_draining = true;
+	bool all = budget == 0;
+	while (free_queue_len > 0 && (all || budget > 0)) {
+		// Release the elements of the top entry, until they're done, the
+		// budget is spent or an element is queued (which is then done first).
+		di_size_t top = free_queue_len - 1;
+		di_tagged_t *ptr = free_queue[top].ptr;
+		di_size_t pos = free_queue[top].pos, end;
+		if (ptr->tag == DI_ARRAY)
+			end = aadeque_len((aadeque_t *)ptr);
+		else if (ptr->tag == DI_SHAPED)
+			end = ((di_shaped_t *)ptr)->shape->len;
+		else if (ptr->tag == DI_VECTOR || ptr->tag == DI_HAMT)
+			end = 1; // the nodes are released in one go
+		else
+			end = ((struct oaht *)ptr)->fill;
+		while (pos < end && free_queue_len == top + 1 && (all || budget > 0)) {
+			if (ptr->tag == DI_ARRAY) {
+				di_decref_and_free(aadeque_get((aadeque_t *)ptr, pos));
+			} else if (ptr->tag == DI_SHAPED) {
+				// The keys are immortal.
+				di_decref_and_free(((di_shaped_t *)ptr)->values[pos]);
+			} else if (ptr->tag == DI_VECTOR) {
+				di_vector_t *vec = (di_vector_t *)ptr;
+				if (vec->root)
+					vnode_release(vec->root, vec->shift);
+			} else if (ptr->tag == DI_HAMT) {
+				hnode_release(((di_hamt_t *)ptr)->root, 0);
+			} else {
+				struct oaht_entry *entry =
+					&oaht_entries((struct oaht *)ptr)[pos];
+				if (!OAHT_IS_DELETED_KEY(entry->key)) {
+					di_decref_and_free(entry->key);
+					di_decref_and_free(entry->value);
+				}
+			}
+			pos++;
+			if (!all)
+				budget--;
+		}
+		free_queue[top].pos = pos;
+		if (pos < end)
+			continue;
+		// All elements are released. Free the container and replace its
+		// entry, which may no longer be the top one, by the top one.
+		if (ptr->tag == DI_ARRAY)
+			di_aadeque_drop_twin((aadeque_t *)ptr);
+		else if (ptr->tag == DI_DICT)
+			di_oaht_drop_twin((struct oaht *)ptr);
+		if (ptr->tag == DI_ARRAY)
+			aadeque_destroy((aadeque_t *)ptr);
+		else if (ptr->tag == DI_SHAPED)
+			di_free(ptr, shaped_size(((di_shaped_t *)ptr)->cap));
+		else if (ptr->tag == DI_VECTOR)
+			di_free(ptr, sizeof(di_vector_t));
+		else if (ptr->tag == DI_HAMT)
+			di_free(ptr, sizeof(di_hamt_t));
+		else
+			oaht_destroy((struct oaht *)ptr);
+		free_queue[top] = free_queue[--free_queue_len];
+	}
+	free_draining = false;
+	return free_queue_len > 0;
+}
+
+void di_thread_cleanup(void) {
+	di_drain_frees(0);
+	free(free_queue);
+	free_queue = NULL;
+	free_queue_cap = 0;
+#ifdef DI_STATS
+	flush_stats();
+#endif
+}
+
+// Helper for di_arena_destroy(). Drops the queued containers in an arena.
+static void di_forget_frees(di_arena_t *arena) {
+	di_size_t i, n = 0;
+	for (i = 0; i < free_queue_len; i++)
+		if (di_arena_of(free_queue[i].ptr) != arena)
+			free_queue[n++] = free_queue[i];
+	free_queue_len = n;
+}
+
+/*------------------------------*
+ * Sharing values among threads *
+ *------------------------------*/
+
+// Values which are still to be marked as shared, in a stack instead of being
+// visited recursively, as for freeing. The nodes of vectors and HAMTs are
+// visited recursively, since the trees are shallow.
+typedef struct share_stack {
+	di_t *values;
+	di_size_t len, cap;
+} share_stack_t;
+
+static void share_push(share_stack_t *stack, di_t v) {
+	if (!di_is_pointer(v) || di_is_shared(v))
+		return;
+	if (stack->len == stack->cap) {
+		stack->cap = stack->cap ? 2 * stack->cap : 64;
+		stack->values = realloc(stack->values, stack->cap * sizeof(di_t));
+		if (!stack->values) DIE("Out of memory");
+	}
+	stack->values[stack->len++] = v;
+}
+
+static void share_vnode(share_stack_t *stack, di_vnode_t *node,
+                        unsigned shift) {
+	if (node_is_shared(&node->refc))
+		return;
+	node->refc |= NODE_SHARED;
+	int i;
+	for (i = 0; i < DI_VECTOR_WIDTH; i++) {
+		if (shift == 0)
+			share_push(stack, node->u.values[i]);
+		else if (node->u.children[i])
+			share_vnode(stack, node->u.children[i], shift - DI_VECTOR_BITS);
+	}
+}
+
+static void share_hnode(share_stack_t *stack, di_hnode_t *node,
+                        unsigned shift) {
+	if (node_is_shared(&node->refc))
+		return;
+	node->refc |= NODE_SHARED;
+	di_size_t i, n = 2 * hnode_entries(node, shift),
+	          m = hnode_slots(node, shift);
+	for (i = 0; i < n; i++)
+		share_push(stack, node->slots[i].v);
+	for (; i < m; i++)
+		share_hnode(stack, node->slots[i].node, shift + DI_HAMT_BITS);
+}
+
+di_t di_share(di_t v) {
+	share_stack_t stack = {NULL, 0, 0};
+	share_push(&stack, v);
+	while (stack.len > 0) {
+		di_tagged_t *p = di_to_pointer(stack.values[--stack.len]);
+		if (p->flags & DI_SHARED)
+			continue; // pushed twice
+		p->flags |= DI_SHARED;
+		di_size_t i;
+		switch (p->tag) {
+		case DI_STRING:
+			break;
+		case DI_EXTSTRING:
+			share_push(&stack, ((di_extstring_t *)p)->owner);
+			break;
+		case DI_PACKED:
+			share_push(&stack, ((di_packed_t *)p)->owner);
+			break;
+		case DI_SLICE:
+			share_push(&stack,
+			           di_from_pointer(&((di_slice_t *)p)->parent->header));
+			break;
+		case DI_ARRAY:
+			{
+				aadeque_t *arr = (aadeque_t *)p;
+				for (i = 0; i < aadeque_len(arr); i++)
+					share_push(&stack, aadeque_get(arr, i));
+				if (arr->twin)
+					share_push(&stack, di_from_pointer(&arr->twin->header));
+				break;
+			}
+		case DI_VECTOR:
+			{
+				di_vector_t *vec = (di_vector_t *)p;
+				if (vec->root)
+					share_vnode(&stack, vec->root, vec->shift);
+				break;
+			}
+		case DI_DICT:
+			{
+				struct oaht *ht = (struct oaht *)p;
+				struct oaht_entry *entries = oaht_entries(ht);
+				for (i = 0; i < ht->fill; i++) {
+					struct oaht_entry *entry = &entries[i];
+					if (!OAHT_IS_DELETED_KEY(entry->key)) {
+						share_push(&stack, entry->key);
+						share_push(&stack, entry->value);
+					}
+				}
+				if (ht->twin)
+					share_push(&stack, di_from_pointer(&ht->twin->header));
+				break;
+			}
+		case DI_SHAPED:
+			{
+				di_shaped_t *d = (di_shaped_t *)p;
+				for (i = 0; i < d->shape->len; i++)
+					share_push(&stack, d->values[i]);
+				break;
+			}
+		case DI_HAMT:
+			share_hnode(&stack, ((di_hamt_t *)p)->root, 0);
+			break;
+		case DI_FUN:
+			{
+				di_fun_t *f = (di_fun_t *)p;
+				for (i = 0; i < f->env_size; i++)
+					share_push(&stack, f->env[i]);
+				break;
+			}
+		case DI_TASK:
+			break; // its function and arguments are already shared
+		case DI_REGEX:
+			share_push(&stack, ((di_regex_t *)p)->pattern);
+			break;
+		default:
+			DIE("Unexpected type");
+		}
+	}
+	free(stack.values);
+	return di_keep(v);
+}
@@ -13,13 +13,19 @@
  *   - integers (32-bit)
  *   - booleans and null
  *   - short strings (up to 6 bytes)
+ *   - atoms (interned strings, pointing to immortal strings)
  *   - empty array (maybe TODO)
  *   - empty dict (maybe TODO)
  *
  * Large values using pointers to reference-counted allocated memory:
  *
  *   - aadeque for arrays
+ *   - slices of arrays, as views into arrays
+ *   - persistent vectors for large arrays which are updated while shared
+ *   - packed arrays of only ints, only doubles or only bytes
  *   - oaht for dicts
+ *   - shapes and values for small dicts
+ *   - HAMTs for large dicts which are updated while shared
  *   - length-prefixed strings
  *
  * Memory handling scheme:
@@ -36,13 +42,24 @@
 #define DI_H
 
 typedef struct di_tagged {
-	char     tag;
-	unsigned refc;
+	char          tag;
+	unsigned char flags;
+	unsigned      refc;
 } di_tagged_t;
 
+// Flags in di_tagged_t
+#define DI_SHARED 0x1 // Shared between threads; see di_share()
+#define DI_UNTERMINATED 0x2 // A view whose chars aren't followed by a nul byte
+
 #define DI_STRING 0x5
+#define DI_EXTSTRING 0x6 // A string whose chars are in an external buffer
 #define DI_ARRAY  0x10
+#define DI_SLICE  0x11 // An array which is a view into another array
+#define DI_VECTOR 0x12 // A large array stored as a persistent tree
+#define DI_PACKED 0x13 // An array of unboxed ints, doubles or bytes
 #define DI_DICT   0x20
+#define DI_SHAPED 0x21 // A small dict stored as a shared key layout and values
+#define DI_HAMT   0x22 // A large dict stored as a persistent hash trie
 
 #define NANBOX_POINTER_TYPE di_tagged_t*
 
@@ -56,6 +73,10 @@ typedef struct di_tagged {
 #include "nanbox.h"
 #include "nanbox_shortstring.h"
 
+// Atoms point to immortal dynstr strings.
+#define NANBOX_ATOM_TYPE struct dynstr*
+#include "nanbox_atom.h"
+
 // Now, our type is di_t
 typedef unsigned di_size_t;
 
@@ -74,12 +95,197 @@ static inline bool di_is_dict(di_t v);
 //bool di_is_boolean(di_t v);
 //bool di_is_null(di_t v);
 
-/*-------------*
- * Alloc debug *
- *-------------*/
+/*--------*
+ * Arenas *
+ *--------*/
+
+// An arena is a region from which memory is bump-allocated. While an arena is
+// entered, all values are allocated from it. Memory freed in an arena is only
+// reused within the arena; it's all returned to the system at once when the
+// arena is destroyed, without visiting the values. Ref-counters work as usual,
+// so in-place updates are still safe. Values in an arena must not be used after
+// the arena is destroyed.
+//
+// An arena belongs to the thread which created it. Only that thread can enter
+// it and use its values, so each thread can have arenas of its own. If another
+// thread frees a value of the arena anyway, its memory isn't reused until the
+// arena is destroyed.
+typedef struct di_arena di_arena_t;
+
+// Creates an empty arena.
+di_arena_t *di_arena_create(void);
+
+// Makes an arena the current one of the calling thread, i.e. the one new values
+// are allocated from. Returns the previous current arena (or NULL). Entering
+// NULL means allocating using malloc, e.g. for values that must outlive the
+// current arena.
+di_arena_t *di_arena_enter(di_arena_t *arena);
+
+// Frees all memory allocated in an arena. If it's the current arena, NULL is
+// entered.
+void di_arena_destroy(di_arena_t *arena);
+
+/*-------------------------------------------------------------*
+ * Allocation functions, used by dynstr, oaht and aadeque and  *
+ * for other allocated values                                  *
+ *-------------------------------------------------------------*/
+
+#include <stdlib.h>
+
+// Used internally by the allocation functions below.
+extern __thread di_arena_t *di_current_arena;
+void *di_arena_alloc(di_arena_t *arena, size_t size);
+void *di_arena_realloc(di_arena_t *arena, void *ptr, size_t size,
+                       size_t oldsize);
+void di_arena_free(di_arena_t *arena, void *ptr, size_t size);
+
+// Arena memory is allocated in chunks aligned to DI_ARENA_REGION bytes, and
+// di_arena_map has the arena of each such region of the address space, in
+// leaves of DI_ARENA_LEAF regions which are allocated when an arena first uses
+// them. It's shared by all threads.
+#define DI_ARENA_REGION_BITS 16
+#define DI_ARENA_LEAF_BITS 16
+#define DI_ARENA_ADDRESS_BITS 48
+#define DI_ARENA_REGION ((size_t)1 << DI_ARENA_REGION_BITS)
+#define DI_ARENA_LEAF ((size_t)1 << DI_ARENA_LEAF_BITS)
+extern di_arena_t **di_arena_map[(size_t)1 << (DI_ARENA_ADDRESS_BITS -
+                                               DI_ARENA_REGION_BITS -
+                                               DI_ARENA_LEAF_BITS)];
+
+// Returns the arena ptr was allocated from, in any thread, or NULL if it
+// wasn't allocated from an arena.
+static inline di_arena_t *di_arena_of(void *ptr) {
+	size_t region = (uintptr_t)ptr >> DI_ARENA_REGION_BITS;
+	di_arena_t **leaf = __atomic_load_n(&di_arena_map[region >>
+	                                                  DI_ARENA_LEAF_BITS],
+	                                    __ATOMIC_ACQUIRE);
+	if (!leaf)
+		return NULL;
+	return __atomic_load_n(&leaf[region & (DI_ARENA_LEAF - 1)],
+	                       __ATOMIC_RELAXED);
+}
+
+// With DI_POOL_ALLOC defined, blocks of up to DI_POOL_MAX bytes (small dicts,
+// arrays and strings) are allocated from thread-local pools with one free list
+// per size class, instead of using malloc. A block of that size must be freed
+// by di_free and resized by di_realloc, with its correct size.
+#ifdef DI_POOL_ALLOC
+#define DI_POOL_MAX 256
+void *di_pool_alloc(size_t size);
+void *di_pool_realloc(void *ptr, size_t size, size_t oldsize);
+void di_pool_free(void *ptr, size_t size);
+#endif
+
+// With DI_ALLOC_COUNT defined, the allocation functions below count the calls
+// and the number of bytes requested, e.g. for benchmarks.
+#ifdef DI_ALLOC_COUNT
+typedef struct di_alloc_counters {
+	unsigned long long allocs, reallocs, frees, bytes;
+} di_alloc_counters_t;
+extern di_alloc_counters_t di_alloc_counters;
+#define DI_COUNT_ALLOC(counter, size) \
+	(di_alloc_counters.counter++, di_alloc_counters.bytes += (size))
+#else
+#define DI_COUNT_ALLOC(counter, size) ((void)0)
+#endif
+
+// With DI_STATS defined (make STATS=1), the runtime keeps statistics for
+// finding out which updates copy values instead of updating them in place. See
+// di_stats(). The counters of the objects are per tag, e.g. DI_DICT. Each
+// thread counts in di_thread_stats and adds its counts to the process' totals
+// in di_thread_cleanup(). The live bytes are counted for the whole process.
+#ifdef DI_STATS
+#define DI_STATS_TAGS 128 // the tags are chars
+
+typedef struct di_tag_stats {
+	unsigned long long created;   // objects allocated, including clones
+	unsigned long long freed;     // objects freed when the last ref is dropped
+	unsigned long long cloned;    // updates which copied a shared object
+	unsigned long long reused;    // updates done in place
+	unsigned long long noop_sets; // dict sets to the value already there
+} di_tag_stats_t;
+
+typedef struct di_stats_counters {
+	unsigned long long allocs, reallocs, frees, bytes;
+	di_tag_stats_t tags[DI_STATS_TAGS];
+} di_stats_counters_t;
+
+extern __thread di_stats_counters_t di_thread_stats;
+extern long long di_live_bytes, di_peak_bytes;
+
+// Adds to the live bytes. (Used internally)
+static inline void di_stats_live(long long delta) {
+	long long live = __atomic_add_fetch(&di_live_bytes, delta,
+	                                    __ATOMIC_RELAXED);
+	long long peak = __atomic_load_n(&di_peak_bytes, __ATOMIC_RELAXED);
+	while (live > peak &&
+	       !__atomic_compare_exchange_n(&di_peak_bytes, &peak, live, true,
+	                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+#define DI_STAT(tag, counter) \
+	(di_thread_stats.tags[(unsigned char)(tag) % DI_STATS_TAGS].counter++)
+#define DI_STATS_ALLOC(counter, size, delta) \
+	(di_thread_stats.counter++, di_thread_stats.bytes += (size), \
+	 di_stats_live(delta))
+#else
+#define DI_STAT(tag, counter) ((void)0)
+#define DI_STATS_ALLOC(counter, size, delta) ((void)0)
+#endif
+
+// Returns the statistics kept with DI_STATS, as a dict, or null if DI_STATS
+// isn't defined. The keys are "allocs", "reallocs" and "frees", the numbers of
+// calls to di_alloc(), di_realloc() and di_free(), "bytes", the bytes requested
+// by di_alloc() and di_realloc(), "live_bytes" and "peak_bytes", the bytes
+// allocated and not freed now and at most, and "types", a dict with the counts
+// per type of object which has any, e.g. "dict", "shaped" and "hamt" for the
+// layouts of dicts. The counts are "created", "freed", "cloned", "reused" and
+// "noop_sets"; see di_tag_stats_t. The counts of other threads are only
+// included once they have called di_thread_cleanup(). Building the dict isn't
+// counted, except in the live bytes.
+di_t di_stats(void);
+
+static inline void *di_alloc(size_t size) {
+	DI_COUNT_ALLOC(allocs, size);
+	DI_STATS_ALLOC(allocs, size, (long long)size);
+	if (di_current_arena)
+		return di_arena_alloc(di_current_arena, size);
+#ifdef DI_POOL_ALLOC
+	if (size <= DI_POOL_MAX)
+		return di_pool_alloc(size);
+#endif
+	return malloc(size);
+}
+
+static inline void *di_realloc(void *ptr, size_t size, size_t oldsize) {
+	DI_COUNT_ALLOC(reallocs, size);
+	DI_STATS_ALLOC(reallocs, size, (long long)size - (long long)oldsize);
+	di_arena_t *arena = di_arena_of(ptr);
+	if (arena)
+		return di_arena_realloc(arena, ptr, size, oldsize);
+#ifdef DI_POOL_ALLOC
+	if (size <= DI_POOL_MAX || oldsize <= DI_POOL_MAX)
+		return di_pool_realloc(ptr, size, oldsize);
+#endif
+	return realloc(ptr, size);
+}
+
+static inline void di_free(void *ptr, size_t size) {
+	DI_COUNT_ALLOC(frees, 0);
+	DI_STATS_ALLOC(frees, 0, -(long long)size);
+	di_arena_t *arena = di_arena_of(ptr);
+	if (arena)
+		di_arena_free(arena, ptr, size);
+#ifdef DI_POOL_ALLOC
+	else if (size <= DI_POOL_MAX)
+		di_pool_free(ptr, size);
+#endif
+	else
+		free(ptr);
+}
 
 #ifdef DI_ALLOC_DEBUG
-	#include <stdlib.h>
 	#include <stdio.h>
 	static inline void * debug_alloc(size_t n) {
 		void * p = malloc(n);
@@ -107,6 +313,18 @@ static inline bool di_is_dict(di_t v);
 	#define AADEQUE_ALLOC(sz) debug_alloc(sz)
 	#define AADEQUE_REALLOC(p, sz, oldsz) debug_realloc((p), (sz))
 	#define AADEQUE_FREE(p, sz) debug_free(p)
+#else
+	#define DYNSTR_ALLOC(sz) di_alloc(sz)
+	#define DYNSTR_REALLOC(p, sz, oldsz) di_realloc((p), (sz), (oldsz))
+	#define DYNSTR_FREE(p, sz) di_free((p), (sz))
+
+	#define OAHT_ALLOC(sz) di_alloc(sz)
+	#define OAHT_REALLOC(p, sz, oldsz) di_realloc((p), (sz), (oldsz))
+	#define OAHT_FREE(p, sz) di_free((p), (sz))
+
+	#define AADEQUE_ALLOC(sz) di_alloc(sz)
+	#define AADEQUE_REALLOC(p, sz, oldsz) di_realloc((p), (sz), (oldsz))
+	#define AADEQUE_FREE(p, sz) di_free((p), (sz))
 #endif
 
 
@@ -116,9 +334,20 @@ static inline bool di_is_dict(di_t v);
 
 void di_error(di_t message);
 
-// Returns true if a == b, but also for identical strings, arrays, hashtables
+// Returns true if a == b, but also for identical strings, arrays, hashtables.
+// Two arrays or dicts whose hashes are both cached are unequal if the hashes
+// differ, without comparing the contents.
 static inline bool di_equal(di_t a, di_t b);
 
+// Returns the hash of a value. Equal values have equal hashes. The hash of a
+// heap-allocated string, an array or a dict is computed once and cached in the
+// value, until it's modified. (Slices don't cache it.)
+uint64_t di_hash(di_t key);
+
+// Returns a 64-bit hash of some bytes. It isn't seeded, so it's the same in
+// every run, e.g. for naming files after their contents.
+uint64_t di_hash_chars(const char *chars, di_size_t length);
+
 /*---------------------------------------------------------------------------*
  * Reference-counter functions. These are necessary to use properly for      *
  * pointer types. For immidiate values, they are optional (no-op).           *
@@ -136,6 +365,70 @@ static inline void di_decref_and_free(di_t a);
 // Free if the reference-counter is zero
 static inline void di_cleanup(di_t a);
 
+/*
+ * Sharing values between threads. The reference-counters are normally updated
+ * without synchronisation, so a value can only be used by one thread at a time.
+ * di_share() marks a value and everything it contains as shared. The
+ * reference-counters of shared objects are updated atomically and shared
+ * objects are never updated in place by more than one thread, so a shared value
+ * can be used by any number of threads without copying it. Objects created
+ * from a shared value, e.g. by updating it, aren't shared and are updated in
+ * place as usual, until they're shared themselves.
+ *
+ * Every thread using a shared value must hold its own reference to it: hand a
+ * reference to another thread using di_incref() and release it in that thread
+ * using di_decref_and_free(). Strings, arrays and dicts don't change when
+ * they're shared, except for their reference-counters. Values allocated in an
+ * arena must not be shared.
+ */
+
+// Marks v and all values it contains as shared. Returns v as a reference which
+// is counted by the reference-counter, i.e. with the reference-counter
+// incremented, so that the caller can release it with di_decref_and_free()
+// like the other threads. Already shared values inside v aren't visited again,
+// so sharing a value which contains a large shared value is cheap.
+di_t di_share(di_t v);
+
+// True if v is a shared heap-allocated value.
+static inline bool di_is_shared(di_t v);
+
+// Arrays and dicts are freed iteratively, so freeing a deep structure doesn't
+// overflow the stack. In deferred mode, freeing a value only does a bounded
+// amount of work. The rest is queued and done by later frees or by
+// di_drain_frees(). This avoids long pauses when dropping large values.
+void di_defer_frees(bool defer);
+
+// Does up to budget units of the queued freeing work (releasing one element or
+// one dict entry each), or all of it if budget is 0. Returns true if there is
+// work left.
+bool di_drain_frees(di_size_t budget);
+
+// Does the queued freeing work of the calling thread and frees the queue. A
+// thread which has used values should call it before exiting.
+void di_thread_cleanup(void);
+
+/*
+ * Borrowed pointers. A borrowed pointer to an object is equivalent to a regular
+ * pointer to it with the reference-counter incremented by one, without writing
+ * to the object. It's used for passing a value to a function which returns
+ * before the caller frees it. A borrowed pointer is never freed, reused or
+ * stored by the functions in this library and it's never returned from them.
+ * The reference-counter functions above are no-ops for borrowed pointers.
+ *
+ * A result which refers to the object, such as a slice of it or a container it
+ * has been stored in, holds a regular reference. Releasing that reference frees
+ * the object if its reference-counter drops to zero, so borrow objects with
+ * refc 0 only for calls which don't return such results.
+ *
+ * From nanbox, we've got these directly:
+ *
+ *     di_t di_borrow(di_t v);       // returns a borrowed pointer (or v)
+ *     bool di_is_borrowed(di_t v);
+ *     di_t di_unborrow(di_t v);     // returns the regular pointer (or v)
+ *
+ * Note that di_unborrow() doesn't touch the reference-counter.
+ */
+
 /*------------------*
  * String functions *
  *------------------*/
@@ -155,6 +448,46 @@ di_t di_string_from_chars(const char *chars, di_size_t length);
 
 static inline di_t di_string_from_cstring(const char *chars);
 
+// Creates a string of the length bytes at chars without copying them, e.g. for
+// a memory-mapped file. The bytes must be followed by a nul byte and must not
+// change while the string is alive. When the string is freed, release(chars,
+// length) is called. Such a string is never modified in place. Strings of up
+// to 6 bytes are copied and released immediately. (Strings in an arena are
+// not freed one by one, so release is not called when the arena is destroyed.)
+di_t di_string_from_external(char *chars, di_size_t length,
+                             void (*release)(char *chars, di_size_t length));
+
+// Creates a string of the length bytes at chars, which are in the memory of
+// another value, owner, e.g. a part of a string read from a file, without
+// copying them. The string holds a reference to owner, which keeps the bytes
+// alive. The bytes must be followed by a nul byte. Strings of up to 6 bytes are
+// copied. Frees owner if its refc is zero and the string doesn't refer to it.
+di_t di_string_view(di_t owner, const char *chars, di_size_t length);
+
+// Creates a string of the length bytes of the string s, starting at the
+// zero-based byte index start, without copying them, like di_string_view().
+// The string refers to s, or to the value s is a view into. Unlike in other
+// strings, the bytes aren't followed by a nul byte unless the substring ends
+// where s ends; see di_string_is_terminated(). Strings of up to 6 bytes are
+// copied. Frees s if its refc is zero and the string doesn't refer to it.
+di_t di_string_subview(di_t s, di_size_t start, di_size_t length);
+
+// Returns the interned string (atom) with the given contents. Strings of up to
+// 6 bytes are returned as short strings. Longer ones are stored once in a global
+// table and never freed. Atoms are strings like any other, but two atoms can be
+// compared by their bit patterns and their hashes are precomputed. Since they
+// are never freed, they're meant for a fixed vocabulary, such as dict keys and
+// keywords, and not for strings from the input, such as identifiers.
+di_t di_atom(const char *chars, di_size_t length);
+
+// Returns the atom with the given contents if it's been interned, or a short
+// string if length is up to 6, or else null. Doesn't add to the table, so it
+// can be used for strings from any source, e.g. to match the names of a fixed
+// vocabulary.
+di_t di_atom_find(const char *chars, di_size_t length);
+
+static inline di_t di_atom_from_cstring(const char *chars);
+
 // Appends length chars to s. Reuses the memory of s if its reference counter
 // is zero.
 di_t di_string_append_chars(di_t s, const char *chars, di_size_t length);
@@ -183,9 +516,22 @@ di_t di_string_resize(di_t string, di_size_t length);
  * Array functions
  *-----------------*/
 
+// When an array or a dict of at least DI_PERSISTENT_MIN elements is updated
+// while it's shared, the result is stored as a persistent tree instead of as a
+// copy. The updated versions then share most of their memory and updating one
+// of them while it's shared costs O(log n) instead of O(n).
+#ifndef DI_PERSISTENT_MIN
+#define DI_PERSISTENT_MIN 1024
+#endif
+
 // Creates an empty array
 di_t di_array_empty(void);
 
+// Creates an array of the n values, with no spare capacity. The array takes
+// over the values, as if they were pushed one by one. If they are all ints or
+// all doubles, the array is packed (see below).
+di_t di_array_from_values(const di_t *values, di_size_t n);
+
 // Returns the number of elements in an array
 di_size_t di_array_length(di_t array);
 
@@ -208,11 +554,14 @@ di_t di_array_set(di_t array, di_size_t index, di_t value);
 
 // Returns an array of length length, starting at start. The interval must be
 // within valid indices of the array. Frees or reuses the memory of array if its
-// ref-counter is zero.
+// ref-counter is zero. If the array is shared, the result is a view into it,
+// which is copied only when it's modified. (A slice of a persistent array is a
+// copy.)
 di_t di_array_slice(di_t array, di_size_t start, di_size_t length);
 
 // Concatenates two arrays. Returns the new array. Frees or reuses the memory of
-// a1 and a2 if their ref-counters are zero.
+// a1 and a2 if their ref-counters are zero. The elements of an unshared a2 are
+// moved to the new array.
 di_t di_array_concat(di_t a1, di_t a2);
 
 // Add an element at the end of an array. Points a to the new array to the new
@@ -242,13 +591,77 @@ void di_array_unshift(di_t * a, di_t v);
 // array.
 di_t di_array_shift(di_t * a);
 
+/*
+ * Packed and numeric arrays
+ */
+
+// An array of only ints, only doubles or only bytes can be packed, i.e. stored
+// without boxing its elements. It behaves like any other array, but storing a
+// value of another kind in it, shifting or unshifting turns it into a generic
+// array. Bytes are ints from 0 to 255. A packed array is copied instead of
+// sliced or turned into a persistent tree when it's updated while it's shared.
+
+// Create packed arrays of n ints, doubles or bytes, copied from a buffer.
+di_t di_array_from_ints(const int32_t *ints, di_size_t n);
+di_t di_array_from_doubles(const double *doubles, di_size_t n);
+di_t di_array_from_bytes(const char *bytes, di_size_t n);
+
+// Create packed arrays of n ints, doubles or bytes in the memory of another
+// value, owner, without copying them, like di_string_view(). The elements must
+// be aligned and in native byte order. The array is copied when it's modified.
+// Frees owner if its refc is zero and the array doesn't refer to it.
+di_t di_array_view_ints(di_t owner, const int32_t *ints, di_size_t n);
+di_t di_array_view_doubles(di_t owner, const double *doubles, di_size_t n);
+di_t di_array_view_bytes(di_t owner, const char *bytes, di_size_t n);
+
+// Returns the contents of a packed byte array, or NULL if the array is not one.
+// The pointer is valid until the array is modified or freed.
+const char *di_array_bytes(di_t array);
+
+// The kinds of packed arrays.
+#define DI_PACKED_INT    1
+#define DI_PACKED_DOUBLE 2
+#define DI_PACKED_BYTE   3
+
+// Returns the elements of a packed array and stores its kind in *kind, or
+// returns NULL if the array is not packed. The pointer is valid until the array
+// is modified or freed.
+const void *di_array_packed_data(di_t array, unsigned *kind);
+
+// Returns the sum of the numbers in an array. The sum of ints is an int if it
+// fits, otherwise a double. If there's a double in the array, the sum is a
+// double.
+di_t di_array_sum(di_t array);
+
+// Return the smallest and the largest number in an array, or undefined if the
+// array is empty.
+di_t di_array_min(di_t array);
+di_t di_array_max(di_t array);
+
+// Returns an array of each element op operand, where op is '+', '-', '*' or
+// '/'. The '/' operator and operations on doubles return doubles. Operations
+// on two ints return an int if the result fits, otherwise a double. Frees or
+// reuses the memory of array if its ref-counter is zero.
+di_t di_array_map_op(di_t array, char op, di_t operand);
+
 /*--------------------------------*
  * Dict (JSON "object") functions *
  *--------------------------------*/
 
+// A small dict with short string or atom keys is stored as a shape, a list of
+// keys shared with other dicts having the same keys in the same order, and the
+// values. It turns into a hash table when needed. Iteration order is the
+// insertion order for a shaped dict and unspecified otherwise.
+
 // creates an empty dict
 di_t di_dict_empty(void);
 
+// Creates a dict of n key-value pairs, stored as key, value, key, value, ...
+// in entries. The dict is allocated with room for all of them. The dict takes
+// over the keys and values, as if they were set one by one, so if a key occurs
+// more than once, the last value wins.
+di_t di_dict_from_entries(const di_t *entries, di_size_t n);
+
 // Returns the number of entries in the dict
 di_size_t di_dict_size(di_t dict);
 
@@ -261,6 +674,8 @@ di_t di_dict_get(di_t dict, di_t key);
 // Associates key with value. Returns the new dict. Frees or reuses the memory
 // of dict if its reference counter is zero. If the key and/or value are already
 // present in the dict, their memory is free'd if their ref-counters are zero.
+// Setting a key to the value it already has is a no-op, but arrays and dicts
+// only count as the same value if they're the same object.
 di_t di_dict_set(di_t dict, di_t key, di_t value);
 
 // Deletes the key if it exists. Returns the new dict. Frees or reuses the
@@ -272,7 +687,8 @@ di_t di_dict_delete(di_t dict, di_t key);
 // key or null if the dict didn't contain the key. Note that the dict is
 // provided as a pointer which is updated to point at the updated dict. To tell
 // if the key didn't exist or if it was mapped to the value null, compare the
-// size of the dict before and after.
+// size of the dict before and after. Frees key if its reference counter is
+// zero.
 di_t di_dict_pop(di_t *dict, di_t key);
 
 /*
@@ -302,18 +718,32 @@ di_size_t di_dict_iter(di_t dict, di_size_t pos, di_t *key, di_t *value);
 
 // Pointer types
 static inline bool di_is_string(const di_t v)  {
-	if (di_is_shortstring(v))
+	if (di_is_shortstring(v) || di_is_atom(v))
 		return true;
 	return di_is_pointer(v) &&
-	       di_to_pointer(v)->tag == DI_STRING;
+	       (di_to_pointer(v)->tag == DI_STRING ||
+	        di_to_pointer(v)->tag == DI_EXTSTRING);
+}
+// True if the chars of a string are followed by a nul byte, i.e. it's neither
+// a short string nor a view made by di_string_subview() which isn't at the end.
+static inline bool di_string_is_terminated(di_t v) {
+	assert(di_is_string(v));
+	if (di_is_shortstring(v))
+		return false;
+	return !di_is_pointer(v) || !(di_to_pointer(v)->flags & DI_UNTERMINATED);
 }
 static inline bool di_is_array(di_t v) {
 	return di_is_pointer(v) &&
-	       di_to_pointer(v)->tag == DI_ARRAY;
+	       (di_to_pointer(v)->tag == DI_ARRAY ||
+	        di_to_pointer(v)->tag == DI_SLICE ||
+	        di_to_pointer(v)->tag == DI_VECTOR ||
+	        di_to_pointer(v)->tag == DI_PACKED);
 }
 static inline bool di_is_dict(di_t v) {
 	return di_is_pointer(v) &&
-	       di_to_pointer(v)->tag == DI_DICT;
+	       (di_to_pointer(v)->tag == DI_DICT ||
+	        di_to_pointer(v)->tag == DI_SHAPED ||
+	        di_to_pointer(v)->tag == DI_HAMT);
 }
 
 /*---------*
@@ -323,30 +753,49 @@ static inline bool di_is_dict(di_t v) {
 bool di_ptr_equal(di_t v1, di_t v2);
 
 // Returns true if v1 == v2, but also for strings, arrays and hashtables
-// with identical contents
+// with identical contents. An atom can only be equal to itself or to a non-atom
+// string with the same contents.
 static inline bool di_equal(di_t v1, di_t v2) {
-	if (!di_is_pointer(v1))
-		return di_raw_value(v1) == di_raw_value(v2); // TODO: && !di_is_nan(v1);
-	if (!di_is_pointer(v2))
-		return false;
 	if (di_raw_value(v1) == di_raw_value(v2))
-		return true;
-	return di_ptr_equal(v1, v2);
+		return true; // TODO: && !di_is_nan(v1);
+	if (di_is_pointer(v1))
+		return (di_is_pointer(v2) || di_is_atom(v2)) && di_ptr_equal(v1, v2);
+	if (di_is_atom(v1))
+		return di_is_pointer(v2) && di_ptr_equal(v1, v2);
+	return false;
 }
 
 /*--------*
  * String *
  *--------*/
 
-// using dynstr for > 6 bytes long strings
-#define DYNSTR_HEADER di_tagged_t header;
+// using dynstr for > 6 bytes long strings. The hash is cached in the header
+// (0 = not computed yet) and is reset whenever the string is resized.
+#define DYNSTR_HEADER di_tagged_t header; uint32_t hash;
 #define DYNSTR_SIZE_T di_size_t
 #include "dynstr.h"
 
+// A string with its chars in an external buffer. The first fields are the same
+// as in a dynstr, so the length and the cached hash are accessed the same way.
+typedef struct di_extstring {
+	DYNSTR_HEADER
+	di_size_t len;
+	char *chars;
+	void (*release)(char *chars, di_size_t length); // or NULL
+	di_t owner; // for a view, the value the chars are in, otherwise null
+} di_extstring_t;
+
+// The chars of a heap-allocated string. (Used internally)
+static inline char *di_heap_string_chars(di_tagged_t *p) {
+	return p->tag == DI_STRING ? dynstr_chars((dynstr_t *)p)
+	                           : ((di_extstring_t *)p)->chars;
+}
+
 // This must be a macro, to be able to return a pointer into its own argument.
 #define di_string_chars(string) \
 	(di_is_shortstring(string) ? di_shortstring_chars(&(string)) \
-	                           : dynstr_chars((dynstr_t *)di_to_pointer(string)))
+	 : di_is_atom(string)      ? dynstr_chars(di_to_atom(string)) \
+	                           : di_heap_string_chars(di_to_pointer(string)))
 
 // Returns an empty string
 static inline di_t di_string_empty(void) {
@@ -357,42 +806,77 @@ static inline di_t di_string_from_cstring(const char *chars) {
 	return di_string_from_chars(chars, strlen(chars));
 }
 
+static inline di_t di_atom_from_cstring(const char *chars) {
+	return di_atom(chars, strlen(chars));
+}
+
 /*--------------------*
  * Reference-counters *
  *--------------------*/
 
 // Init tag and refc for any tagged type (used internally)
 static inline void di_init_tagged(di_tagged_t *tagged, char tag) {
-	tagged->tag  = tag;
-	tagged->refc = 0;
+	DI_STAT(tag, created);
+	tagged->tag   = tag;
+	tagged->flags = 0;
+	tagged->refc  = 0;
+}
+
+// True for a regular (not borrowed) pointer. (Used internally)
+static inline bool di_is_owned_pointer(di_t v) {
+	return di_is_pointer(v) && !di_is_borrowed(v);
+}
+
+// The reference-counter of a shared object is updated atomically. The other
+// threads' releases must be visible before an object is freed or reused, hence
+// the acquire and release orders. (Used internally)
+static inline void di_tagged_incref(di_tagged_t *p) {
+	if (p->flags & DI_SHARED)
+		__atomic_add_fetch(&p->refc, 1, __ATOMIC_RELAXED);
+	else
+		p->refc++;
+}
+
+static inline unsigned di_tagged_decref(di_tagged_t *p) {
+	if (p->flags & DI_SHARED)
+		return __atomic_sub_fetch(&p->refc, 1, __ATOMIC_ACQ_REL);
+	return --p->refc;
+}
+
+static inline unsigned di_tagged_refc(di_tagged_t *p) {
+	if (p->flags & DI_SHARED)
+		return __atomic_load_n(&p->refc, __ATOMIC_ACQUIRE);
+	return p->refc;
+}
+
+static inline bool di_is_shared(di_t v) {
+	return di_is_pointer(v) && (di_to_pointer(v)->flags & DI_SHARED);
 }
 
 // Increment reference-counter
 static inline void di_incref(di_t v) {
-	if (di_is_pointer(v))
-		di_to_pointer(v)->refc++;
+	if (di_is_owned_pointer(v))
+		di_tagged_incref(di_to_pointer(v));
 }
 
 // Decrement reference-counter
 static inline void di_decref(di_t v) {
-	if (di_is_pointer(v))
-		di_to_pointer(v)->refc--;
+	if (di_is_owned_pointer(v))
+		di_tagged_decref(di_to_pointer(v));
 }
 
+// Non-inline helper used by di_cleanup().
+void di_ptr_free(di_t v);
+
 // Decrement reference-counter and free memory if it reaches zero.
 static inline void di_decref_and_free(di_t v) {
-	if (di_is_pointer(v)) {
-		di_to_pointer(v)->refc--;
-		di_cleanup(v);
-	}
+	if (di_is_owned_pointer(v) && di_tagged_decref(di_to_pointer(v)) == 0)
+		di_ptr_free(v);
 }
 
-// Non-inline helper used by di_cleanup().
-void di_ptr_free(di_t v);
-
 // Free if the reference-counter is zero
 static inline void di_cleanup(di_t v) {
-	if (di_is_pointer(v) && di_to_pointer(v)->refc == 0)
+	if (di_is_owned_pointer(v) && di_tagged_refc(di_to_pointer(v)) == 0)
 		di_ptr_free(v);
 }
 
@@ -39,8 +39,6 @@
 
   Terminology used in this file:
 
-  Set = a dict with elements as keys and null as values.
-
   Varset = a dict of variables with their names as the keys and their access
   types as values. The access type is initially set to "bind" for a variable
   bound in a pattern, "first" for the first access to the bound variable or
@@ -49,14 +47,21 @@
   last access. "Bind" may be replaced by "discard" if a variable is never
   accessed.
 
-  Scope = a dict with variable/function names as keys. The values are only used
-  in the case of functions. For function, the value is a dict where the keys are
-  the variables captured in the closure environment. All the captured variables
-  are marked as accessed in the expression. For variables other than functions,
-  the value is non-null (for example true).
+  While annotating, a varset is a bitset (varset_t): each variable name in the
+  tree is numbered once, before annotating, and a varset has one bit per
+  variable, followed by one bit per variable for the ones whose access type is
+  "bind". No varset (NULL) is different from an empty one. A node whose varset
+  is unchanged from that of a child shares the child's dict.
+
+  Scope = the variables and functions bound in a block or a clause. A function
+  is a variable with an environment: the variables captured in its closure.
+  All the captured variables are marked as accessed where the function is
+  accessed.
 
-  Nested scope = an array of scopes. The innermost scope is the first element
-  in the array.
+  Nested scope = the stack of the bindings of all the scopes. Each variable's
+  current binding is found by its number. A binding which shadows an outer one
+  is pushed on the stack with the outer one, which is restored when the inner
+  scope ends.
 */
 
 /*
@@ -139,70 +144,435 @@
 #include "di_debug.h"
 #include <stdarg.h>
 #include <stdio.h>
-
-static di_t create_block_scope(di_t es);
-static di_t block(di_t es, di_t *scopes);
-static di_t expr_or_let(di_t e, di_t *scopes);
-static di_t exprs(di_t es, di_t *scopes);
-static di_t expr(di_t e, di_t *scopes);
-static di_t patterns(di_t ps, di_t *scopes);
-static di_t pattern(di_t p, di_t *scopes);
-static di_t clauses(di_t cs, di_t *scopes);
-
-static bool mark_last_access_in_seq(di_t *es, di_t varname);
-static bool mark_last_access(di_t *e, di_t varname);
-static void mark_last_accesses(di_t *e, di_t varset);
-
-static di_t varset_union(di_t e1, di_t e2);
-static di_t varset_union3(di_t e1, di_t e2, di_t e3);
-static di_t set_varset(di_t e, di_t varset);
-static di_t get_varset(di_t e); // e: dict with a "varset" key or array of such dicts
-
-// Set datatype using dicts, ignoring the values (FIXME we need the values...)
-static di_t setunion(di_t a, di_t b);
-//static di_t setinter(di_t a, di_t b);
-static di_t dict_diff(di_t a, di_t b);
-
-static void error_expr_format(di_t e, const char *format, ...);
+#include <stdlib.h>
 
 // Simple construction of di strings
-#define str(arg) di_string_from_cstring(arg)
+#define str(arg) di_atom_from_cstring(arg)
 
 // For use with printf functions
 #define PRIstr "%.*s"
 #define FMTstr(s) di_string_length(s), di_string_chars(s)
 
-// Nested scope to set (list of dicts => dict)
-#define UNUSED inline // prevents unused warning
-static UNUSED di_t nested_scope_to_set(di_t scopes) {
-    di_t set = di_dict_empty();
-    di_size_t n = di_array_length(scopes);
-    for (di_size_t i = 0; i < n; i++) {
-        set = setunion(set, di_array_get(scopes, i));
+/*
+ * Bitsets
+ */
+
+typedef uint64_t bits_t;
+
+// A varset: the members, followed by the members whose access type is "bind",
+// and the varset as a dict, which is shared by the nodes with this varset.
+typedef struct {
+    di_t dict;     // A counted reference, or null if not made yet
+    bits_t bits[]; // 2 * words
+} varset_t;
+
+// The words of a bitset are handled VARSET_LANES at a time, using the vector
+// extensions of GCC and Clang if available. The number of words is a multiple
+// of VARSET_LANES.
+#define VARSET_LANES 4
+
+#if (defined(__GNUC__) && __GNUC__ >= 9 || defined(__clang__)) && \
+    !defined(DI_NO_SIMD)
+#define VARSET_SIMD 1
+typedef uint64_t vbits_t
+    __attribute__((vector_size(VARSET_LANES * sizeof(bits_t))));
+#endif
+
+// x |= y. Returns true if x changed.
+static bool or_bits(bits_t *x, const bits_t *y, size_t words) {
+    size_t i;
+#ifdef VARSET_SIMD
+    vbits_t u, v, changed = {0};
+    for (i = 0; i < words; i += VARSET_LANES) {
+        memcpy(&u, &x[i], sizeof(u));
+        memcpy(&v, &y[i], sizeof(v));
+        changed |= v & ~u;
+        u |= v;
+        memcpy(&x[i], &u, sizeof(u));
+    }
+    for (i = 1; i < VARSET_LANES; i++)
+        changed[0] |= changed[i];
+    return changed[0] != 0;
+#else
+    bits_t changed = 0;
+    for (i = 0; i < words; i++) {
+        changed |= y[i] & ~x[i];
+        x[i] |= y[i];
     }
-    return set;
+    return changed != 0;
+#endif
 }
 
-// Lookup a variable name in a nested scope. Returns null if the variable isn't
-// found.
-static di_t lookup_nested_scope(di_t name, di_t *scopes) {
-    di_size_t n = di_array_length(*scopes);
-    for (di_size_t i = 0; i < n; i++) {
-        di_t scope = di_array_get(*scopes, i);
-        di_t value = di_dict_get(scope, name);
-        if (!di_is_null(value))
-            return value;
+// x &= ~y. Returns true if x changed.
+static bool andnot_bits(bits_t *x, const bits_t *y, size_t words) {
+    size_t i;
+#ifdef VARSET_SIMD
+    vbits_t u, v, changed = {0};
+    for (i = 0; i < words; i += VARSET_LANES) {
+        memcpy(&u, &x[i], sizeof(u));
+        memcpy(&v, &y[i], sizeof(v));
+        changed |= u & v;
+        u &= ~v;
+        memcpy(&x[i], &u, sizeof(u));
+    }
+    for (i = 1; i < VARSET_LANES; i++)
+        changed[0] |= changed[i];
+    return changed[0] != 0;
+#else
+    bits_t changed = 0;
+    for (i = 0; i < words; i++) {
+        changed |= x[i] & y[i];
+        x[i] &= ~y[i];
+    }
+    return changed != 0;
+#endif
+}
+
+static inline bool has_bit(const bits_t *x, int i) {
+    return (x[i / 64] >> (i % 64)) & 1;
+}
+
+static inline void set_bit(bits_t *x, int i) {
+    x[i / 64] |= (bits_t)1 << (i % 64);
+}
+
+// Returns the index of the first set bit of x[0..words) from index i, or -1.
+// Loop over the bits using for (i = -1; (i = next_bit(x, words, i + 1)) >= 0;).
+static int next_bit(const bits_t *x, size_t words, int i) {
+    size_t w = (size_t)i / 64;
+    if (w >= words)
+        return -1;
+    bits_t word = x[w] >> (i % 64) << (i % 64);
+    while (!word) {
+        if (++w == words)
+            return -1;
+        word = x[w];
+    }
+#if defined(__GNUC__) || defined(__clang__)
+    return (int)(w * 64) + __builtin_ctzll(word);
+#else
+    for (i = 0; !((word >> i) & 1); i++)
+        ;
+    return (int)(w * 64) + i;
+#endif
+}
+
+/*
+ * The annotator
+ */
+
+// The current binding of a variable.
+struct binding {
+    bool bound;    // In scope
+    bool func;     // A function whose environment is known
+    varset_t *env; // If func, the variables captured in its closure, or NULL
+};
+
+// A binding on the stack of nested scopes, with the one it shadows.
+struct saved {
+    int var;
+    struct binding shadowed;
+};
+
+typedef struct {
+    di_t names;               // {name: number}
+    di_t namelist;            // [name]
+    size_t words;             // The words of members and binds of a varset
+    struct binding *bindings; // Indexed by number
+    struct saved *stack;      // The nested scope
+    size_t nstack, capstack;
+    di_t *warnings;           // Array of messages, or NULL to print them
+} annotator_t;
+
+static di_t block(annotator_t *a, di_t es, varset_t **vs);
+static di_t expr_or_let(annotator_t *a, di_t e, varset_t **vs);
+static di_t exprs(annotator_t *a, di_t es, varset_t **vs);
+static di_t expr(annotator_t *a, di_t e, varset_t **vs);
+static di_t patterns(annotator_t *a, di_t ps, varset_t **vs);
+static di_t pattern(annotator_t *a, di_t p, varset_t **vs);
+static di_t clauses(annotator_t *a, di_t cs, varset_t **vs);
+
+static bool mark_last_access_in_seq(annotator_t *a, di_t *es, di_t varname);
+static bool mark_last_access(annotator_t *a, di_t *e, di_t varname);
+
+static void error_expr_format(di_t e, const char *format, ...);
+static void warning(annotator_t *a, const char *message);
+
+static void number_name(annotator_t *a, di_t name) {
+    if (!di_dict_contains(a->names, name)) {
+        a->names = di_dict_set(a->names, name,
+                               di_from_int(di_array_length(a->namelist)));
+        di_array_push(&a->namelist, name);
+    }
+}
+
+// Numbers the variable and function names in a parse tree.
+static void number_names(annotator_t *a, di_t e) {
+    di_t key, value;
+    di_size_t i;
+    if (di_is_array(e)) {
+        for (i = 0; i < di_array_length(e); i++)
+            number_names(a, di_array_get(e, i));
+        return;
+    }
+    di_t syntax = di_dict_get(e, str("syntax"));
+    if (di_equal(syntax, str("lit")))
+        return;
+    if (di_equal(syntax, str("var")))
+        number_name(a, di_dict_get(e, str("name")));
+    di_t defs = di_dict_get(e, str("defs"));
+    for (i = 0; di_is_dict(defs) && (i = di_dict_iter(defs, i, &key, NULL));)
+        number_name(a, key);
+    for (i = 0; (i = di_dict_iter(e, i, NULL, &value));)
+        if (di_is_array(value) || di_is_dict(value))
+            number_names(a, value);
+}
+
+static void annotator_init(annotator_t *a, di_t ast) {
+    a->names = di_dict_empty();
+    a->namelist = di_array_empty();
+    number_names(a, ast);
+    size_t n = di_array_length(a->namelist);
+    size_t lanes = (n + 64 * VARSET_LANES - 1) / (64 * VARSET_LANES);
+    a->words = (lanes ? lanes : 1) * VARSET_LANES;
+    a->bindings = calloc(n ? n : 1, sizeof(struct binding));
+    a->stack = NULL;
+    a->nstack = a->capstack = 0;
+    if (!a->bindings)
+        di_error(str("Out of memory"));
+}
+
+static void annotator_destroy(annotator_t *a) {
+    assert(a->nstack == 0);
+    free(a->bindings);
+    free(a->stack);
+    di_cleanup(a->names);
+    di_cleanup(a->namelist);
+}
+
+static inline int number(annotator_t *a, di_t name) {
+    return di_to_int(di_dict_get(a->names, name));
+}
+
+static inline di_t var_name(annotator_t *a, int i) {
+    return di_array_get(a->namelist, i);
+}
+
+/*
+ * Varsets
+ */
+
+// Returns an empty varset.
+static varset_t *varset_new(annotator_t *a) {
+    varset_t *vs = calloc(1, sizeof(varset_t) + 2 * a->words * sizeof(bits_t));
+    if (!vs)
+        di_error(str("Out of memory"));
+    vs->dict = di_null();
+    return vs;
+}
+
+static void varset_free(varset_t *vs) {
+    if (vs) {
+        di_decref_and_free(vs->dict);
+        free(vs);
+    }
+}
+
+// Returns a varset with one variable.
+static varset_t *varset_single(annotator_t *a, int i, bool bind) {
+    varset_t *vs = varset_new(a);
+    set_bit(vs->bits, i);
+    if (bind)
+        set_bit(vs->bits + a->words, i);
+    return vs;
+}
+
+// Forgets the dict of a varset which has changed.
+static void varset_changed(varset_t *vs) {
+    di_decref_and_free(vs->dict);
+    vs->dict = di_null();
+}
+
+// Returns the union of two varsets, consuming them. A variable in both keeps
+// its access type in vs1. The others get the access type "access", unless one
+// of the varsets is NULL, in which case the other one is returned unchanged.
+static varset_t *varset_union(annotator_t *a, varset_t *vs1, varset_t *vs2) {
+    if (!vs1)
+        return vs2;
+    if (!vs2)
+        return vs1;
+    if (or_bits(vs1->bits, vs2->bits, a->words))
+        varset_changed(vs1);
+    varset_free(vs2);
+    return vs1;
+}
+
+static varset_t *varset_union3(annotator_t *a, varset_t *vs1, varset_t *vs2,
+                               varset_t *vs3) {
+    return varset_union(a, varset_union(a, vs1, vs2), vs3);
+}
+
+// Removes the members of scope from vs. Used when exiting a local scope.
+static varset_t *varset_diff(annotator_t *a, varset_t *vs,
+                             const varset_t *scope) {
+    if (vs && andnot_bits(vs->bits, scope->bits, a->words)) {
+        andnot_bits(vs->bits + a->words, scope->bits, a->words);
+        varset_changed(vs);
+    }
+    return vs;
+}
+
+// Returns the varset as a dict, or null if it's NULL.
+static di_t varset_dict(annotator_t *a, varset_t *vs) {
+    if (!vs)
+        return di_null();
+    if (di_is_null(vs->dict)) {
+        di_t dict = di_dict_empty();
+        int i;
+        for (i = -1; (i = next_bit(vs->bits, a->words, i + 1)) >= 0;) {
+            bool bind = has_bit(vs->bits + a->words, i);
+            dict = di_dict_set(dict, var_name(a, i),
+                               str(bind ? "bind" : "access"));
+        }
+        di_incref(dict);
+        vs->dict = dict;
+    }
+    return vs->dict;
+}
+
+// Sets the "varset" key of expression e to varset, or deletes the key if varset
+// is NULL.
+static di_t set_varset(annotator_t *a, di_t e, varset_t *vs) {
+    if (!vs)
+        return di_dict_delete(e, str("varset"));
+    else
+        return di_dict_set(e, str("varset"), varset_dict(a, vs));
+}
+
+/*
+ * Scopes
+ */
+
+// Binds a variable in the innermost scope.
+static void bind(annotator_t *a, int i) {
+    if (a->nstack == a->capstack) {
+        a->capstack = a->capstack ? 2 * a->capstack : 64;
+        a->stack = realloc(a->stack, a->capstack * sizeof(struct saved));
+        if (!a->stack)
+            di_error(str("Out of memory"));
+    }
+    a->stack[a->nstack].var = i;
+    a->stack[a->nstack].shadowed = a->bindings[i];
+    a->nstack++;
+    a->bindings[i].bound = true;
+    a->bindings[i].func = false;
+    a->bindings[i].env = NULL;
+}
+
+// Ends the scope which started when the nested scope had start bindings.
+// Returns the set of variables bound in it.
+static varset_t *end_scope(annotator_t *a, size_t start) {
+    varset_t *scope = varset_new(a);
+    while (a->nstack > start) {
+        struct saved *s = &a->stack[--a->nstack];
+        set_bit(scope->bits, s->var);
+        varset_free(a->bindings[s->var].env);
+        a->bindings[s->var] = s->shadowed;
+    }
+    return scope;
+}
+
+// Adds variable i and the variables its closure (if any) captures,
+// recursively, to the varset acc. If any variable is free, an "undefined
+// variable" error is raised.
+static void add_accessed(annotator_t *a, int i, bits_t *acc, di_t orig_expr) {
+    if (has_bit(acc, i))
+        return; // We've already explored this path.
+    struct binding *b = &a->bindings[i];
+    if (!b->bound) {
+        di_t varname = var_name(a, i);
+        error_expr_format(orig_expr, "Undefined variable "PRIstr,
+                          FMTstr(varname));
+    }
+    set_bit(acc, i);
+    if (b->func && b->env) {
+        // This is a function. Here, the closure is instanciated (if it's not
+        // already instantiated, which we only know at runtime) and the closure
+        // variables are thereby possibly accessed.
+        //
+        //     somevar = ["some", "data"]
+        //     if a then map(f, xs)         -- maybe instanciate f
+        //          else null               -- (access somevar and othervar)
+        //     if b then map(f, ys)         -- maybe instanciate f
+        //          else null               -- (access somevar and othervar)
+        //     f(x) = [x, somevar, g()]
+        //     g() = [othervar]
+        //
+        int j;
+        for (j = -1; (j = next_bit(b->env->bits, a->words, j + 1)) >= 0;)
+            add_accessed(a, j, acc, orig_expr);
     }
-    return di_null();
 }
 
+// Marks the last access of each variable in scope in the sequence es (see
+// mark_last_access_in_seq()), where vss are the varsets of the elements. The
+// elements are searched backwards, once.
+static void mark_last_accesses_in_seq(annotator_t *a, di_t *es,
+                                      varset_t **vss, const varset_t *scope) {
+    size_t size = a->words * sizeof(bits_t);
+    bits_t *left = malloc(2 * size), *found = left + a->words;
+    if (!left)
+        di_error(str("Out of memory"));
+    memcpy(left, scope->bits, size);
+    di_size_t i = di_array_length(*es);
+    int j;
+    while (i-- > 0 && next_bit(left, a->words, 0) >= 0) {
+        if (!vss[i])
+            continue;
+        // found = left & vss[i], left = left & ~vss[i]
+        memcpy(found, left, size);
+        andnot_bits(left, vss[i]->bits, a->words);
+        andnot_bits(found, left, a->words);
+        if (next_bit(found, a->words, 0) < 0)
+            continue;
+        // Take out e from es to enable in-place updates of e without copying.
+        di_t e = di_array_get(*es, i);
+        di_incref(e);
+        *es = di_array_set(*es, i, di_null());
+        di_decref(e);
+        for (j = -1; (j = next_bit(found, a->words, j + 1)) >= 0;) {
+            bool success = mark_last_access(a, &e, var_name(a, j));
+            assert(success);
+        }
+        *es = di_array_set(*es, i, e);
+    }
+    if ((j = next_bit(left, a->words, 0)) >= 0) {
+        di_debug("Failed to mark last access of ", var_name(a, j));
+        di_debug("... in seq ", *es);
+    }
+    assert(j < 0);
+    free(left);
+}
+
+/*
+ * Annotating
+ */
+
 di_t di_annotate(di_t ast) {
-    di_t scopes = di_array_empty();
+    return di_annotate_warnings(ast, NULL);
+}
+
+di_t di_annotate_warnings(di_t ast, di_t *warnings) {
+    annotator_t a;
+    varset_t *vs;
     if (!di_equal(str("do"), di_dict_get(ast, str("syntax")))) {
         di_error(str("Unexpected parse tree. A block is expected on top level."));
     }
-    ast = block(ast, &scopes);
-    di_cleanup(scopes);
+    annotator_init(&a, ast);
+    a.warnings = warnings;
+    ast = block(&a, ast, &vs);
+    varset_free(vs);
+    annotator_destroy(&a);
     return ast;
 }
 
@@ -212,25 +582,30 @@ di_t di_annotate(di_t ast) {
 // - "env": a dict of variables captured from the surrounding scope (values
 //   unspecified)
 // - "varset": added in each clause and in expressions and patterns
-static di_t funcdef(di_t def, di_t *scopes) {
+//
+// The env is returned in *env.
+static di_t funcdef(annotator_t *a, di_t def, varset_t **env) {
     di_t cs = di_dict_get(def, str("clauses"));
-    cs = clauses(cs, scopes);
-    di_t env = get_varset(cs);
+    cs = clauses(a, cs, env);
     def = di_dict_set(def, str("clauses"), cs);
-    def = di_dict_set(def, str("env"), env); // TODO? rename "env" to "varset"?
+    def = di_dict_set(def, str("env"), varset_dict(a, *env)); // TODO? rename "env" to "varset"?
     return def;
 }
 
 // The top-level sequence of expressions and definitions or the body of a 'do'
 // expression. Returns an annotated one. The nested scope is not modified, since
 // variables are bound in an inner scope which is gone when the function return.
-static di_t block(di_t block, di_t *scopes) {
+static di_t block(annotator_t *a, di_t block, varset_t **vs) {
     di_t defs = di_dict_pop(&block, str("defs"));
+    size_t start = a->nstack;
 
-    // Create a scope with the function definitions in this block first. They
-    // can be defined in any order.
-    di_t scope = create_block_scope(defs);
-    di_array_unshift(scopes, scope);
+    // Bind the function definitions in this block first. They can be defined
+    // in any order. We allow out-of-order function definitions, but not
+    // variable bindings.
+    di_t name;
+    int i;
+    for (i = 0; (i = di_dict_iter(defs, i, &name, NULL)) != 0;)
+        bind(a, number(a, name));
 
     // Check the function defintions and get their closure environments, i.e.
     // accesses to variables outside their local scope, so we can check that all
@@ -240,50 +615,47 @@ static di_t block(di_t block, di_t *scopes) {
     //     y = 2
     //     f(x) = x + y
     //
-    di_t name;
-    for (int i = 0; (i = di_dict_iter(defs, i, &name, NULL)) != 0;) {
+    for (i = 0; (i = di_dict_iter(defs, i, &name, NULL)) != 0;) {
         di_t def = di_dict_pop(&defs, name);
-        def = funcdef(def, scopes);
+        varset_t *env;
+        def = funcdef(a, def, &env);
         defs = di_dict_set(defs, name, def);
 
-        // Update the function's entry in the local scope reflect the variables
-        // the function depends on (if any), so we can check that we don't
-        // access the closure before their environment variables are bound.
-        di_t env = di_dict_get(def, str("env"));
-        di_t scope = di_array_shift(scopes);
-        di_t scope_value = di_is_null(env) ? di_dict_empty() : env;
-        scope = di_dict_set(scope, name, scope_value);
-        di_array_unshift(scopes, scope);
+        // Update the function's binding to reflect the variables the function
+        // depends on (if any), so we can check that we don't access the
+        // closure before their environment variables are bound.
+        struct binding *b = &a->bindings[number(a, name)];
+        b->func = true;
+        b->env = env;
     }
     block = di_dict_set(block, str("defs"), defs);
 
     // The sequence of expressions including let (or match) expressions
     di_t es = di_dict_pop(&block, str("seq"));
-    for (di_size_t i = 1, n = di_array_length(es); i <= n; i++) {
+    di_size_t j, n = di_array_length(es);
+    varset_t **vss = malloc((n ? n : 1) * sizeof(varset_t *));
+    if (!vss)
+        di_error(str("Out of memory"));
+    for (j = 0; j < n; j++) {
         di_t e = di_array_shift(&es);
-        e = expr_or_let(e, scopes); // this differs from exprs()
+        e = expr_or_let(a, e, &vss[j]); // this differs from exprs()
         di_array_push(&es, e);
     }
 
     // End of the variable scope. Mark the first (TODO) and last accesses of
     // each of the variables that go out of scope. Detect unused variables.
-    scope = di_array_shift(scopes);
-    di_size_t j = 0;
-    di_t varname;
-    while ((j = di_dict_iter(scope, j, &varname, NULL)) != 0) {
-        bool found = mark_last_access_in_seq(&es, varname);
-        if (!found) {
-            di_debug("Failed to mark last access of ", varname);
-            di_debug("... in seq ", es);
-            di_debug("... where outer scopes are ", *scopes);
-        }
-        assert(found);
-    }
+    varset_t *scope = end_scope(a, start);
+    mark_last_accesses_in_seq(a, &es, vss, scope);
 
     // Set varset, the accesses of variables bound outside the block, to that of
     // seq (defs are included in seq) minus the local scope.
-    di_t varset = dict_diff(get_varset(es), scope);
-    block = set_varset(block, varset);
+    *vs = NULL;
+    for (j = 0; j < n; j++)
+        *vs = varset_union(a, *vs, vss[j]);
+    *vs = varset_diff(a, *vs, scope);
+    varset_free(scope);
+    free(vss);
+    block = set_varset(a, block, *vs);
 
     block = di_dict_set(block, str("seq"), es);
 
@@ -291,20 +663,26 @@ static di_t block(di_t block, di_t *scopes) {
 }
 
 // a sequence of expressions, such as the args in a function call.
-static di_t exprs(di_t es, di_t *scopes) {
+static di_t exprs(annotator_t *a, di_t es, varset_t **vs) {
+    *vs = NULL;
     for (di_size_t i = 0, n = di_array_length(es); i < n; i++) {
         di_t e = di_array_shift(&es);
-        e = expr(e, scopes);
+        varset_t *evs;
+        e = expr(a, e, &evs);
+        *vs = varset_union(a, *vs, evs);
         di_array_push(&es, e);
     }
     return es;
 }
 
 // a sequence of patterns, such as the parameters in a function definition.
-static di_t patterns(di_t ps, di_t *scopes) {
+static di_t patterns(annotator_t *a, di_t ps, varset_t **vs) {
+    *vs = NULL;
     for (di_size_t i = 0, n = di_array_length(ps); i < n; i++) {
         di_t p = di_array_shift(&ps);
-        p = pattern(p, scopes);
+        varset_t *pvs;
+        p = pattern(a, p, &pvs);
+        *vs = varset_union(a, *vs, pvs);
         di_array_push(&ps, p);
     }
     return ps;
@@ -312,21 +690,23 @@ static di_t patterns(di_t ps, di_t *scopes) {
 
 // x = y is not really an expression. It is only allowed in a do block and on
 // top-level. A sequence on the form `x = y; e` means `let x = y in e`.
-static di_t expr_or_let(di_t e, di_t *scopes) {
+static di_t expr_or_let(annotator_t *a, di_t e, varset_t **vs) {
     di_t op = di_dict_get(e, str("syntax"));
     if (di_equal(op, str("="))) {
         di_t left = di_dict_get(e, str("left"));
         di_t right = di_dict_get(e, str("right"));
+        varset_t *lvs, *rvs;
         // LHS is a pattern which binds variables in current scope, but not
         // in the scope of RHS! (That's letrec and we don't have that.)
         // RHS: expression
-        right = expr(right, scopes);
-        left = pattern(left, scopes);
-        e = set_varset(e, varset_union(left, right));
+        right = expr(a, right, &rvs);
+        left = pattern(a, left, &lvs);
+        *vs = varset_union(a, lvs, rvs);
+        e = set_varset(a, e, *vs);
         e = di_dict_set(e, str("left"), left);
         e = di_dict_set(e, str("right"), right);
     } else {
-        e = expr(e, scopes);
+        e = expr(a, e, vs);
     }
     return e;
 }
@@ -358,216 +738,148 @@ static bool is_operator(di_t op) {
 // The patterns bind variables in a local scope. This function adds a "varset"
 // key to each clause, containing only the vars with a scope outside the
 // clauses.
-static di_t clauses(di_t cs, di_t *scopes) {
+static di_t clauses(annotator_t *a, di_t cs, varset_t **vs) {
     di_size_t n = di_array_length(cs);
+    *vs = NULL;
     for (di_size_t i = 0; i < n; i++) {
         di_t c = di_array_shift(&cs);
         // Push local scope
-        di_t scope = di_dict_empty();
-        di_array_unshift(scopes, scope);
+        size_t start = a->nstack;
         // Patterns bind vars in local scope
         di_t pats = di_dict_pop(&c, str("pats"));
         di_t body = di_dict_pop(&c, str("body"));
-        di_debug("Scopes clause patterns: ", *scopes);
-        pats = patterns(pats, scopes);
-        di_debug("Scopes before body: ", *scopes);
-        body = expr(body, scopes);
+        varset_t *pvs, *bvs;
+        pats = patterns(a, pats, &pvs);
+        body = expr(a, body, &bvs);
         // Pop local scope
-        scope = di_array_shift(scopes);
-        di_incref(scope);
-        // First set varset of clause including local scope (we'll remove it later)
-        di_t varset = varset_union(pats, body);
-        c = set_varset(c, varset);
-        c = di_dict_set(c, str("pats"), pats);
-        c = di_dict_set(c, str("body"), body);
-        // mark last accesses
-        mark_last_accesses(&c, scope);
+        varset_t *scope = end_scope(a, start);
+        // Mark last accesses, in the body or else in the patterns
         // TODO: mark first access
+        int j;
+        for (j = -1; (j = next_bit(scope->bits, a->words, j + 1)) >= 0;) {
+            di_t varname = var_name(a, j);
+            bool found = mark_last_access(a, &body, varname) ||
+                         mark_last_access_in_seq(a, &pats, varname);
+            if (!found) {
+                di_debug("Last access not found for var ", varname);
+                di_debug("... in ... ", c);
+            }
+            assert(found);
+        }
         // Varset of clause = varset of pats and body minus local scope
-        varset = di_dict_pop(&c, str("varset"));
-        di_decref(scope);
-        varset = dict_diff(varset, scope);
-        c = set_varset(c, varset);
+        varset_t *cvs = varset_diff(a, varset_union(a, pvs, bvs), scope);
+        varset_free(scope);
+        c = set_varset(a, c, cvs);
+        c = di_dict_set(c, str("pats"), pats);
+        c = di_dict_set(c, str("body"), body);
+        *vs = varset_union(a, *vs, cvs);
         di_array_push(&cs, c);
     }
     return cs;
 }
 
 // Checks the key-value entries and adds a "varset" key to each entry dict.
-static di_t dict_entries(di_t entries, di_t *scopes,
-                         di_t (*pattern_or_expr)(di_t, di_t*)) {
+static di_t dict_entries(annotator_t *a, di_t entries, varset_t **vs,
+                         di_t (*pattern_or_expr)(annotator_t *, di_t,
+                                                 varset_t **)) {
+    *vs = NULL;
     for (di_size_t i = 0, n = di_array_length(entries); i < n; i++) {
         di_t entry = di_array_shift(&entries);
         assert(di_equal(di_dict_get(entry, str("syntax")), str("entry")));
+        varset_t *kvs, *vvs;
 
         di_t key = di_dict_pop(&entry, str("key"));
-        key = pattern_or_expr(key, scopes);
+        key = pattern_or_expr(a, key, &kvs);
         entry = di_dict_set(entry, str("key"), key);
 
         di_t value = di_dict_pop(&entry, str("value"));
-        value = pattern_or_expr(value, scopes);
+        value = pattern_or_expr(a, value, &vvs);
         entry = di_dict_set(entry, str("value"), value);
 
-        entry = set_varset(entry, varset_union(key, value));
+        varset_t *evs = varset_union(a, kvs, vvs);
+        entry = set_varset(a, entry, evs);
+        *vs = varset_union(a, *vs, evs);
         di_array_push(&entries, entry);
     }
     return entries;
 }
 
-// returns the union of the varset of two expressions or arrays of expressions.
-// (Does not free the arguments.)
-//
-// FIXME 1: Merge accesses properly.
-// FIXME 2: Use the empty dict for the empty varset.
-static di_t varset_union(di_t e1, di_t e2) {
-    return setunion(get_varset(e1), get_varset(e2));
-}
-
-static di_t varset_union3(di_t e1, di_t e2, di_t e3) {
-    return setunion(setunion(get_varset(e1), get_varset(e2)), get_varset(e3));
-}
-
-// Sets the "varset" key of expression e to varset, or deletes the key if varset
-// is null. (TODO: Add immediate value for empty dict and empty array? Then we
-// can just use that instead of a null hack.)
-static di_t set_varset(di_t e, di_t varset) {
-    if (di_is_null(varset))
-        return di_dict_delete(e, str("varset"));
-    else
-        return di_dict_set(e, str("varset"), varset);
-}
-
-// Returns the value of the "varset" key of a dict. For an array, we take the
-// varset of each child and merge them.
-static di_t get_varset(di_t e) {
-    if (di_is_array(e)) {
-        // For array, we get_varset on the elements and merge the results.
-        di_t merged = di_null();
-        di_size_t i, n = di_array_length(e);
-        for (i = 0; i < n; i++) {
-            di_t elem = di_array_get(e, i);
-            di_t varset = di_dict_get(elem, str("varset"));
-            merged = setunion(merged, varset);
-        }
-        return merged;
-    } else if (di_is_dict(e)) {
-        return di_dict_get(e, str("varset"));
-    } else {
-        di_debug("get_varset() invalid arg ", e);
-        assert(0);
-        return di_empty();
-    }
-}
-
-// Adds all recursively accessed vars to varset. Varset_acc are the vars already
-// explored, so we can avoid going into loops. If any variable is free, an
-// "undefined variable" error is raised.
-di_t get_rec_accessed_varset(di_t name, di_t *scopes, di_t varset_acc, di_t orig_expr) {
-    /* di_debug("hello from get_rec_accessed_varset ", name); */
-    /* di_debug("*scopes = ", *scopes); */
-    /* di_debug("varset_acc = ", varset_acc); */
-    /* di_debug("orig_expr = ", orig_expr); */
-    if (di_dict_contains(varset_acc, name)) {
-        return varset_acc; // We've already explored this path.
-    }
-    di_t scope_value = lookup_nested_scope(name, scopes);
-    /* di_debug("scope_value = ", scope_value); */
-    if (di_is_null(scope_value)) {
-        error_expr_format(orig_expr, "Undefined variable "PRIstr, FMTstr(name));
-    }
-    varset_acc = di_dict_set(varset_acc, name, str("access"));
-    if (di_is_dict(scope_value)) {
-        // This is a function. Here, the closure is instanciated (if it's not
-        // already instantiated, which we only know at runtime) and the closure
-        // variables are thereby possibly accessed.
-        //
-        //     somevar = ["some", "data"]
-        //     if a then map(f, xs)         -- maybe instanciate f
-        //          else null               -- (access somevar and othervar)
-        //     if b then map(f, ys)         -- maybe instanciate f
-        //          else null               -- (access somevar and othervar)
-        //     f(x) = [x, somevar, g()]
-        //     g() = [othervar]
-        //
-        di_t key;
-        for (di_size_t i = 0; (i = di_dict_iter(scope_value, i, &key, NULL)) != 0;) {
-            varset_acc = get_rec_accessed_varset(key, scopes, varset_acc, orig_expr);
-        }
-    }
-    return varset_acc;
-}
-
-static di_t expr(di_t e, di_t *scopes) {
+static di_t expr(annotator_t *a, di_t e, varset_t **vs) {
     di_t op = di_dict_get(e, str("syntax"));
+    varset_t *vs1, *vs2, *vs3;
+    *vs = NULL;
     /* di_debug("expr ", op); */
     if (is_operator(op)) {
         di_t right = di_dict_pop(&e, str("right"));
-        right = expr(right, scopes);
+        right = expr(a, right, &vs2);
         di_t left = di_dict_pop(&e, str("left"));
         if (di_is_null(left)) {
             assert(is_unop(op));
-            e = set_varset(e, get_varset(right));
+            *vs = vs2;
         } else {
-            left = expr(left, scopes);
-            e = set_varset(e, varset_union(left, right));
+            left = expr(a, left, &vs1);
+            *vs = varset_union(a, vs1, vs2);
             e = di_dict_set(e, str("left"), left);
         }
+        e = set_varset(a, e, *vs);
         e = di_dict_set(e, str("right"), right);
     } else if (di_equal(op, str("apply"))) {
-        di_t func = expr(di_dict_pop(&e, str("func")), scopes);
-        di_t args = exprs(di_dict_pop(&e, str("args")), scopes);
-        e = set_varset(e, varset_union(func, args));
+        di_t func = expr(a, di_dict_pop(&e, str("func")), &vs1);
+        di_t args = exprs(a, di_dict_pop(&e, str("args")), &vs2);
+        *vs = varset_union(a, vs1, vs2);
+        e = set_varset(a, e, *vs);
         e = di_dict_set(e, str("func"), func);
         e = di_dict_set(e, str("args"), args);
     } else if (di_equal(op, str("case"))) {
         di_t subj = di_dict_pop(&e, str("subj"));
-        subj = expr(subj, scopes);
+        subj = expr(a, subj, &vs1);
         di_t cs = di_dict_pop(&e, str("clauses")); // [{"pats": [pat], "body": expr}]
-        cs = clauses(cs, scopes);
-        e = set_varset(e, varset_union(subj, cs));
+        cs = clauses(a, cs, &vs2);
+        *vs = varset_union(a, vs1, vs2);
+        e = set_varset(a, e, *vs);
         e = di_dict_set(e, str("subj"), subj);
         e = di_dict_set(e, str("clauses"), cs);
     } else if (di_equal(op, str("do"))) {
-        e = block(e, scopes);
+        e = block(a, e, vs);
     } else if (di_equal(op, str("if"))) {
-        di_t cond = expr(di_dict_pop(&e, str("cond")), scopes);
-        di_t if_then = expr(di_dict_pop(&e, str("then")), scopes);
-        di_t if_else = expr(di_dict_pop(&e, str("else")), scopes);
-        e = set_varset(e, varset_union3(cond, if_then, if_else));
+        di_t cond = expr(a, di_dict_pop(&e, str("cond")), &vs1);
+        di_t if_then = expr(a, di_dict_pop(&e, str("then")), &vs2);
+        di_t if_else = expr(a, di_dict_pop(&e, str("else")), &vs3);
+        *vs = varset_union3(a, vs1, vs2, vs3);
+        e = set_varset(a, e, *vs);
         e = di_dict_set(e, str("cond"), cond);
         e = di_dict_set(e, str("then"), if_then);
         e = di_dict_set(e, str("else"), if_else);
     } else if (di_equal(op, str("array"))) {
         di_t elems = di_dict_pop(&e, str("elems"));
-        elems = exprs(elems, scopes);
-        e = set_varset(e, get_varset(elems));
+        elems = exprs(a, elems, vs);
+        e = set_varset(a, e, *vs);
         e = di_dict_set(e, str("elems"), elems);
-        /* if (!di_is_array(elems)) { */
-        /*     printf("%s:%d: Dict set destroyed array.\n", __FILE__, __LINE__); */
-        /* } */
     } else if (di_equal(op, str("dict"))) {
         // entries = [{"syntax": "entry", "key":pattern, "value":expr}]
         di_t entries = di_dict_pop(&e, str("entries"));
-        entries = dict_entries(entries, scopes, &expr);
-        e = set_varset(e, get_varset(entries));
+        entries = dict_entries(a, entries, vs, &expr);
+        e = set_varset(a, e, *vs);
         e = di_dict_set(e, str("entries"), entries);
     } else if (di_equal(op, str("dictup"))) {
         // subj{k: v, entries...}
         // subj = expr
         // entries = [{"syntax":"entries", "key":pattern, "value":expr}, ...]
         di_t subj = di_dict_pop(&e, str("subj")); // expr
-        subj = expr(subj, scopes);
+        subj = expr(a, subj, &vs1);
         di_t entries = di_dict_pop(&e, str("entries"));
-        entries = dict_entries(entries, scopes, &expr);
-        e = set_varset(e, varset_union(subj, entries));
+        entries = dict_entries(a, entries, &vs2, &expr);
+        *vs = varset_union(a, vs1, vs2);
+        e = set_varset(a, e, *vs);
         e = di_dict_set(e, str("subj"), subj);
         e = di_dict_set(e, str("entries"), entries);
     } else if (di_equal(op, str("var"))) {
         di_t name = di_dict_get(e, str("name"));
         // Check if var (and any other var it depends on) is in scope.
-        di_t varset = get_rec_accessed_varset(name, scopes, di_dict_empty(), e);
+        *vs = varset_new(a);
+        add_accessed(a, number(a, name), (*vs)->bits, e);
         e = di_dict_set(e, str("action"), str("access"));
-        e = di_dict_set(e, str("varset"), varset); // set of accessed variables
+        e = set_varset(a, e, *vs); // set of accessed variables
     } else if (di_equal(op, str("lit"))) {
         // value
         return e;
@@ -581,24 +893,11 @@ static di_t expr(di_t e, di_t *scopes) {
     return e;
 }
 
-static void mark_last_accesses(di_t *e_ptr, di_t varset) {
-    di_t varname;
-    for (di_size_t i = 0; (i = di_dict_iter(varset, i, &varname, NULL)) != 0;) {
-        bool found = mark_last_access(e_ptr, varname);
-        if (!found) {
-            di_debug("Last access not found for var ", varname);
-            di_debug("... in ... ", *e_ptr);
-        }
-        assert(found);
-    }
-    di_cleanup(varset);
-}
-
 // Marks the last access to a variable in a sequence of syntax elements
 // (expressions, patterns, clauses or entries).
 // A boolean is returned indicating if any access was found. If true, the es
 // (expression array) pointer is updated with the last access marked.
-static bool mark_last_access_in_seq(di_t *es, di_t varname) {
+static bool mark_last_access_in_seq(annotator_t *a, di_t *es, di_t varname) {
     // Loop over the expressions backwards. Where the variable last occurs is
     // the last access.
     di_size_t n = di_array_length(*es);
@@ -612,7 +911,7 @@ static bool mark_last_access_in_seq(di_t *es, di_t varname) {
             di_incref(e);
             *es = di_array_set(*es, i, di_null());
             di_decref(e);
-            bool success = mark_last_access(&e, varname);
+            bool success = mark_last_access(a, &e, varname);
             assert(success);
             *es = di_array_set(*es, i, e);
             return true;
@@ -627,7 +926,7 @@ static bool mark_last_access_in_seq(di_t *es, di_t varname) {
 // the variable).
 //
 // Currently, the value of "varset" keys are is not updated. Do we need to do that?
-static bool mark_last_access(di_t *e_ptr, di_t varname) {
+static bool mark_last_access(annotator_t *a, di_t *e_ptr, di_t varname) {
     di_t e = *e_ptr;
     di_t op = di_dict_get(e, str("syntax"));
     di_t varset = di_dict_get(e, str("varset"));
@@ -643,10 +942,13 @@ static bool mark_last_access(di_t *e_ptr, di_t varname) {
         } else if (di_equal(action, str("bind"))) {
             // TODO: Warning or error for unused variable (except if it starts
             // with an underscore).
-            printf("TODO: %d:%d: Warning: Unused variable '" PRIstr "'\n",
-                   di_to_int(di_dict_get(e, str("line"))),
-                   di_to_int(di_dict_get(e, str("column"))),
-                   FMTstr(varname));
+            char buf[256];
+            snprintf(buf, sizeof(buf),
+                     "TODO: %d:%d: Warning: Unused variable '" PRIstr "'",
+                     di_to_int(di_dict_get(e, str("line"))),
+                     di_to_int(di_dict_get(e, str("column"))),
+                     FMTstr(varname));
+            warning(a, buf);
             action = str("discard");
         } else {
             assert(0); // The only possibilities are "access" and "bind" here.
@@ -656,86 +958,86 @@ static bool mark_last_access(di_t *e_ptr, di_t varname) {
         // FIXME
     } else if (di_equal(op, str("="))) {
         di_t left = di_dict_pop(&e, str("left"));
-        if (!mark_last_access(&left, varname)) {
+        if (!mark_last_access(a, &left, varname)) {
             di_t right = di_dict_pop(&e, str("right"));
-            assert(mark_last_access(&right, varname));
+            assert(mark_last_access(a, &right, varname));
             e = di_dict_set(e, str("right"), right);
         }
         e = di_dict_set(e, str("left"), left);
     } else if (is_operator(op)) {
         di_t right = di_dict_pop(&e, str("right"));
-        if (!mark_last_access(&right, varname)) {
+        if (!mark_last_access(a, &right, varname)) {
             di_t left = di_dict_pop(&e, str("left"));
             assert(!di_is_null(left)); // unary operators have no left operand.
-            assert(mark_last_access(&left, varname));
+            assert(mark_last_access(a, &left, varname));
             e = di_dict_set(e, str("left"), left);
         }
         e = di_dict_set(e, str("right"), right);
     } else if (di_equal(op, str("if"))) {
         di_t if_then = di_dict_pop(&e, str("then"));
         di_t if_else = di_dict_pop(&e, str("else"));
-        bool last_then = mark_last_access(&if_then, varname);
-        bool last_else = mark_last_access(&if_else, varname);
+        bool last_then = mark_last_access(a, &if_then, varname);
+        bool last_else = mark_last_access(a, &if_else, varname);
         e = di_dict_set(e, str("then"), if_then);
         e = di_dict_set(e, str("else"), if_else);
         if (!last_then && !last_else) {
             di_t cond = di_dict_pop(&e, str("cond"));
-            assert(mark_last_access(&cond, varname));
+            assert(mark_last_access(a, &cond, varname));
             e = di_dict_set(e, str("cond"), cond);
         }
     } else if (di_equal(op, str("case"))) {
         di_t cs = di_dict_pop(&e, str("clauses"));
-        if (!mark_last_access_in_seq(&cs, varname)) {
+        if (!mark_last_access_in_seq(a, &cs, varname)) {
             di_t subj = di_dict_pop(&e, str("subj"));
-            assert(mark_last_access(&subj, varname));
+            assert(mark_last_access(a, &subj, varname));
             e = di_dict_set(e, str("subj"), subj);
         }
         e = di_dict_set(e, str("clauses"), cs);
     } else if (di_equal(op, str("clause"))) {
         // Case clause
         di_t body = di_dict_pop(&e, str("body"));
-        if (!mark_last_access(&body, varname)) {
+        if (!mark_last_access(a, &body, varname)) {
             di_t pats = di_dict_pop(&e, str("pats"));
-            assert(mark_last_access_in_seq(&pats, varname));
+            assert(mark_last_access_in_seq(a, &pats, varname));
             e = di_dict_set(e, str("pats"), pats);
         }
         e = di_dict_set(e, str("body"), body);
     } else if (di_equal(op, str("apply"))) {
         di_t args = di_dict_pop(&e, str("args"));
-        if (!mark_last_access_in_seq(&args, varname)) {
+        if (!mark_last_access_in_seq(a, &args, varname)) {
             di_t func = di_dict_pop(&e, str("func"));
-            assert(mark_last_access(&func, varname));
+            assert(mark_last_access(a, &func, varname));
             e = di_dict_set(e, str("func"), func);
         }
         e = di_dict_set(e, str("args"), args);
     } else if (di_equal(op, str("array"))) {
         di_t elems = di_dict_pop(&e, str("elems"));
-        assert(mark_last_access_in_seq(&elems, varname));
+        assert(mark_last_access_in_seq(a, &elems, varname));
         e = di_dict_set(e, str("elems"), elems);
     } else if (di_equal(op, str("dict"))) {
         di_t entries = di_dict_pop(&e, str("entries"));
-        assert(mark_last_access_in_seq(&entries, varname));
+        assert(mark_last_access_in_seq(a, &entries, varname));
         e = di_dict_set(e, str("entries"), entries);
     } else if (di_equal(op, str("dictup"))) {
         di_t entries = di_dict_pop(&e, str("entries"));
-        if (!mark_last_access_in_seq(&entries, varname)) {
+        if (!mark_last_access_in_seq(a, &entries, varname)) {
             di_t subj = di_dict_pop(&e, str("subj"));
-            assert(mark_last_access(&subj, varname));
+            assert(mark_last_access(a, &subj, varname));
             e = di_dict_set(e, str("subj"), subj);
         }
         e = di_dict_set(e, str("entries"), entries);
     } else if (di_equal(op, str("entry"))) {
         // Dict entry
         di_t value = di_dict_pop(&e, str("value"));
-        if (!mark_last_access(&value, varname)) {
+        if (!mark_last_access(a, &value, varname)) {
             di_t key = di_dict_pop(&e, str("key"));
-            assert(mark_last_access(&key, varname));
+            assert(mark_last_access(a, &key, varname));
             e = di_dict_set(e, str("key"), key);
         }
         e = di_dict_set(e, str("value"), value);
     } else if (di_equal(op, str("do"))) {
         di_t es = di_dict_pop(&e, str("seq"));
-        assert(mark_last_access_in_seq(&es, varname));
+        assert(mark_last_access_in_seq(a, &es, varname));
         e = di_dict_set(e, str("seq"), es);
     } else {
         // This can't happen. We could assert(0) but we give an error message
@@ -752,39 +1054,21 @@ static bool mark_last_access(di_t *e_ptr, di_t varname) {
     return true;
 }
 
-/* Types:
- *
- * scope        = {name: null | deps, ...} (for variables null; for functions the deps)
- * nested scope = [scope, ...]
- */
-
-// Initializes a scope to the function definitions on this level, so they can be
-// used even if they're defined in the wrong order. We allow out-of-order
-// function definitions, but not variable bindings.
-di_t create_block_scope(di_t defs) {
-    di_t new_scope = di_dict_empty();
-    di_t name;
-    for (int i = 0; (i = di_dict_iter(defs, i, &name, NULL)) != 0;) {
-        new_scope = di_dict_set(new_scope, name, di_true());
-    }
-    return new_scope;
-}
-
-static di_t pattern(di_t e, di_t *scopes) {
+static di_t pattern(annotator_t *a, di_t e, varset_t **vs) {
     di_t op = di_dict_get(e, str("syntax"));
+    varset_t *vs1, *vs2;
+    *vs = NULL;
     if (di_equal(op, str("var"))) {
         di_t name = di_dict_get(e, str("name"));
         if (di_equal(name, str("_"))) {
             return e; // match-all, no variable is bound
         }
-        di_t scope_value = lookup_nested_scope(name, scopes);
+        int i = number(a, name);
         di_t action;
-        if (di_is_null(scope_value)) {
-            di_t scope = di_array_shift(scopes);
-            scope = di_dict_set(scope, name, di_true());
-            di_array_unshift(scopes, scope);
+        if (!a->bindings[i].bound) {
+            bind(a, i);
             action = str("bind");
-        } else if (!di_is_dict(scope_value)) {
+        } else if (!a->bindings[i].func) {
             action = str("access");
         } else {
             // The variable is a function or closure. Supporting this case would
@@ -793,8 +1077,8 @@ static di_t pattern(di_t e, di_t *scopes) {
             error_expr_format(e, "Pattern matching on functions not supported");
         }
         e = di_dict_set(e, str("action"), action);
-        di_t varset = di_dict_set(di_dict_empty(), name, action);
-        e = di_dict_set(e, str("varset"), varset); // accessed or bound variables
+        *vs = varset_single(a, i, di_equal(action, str("bind")));
+        e = set_varset(a, e, *vs); // accessed or bound variables
     } else if (di_equal(op, str("lit"))) {
         return e;
     } else if (di_equal(op, str("regex"))) {
@@ -802,14 +1086,14 @@ static di_t pattern(di_t e, di_t *scopes) {
         return e; // TODO: Find out variable bindings in the pattern.
     } else if (di_equal(op, str("array"))) {
         di_t elems = di_dict_pop(&e, str("elems"));
-        elems = patterns(elems, scopes);
-        e = set_varset(e, get_varset(elems));
+        elems = patterns(a, elems, vs);
+        e = set_varset(a, e, *vs);
         e = di_dict_set(e, str("elems"), elems);
     } else if (di_equal(op, str("dict"))) {
         // entries = [{"syntax": "entry", "key":pattern, "value":expr}]
         di_t entries = di_dict_pop(&e, str("entries"));
-        entries = dict_entries(entries, scopes, &pattern);
-        e = set_varset(e, get_varset(entries));
+        entries = dict_entries(a, entries, vs, &pattern);
+        e = set_varset(a, e, *vs);
         e = di_dict_set(e, str("entries"), entries);
     } else if (di_equal(op, str("dictup"))) {
         // subj{k: v, entries...}
@@ -817,17 +1101,19 @@ static di_t pattern(di_t e, di_t *scopes) {
         // entries = [{"syntax":"entry", "key":pattern, "value":pattern}, ...]
         di_t subj = di_dict_pop(&e, str("subj"));
         di_t entries = di_dict_pop(&e, str("entries"));
-        subj = pattern(subj, scopes);
-        entries = dict_entries(entries, scopes, &pattern);
-        e = set_varset(e, varset_union(subj, entries));
+        subj = pattern(a, subj, &vs1);
+        entries = dict_entries(a, entries, &vs2, &pattern);
+        *vs = varset_union(a, vs1, vs2);
+        e = set_varset(a, e, *vs);
         e = di_dict_set(e, str("subj"), subj);
         e = di_dict_set(e, str("entries"), entries);
     } else if (di_equal(op, str("@")) || di_equal(op, str("~"))) {
         di_t left = di_dict_pop(&e, str("left"));
         di_t right = di_dict_pop(&e, str("right"));
-        left = pattern(left, scopes);
-        right = pattern(right, scopes);
-        e = set_varset(e, varset_union(left, right));
+        left = pattern(a, left, &vs1);
+        right = pattern(a, right, &vs2);
+        *vs = varset_union(a, vs1, vs2);
+        e = set_varset(a, e, *vs);
         e = di_dict_set(e, str("left"), left);
         e = di_dict_set(e, str("right"), right);
     } else {
@@ -837,50 +1123,12 @@ static di_t pattern(di_t e, di_t *scopes) {
     return e;
 }
 
-// -------------------------------------------------------------------
-
-// Set datatype using dicts with null values
-// TODO: merge values "access" (+) "bind" => "access"
-static di_t setunion(di_t a, di_t b) {
-    if (di_is_null(a)) return b;
-    if (di_is_null(b)) return a;
-    di_size_t i = 0;
-    di_t key;
-    while ((i = di_dict_iter(b, i, &key, NULL)) != 0) {
-        if (!di_dict_contains(a, key))
-            a = di_dict_set(a, key, str("access"));
-    }
-    di_cleanup(b);
-    return a;
-}
-/* static di_t setinter(di_t a, di_t b) { */
-/*     di_size_t i = 0; */
-/*     di_t key; */
-/*     di_t c = di_dict_empty(); */
-/*     while ((i = di_dict_iter(a, i, &key, NULL)) != 0) { */
-/*         if (di_dict_contains(b, key)) */
-/*             c = di_dict_set(c, key, di_null()); */
-/*     } */
-/*     di_cleanup(a); */
-/*     di_cleanup(b); */
-/*     return c; */
-/* } */
-
-
-// Returns the dict a minus the keys in b. Used when exiting a local scope b.
-static di_t dict_diff(di_t a, di_t b) {
-    if (di_is_null(a)) {
-        // Nothing to do.
-    } else {
-        di_size_t i = 0;
-        di_t key;
-        while ((i = di_dict_iter(b, i, &key, NULL)) != 0) {
-            if (di_dict_contains(a, key))
-                a = di_dict_delete(a, key);
-        }
-    }
-    di_cleanup(b);
-    return a;
+// Prints a warning, or adds it to the warnings of the annotator.
+static void warning(annotator_t *a, const char *message) {
+    if (a->warnings)
+        di_array_push(a->warnings, di_string_from_cstring(message));
+    else
+        fprintf(stderr, "%s\n", message);
 }
 
 // Raises an error with the location of e and the message given by format and
@@ -896,5 +1144,5 @@ static void error_expr_format(di_t e, const char *format, ...) {
     int written2 = vsnprintf(buf + written1, sizeof(buf) - written1, format, va);
     va_end(va);
     assert(written2 > 0);
-    di_error(str(buf));
+    di_error(di_string_from_cstring(buf));
 }
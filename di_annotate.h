@@ -1,3 +1,9 @@
 #include "di.h"
 
+// Checks and annotates a parse tree returned by di_parse(). Warnings are
+// printed to stderr.
 di_t di_annotate(di_t ast);
+
+// Like di_annotate(), but the warnings are appended to *warnings, an array,
+// as message strings instead of being printed.
+di_t di_annotate_warnings(di_t ast, di_t *warnings);
@@ -0,0 +1,130 @@
+#define _POSIX_C_SOURCE 200809L // mkdir
+#include "di_cache.h"
+#include "di_io.h"
+#include "di_serialize.h"
+#include "di_writer.h"
+#include <stdio.h>
+#include <sys/stat.h>
+
+#define DI_CACHE_VERSION 3
+
+#define HEADER_SIZE 16
+
+static inline di_t str(const char *chars) {
+	return di_atom_from_cstring(chars);
+}
+
+di_t di_module_interface(di_t tree) {
+	di_t functions = di_dict_empty();
+	di_t defs = di_dict_get(tree, str("defs"));
+	di_t name, def;
+	di_size_t i;
+	if (!di_is_dict(defs))
+		defs = di_dict_empty();
+	for (i = 0; (i = di_dict_iter(defs, i, &name, &def));) {
+		di_t info = di_dict_empty();
+		info = di_dict_set(info, str("arity"), di_dict_get(def, str("arity")));
+		info = di_dict_set(info, str("type"), di_null());
+		functions = di_dict_set(functions, name, info);
+	}
+	return di_dict_set(di_dict_empty(), str("functions"), functions);
+}
+
+static void put_le(char *p, uint64_t v, int n) {
+	int i;
+	for (i = 0; i < n; i++)
+		p[i] = (char)(v >> (8 * i));
+}
+
+// Fills in the header of the cache file of a source and returns its name.
+static di_t cache_file(const char *dir, di_t source, char *header) {
+	di_size_t length = di_string_length(source);
+	uint64_t hash = di_hash_chars(di_string_chars(source), length);
+	memcpy(header, "DIC", 3);
+	header[3] = DI_CACHE_VERSION;
+	put_le(header + 4, length, 4);
+	put_le(header + 8, hash, 8);
+	char name[4096];
+	snprintf(name, sizeof(name), "%s/%016llx.dic", dir,
+	         (unsigned long long)hash);
+	return di_string_from_cstring(name);
+}
+
+// Reads the cache file of a source. Returns null if there is none, or if it's
+// for another source or another version.
+static di_t read_cache_file(const char *dir, di_t source) {
+	char header[HEADER_SIZE];
+	di_t filename = cache_file(dir, source, header);
+	di_t data = di_tryreadfile(filename);
+	di_cleanup(filename);
+	if (di_is_null(data))
+		return data;
+	if (di_string_length(data) < HEADER_SIZE ||
+	    memcmp(di_string_chars(data), header, HEADER_SIZE)) {
+		di_cleanup(data);
+		return di_null();
+	}
+	return data;
+}
+
+di_t di_cache_load(const char *dir, di_t source, di_t *interface,
+                   di_t *warnings) {
+	di_t data = read_cache_file(dir, source);
+	if (di_is_null(data))
+		return di_undefined();
+	// The strings and the packed arrays are views into the file. The values
+	// are decoded one after another and must use up the file.
+	const char *chars = di_string_chars(data) + HEADER_SIZE;
+	di_size_t pos = 0, used, length = di_string_length(data) - HEADER_SIZE;
+	di_t values[3];
+	int i;
+	di_incref(data);
+	for (i = 0; i < 3; i++) {
+		values[i] = di_deserialize_lazy_chars(data, chars + pos,
+		                                      length - pos, &used);
+		if (di_is_undefined(values[i]))
+			break;
+		pos += used;
+	}
+	di_decref_and_free(data);
+	if (i < 3 || pos != length || !di_is_array(values[2])) {
+		while (i-- > 0)
+			di_cleanup(values[i]);
+		return di_undefined();
+	}
+	if (interface)
+		*interface = values[0];
+	else
+		di_cleanup(values[0]);
+	*warnings = values[2];
+	return values[1];
+}
+
+di_t di_cache_load_interface(const char *dir, di_t source) {
+	di_t data = read_cache_file(dir, source);
+	if (di_is_null(data))
+		return di_undefined();
+	di_t iface = di_deserialize_chars(di_string_chars(data) + HEADER_SIZE,
+	                                  di_string_length(data) - HEADER_SIZE,
+	                                  NULL);
+	di_cleanup(data);
+	return iface;
+}
+
+bool di_cache_store(const char *dir, di_t source, di_t tree, di_t interface,
+                    di_t warnings) {
+	char header[HEADER_SIZE];
+	di_t filename = cache_file(dir, source, header);
+	di_writer_t w;
+	di_writer_init_string(&w);
+	di_write(&w, header, HEADER_SIZE);
+	bool ok = di_write_serialized(&w, interface) &&
+	          di_write_serialized(&w, tree) &&
+	          di_write_serialized(&w, warnings);
+	di_t data = di_writer_finish_string(&w);
+	mkdir(dir, 0777); // or it exists
+	ok = ok && !di_is_undefined(data) && di_writefile(filename, data);
+	di_cleanup(data);
+	di_cleanup(filename);
+	return ok;
+}
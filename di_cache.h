@@ -0,0 +1,49 @@
+#ifndef DI_CACHE_H
+#define DI_CACHE_H
+
+/*
+ * Front-end cache
+ * ---------------
+ * The annotated parse tree of a module (see di_annotate()), its interface and
+ * the annotator's warnings are stored in a cache directory, in a file named
+ * after a hash of the source. When the same source is compiled again, the tree
+ * is loaded instead of lexing, parsing and annotating the source, and the
+ * warnings are printed again by the caller. The interface of a module can be
+ * loaded without decoding its tree.
+ *
+ * A cache file starts with "DIC" and a format version byte, followed by the
+ * length (4 bytes) and the hash (8 bytes) of the source, little-endian, and
+ * then the interface, the tree and the array of warnings, serialized (see
+ * di_serialize.h), which make up the rest of the file. A file is mapped into
+ * memory when it's loaded, if possible, and the tree is decoded lazily, so its
+ * strings are views into the file. The file stays mapped until they're all
+ * freed. The version is incremented when the parse tree or the format changes,
+ * so that older files are ignored.
+ */
+
+#include "di.h"
+
+// Returns the interface of a module, from its parse tree: a dict with
+// "functions" => a dict of the functions defined at the top level, with their
+// names as keys and {"arity": arity, "type": null} as values. (Types aren't
+// inferred yet.) Does not free tree.
+di_t di_module_interface(di_t tree);
+
+// Returns the cached annotated parse tree of a source, or undefined if it isn't
+// in the cache. If interface isn't NULL, the interface is stored in *interface.
+// The warnings, an array of message strings, are stored in *warnings. Does not
+// free source.
+di_t di_cache_load(const char *dir, di_t source, di_t *interface,
+                   di_t *warnings);
+
+// Returns the cached interface of a source without decoding its tree, or
+// undefined if it isn't in the cache. Does not free source.
+di_t di_cache_load_interface(const char *dir, di_t source);
+
+// Stores the annotated parse tree, the interface and the warnings (see
+// di_annotate_warnings()) of a source in the cache. The directory is created
+// if it doesn't exist. Returns false on error. Frees nothing.
+bool di_cache_store(const char *dir, di_t source, di_t tree, di_t interface,
+                    di_t warnings);
+
+#endif
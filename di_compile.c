@@ -0,0 +1,1325 @@
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "di.h"
+#include "di_compile.h"
+#include "di_writer.h"
+
+/*
+  di_compile(): The back-end of dlc. Translates an annotated parse tree, as
+  returned by di_annotate(), to C code calling the runtime in di.h. The
+  operators are implemented by the inline functions in di_rt.h.
+
+  Each function definition becomes a C function and the top-level code becomes
+  the function module(). A compiled function treats its arguments like the
+  functions in di.h do: an argument whose ref-counter is zero is owned by the
+  callee, which frees it or reuses its memory, and an argument whose
+  ref-counter is non-zero is borrowed. Like them, it never returns a borrowed
+  pointer.
+
+  Reference counting uses the variable actions added by the annotator:
+
+  - A "pinned" variable holds a counted reference to its value, i.e. its ref-
+    counter is incremented when the variable is bound. A variable bound to a
+    fresh value (one which nothing else refers to, such as a new array), to a
+    value which no other variable can own (such as f(1, 2)) or to a function
+    parameter isn't pinned, if it has no accesses other than the last one.
+    Most variables are used only once, so the incref-decref pair is elided
+    for them.
+
+  - An access other than the last passes the value borrowed. At the last access
+    of a pinned variable, its ref-counter is decremented first. Thus, if the
+    variable was the only one referring to the value, it is passed with a ref-
+    counter of zero at the last access, so functions like di_dict_set() and
+    di_array_push() can update it in place.
+
+  - A variable which is bound but never accessed ("discard") is released
+    immediately. A variable consumed in one branch of an if or a case is
+    released at the end of the other branches, and a variable which is still
+    held at the end of its scope is released there.
+
+  - An operand which may be part of the value of a variable consumed by a later
+    operand, like the first argument of f(first(xs), xs), is protected by an
+    incref-decref pair around the operation.
+
+  Literal strings are atoms, created once. Literal arrays and dicts are created
+  presized, by di_array_from_values() and di_dict_from_entries(). Regex
+  patterns are compiled once, with the literals, when the module is loaded. A
+  regex pattern matches a string containing a match of the regex. It doesn't
+  bind any variables yet.
+
+  Not supported yet: closures (functions which access variables in the
+  enclosing scope) and functions as values. They are reported as errors.
+*/
+
+// For "%.*s" in formats. The argument must be an lvalue.
+#define STR(s) (int)di_string_length(s), di_string_chars(s)
+
+// For "%d, %d": the location of a node, for runtime errors.
+#define LOC(e) location(e, "line"), location(e, "column")
+
+static inline di_t str(const char *chars) {
+    return di_atom_from_cstring(chars);
+}
+
+static inline di_t get(di_t e, const char *key) {
+    return di_dict_get(e, str(key));
+}
+
+static inline bool is(di_t e, const char *syntax) {
+    return di_equal(get(e, "syntax"), str(syntax));
+}
+
+static inline int location(di_t e, const char *key) {
+    di_t n = get(e, key);
+    return di_is_int(n) ? di_to_int(n) : 0;
+}
+
+// Raises an error with the location of e and a message formatted like printf.
+static void error_at(di_t e, const char *format, ...) {
+    char buf[256];
+    int n = snprintf(buf, sizeof(buf), "%d:%d: ", LOC(e));
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buf + n, sizeof(buf) - n, format, args);
+    va_end(args);
+    di_error(di_string_from_cstring(buf));
+}
+
+struct var {
+    di_t name;
+    di_t cname;    // The C variable
+    di_t deps;     // Variables whose values this one's may be part of, or null
+    bool pinned;   // It holds a counted reference
+    bool floating; // It isn't pinned and its value is fresh
+    bool held;     // Not yet consumed or released
+};
+
+typedef struct {
+    di_writer_t *w;      // The code being written
+    int indent;
+    di_writer_t protos;  // The function prototypes
+    di_t pool;           // The strings etc. which live until the end
+    di_t lits;           // {string: index} of the literal strings
+    di_t litlist;        // [string] of the literal strings
+    di_t regexes;        // {pattern: index} of the regex patterns
+    di_t relist;         // [C expression] of the regex patterns' strings
+    di_t cnames;         // The C names of the functions, as a set
+    di_t funcs;          // {name: {"cname", "arity"}} of the functions in scope
+    di_t queue;          // [{"def", "cname", "funcs"}] of the functions
+    di_t scope;          // {name: index in vars} of the variables in scope
+    di_t accessed;       // The variables with accesses other than the last
+    struct var *vars;
+    int nvars, capvars;
+    int ntemps, nlabels;
+} compiler_t;
+
+// An operand of an operation
+struct operands {
+    int n;
+    di_t *values;    // C expressions
+    bool *protected; // Protected by an incref until the operation is done
+};
+
+// A value matched against patterns
+struct subject {
+    di_t value;      // C expression
+    bool fresh;      // The value is fresh
+    bool param;      // The value is a function parameter
+    bool keep;       // The value is used afterwards, so it isn't released
+    di_t deps;       // If not fresh, the variables whose values it may be part of
+};
+
+static di_t expr(compiler_t *c, di_t e);
+static di_t seq(compiler_t *c, di_t block);
+
+// Keeps a value until the end of the compilation and returns it.
+static di_t keep(compiler_t *c, di_t value) {
+    di_array_push(&c->pool, value);
+    return value;
+}
+
+// Returns a string formatted like printf, which lives until the end.
+static di_t format(compiler_t *c, const char *format, ...) {
+    di_writer_t w;
+    va_list args;
+    di_writer_init_string(&w);
+    va_start(args, format);
+    di_vwritef(&w, format, args);
+    va_end(args);
+    return keep(c, di_writer_finish_string(&w));
+}
+
+// Writes an indented line of code, formatted like printf.
+static void line(compiler_t *c, const char *format, ...) {
+    va_list args;
+    di_write_spaces(c->w, 4 * c->indent);
+    va_start(args, format);
+    di_vwritef(c->w, format, args);
+    va_end(args);
+    di_write_char(c->w, '\n');
+}
+
+static di_t temp(compiler_t *c) {
+    return format(c, "t%d", ++c->ntemps);
+}
+
+static di_t label(compiler_t *c) {
+    return format(c, "L%d", ++c->nlabels);
+}
+
+// A C identifier for a name, which may contain '$'.
+static di_t mangle(compiler_t *c, const char *prefix, di_t name) {
+    di_writer_t w;
+    const char *chars = di_string_chars(name);
+    di_size_t i, n = di_string_length(name);
+    di_writer_init_string(&w);
+    di_write_cstring(&w, prefix);
+    for (i = 0; i < n; i++) {
+        unsigned char ch = chars[i];
+        if (isalnum(ch))
+            di_write_char(&w, ch);
+        else if (ch == '_')
+            di_write_cstring(&w, "__");
+        else
+            di_writef(&w, "_%02x", ch);
+    }
+    return keep(c, di_writer_finish_string(&w));
+}
+
+// Writes a C string literal.
+static void write_c_string(di_writer_t *w, di_t s) {
+    const char *chars = di_string_chars(s);
+    di_size_t i, n = di_string_length(s);
+    di_write_char(w, '"');
+    for (i = 0; i < n; i++) {
+        unsigned char ch = chars[i];
+        if (ch >= ' ' && ch < 0x7f && ch != '"' && ch != '\\' && ch != '?')
+            di_write_char(w, ch);
+        else
+            di_writef(w, "\\%03o", ch);
+    }
+    di_write_char(w, '"');
+}
+
+static bool is_operator(di_t op) {
+    static const char *ops[] = {"+", "-", "*", "/", "mod", "<", ">", "=<",
+                                ">=", "==", "!=", "and", "or", "not", "~",
+                                "@"};
+    size_t i;
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+        if (di_equal(op, str(ops[i])))
+            return true;
+    return false;
+}
+
+/*
+ * Variables
+ */
+
+static struct var *lookup(compiler_t *c, di_t name) {
+    di_t index = di_dict_get(c->scope, name);
+    return di_is_int(index) ? &c->vars[di_to_int(index)] : NULL;
+}
+
+// Declares a variable bound to value. See the comment at the top.
+static void bind(compiler_t *c, di_t name, di_t value, bool pinned,
+                 bool fresh, di_t deps) {
+    if (c->nvars == c->capvars) {
+        c->capvars = c->capvars ? 2 * c->capvars : 16;
+        c->vars = realloc(c->vars, c->capvars * sizeof(struct var));
+        if (!c->vars)
+            di_error(str("Out of memory"));
+    }
+    struct var *v = &c->vars[c->nvars];
+    v->name = name;
+    v->cname = mangle(c, "v_", name);
+    v->deps = deps;
+    v->pinned = pinned;
+    v->floating = fresh && !pinned;
+    v->held = true;
+    c->scope = di_dict_set(c->scope, name, di_from_int(c->nvars++));
+    line(c, "di_t %.*s = %.*s;", STR(v->cname), STR(value));
+    if (pinned)
+        line(c, "di_incref(%.*s);", STR(v->cname));
+}
+
+// Releases the variables whose held[index] is true. If value may be part of one
+// of them, i.e. one of them is in deps (see value_deps()), it's protected
+// meanwhile.
+static void release(compiler_t *c, const bool *held, int n, di_t value,
+                    di_t deps) {
+    bool any = false, protect = false;
+    int i;
+    for (i = 0; i < n; i++) {
+        any = any || held[i];
+        protect = protect || (held[i] && di_is_dict(deps) &&
+                              di_dict_contains(deps, c->vars[i].name));
+    }
+    if (!any)
+        return;
+    if (protect)
+        line(c, "di_incref(%.*s);", STR(value));
+    for (i = 0; i < n; i++) {
+        if (!held[i])
+            continue;
+        struct var *v = &c->vars[i];
+        line(c, v->pinned ? "di_decref_and_free(%.*s);" : "di_cleanup(%.*s);",
+             STR(v->cname));
+        v->held = false;
+    }
+    if (protect)
+        line(c, "di_decref(%.*s);", STR(value));
+}
+
+// Ends the scope of the variables bound since the scope had start variables.
+// The ones that are still held are released. The value of the scope is value,
+// with the dependencies deps.
+static void end_scope(compiler_t *c, int start, di_t value, di_t deps) {
+    bool *held = calloc(c->nvars + 1, sizeof(bool));
+    int i;
+    for (i = start; i < c->nvars; i++)
+        held[i] = c->vars[i].held;
+    release(c, held, c->nvars, value, deps);
+    free(held);
+    for (i = start; i < c->nvars; i++) {
+        di_t index = di_dict_get(c->scope, c->vars[i].name);
+        if (di_is_int(index) && di_to_int(index) == i)
+            c->scope = di_dict_delete(c->scope, c->vars[i].name);
+    }
+}
+
+// The variables in varset and the ones whose values theirs may be part of.
+static di_t closure(compiler_t *c, di_t varset) {
+    di_t set = di_dict_empty(), name, dep;
+    di_size_t i, j;
+    if (!di_is_dict(varset))
+        return keep(c, set);
+    for (i = 0; (i = di_dict_iter(varset, i, &name, NULL));) {
+        struct var *v = lookup(c, name);
+        if (!v)
+            continue;
+        set = di_dict_set(set, name, di_true());
+        if (di_is_dict(v->deps))
+            for (j = 0; (j = di_dict_iter(v->deps, j, &dep, NULL));)
+                set = di_dict_set(set, dep, di_true());
+    }
+    return keep(c, set);
+}
+
+// True if e contains the last access of a variable in set.
+static bool consumes(di_t e, di_t set) {
+    di_t key, value;
+    di_size_t i;
+    if (di_is_array(e)) {
+        for (i = 0; i < di_array_length(e); i++)
+            if (consumes(di_array_get(e, i), set))
+                return true;
+        return false;
+    }
+    if (!di_is_dict(e))
+        return false;
+    if (is(e, "var"))
+        return di_equal(get(e, "action"), str("last")) &&
+               di_dict_contains(set, get(e, "name"));
+    for (i = 0; (i = di_dict_iter(e, i, &key, &value));)
+        if (!di_equal(key, str("defs")) && !di_equal(key, str("varset")) &&
+            consumes(value, set))
+            return true;
+    return false;
+}
+
+// Adds the variables accessed in e, other than by their last access, to the
+// set c->accessed. Nested functions are not included.
+static void collect_accesses(compiler_t *c, di_t e) {
+    di_t key, value;
+    di_size_t i;
+    if (di_is_array(e)) {
+        for (i = 0; i < di_array_length(e); i++)
+            collect_accesses(c, di_array_get(e, i));
+    } else if (di_is_dict(e) && is(e, "var")) {
+        if (di_equal(get(e, "action"), str("access")))
+            c->accessed = di_dict_set(c->accessed, get(e, "name"), di_true());
+    } else if (di_is_dict(e)) {
+        for (i = 0; (i = di_dict_iter(e, i, &key, &value));)
+            if (!di_equal(key, str("defs")) && !di_equal(key, str("varset")))
+                collect_accesses(c, value);
+    }
+}
+
+// True if the value of e is known to be fresh, i.e. nothing else refers to it.
+// The runtime functions sometimes return one of their arguments, so e.g. the
+// result of di_dict_set() is fresh only if the dict passed to it is.
+static bool is_fresh(compiler_t *c, di_t e) {
+    if (is(e, "lit") || is(e, "array") || is(e, "dict"))
+        return true;
+    if (is(e, "var")) {
+        struct var *v = lookup(c, get(e, "name"));
+        return v && v->floating && di_equal(get(e, "action"), str("last"));
+    }
+    if (is(e, "dictup"))
+        return is_fresh(c, get(e, "subj"));
+    if (is(e, "~") || is(e, "@"))
+        return is_fresh(c, get(e, "left")) && is_fresh(c, get(e, "right"));
+    if (is(e, "if"))
+        return is_fresh(c, get(e, "then")) && is_fresh(c, get(e, "else"));
+    if (is(e, "case")) {
+        di_t clauses = get(e, "clauses");
+        di_size_t i;
+        for (i = 0; i < di_array_length(clauses); i++)
+            if (!is_fresh(c, get(di_array_get(clauses, i), "body")))
+                return false;
+        return true;
+    }
+    if (is(e, "do")) {
+        di_t es = get(e, "seq");
+        di_t last = di_array_get(es, di_array_length(es) - 1);
+        return is_fresh(c, is(last, "=") ? get(last, "right") : last);
+    }
+    // The other operators return ints, doubles and booleans.
+    return is_operator(get(e, "syntax"));
+}
+
+// The variables whose values the value of e may be part of, or null if it's
+// fresh.
+static di_t value_deps(compiler_t *c, di_t e) {
+    return is_fresh(c, e) ? di_null() : closure(c, get(e, "varset"));
+}
+
+/*
+ * Branches
+ */
+
+// Compiles branch i of n alternative branches and returns its value. Sets *deps
+// to its dependencies (see value_deps()).
+typedef di_t (*branch_fn)(compiler_t *c, int i, void *arg, di_t *deps);
+
+// Compiles alternative code paths, such as the branches of an if, and returns
+// the code of each of them in texts. Each one ends by assigning its value to
+// result. Variables consumed in one branch are released at the end of the
+// others, so they're all consumed after the branches.
+static void branches(compiler_t *c, int n, branch_fn fn, void *arg,
+                     di_t result, di_t *texts) {
+    int m = c->nvars, i, j;
+    bool *before = malloc(m + 1), *consumed = calloc(m + 1, 1);
+    bool *after = malloc((size_t)n * m + 1), *held = malloc(m + 1);
+    di_t *values = malloc(n * sizeof(di_t)), *deps = malloc(n * sizeof(di_t));
+    di_writer_t *ws = malloc(n * sizeof(di_writer_t)), *w = c->w;
+    if (!before || !consumed || !after || !held || !values || !deps || !ws)
+        di_error(str("Out of memory"));
+    for (j = 0; j < m; j++)
+        before[j] = c->vars[j].held;
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < m; j++)
+            c->vars[j].held = before[j];
+        di_writer_init_string(&ws[i]);
+        c->w = &ws[i];
+        values[i] = fn(c, i, arg, &deps[i]);
+        for (j = 0; j < m; j++) {
+            after[i * m + j] = c->vars[j].held;
+            consumed[j] = consumed[j] || (before[j] && !c->vars[j].held);
+        }
+    }
+    for (i = 0; i < n; i++) {
+        c->w = &ws[i];
+        for (j = 0; j < m; j++) {
+            c->vars[j].held = after[i * m + j];
+            held[j] = consumed[j] && after[i * m + j];
+        }
+        release(c, held, m, values[i], deps[i]);
+        line(c, "%.*s = %.*s;", STR(result), STR(values[i]));
+        texts[i] = di_writer_finish_string(&ws[i]);
+    }
+    for (j = 0; j < m; j++)
+        c->vars[j].held = before[j] && !consumed[j];
+    c->w = w;
+    free(before);
+    free(consumed);
+    free(after);
+    free(held);
+    free(values);
+    free(deps);
+    free(ws);
+}
+
+static void write_text(compiler_t *c, di_t text) {
+    di_write_string(c->w, text);
+    di_cleanup(text);
+}
+
+/*
+ * Patterns
+ */
+
+struct matching {
+    di_t fail;    // The statement run on mismatch
+    di_t binds;   // [[var node, C expression, subject index]]
+    di_t temps;   // Slices and substrings, to clean up
+    int subject;  // The index of the current subject
+    bool used;    // The fail statement is used
+};
+
+// Writes the check that a condition, formatted like printf, is true.
+static void fail_unless(compiler_t *c, struct matching *m, const char *format,
+                        ...) {
+    va_list args;
+    di_write_spaces(c->w, 4 * c->indent);
+    di_write_cstring(c->w, "if (!(");
+    va_start(args, format);
+    di_vwritef(c->w, format, args);
+    va_end(args);
+    di_writef(c->w, ")) %.*s\n", STR(m->fail));
+    m->used = true;
+}
+
+// The C expression of a variable, bound earlier or in the same match.
+static di_t bound_value(compiler_t *c, struct matching *m, di_t p) {
+    di_t name = get(p, "name");
+    di_size_t i;
+    for (i = 0; i < di_array_length(m->binds); i++) {
+        di_t bind = di_array_get(m->binds, i);
+        if (di_equal(get(di_array_get(bind, 0), "name"), name))
+            return di_array_get(bind, 1);
+    }
+    struct var *v = lookup(c, name);
+    if (!v)
+        error_at(p, "Functions as values are not supported");
+    return v->cname;
+}
+
+// True if a pattern never fails and binds nothing.
+static bool is_wildcard(di_t p) {
+    di_t action = get(p, "action");
+    return is(p, "var") &&
+           (di_is_null(action) || di_equal(action, str("discard")));
+}
+
+static di_t literal(compiler_t *c, di_t e, di_t value);
+static di_t regex(compiler_t *c, di_t e);
+
+// The part of a "@" or "~" pattern which isn't the literal array or string.
+// The other part is matched against s with the first length elements or chars
+// taken off (at_end is false) or the last ones. Substr is the function
+// returning this part.
+static void check_rest(compiler_t *c, struct matching *m, di_t rest,
+                       di_t s, int length, bool at_end, const char *substr,
+                       const char *size);
+
+// Writes the checks that s matches a pattern, and collects the variables it
+// binds, which are bound when all the patterns have matched.
+static void check(compiler_t *c, struct matching *m, di_t p, di_t s) {
+    if (is(p, "var")) {
+        di_t action = get(p, "action");
+        if (di_equal(action, str("bind"))) {
+            di_t bind = di_array_empty();
+            di_array_push(&bind, p);
+            di_array_push(&bind, s);
+            di_array_push(&bind, di_from_int(m->subject));
+            di_array_push(&m->binds, bind);
+        } else if (!is_wildcard(p)) {
+            // A variable bound earlier. The values must be equal.
+            di_t value = bound_value(c, m, p);
+            fail_unless(c, m, "di_equal(%.*s, %.*s)", STR(s), STR(value));
+        }
+    } else if (is(p, "lit")) {
+        di_t value = literal(c, p, get(p, "value"));
+        fail_unless(c, m, "di_equal(%.*s, %.*s)", STR(s), STR(value));
+    } else if (is(p, "regex")) {
+        di_t re = regex(c, p);
+        fail_unless(c, m, "di_rt_regex(%.*s, %.*s)", STR(re), STR(s));
+    } else if (is(p, "array")) {
+        di_t elems = get(p, "elems");
+        int i, n = di_array_length(elems);
+        fail_unless(c, m, "di_is_array(%.*s) && di_array_length(%.*s) == %d",
+                    STR(s), STR(s), n);
+        for (i = 0; i < n; i++) {
+            di_t elem = di_array_get(elems, i);
+            if (is_wildcard(elem))
+                continue;
+            di_t t = temp(c);
+            line(c, "di_t %.*s = di_array_get(%.*s, %d);", STR(t), STR(s), i);
+            check(c, m, elem, t);
+        }
+    } else if (is(p, "dict")) {
+        di_t entries = get(p, "entries");
+        di_size_t i;
+        fail_unless(c, m, "di_is_dict(%.*s)", STR(s));
+        for (i = 0; i < di_array_length(entries); i++) {
+            di_t entry = di_array_get(entries, i);
+            di_t key = get(entry, "key");
+            if (!is(key, "lit"))
+                error_at(p, "Only literal keys are supported in dict patterns");
+            key = literal(c, key, get(key, "value"));
+            di_t t = temp(c);
+            line(c, "di_t %.*s = di_dict_get(%.*s, %.*s);", STR(t), STR(s),
+                 STR(key));
+            fail_unless(c, m, "!di_is_null(%.*s) || di_dict_contains(%.*s, %.*s)",
+                        STR(t), STR(s), STR(key));
+            check(c, m, get(entry, "value"), t);
+        }
+    } else if (is(p, "=")) {
+        check(c, m, get(p, "left"), s);
+        check(c, m, get(p, "right"), s);
+    } else if (is(p, "@")) {
+        // One side must be an array pattern: [a, b] @ rest or rest @ [a, b].
+        di_t left = get(p, "left"), right = get(p, "right");
+        bool at_end = !is(left, "array");
+        di_t fixed = at_end ? right : left, rest = at_end ? left : right;
+        if (!is(fixed, "array"))
+            error_at(p, "Only @ patterns with a literal array are supported");
+        di_t elems = get(fixed, "elems");
+        int i, n = di_array_length(elems);
+        fail_unless(c, m, "di_is_array(%.*s) && di_array_length(%.*s) >= %d",
+                    STR(s), STR(s), n);
+        for (i = 0; i < n; i++) {
+            di_t elem = di_array_get(elems, i);
+            if (is_wildcard(elem))
+                continue;
+            di_t t = temp(c);
+            if (at_end)
+                line(c, "di_t %.*s = di_array_get(%.*s, "
+                     "di_array_length(%.*s) - %d);", STR(t), STR(s), STR(s),
+                     n - i);
+            else
+                line(c, "di_t %.*s = di_array_get(%.*s, %d);", STR(t),
+                     STR(s), i);
+            check(c, m, elem, t);
+        }
+        check_rest(c, m, rest, s, n, at_end, "di_array_slice",
+                   "di_array_length");
+    } else if (is(p, "~")) {
+        // One side must be a literal string: "a" ~ rest or rest ~ "a".
+        di_t left = get(p, "left"), right = get(p, "right");
+        bool at_end = !(is(left, "lit") && di_is_string(get(left, "value")));
+        di_t fixed = at_end ? right : left, rest = at_end ? left : right;
+        if (!is(fixed, "lit") || !di_is_string(get(fixed, "value")))
+            error_at(p, "Only ~ patterns with a literal string are supported");
+        di_t affix = literal(c, fixed, get(fixed, "value"));
+        fail_unless(c, m, "di_rt_affix(%.*s, %.*s, %s)", STR(s), STR(affix),
+                    at_end ? "true" : "false");
+        check_rest(c, m, rest, s, di_string_length(get(fixed, "value")),
+                   at_end, "di_string_substr", "di_string_length");
+    } else {
+        di_t syntax = get(p, "syntax");
+        error_at(p, "%.*s patterns are not supported", STR(syntax));
+    }
+}
+
+static void check_rest(compiler_t *c, struct matching *m, di_t rest,
+                       di_t s, int length, bool at_end, const char *substr,
+                       const char *size) {
+    if (is_wildcard(rest))
+        return;
+    if (length == 0) {
+        check(c, m, rest, s);
+        return;
+    }
+    // The part is fresh. It's cleaned up after the match, or on mismatch.
+    di_t t = temp(c);
+    di_array_push(&m->temps, t);
+    line(c, "%.*s = %s(di_borrow(%.*s), %d, %s(%.*s) - %d);", STR(t), substr,
+         STR(s), at_end ? 0 : length, size, STR(s), length);
+    check(c, m, rest, t);
+}
+
+// Matches pats[i] against subjs[i], for i < n, and binds their variables. On
+// mismatch, fail is run. Returns the temps which must be cleaned up after a
+// mismatch, e.g. after a label which fail jumps to, or null if the patterns
+// can't fail.
+static di_t match(compiler_t *c, int n, const di_t *pats,
+                  const struct subject *subjs, di_t fail) {
+    struct matching m = {fail, keep(c, di_array_empty()),
+                         keep(c, di_array_empty()), 0, false};
+    di_writer_t checks, *w = c->w;
+    di_size_t i, j;
+    di_writer_init_string(&checks);
+    c->w = &checks;
+    for (m.subject = 0; m.subject < n; m.subject++)
+        check(c, &m, pats[m.subject], subjs[m.subject].value);
+    c->w = w;
+    for (i = 0; i < di_array_length(m.temps); i++) {
+        di_t t = di_array_get(m.temps, i);
+        line(c, "di_t %.*s = di_null();", STR(t));
+    }
+    write_text(c, di_writer_finish_string(&checks));
+
+    // All matched. Bind the variables.
+    for (i = 0; i < (di_size_t)n; i++) {
+        const struct subject *s = &subjs[i];
+        // No variable in scope can own the value.
+        bool independent = s->fresh || s->param ||
+                           (di_is_dict(s->deps) && di_dict_size(s->deps) == 0);
+        if (is(pats[i], "var") &&
+            di_equal(get(pats[i], "action"), str("bind"))) {
+            // The variable takes over the subject.
+            di_t name = get(pats[i], "name");
+            bool pinned = s->keep || !independent ||
+                          di_dict_contains(c->accessed, name);
+            bind(c, name, s->value, pinned, s->fresh,
+                 independent ? di_null() : s->deps);
+            continue;
+        }
+        for (j = 0; j < di_array_length(m.binds); j++) {
+            di_t b = di_array_get(m.binds, j);
+            if ((di_size_t)di_to_int(di_array_get(b, 2)) == i)
+                bind(c, get(di_array_get(b, 0), "name"), di_array_get(b, 1),
+                     true, false, independent ? di_null() : s->deps);
+        }
+        if (!s->keep)
+            line(c, "di_cleanup(%.*s);", STR(s->value));
+    }
+    for (i = 0; i < di_array_length(m.temps); i++) {
+        di_t t = di_array_get(m.temps, i);
+        line(c, "di_cleanup(%.*s);", STR(t));
+    }
+    return m.used ? m.temps : di_null();
+}
+
+// Writes a label followed by the cleanup of temps, if the label is used, i.e.
+// if temps isn't null.
+static void fail_label(compiler_t *c, di_t label, di_t temps) {
+    if (di_is_null(temps))
+        return;
+    di_size_t i, n = di_array_length(temps);
+    line(c, n ? "%.*s:" : "%.*s:;", STR(label));
+    c->indent++;
+    for (i = 0; i < n; i++) {
+        di_t t = di_array_get(temps, i);
+        line(c, "di_cleanup(%.*s);", STR(t));
+    }
+    c->indent--;
+}
+
+/*
+ * Expressions
+ */
+
+static di_t literal(compiler_t *c, di_t e, di_t value) {
+    if (di_is_int(value)) {
+        int32_t i = di_to_int(value);
+        if (i == INT32_MIN)
+            return format(c, "di_from_int(-2147483647 - 1)");
+        return format(c, "di_from_int(%d)", (int)i);
+    }
+    if (di_is_double(value)) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.17g", di_to_double(value));
+        if (!strpbrk(buf, ".e"))
+            strcat(buf, ".0");
+        return format(c, "di_from_double(%s)", buf);
+    }
+    if (di_is_string(value)) {
+        di_t index = di_dict_get(c->lits, value);
+        if (di_is_null(index)) {
+            index = di_from_int(di_array_length(c->litlist));
+            c->lits = di_dict_set(c->lits, value, index);
+            di_array_push(&c->litlist, value);
+        }
+        return format(c, "lit[%d]", di_to_int(index));
+    }
+    if (di_is_true(value))
+        return format(c, "di_true()");
+    if (di_is_false(value))
+        return format(c, "di_false()");
+    if (!di_is_null(value))
+        error_at(e, "Unsupported literal");
+    return format(c, "di_null()");
+}
+
+// The C expression of the compiled regex of a regex pattern.
+static di_t regex(compiler_t *c, di_t e) {
+    di_t pattern = get(e, "regex");
+    di_t index = di_dict_get(c->regexes, pattern);
+    if (di_is_null(index)) {
+        index = di_from_int(di_array_length(c->relist));
+        c->regexes = di_dict_set(c->regexes, pattern, index);
+        di_array_push(&c->relist, literal(c, e, pattern));
+    }
+    return format(c, "re[%d]", di_to_int(index));
+}
+
+static di_t var(compiler_t *c, di_t e) {
+    di_t name = get(e, "name");
+    struct var *v = lookup(c, name);
+    if (!v) {
+        if (di_dict_contains(c->funcs, name))
+            error_at(e, "Functions as values are not supported");
+        error_at(e, "Unknown variable %.*s", STR(name));
+    }
+    if (v->held && di_equal(get(e, "action"), str("last"))) {
+        // Pass it on with the reference we had.
+        if (v->pinned)
+            line(c, "di_decref(%.*s);", STR(v->cname));
+        v->held = false;
+    }
+    return v->cname;
+}
+
+// Compiles the operands of an operation, in order. An operand which may be
+// part of the value of a variable consumed by a later operand is protected.
+static void operands(compiler_t *c, di_t nodes, struct operands *ops) {
+    int i, j;
+    ops->n = di_array_length(nodes);
+    ops->values = malloc((ops->n + 1) * sizeof(di_t));
+    ops->protected = calloc(ops->n + 1, sizeof(bool));
+    if (!ops->values || !ops->protected)
+        di_error(str("Out of memory"));
+    for (i = 0; i < ops->n; i++) {
+        di_t node = di_array_get(nodes, i);
+        bool fresh = is_fresh(c, node);
+        di_t deps = fresh ? di_null() : closure(c, get(node, "varset"));
+        ops->values[i] = expr(c, node);
+        for (j = i + 1; !fresh && j < ops->n; j++)
+            if (consumes(di_array_get(nodes, j), deps)) {
+                line(c, "di_incref(%.*s);", STR(ops->values[i]));
+                ops->protected[i] = true;
+                break;
+            }
+    }
+}
+
+// Ends the protection of the operands, once the operation has returned result.
+static void end_operands(compiler_t *c, struct operands *ops, di_t result) {
+    int i;
+    for (i = 0; i < ops->n; i++)
+        if (ops->protected[i])
+            line(c, "di_rt_unprotect(%.*s, %.*s);", STR(ops->values[i]),
+                 STR(result));
+    free(ops->values);
+    free(ops->protected);
+}
+
+// Writes "di_t result = before" followed by the operands from the one at index
+// start, separated by commas, and after.
+static void call(compiler_t *c, di_t result, const char *before,
+                 struct operands *ops, int start, const char *after) {
+    int i;
+    di_write_spaces(c->w, 4 * c->indent);
+    di_writef(c->w, "di_t %.*s = %s", STR(result), before);
+    for (i = start; i < ops->n; i++) {
+        if (i > start)
+            di_write_cstring(c->w, ", ");
+        di_write_string(c->w, ops->values[i]);
+    }
+    di_write_cstring(c->w, after);
+    di_write_char(c->w, '\n');
+}
+
+// The keys and values of the entries after the nodes in array.
+static di_t entries(di_t array, di_t entries) {
+    di_size_t i;
+    for (i = 0; i < di_array_length(entries); i++) {
+        di_t entry = di_array_get(entries, i);
+        di_array_push(&array, get(entry, "key"));
+        di_array_push(&array, get(entry, "value"));
+    }
+    return array;
+}
+
+static di_t apply(compiler_t *c, di_t e) {
+    di_t func = get(e, "func"), name = get(func, "name");
+    di_t info = di_null();
+    if (is(func, "var") && !lookup(c, name))
+        info = di_dict_get(c->funcs, name);
+    if (di_is_null(info))
+        error_at(e, "Calling a function value is not supported");
+    di_t args = get(e, "args"), cname = get(info, "cname");
+    int arity = di_to_int(get(info, "arity"));
+    if ((int)di_array_length(args) != arity)
+        error_at(e, "%.*s takes %d arguments", STR(name), arity);
+    struct operands ops;
+    operands(c, args, &ops);
+    di_t result = temp(c);
+    char before[256];
+    snprintf(before, sizeof(before), "%.*s(", STR(cname));
+    call(c, result, before, &ops, 0, ");");
+    end_operands(c, &ops, result);
+    return result;
+}
+
+static di_t array(compiler_t *c, di_t e) {
+    di_t elems = get(e, "elems");
+    if (di_array_length(elems) == 0)
+        return format(c, "di_array_empty()");
+    struct operands ops;
+    operands(c, elems, &ops);
+    di_t result = temp(c);
+    char after[32];
+    snprintf(after, sizeof(after), "}, %d);", ops.n);
+    call(c, result, "di_array_from_values((di_t[]){", &ops, 0, after);
+    end_operands(c, &ops, result);
+    return result;
+}
+
+static di_t dict(compiler_t *c, di_t e) {
+    if (di_array_length(get(e, "entries")) == 0)
+        return format(c, "di_dict_empty()");
+    di_t nodes = entries(di_array_empty(), get(e, "entries"));
+    struct operands ops;
+    operands(c, nodes, &ops);
+    di_cleanup(nodes);
+    di_t result = temp(c);
+    char after[32];
+    snprintf(after, sizeof(after), "}, %d);", ops.n / 2);
+    call(c, result, "di_dict_from_entries((di_t[]){", &ops, 0, after);
+    end_operands(c, &ops, result);
+    return result;
+}
+
+static di_t dictup(compiler_t *c, di_t e) {
+    di_t nodes = di_array_empty();
+    di_array_push(&nodes, get(e, "subj"));
+    nodes = entries(nodes, get(e, "entries"));
+    struct operands ops;
+    operands(c, nodes, &ops);
+    di_cleanup(nodes);
+    di_t result = temp(c);
+    int i;
+    line(c, "di_t %.*s = %.*s;", STR(result), STR(ops.values[0]));
+    line(c, "if (!di_is_dict(%.*s))", STR(result));
+    line(c, "    di_rt_error(%d, %d, \"Not a dict\");", LOC(e));
+    for (i = 1; i < ops.n; i += 2)
+        line(c, "%.*s = di_dict_set(%.*s, %.*s, %.*s);", STR(result),
+             STR(result), STR(ops.values[i]), STR(ops.values[i + 1]));
+    end_operands(c, &ops, result);
+    return result;
+}
+
+static di_t if_branch(compiler_t *c, int i, void *arg, di_t *deps) {
+    di_t e = get(*(di_t *)arg, i == 0 ? "then" : "else");
+    *deps = value_deps(c, e);
+    return expr(c, e);
+}
+
+static di_t if_expr(compiler_t *c, di_t e) {
+    di_t cond = expr(c, get(e, "cond")), result = temp(c), texts[2];
+    line(c, "di_t %.*s;", STR(result));
+    c->indent++;
+    branches(c, 2, if_branch, &e, result, texts);
+    c->indent--;
+    line(c, "if (di_rt_truth(%.*s, %d, %d)) {", STR(cond), LOC(e));
+    write_text(c, texts[0]);
+    line(c, "} else {");
+    write_text(c, texts[1]);
+    line(c, "}");
+    return result;
+}
+
+// Branch 0 evaluates the right operand of "and" or "or" and branch 1 doesn't.
+static di_t logic_branch(compiler_t *c, int i, void *arg, di_t *deps) {
+    di_t e = *(di_t *)arg;
+    *deps = di_null();
+    if (i == 1)
+        return format(c, is(e, "and") ? "di_false()" : "di_true()");
+    di_t right = expr(c, get(e, "right"));
+    return format(c, "di_from_boolean(di_rt_truth(%.*s, %d, %d))", STR(right),
+                  LOC(e));
+}
+
+static di_t logic(compiler_t *c, di_t e) {
+    di_t left = expr(c, get(e, "left")), result = temp(c), texts[2];
+    line(c, "di_t %.*s;", STR(result));
+    c->indent++;
+    branches(c, 2, logic_branch, &e, result, texts);
+    c->indent--;
+    line(c, "if (%sdi_rt_truth(%.*s, %d, %d)) {", is(e, "and") ? "" : "!",
+         STR(left), LOC(e));
+    write_text(c, texts[0]);
+    line(c, "} else {");
+    write_text(c, texts[1]);
+    line(c, "}");
+    return result;
+}
+
+struct case_arg {
+    di_t clauses;
+    struct subject subj;
+    di_t *labels, *temps; // For each clause
+};
+
+static di_t case_branch(compiler_t *c, int i, void *arg, di_t *deps) {
+    struct case_arg *a = arg;
+    di_t clause = di_array_get(a->clauses, i);
+    di_t pat = di_array_get(get(clause, "pats"), 0), body = get(clause, "body");
+    int start = c->nvars;
+    a->labels[i] = label(c);
+    a->temps[i] = match(c, 1, &pat, &a->subj,
+                        format(c, "goto %.*s;", STR(a->labels[i])));
+    *deps = value_deps(c, body);
+    di_t value = expr(c, body);
+    end_scope(c, start, value, *deps);
+    return value;
+}
+
+static di_t case_expr(compiler_t *c, di_t e) {
+    struct case_arg a;
+    di_t subj = get(e, "subj");
+    a.clauses = get(e, "clauses");
+    a.subj.fresh = is_fresh(c, subj);
+    a.subj.param = false;
+    // A variable which is accessed again later isn't released.
+    a.subj.keep = is(subj, "var") && !di_equal(get(subj, "action"), str("last"));
+    a.subj.deps = a.subj.fresh ? di_null() : closure(c, get(subj, "varset"));
+    a.subj.value = expr(c, subj);
+    int i, n = di_array_length(a.clauses);
+    di_t result = temp(c), end = label(c);
+    di_t *texts = malloc(n * sizeof(di_t));
+    a.labels = malloc(n * sizeof(di_t));
+    a.temps = malloc(n * sizeof(di_t));
+    if (!texts || !a.labels || !a.temps)
+        di_error(str("Out of memory"));
+    line(c, "di_t %.*s = di_null();", STR(result));
+    c->indent++;
+    branches(c, n, case_branch, &a, result, texts);
+    c->indent--;
+    for (i = 0; i < n; i++) {
+        line(c, "{");
+        write_text(c, texts[i]);
+        line(c, "    goto %.*s;", STR(end));
+        fail_label(c, a.labels[i], a.temps[i]);
+        line(c, "}");
+    }
+    line(c, "di_rt_error(%d, %d, \"No matching clause\");", LOC(e));
+    line(c, "%.*s:;", STR(end));
+    free(texts);
+    free(a.labels);
+    free(a.temps);
+    return result;
+}
+
+static di_t do_expr(compiler_t *c, di_t e) {
+    di_t result = temp(c);
+    line(c, "di_t %.*s;", STR(result));
+    line(c, "{");
+    c->indent++;
+    di_t value = seq(c, e);
+    line(c, "%.*s = %.*s;", STR(result), STR(value));
+    c->indent--;
+    line(c, "}");
+    return result;
+}
+
+static di_t operation(compiler_t *c, di_t e) {
+    di_t op = get(e, "syntax"), result = temp(c), code;
+    if (di_is_null(get(e, "left"))) {
+        // Unary - and not
+        di_t right = expr(c, get(e, "right"));
+        if (is(e, "not"))
+            code = format(c, "di_from_boolean(!di_rt_truth(%.*s, %d, %d))",
+                          STR(right), LOC(e));
+        else
+            code = format(c, "di_rt_negate(%.*s, %d, %d)", STR(right), LOC(e));
+        line(c, "di_t %.*s = %.*s;", STR(result), STR(code));
+        return result;
+    }
+    if (is(e, "and") || is(e, "or"))
+        return logic(c, e);
+    di_t nodes = di_array_empty();
+    di_array_push(&nodes, get(e, "left"));
+    di_array_push(&nodes, get(e, "right"));
+    struct operands ops;
+    operands(c, nodes, &ops);
+    di_cleanup(nodes);
+    di_t a = ops.values[0], b = ops.values[1];
+    char *s = di_string_chars(op);
+    if (strchr("+-*/", s[0]) || is(e, "mod"))
+        code = format(c, "di_rt_arith('%c', %.*s, %.*s, %d, %d)",
+                      is(e, "mod") ? 'm' : s[0], STR(a), STR(b), LOC(e));
+    else if (is(e, "==") || is(e, "!="))
+        code = format(c, "di_from_boolean(%sdi_rt_equal(%.*s, %.*s))",
+                      is(e, "!=") ? "!" : "", STR(a), STR(b));
+    else if (is(e, "<") || is(e, ">=")) // a < b, !(a < b)
+        code = format(c, "di_from_boolean(%sdi_rt_less(%.*s, %.*s, %d, %d))",
+                      is(e, ">=") ? "!" : "", STR(a), STR(b), LOC(e));
+    else if (is(e, ">") || is(e, "=<")) // b < a, !(b < a)
+        code = format(c, "di_from_boolean(%sdi_rt_less(%.*s, %.*s, %d, %d))",
+                      is(e, "=<") ? "!" : "", STR(b), STR(a), LOC(e));
+    else if (is(e, "~"))
+        code = format(c, "di_rt_string_concat(%.*s, %.*s, %d, %d)", STR(a),
+                      STR(b), LOC(e));
+    else
+        code = format(c, "di_rt_array_concat(%.*s, %.*s, %d, %d)", STR(a),
+                      STR(b), LOC(e));
+    line(c, "di_t %.*s = %.*s;", STR(result), STR(code));
+    end_operands(c, &ops, result);
+    return result;
+}
+
+static di_t expr(compiler_t *c, di_t e) {
+    if (is(e, "lit"))
+        return literal(c, e, get(e, "value"));
+    if (is(e, "var"))
+        return var(c, e);
+    if (is(e, "apply"))
+        return apply(c, e);
+    if (is(e, "array"))
+        return array(c, e);
+    if (is(e, "dict"))
+        return dict(c, e);
+    if (is(e, "dictup"))
+        return dictup(c, e);
+    if (is(e, "if"))
+        return if_expr(c, e);
+    if (is(e, "case"))
+        return case_expr(c, e);
+    if (is(e, "do"))
+        return do_expr(c, e);
+    if (is_operator(get(e, "syntax")))
+        return operation(c, e);
+    di_t syntax = get(e, "syntax");
+    error_at(e, "%.*s expressions are not supported", STR(syntax));
+    return di_null();
+}
+
+/*
+ * Blocks and functions
+ */
+
+// Adds the function definitions of a block to the functions in scope and to
+// the queue of functions to compile.
+static void defs(compiler_t *c, di_t defs) {
+    di_t name, def, var;
+    di_size_t i, j;
+    if (!di_is_dict(defs))
+        return;
+    for (i = 0; (i = di_dict_iter(defs, i, &name, &def));) {
+        di_t cname = mangle(c, "f_", name), base = cname;
+        for (j = 2; di_dict_contains(c->cnames, cname); j++)
+            cname = format(c, "%.*s_%d", STR(base), (int)j);
+        c->cnames = di_dict_set(c->cnames, cname, di_true());
+        di_t info = di_dict_empty();
+        info = di_dict_set(info, str("cname"), cname);
+        info = di_dict_set(info, str("arity"), get(def, "arity"));
+        c->funcs = di_dict_set(c->funcs, name, info);
+    }
+    for (i = 0; (i = di_dict_iter(defs, i, &name, &def));) {
+        di_t env = get(def, "env");
+        for (j = 0; di_is_dict(env) && (j = di_dict_iter(env, j, &var, NULL));)
+            if (!di_dict_contains(c->funcs, var))
+                error_at(di_array_get(get(def, "clauses"), 0),
+                         "%.*s is a closure, which is not supported",
+                         STR(name));
+        di_t entry = di_dict_empty();
+        entry = di_dict_set(entry, str("def"), def);
+        entry = di_dict_set(entry, str("cname"),
+                            get(di_dict_get(c->funcs, name), "cname"));
+        entry = di_dict_set(entry, str("funcs"), c->funcs);
+        di_array_push(&c->queue, entry);
+    }
+}
+
+// Matches a pattern against an expression in a block, e.g. [x, y] = f(z). If
+// it's the last one, the value of the expression is the value of the block.
+static di_t let(compiler_t *c, di_t e, bool last, di_t *deps) {
+    di_t pat = get(e, "left"), right = get(e, "right");
+    if (is(right, "=")) {
+        // p1 = p2 = expr
+        di_t both = di_dict_empty();
+        both = di_dict_set(both, str("syntax"), str("="));
+        both = di_dict_set(both, str("left"), pat);
+        both = di_dict_set(both, str("right"), get(right, "left"));
+        e = keep(c, di_dict_set(keep(c, di_dict_empty()), str("left"), both));
+        e = keep(c, di_dict_set(e, str("right"), get(right, "right")));
+        return let(c, e, last, deps);
+    }
+    struct subject s;
+    s.fresh = is_fresh(c, right);
+    s.param = false;
+    s.keep = last;
+    s.deps = *deps = value_deps(c, right);
+    s.value = expr(c, right);
+    di_t fail = format(c, "di_rt_error(%d, %d, \"No match\");",
+                       LOC(get(e, "left")));
+    match(c, 1, &pat, &s, fail);
+    return s.value;
+}
+
+// The expressions and function definitions of a block. Returns the value of
+// the last expression.
+static di_t seq(compiler_t *c, di_t block) {
+    di_t outer = c->funcs, es = get(block, "seq"), value = di_null();
+    di_t deps = di_null();
+    di_size_t i, n = di_array_length(es);
+    int start = c->nvars;
+    di_incref(outer);
+    defs(c, get(block, "defs"));
+    for (i = 0; i < n; i++) {
+        di_t e = di_array_get(es, i);
+        bool last = i == n - 1;
+        if (is(e, "=")) {
+            value = let(c, e, last, &deps);
+            continue;
+        }
+        deps = value_deps(c, e);
+        value = expr(c, e);
+        if (!last && !is(e, "lit"))
+            line(c, "di_cleanup(%.*s);", STR(value));
+    }
+    end_scope(c, start, value, deps);
+    di_cleanup(c->funcs);
+    c->funcs = outer;
+    di_decref(outer);
+    return value;
+}
+
+static void reset_function(compiler_t *c) {
+    c->nvars = 0;
+    c->ntemps = 0;
+    c->nlabels = 0;
+    di_cleanup(c->scope);
+    c->scope = di_dict_empty();
+    di_cleanup(c->accessed);
+    c->accessed = di_dict_empty();
+}
+
+static void function(compiler_t *c, di_t entry) {
+    di_t def = get(entry, "def"), cname = get(entry, "cname");
+    di_t name = get(def, "name"), clauses = get(def, "clauses");
+    int arity = di_to_int(get(def, "arity")), i, j;
+    di_size_t k;
+    reset_function(c);
+    c->funcs = get(entry, "funcs");
+    collect_accesses(c, clauses);
+
+    di_writer_t params;
+    di_writer_init_string(&params);
+    for (i = 0; i < arity; i++)
+        di_writef(&params, "%sdi_t a%d", i ? ", " : "", i);
+    if (arity == 0)
+        di_write_cstring(&params, "void");
+    di_t ps = keep(c, di_writer_finish_string(&params));
+    di_writef(&c->protos, "static di_t %.*s(%.*s);\n", STR(cname), STR(ps));
+    line(c, "static di_t %.*s(%.*s) {", STR(cname), STR(ps));
+    c->indent = 1;
+    struct subject *subjs = calloc(arity + 1, sizeof(struct subject));
+    if (!subjs)
+        di_error(str("Out of memory"));
+    for (i = 0; i < arity; i++) {
+        subjs[i].value = format(c, "a%d", i);
+        subjs[i].param = true;
+        subjs[i].deps = di_null();
+    }
+    for (k = 0; k < di_array_length(clauses); k++) {
+        di_t clause = di_array_get(clauses, k), body = get(clause, "body");
+        di_t pats = get(clause, "pats"), fail = label(c);
+        di_t *ps = malloc((arity + 1) * sizeof(di_t));
+        if (!ps)
+            di_error(str("Out of memory"));
+        for (j = 0; j < arity; j++)
+            ps[j] = di_array_get(pats, j);
+        line(c, "{");
+        c->indent++;
+        di_t temps = match(c, arity, ps, subjs,
+                           format(c, "goto %.*s;", STR(fail)));
+        free(ps);
+        di_t deps = value_deps(c, body);
+        di_t value = expr(c, body);
+        end_scope(c, 0, value, deps);
+        if (di_is_null(deps))
+            line(c, "return %.*s;", STR(value));
+        else
+            line(c, "return di_rt_return(%.*s);", STR(value));
+        c->indent--;
+        fail_label(c, fail, temps);
+        line(c, "}");
+    }
+    free(subjs);
+    di_t clause = di_array_get(clauses, 0);
+    line(c, "di_rt_error(%d, %d, \"No matching clause of %.*s\");",
+         LOC(clause), STR(name));
+    line(c, "return di_null();");
+    c->indent = 0;
+    line(c, "}");
+    line(c, "");
+}
+
+// The top-level code.
+static void module(compiler_t *c, di_t tree) {
+    reset_function(c);
+    collect_accesses(c, get(tree, "seq"));
+    line(c, "di_t module(void) {");
+    c->indent = 1;
+    line(c, "init_literals();");
+    di_t value = seq(c, tree);
+    line(c, "return %.*s;", STR(value));
+    c->indent = 0;
+    line(c, "}");
+}
+
+void di_compile(di_writer_t *out, di_t tree) {
+    compiler_t c = {0};
+    di_writer_t functions, top;
+    di_size_t i;
+    c.pool = di_array_empty();
+    c.lits = di_dict_empty();
+    c.litlist = di_array_empty();
+    c.regexes = di_dict_empty();
+    c.relist = di_array_empty();
+    c.cnames = di_dict_empty();
+    c.funcs = di_dict_empty();
+    c.queue = di_array_empty();
+    c.scope = di_dict_empty();
+    c.accessed = di_dict_empty();
+    di_writer_init_string(&c.protos);
+    di_writer_init_string(&top);
+    c.w = &top;
+    module(&c, tree);
+    di_writer_init_string(&functions);
+    c.w = &functions;
+    di_cleanup(c.funcs);
+    for (i = 0; i < di_array_length(c.queue); i++) // It grows meanwhile
+        function(&c, di_array_get(c.queue, i));
+    c.w = out;
+
+    di_write_cstring(out, "/* Generated by dlc compile. */\n\n"
+                     "#include \"di_rt.h\"\n"
+                     "#include \"di_prettyprint.h\"\n\n");
+    di_writef(out, "static di_t lit[%d];\n\n",
+              (int)di_array_length(c.litlist) + 1);
+    if (di_array_length(c.relist))
+        di_writef(out, "static di_t re[%d];\n\n",
+                  (int)di_array_length(c.relist));
+    di_write_cstring(out, "static void init_literals(void);\n");
+    write_text(&c, di_writer_finish_string(&c.protos));
+    di_write_char(out, '\n');
+    write_text(&c, di_writer_finish_string(&functions));
+    write_text(&c, di_writer_finish_string(&top));
+    di_write_cstring(out, "\nstatic void init_literals(void) {\n");
+    for (i = 0; i < di_array_length(c.litlist); i++) {
+        di_t s = di_array_get(c.litlist, i);
+        di_writef(out, "    lit[%d] = di_atom(", (int)i);
+        write_c_string(out, s);
+        di_writef(out, ", %d);\n", (int)di_string_length(s));
+    }
+    for (i = 0; i < di_array_length(c.relist); i++) {
+        di_t pattern = di_array_get(c.relist, i);
+        di_writef(out, "    re[%d] = di_regex_compile(%.*s, NULL);\n",
+                  (int)i, STR(pattern));
+    }
+    di_write_cstring(out, "}\n\n"
+                     "#ifndef DI_NO_MAIN\n"
+                     "int main(void) {\n"
+                     "    di_writer_t w;\n"
+                     "    di_writer_init_file(&w, stdout);\n"
+                     "    di_t value = module();\n"
+                     "    di_write_source(&w, value, 0);\n"
+                     "    di_write_char(&w, '\\n');\n"
+                     "    di_cleanup(value);\n"
+                     "    return di_writer_finish(&w) ? 0 : 1;\n"
+                     "}\n"
+                     "#endif\n");
+
+    di_cleanup(c.pool);
+    di_cleanup(c.lits);
+    di_cleanup(c.litlist);
+    di_cleanup(c.regexes);
+    di_cleanup(c.relist);
+    di_cleanup(c.cnames);
+    di_cleanup(c.queue);
+    di_cleanup(c.scope);
+    di_cleanup(c.accessed);
+    free(c.vars);
+    di_cleanup(tree);
+}
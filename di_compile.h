@@ -0,0 +1,15 @@
+#ifndef DI_COMPILE_H
+#define DI_COMPILE_H
+
+#include "di.h"
+#include "di_writer.h"
+
+/* Compiles an annotated parse tree, as returned by di_annotate(), to C and
+ * writes the C code to a writer. The code includes di_rt.h and is linked with
+ * the runtime (di.c). It defines di_t module(void), which runs the top-level
+ * code and returns its value, and a main() which prints the value, unless
+ * DI_NO_MAIN is defined. Frees the tree if its refc == 0. Errors, such as
+ * unsupported constructs, are reported using di_error(). */
+void di_compile(di_writer_t *w, di_t tree);
+
+#endif
@@ -5,49 +5,50 @@
 
 #define STEP 2
 
-static inline void print_indent(int indent) {
-        printf("%*s", indent, "");
-}
-
-void di_dump(di_t v, int indent) {
+void di_write_dump(di_writer_t *w, di_t v, int indent) {
 	// pointer types
 	if (di_is_pointer(v)) {
 		di_tagged_t *d = di_to_pointer(v);
 		di_size_t i;
-		printf("|tag=%#x refc=%d %p| ", d->tag, d->refc, (void*)d);
+		di_writef(w, "|tag=%#x refc=%d %p| ", d->tag, d->refc, (void*)d);
 		if (di_is_array(v)) {
-			printf("[\n");
+			di_write_cstring(w, "[\n");
 			for (i = 0; i < di_array_length(v); i++) {
-				print_indent(indent + STEP);
-				di_dump(di_array_get(v, i), indent + STEP);
-				printf("\n");
+				di_write_spaces(w, indent + STEP);
+				di_write_dump(w, di_array_get(v, i), indent + STEP);
+				di_write_char(w, '\n');
 			}
-			print_indent(indent);
-			printf("]");
+			di_write_spaces(w, indent);
+			di_write_char(w, ']');
 			return;
 		} else if (di_is_dict(v)) {
-			printf("{\n");
+			di_write_cstring(w, "{\n");
 			di_t key, value;
 			for (i = 0; (i = di_dict_iter(v, i, &key, &value)) != 0;) {
-				print_indent(indent + STEP);
-				di_dump(key, indent + STEP);
-				printf(": ");
-				di_dump(value, indent + STEP);
-				printf("\n");
+				di_write_spaces(w, indent + STEP);
+				di_write_dump(w, key, indent + STEP);
+				di_write_cstring(w, ": ");
+				di_write_dump(w, value, indent + STEP);
+				di_write_char(w, '\n');
 			}
-			print_indent(indent);
-			printf("}");
+			di_write_spaces(w, indent);
+			di_write_char(w, '}');
 			return;
 		} else if (di_is_string(v)) {
-                    // Allocated string, printed by di_to_source below.
+                    // Allocated string, written by di_write_source below.
 		} else {
-                    printf("(Unknown value tag %#x)\n", d->tag);
+                    di_writef(w, "(Unknown value tag %#x)\n", d->tag);
                     return;
                 }
 	}
-	di_t lit = di_to_source(v, indent); // json_encode(v);
-	printf("%.*s", di_string_length(lit), di_string_chars(lit));
-	di_cleanup(lit);
+	di_write_source(w, v, indent); // json_encode(v);
+}
+
+void di_dump(di_t v, int indent) {
+	di_writer_t w;
+	di_writer_init_file(&w, stdout);
+	di_write_dump(&w, v, indent);
+	di_writer_finish(&w);
 }
 
 void di_debug(char * const prefix, di_t value) {
@@ -1,7 +1,12 @@
 #ifndef DI_DEBUG_H
 #define DI_DEBUG_H
 
+#include "di_writer.h"
+
 void di_dump(di_t v, int indent);
 void di_debug(char * const prefix, di_t value);
 
+/* Like di_dump, to a writer. */
+void di_write_dump(di_writer_t *w, di_t v, int indent);
+
 #endif
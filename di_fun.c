@@ -0,0 +1,318 @@
+#include "di_fun.h"
+#include <pthread.h>
+#include <unistd.h>
+
+/*------------------------------------------*
+ * Dummy error handling: DIE(message) macro *
+ *------------------------------------------*/
+#define DIE(msg) do { \
+	fprintf(stderr, \
+	       "Fatal error: %s on line %d in %s\n", \
+	       msg, __LINE__, __FILE__); \
+	exit(-1); \
+} while(0)
+
+/*+-----------+*
+ *| Functions |*
+ *+-----------+*/
+
+void di_fun_arity_error(di_t fun, di_size_t n) {
+	char msg[80];
+	snprintf(msg, sizeof(msg), "Function of arity %u called with %u "
+	         "arguments", di_fun_arity(fun), n);
+	di_error(di_string_from_cstring(msg));
+}
+
+di_t di_apply(di_t fun, const di_t *args, di_size_t n) {
+	const di_fun_t *f = di_to_fun(fun);
+	const di_t *a = args, *e = f->env;
+	if (n != f->arity)
+		di_fun_arity_error(fun, n);
+	di_funptr0_t p = f->funptr;
+	if (f->env_size == 0) {
+		switch (n) {
+		case 0: return ((di_funptr0_t)p)();
+		case 1: return ((di_funptr1_t)p)(a[0]);
+		case 2: return ((di_funptr2_t)p)(a[0], a[1]);
+		case 3: return ((di_funptr3_t)p)(a[0], a[1], a[2]);
+		case 4: return ((di_funptr4_t)p)(a[0], a[1], a[2], a[3]);
+		case 5: return ((di_funptr5_t)p)(a[0], a[1], a[2], a[3], a[4]);
+		case 6: return ((di_funptr6_t)p)(a[0], a[1], a[2], a[3], a[4], a[5]);
+		case 7: return ((di_funptr7_t)p)(a[0], a[1], a[2], a[3], a[4], a[5],
+		                                 a[6]);
+		case 8: return ((di_funptr8_t)p)(a[0], a[1], a[2], a[3], a[4], a[5],
+		                                 a[6], a[7]);
+		}
+	} else {
+		switch (n) {
+		case 0: return ((di_clptr0_t)p)(e);
+		case 1: return ((di_clptr1_t)p)(e, a[0]);
+		case 2: return ((di_clptr2_t)p)(e, a[0], a[1]);
+		case 3: return ((di_clptr3_t)p)(e, a[0], a[1], a[2]);
+		case 4: return ((di_clptr4_t)p)(e, a[0], a[1], a[2], a[3]);
+		case 5: return ((di_clptr5_t)p)(e, a[0], a[1], a[2], a[3], a[4]);
+		case 6: return ((di_clptr6_t)p)(e, a[0], a[1], a[2], a[3], a[4], a[5]);
+		case 7: return ((di_clptr7_t)p)(e, a[0], a[1], a[2], a[3], a[4], a[5],
+		                                a[6]);
+		case 8: return ((di_clptr8_t)p)(e, a[0], a[1], a[2], a[3], a[4], a[5],
+		                                a[6], a[7]);
+		}
+	}
+	DIE("Too many arguments");
+}
+
+/*+--------+*
+ *| Deques |*
+ *+--------+*/
+
+// The tasks of a worker, in a circular buffer. The worker pushes and pops at
+// the bottom and other threads steal from the top. Each deque has a lock of its
+// own, so the workers only contend when one of them is stealing.
+typedef struct deque {
+	pthread_mutex_t lock;
+	di_task_t **tasks;
+	size_t top, len, cap;
+} deque_t;
+
+static void deque_push(deque_t *q, di_task_t *t) {
+	pthread_mutex_lock(&q->lock);
+	if (q->len == q->cap) {
+		size_t i, cap = q->cap ? 2 * q->cap : 64;
+		di_task_t **tasks = malloc(cap * sizeof(di_task_t *));
+		if (!tasks) DIE("Out of memory");
+		for (i = 0; i < q->len; i++)
+			tasks[i] = q->tasks[(q->top + i) & (q->cap - 1)];
+		free(q->tasks);
+		q->tasks = tasks;
+		q->top = 0;
+		q->cap = cap;
+	}
+	q->tasks[(q->top + q->len++) & (q->cap - 1)] = t;
+	pthread_mutex_unlock(&q->lock);
+}
+
+// Takes the newest task, or NULL.
+static di_task_t *deque_pop(deque_t *q) {
+	di_task_t *t = NULL;
+	pthread_mutex_lock(&q->lock);
+	if (q->len > 0)
+		t = q->tasks[(q->top + --q->len) & (q->cap - 1)];
+	pthread_mutex_unlock(&q->lock);
+	return t;
+}
+
+// Takes the oldest task, or NULL.
+static di_task_t *deque_steal(deque_t *q) {
+	di_task_t *t = NULL;
+	if (pthread_mutex_trylock(&q->lock))
+		return NULL; // busy; try another one
+	if (q->len > 0) {
+		t = q->tasks[q->top];
+		q->top = (q->top + 1) & (q->cap - 1);
+		q->len--;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return t;
+}
+
+/*+-----------+*
+ *| Scheduler |*
+ *+-----------+*/
+
+typedef struct worker {
+	pthread_t thread;
+	deque_t deque;
+} worker_t;
+
+static worker_t *workers = NULL;
+static unsigned num_workers = 0;
+
+// The index of the worker running on this thread, or -1 if it isn't a worker.
+static __thread int self = -1;
+
+// The number of tasks in the deques, for finding out if there's anything to
+// steal without locking them.
+static unsigned queued = 0;
+
+// Idle workers and threads waiting for tasks to finish sleep on sched_cond.
+// They're woken up when a task is spawned or finished or when the workers are
+// stopped.
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER;
+static unsigned sleepers = 0;
+static bool stopping = false;
+
+static void wake_sleepers(void) {
+	if (__atomic_load_n(&sleepers, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&sched_lock);
+		pthread_cond_broadcast(&sched_cond);
+		pthread_mutex_unlock(&sched_lock);
+	}
+}
+
+static bool task_done(di_task_t *t) {
+	return __atomic_load_n(&t->state, __ATOMIC_ACQUIRE) & DI_TASK_DONE;
+}
+
+// Blocks until a task is queued, the task is done (if one is given) or the
+// workers are stopping.
+static void sleep_until(di_task_t *t) {
+	pthread_mutex_lock(&sched_lock);
+	__atomic_add_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+	while (!__atomic_load_n(&queued, __ATOMIC_SEQ_CST) &&
+	       !(t && task_done(t)) && !stopping)
+		pthread_cond_wait(&sched_cond, &sched_lock);
+	__atomic_sub_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&sched_lock);
+}
+
+// Takes a task from the own deque, or steals one from another worker.
+static di_task_t *find_task(void) {
+	if (!__atomic_load_n(&queued, __ATOMIC_SEQ_CST))
+		return NULL;
+	di_task_t *t = self >= 0 ? deque_pop(&workers[self].deque) : NULL;
+	unsigned i, start = self >= 0 ? self + 1 : 0;
+	for (i = 0; !t && i < num_workers; i++)
+		t = deque_steal(&workers[(start + i) % num_workers].deque);
+	if (t)
+		__atomic_sub_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+	return t;
+}
+
+// Calls the function of a task with the elements of its args, which the task
+// holds references to. An element which no one else refers to is passed on as
+// unshared. The others are released when the function returns.
+static di_t call_task(di_task_t *t) {
+	di_t args[DI_FUN_MAX_ARITY];
+	bool owned[DI_FUN_MAX_ARITY];
+	di_size_t i, n = di_array_length(t->args);
+	for (i = 0; i < n; i++) {
+		args[i] = di_unborrow(di_array_get(t->args, i));
+		di_incref(args[i]);
+	}
+	di_decref_and_free(t->args);
+	t->args = di_null();
+	for (i = 0; i < n; i++) {
+		owned[i] = di_is_pointer(args[i]) &&
+		           di_tagged_refc(di_to_pointer(args[i])) == 1;
+		if (owned[i])
+			di_decref(args[i]); // ours only
+	}
+	di_t result = di_apply(t->fun, args, n);
+	for (i = 0; i < n; i++)
+		if (!owned[i])
+			di_decref_and_free(args[i]);
+	di_decref_and_free(t->fun);
+	t->fun = di_null();
+	return result;
+}
+
+static void run_task(di_task_t *t) {
+	t->result = call_task(t);
+	if (__atomic_fetch_or(&t->state, DI_TASK_DONE, __ATOMIC_ACQ_REL) &
+	    DI_TASK_DROPPED)
+		di_task_free(t); // no one is waiting for it
+	else
+		wake_sleepers();
+}
+
+static void *worker_main(void *arg) {
+	self = (int)(intptr_t)arg;
+	for (;;) {
+		di_task_t *t = find_task();
+		if (t) {
+			run_task(t);
+			continue;
+		}
+		if (__atomic_load_n(&stopping, __ATOMIC_SEQ_CST) &&
+		    !__atomic_load_n(&queued, __ATOMIC_SEQ_CST))
+			break;
+		sleep_until(NULL);
+	}
+	di_thread_cleanup();
+	return NULL;
+}
+
+void di_tasks_start(unsigned n) {
+	if (workers)
+		return;
+	if (n == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		n = cpus > 0 ? cpus : 1;
+	}
+	workers = calloc(n, sizeof(worker_t));
+	if (!workers) DIE("Out of memory");
+	num_workers = n;
+	stopping = false;
+	unsigned i;
+	for (i = 0; i < n; i++)
+		pthread_mutex_init(&workers[i].deque.lock, NULL);
+	for (i = 0; i < n; i++)
+		if (pthread_create(&workers[i].thread, NULL, worker_main,
+		                   (void *)(intptr_t)i))
+			DIE("Can't create thread");
+}
+
+void di_tasks_stop(void) {
+	if (!workers)
+		return;
+	pthread_mutex_lock(&sched_lock);
+	__atomic_store_n(&stopping, true, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&sched_cond);
+	pthread_mutex_unlock(&sched_lock);
+	unsigned i;
+	for (i = 0; i < num_workers; i++)
+		pthread_join(workers[i].thread, NULL);
+	for (i = 0; i < num_workers; i++) {
+		pthread_mutex_destroy(&workers[i].deque.lock);
+		free(workers[i].deque.tasks);
+	}
+	free(workers);
+	workers = NULL;
+	num_workers = 0;
+}
+
+di_t di_spawn(di_t fun, di_t args) {
+	if (!di_is_fun(fun) || !di_is_array(args))
+		di_error(di_string_from_cstring("Spawning a non-function or without "
+		                                "an array of arguments"));
+	if (di_array_length(args) != di_fun_arity(fun))
+		di_fun_arity_error(fun, di_array_length(args));
+	if (!workers)
+		di_tasks_start(0);
+	di_task_t *t = di_alloc(sizeof(di_task_t));
+	if (!t) DIE("Out of memory");
+	di_init_tagged(&t->header, DI_TASK);
+	t->fun = di_share(fun);
+	t->args = di_share(args);
+	t->result = di_null();
+	t->state = 0;
+	// From another thread, the tasks are spread over the workers.
+	static unsigned next = 0;
+	unsigned w = self >= 0 ? (unsigned)self
+	           : __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) % num_workers;
+	deque_push(&workers[w].deque, t);
+	__atomic_add_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+	wake_sleepers();
+	return di_from_pointer(&t->header);
+}
+
+di_t di_wait(di_t task) {
+	if (!di_is_task(task))
+		di_error(di_string_from_cstring("Waiting for a non-task"));
+	di_task_t *t = (di_task_t *)di_to_pointer(task);
+	// Run other tasks meanwhile, if there are any.
+	while (!task_done(t)) {
+		di_task_t *other = find_task();
+		if (other)
+			run_task(other);
+		else
+			sleep_until(t);
+	}
+	pthread_mutex_lock(&sched_lock);
+	di_t result = t->result;
+	t->result = di_null();
+	pthread_mutex_unlock(&sched_lock);
+	di_cleanup(task);
+	return result;
+}
@@ -1,30 +1,31 @@
 /*
- * Functions and closures for the di value system.
+ * Functions, closures and tasks for the di value system.
  */
 #ifndef DI_FUN_H
 #define DI_FUN_H
 
 #include "di.h"
-#include <stdarg.h>
-#include <alloca.h>
+#include <stdio.h>
 
 #define DI_FUN   0x40
+#define DI_TASK  0x41
 
+/*-----------*
+ * Functions *
+ *-----------*/
 
-typedef struct di_fun {
-	di_tagged_t header;
-	void * funptr;     /* actually di_t(*funptr)(di_t, di_t, ...) */
-	di_size_t arity;   /* real arity, including captured closure vars */
-	di_t * cl_data;    /* closure vars as the first params to funptr */
-	di_size_t cl_size; /* num closure vars */
-} di_fun_t;
-
-
-
-static inline bool di_is_fun(di_t v) {
-	return di_is_pointer(v) &&
-	       di_to_pointer(v)->tag == DI_FUN;
-}
+/*
+ * A function value is a function pointer, its arity and the closure vars it
+ * has captured, its environment, stored inline in the same allocation. A plain
+ * function, without an environment, is called with its arguments only. A
+ * closure is called with a pointer to its environment first, followed by the
+ * arguments. The environment belongs to the function value, so the closure
+ * must not free the values in it.
+ *
+ * A function value without an environment doesn't need to be allocated. It can
+ * be a tagged pointer to a static, immortal di_fun_t (see DI_FUN_STATIC),
+ * stored in auxiliary space after the atoms, which isn't reference-counted.
+ */
 
 typedef di_t (*di_funptr0_t)(void);
 typedef di_t (*di_funptr1_t)(di_t);
@@ -36,42 +37,236 @@ typedef di_t (*di_funptr6_t)(di_t, di_t, di_t, di_t, di_t, di_t);
 typedef di_t (*di_funptr7_t)(di_t, di_t, di_t, di_t, di_t, di_t, di_t);
 typedef di_t (*di_funptr8_t)(di_t, di_t, di_t, di_t, di_t, di_t, di_t, di_t);
 
-static inline di_t di_call0(di_t fun) {
-	assert(di_is_fun(fun));
-	di_fun_t * p = (di_fun_t *)di_to_pointer(fun);
-	assert (p->arity == 0);
-	di_funptr0_t f = (di_funptr0_t)p->funptr;
-	return f();
+// Closures take the environment as the first parameter.
+typedef const di_t *di_env_t;
+typedef di_t (*di_clptr0_t)(di_env_t);
+typedef di_t (*di_clptr1_t)(di_env_t, di_t);
+typedef di_t (*di_clptr2_t)(di_env_t, di_t, di_t);
+typedef di_t (*di_clptr3_t)(di_env_t, di_t, di_t, di_t);
+typedef di_t (*di_clptr4_t)(di_env_t, di_t, di_t, di_t, di_t);
+typedef di_t (*di_clptr5_t)(di_env_t, di_t, di_t, di_t, di_t, di_t);
+typedef di_t (*di_clptr6_t)(di_env_t, di_t, di_t, di_t, di_t, di_t, di_t);
+typedef di_t (*di_clptr7_t)(di_env_t, di_t, di_t, di_t, di_t, di_t, di_t, di_t);
+typedef di_t (*di_clptr8_t)(di_env_t, di_t, di_t, di_t, di_t, di_t, di_t, di_t,
+                            di_t);
+
+typedef struct di_fun {
+	di_tagged_t header;
+	di_funptr0_t funptr; /* a di_funptrN_t, or a di_clptrN_t if env_size > 0 */
+	di_size_t arity;     /* num args, not counting the environment */
+	di_size_t env_size;  /* num closure vars */
+	di_t env[];          /* the closure vars */
+} di_fun_t;
+
+// The most arguments a function can have, not counting the environment.
+#define DI_FUN_MAX_ARITY 8
+
+// The aux tag of a function value pointing to a static di_fun_t.
+#define DI_FUN_STATIC_TAG (NANBOX_MIN_AUX_TAG + 0x00040000)
+
+// Defines a static function value descriptor for a plain function, e.g.
+//
+//     DI_FUN_STATIC(add_fun, add, 2);
+//     di_t add = di_from_static_fun(&add_fun);
+#define DI_FUN_STATIC(name, funptr, arity) \
+	static const di_fun_t name = {{DI_FUN, 0, 0}, (di_funptr0_t)(funptr), \
+	                              (arity), 0}
+
+static inline bool di_is_static_fun(di_t v) {
+#if defined(NANBOX_64)
+	return (v.as_bits.tag & 0xffff0000) == DI_FUN_STATIC_TAG;
+#else
+	return v.as_bits.tag == DI_FUN_STATIC_TAG;
+#endif
 }
 
-static inline di_t di_call(di_t fun, di_size_t n, ...) {
-	assert(di_is_fun(fun));
-	di_fun_t * f = (di_fun_t *)di_to_pointer(fun);
-	if (n != f->arity - f->cl_size) {
-		fprintf(stderr, "Wrong number of arguments in function call\n");
+static inline di_t di_from_static_fun(const di_fun_t *f) {
+	assert(f->env_size == 0);
+	di_t v;
+#if defined(NANBOX_64)
+	v.as_int64 = ((uint64_t)DI_FUN_STATIC_TAG << 32) | (uintptr_t)f;
+#else
+	v.as_bits.tag = DI_FUN_STATIC_TAG;
+	v.as_bits.payload = (uint32_t)(uintptr_t)f;
+#endif
+	assert(di_is_static_fun(v));
+	return v;
+}
+
+static inline bool di_is_fun(di_t v) {
+	return di_is_static_fun(v) ||
+	       (di_is_pointer(v) && di_to_pointer(v)->tag == DI_FUN);
+}
+
+// The function value descriptor of a function value. (Used internally)
+static inline const di_fun_t *di_to_fun(di_t v) {
+	assert(di_is_fun(v));
+#if defined(NANBOX_64)
+	if (di_is_static_fun(v))
+		return (const di_fun_t *)(uintptr_t)(v.as_int64 &
+		                                     0x0000ffffffffffffllu);
+#else
+	if (di_is_static_fun(v))
+		return (const di_fun_t *)(uintptr_t)v.as_bits.payload;
+#endif
+	return (const di_fun_t *)di_to_pointer(v);
+}
+
+// The number of arguments a function value takes.
+static inline di_size_t di_fun_arity(di_t fun) {
+	return di_to_fun(fun)->arity;
+}
+
+// Creates a function value, allocated together with its environment. The
+// function pointer is cast to di_funptr0_t. If env_size > 0, it's a closure
+// (di_clptrN_t) and the closure vars are copied to the environment. Their
+// reference-counters are incremented, so the function value takes over the
+// ones with refc 0.
+static inline di_t di_fun_create(di_funptr0_t funptr, di_size_t arity,
+                                 const di_t *env, di_size_t env_size) {
+	assert(arity <= DI_FUN_MAX_ARITY);
+	di_fun_t *f = di_alloc(sizeof(di_fun_t) + env_size * sizeof(di_t));
+	if (!f) {
+		fprintf(stderr, "Out of memory\n");
 		exit(1);
 	}
-	va_list va;
-	va_start(va, n);
-	di_t * a = (di_t*)alloca(sizeof(di_t) * n);
+	di_init_tagged(&f->header, DI_FUN);
+	f->funptr   = funptr;
+	f->arity    = arity;
+	f->env_size = env_size;
 	di_size_t i;
-	for (i = 0; i < n; i++)
-		a[i] = va_arg(va, di_t);
-	void * p = f->funptr;
-	switch (n) {
-	case 0: return ((di_funptr0_t)p)();
-	case 1: return ((di_funptr0_t)p)(a[0]);
-	case 2: return ((di_funptr0_t)p)(a[0], a[1]);
-	case 3: return ((di_funptr0_t)p)(a[0], a[1], a[2]);
-	case 4: return ((di_funptr0_t)p)(a[0], a[1], a[2], a[3]);
-	case 5: return ((di_funptr0_t)p)(a[0], a[1], a[2], a[3], a[4]);
-	case 6: return ((di_funptr0_t)p)(a[0], a[1], a[2], a[3], a[4], a[5]);
-	case 7: return ((di_funptr0_t)p)(a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
-	case 8: return ((di_funptr0_t)p)(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
-	default:
-		fprintf(stderr, "To many args.\n");
-		exit(1);
+	for (i = 0; i < env_size; i++) {
+		f->env[i] = di_unborrow(env[i]);
+		di_incref(f->env[i]);
 	}
+	return di_from_pointer(&f->header);
+}
+
+// Reports a call with the wrong number of arguments using di_error().
+void di_fun_arity_error(di_t fun, di_size_t n);
+
+/*
+ * Calls a function value with n arguments. The arguments are passed on as they
+ * are, so the function frees the ones with refc 0. The function value itself
+ * isn't freed. There are entry points for 0-4 arguments, which call the
+ * function pointer directly, and di_apply() for any number of arguments.
+ */
+
+static inline di_t di_call0(di_t fun) {
+	const di_fun_t *f = di_to_fun(fun);
+	if (f->arity != 0)
+		di_fun_arity_error(fun, 0);
+	if (f->env_size == 0)
+		return ((di_funptr0_t)f->funptr)();
+	return ((di_clptr0_t)f->funptr)(f->env);
+}
+
+static inline di_t di_call1(di_t fun, di_t a) {
+	const di_fun_t *f = di_to_fun(fun);
+	if (f->arity != 1)
+		di_fun_arity_error(fun, 1);
+	if (f->env_size == 0)
+		return ((di_funptr1_t)f->funptr)(a);
+	return ((di_clptr1_t)f->funptr)(f->env, a);
+}
+
+static inline di_t di_call2(di_t fun, di_t a, di_t b) {
+	const di_fun_t *f = di_to_fun(fun);
+	if (f->arity != 2)
+		di_fun_arity_error(fun, 2);
+	if (f->env_size == 0)
+		return ((di_funptr2_t)f->funptr)(a, b);
+	return ((di_clptr2_t)f->funptr)(f->env, a, b);
+}
+
+static inline di_t di_call3(di_t fun, di_t a, di_t b, di_t c) {
+	const di_fun_t *f = di_to_fun(fun);
+	if (f->arity != 3)
+		di_fun_arity_error(fun, 3);
+	if (f->env_size == 0)
+		return ((di_funptr3_t)f->funptr)(a, b, c);
+	return ((di_clptr3_t)f->funptr)(f->env, a, b, c);
+}
+
+static inline di_t di_call4(di_t fun, di_t a, di_t b, di_t c, di_t d) {
+	const di_fun_t *f = di_to_fun(fun);
+	if (f->arity != 4)
+		di_fun_arity_error(fun, 4);
+	if (f->env_size == 0)
+		return ((di_funptr4_t)f->funptr)(a, b, c, d);
+	return ((di_clptr4_t)f->funptr)(f->env, a, b, c, d);
+}
+
+// Calls a function value with the n arguments in args.
+di_t di_apply(di_t fun, const di_t *args, di_size_t n);
+
+/*-------*
+ * Tasks *
+ *-------*/
+
+/*
+ * A task is a function call running on one of a number of worker threads. The
+ * workers have a deque of tasks each. A task spawned by a worker is pushed to
+ * its own deque and a worker without tasks steals the oldest task of another
+ * worker. A worker waiting for a task runs other tasks meanwhile, so tasks
+ * can wait for the tasks they spawn.
+ *
+ * The function and the arguments are shared (see di_share()), so the spawning
+ * thread can go on using them. An argument which the task holds the only
+ * reference to is passed to the function as unshared though, so it can be
+ * updated in place, e.g. an array passed to the task and dropped by the
+ * spawning thread.
+ *
+ * The result is handed over to the waiting thread without copying. Each worker
+ * allocates from pools of its own with DI_POOL_ALLOC.
+ */
+
+// The state bits of a task.
+#define DI_TASK_DONE    0x1 // the result is ready
+#define DI_TASK_DROPPED 0x2 // the task value has been freed
+
+typedef struct di_task {
+	di_tagged_t header;
+	di_t fun, args; // while it's waiting to run
+	di_t result;    // when it's done, until it's taken
+	unsigned state;
+} di_task_t;
+
+static inline bool di_is_task(di_t v) {
+	return di_is_pointer(v) &&
+	       di_to_pointer(v)->tag == DI_TASK;
+}
+
+// Starts n worker threads, or one per CPU if n is 0. It's done by the first
+// di_spawn() if it hasn't been done before.
+void di_tasks_start(unsigned n);
+
+// Waits for all tasks to finish and stops the workers.
+void di_tasks_stop(void);
+
+// Starts a task calling fun with the elements of the array args as arguments.
+// Frees or takes over fun and args if their refc is 0, like other functions.
+di_t di_spawn(di_t fun, di_t args);
+
+// Waits for a task to finish and returns its result. The result is taken out of
+// the task, so waiting for the same task again returns null. Frees the task if
+// its refc is 0.
+di_t di_wait(di_t task);
+
+// Frees a task and the values it holds. (Used internally)
+static inline void di_task_free(di_task_t *t) {
+	di_decref_and_free(t->fun);
+	di_decref_and_free(t->args);
+	di_cleanup(t->result);
+	di_free(t, sizeof(di_task_t));
+}
+
+// Releases a task value from the thread holding it. The task is freed by
+// whichever of this and the worker finishing it comes last. (Used internally)
+static inline void di_task_drop(di_task_t *t) {
+	if (__atomic_fetch_or(&t->state, DI_TASK_DROPPED, __ATOMIC_ACQ_REL) &
+	    DI_TASK_DONE)
+		di_task_free(t);
 }
 
 #endif
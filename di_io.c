@@ -1,10 +1,23 @@
+#define _POSIX_C_SOURCE 200809L // fileno, fstat, mmap
 #include "di_io.h"
 #include <assert.h>
 #include <stdio.h>
 
-static FILE * di_fopen(const di_t filename, const char *mode) {
+#if defined(__unix__) || defined(__APPLE__)
+#define DI_IO_MMAP 1
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// The initial buffer size when reading a file which can't be mapped.
+#define DI_IO_CHUNK (64 * 1024)
+
+// Opens a file, or returns NULL if it can't be opened and must_exist is false.
+static FILE * di_fopen(const di_t filename, const char *mode, bool must_exist) {
 	char * fn;
 	char buf[7];
+	di_t copy = di_null();
 	assert(di_is_string(filename));
 	di_size_t name_len = di_string_length(filename);
 	if (name_len < 7) {
@@ -15,43 +28,130 @@ static FILE * di_fopen(const di_t filename, const char *mode) {
 		buf[name_len] = '\0';
 		fn = buf;
 	}
+	else if (!di_string_is_terminated(filename)) {
+		// A view into a longer string. Copy it to get a nul-terminator.
+		copy = di_string_from_chars(di_string_chars(filename), name_len);
+		fn = di_string_chars(copy);
+	}
 	else {
 		// Nul-terminated. Just point fn to the char contents.
 		fn = di_string_chars(filename);
 	}
+	if (!strcmp(fn, "-"))
+		return stdin;
 	FILE * f = fopen(fn, mode);
-	if (!f) {
+	if (!f && must_exist) {
 		fprintf(stderr, "Can't open file %s in mode %s\n", fn, mode);
 		exit(1);
 	}
+	di_cleanup(copy);
 	return f;
 }
 
-di_t di_readfile(di_t filename) {
-	FILE *f = di_fopen(filename, "r");
-	fseek(f, 0L, SEEK_END);
-	long size = ftell(f);
-	rewind(f);
-	if (size < 0) {
-		fprintf(stderr, "Can't check filesize\n");
+static void di_fclose(FILE *f) {
+	if (f != stdin)
 		fclose(f);
-		exit(1);
-	}
-	di_size_t max_size = (di_size_t)-1;
-	if (size > max_size) {
+}
+
+#ifdef DI_IO_MMAP
+static void di_munmap(char *chars, di_size_t length) {
+	munmap(chars, length);
+}
+
+// Maps a regular file into memory and returns it as an external string, or
+// null if it can't be mapped. The bytes after the end of the file up to the
+// end of the last page are zero, which gives the string its nul terminator, so
+// a file whose size is a multiple of the page size is not mapped.
+static di_t di_mapfile(FILE *f) {
+	struct stat st;
+	if (fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode) ||
+	    st.st_size == 0 || st.st_size % sysconf(_SC_PAGESIZE) == 0)
+		return di_null();
+	if ((unsigned long long)st.st_size >= (di_size_t)-1) {
 		fprintf(stderr, "File too large\n");
-		fclose(f);
 		exit(1);
 	}
-	//printf("File size: %ld\n", size);
-	di_t contents = di_string_create_presized((di_size_t)size);
-	char * dst = di_string_chars(contents);
-	size_t nread = fread((void*)dst, (size_t)size, 1, f);
-	if (!nread) {
+	di_size_t size = (di_size_t)st.st_size;
+	char *chars = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+	if (chars == MAP_FAILED)
+		return di_null();
+	return di_string_from_external(chars, size, di_munmap);
+}
+#endif
+
+// Reads a file in chunks until EOF, into a string which is resized as needed.
+// This works for pipes and other files which can't be seeked.
+static di_t di_readstream(FILE *f) {
+	di_size_t cap = DI_IO_CHUNK, len = 0;
+	di_t contents = di_string_create_presized(cap);
+	for (;;) {
+		len += fread(&di_string_chars(contents)[len], 1, cap - len, f);
+		if (len < cap)
+			break;
+		if (cap > (di_size_t)-1 / 2) {
+			fprintf(stderr, "File too large\n");
+			exit(1);
+		}
+		cap *= 2;
+		contents = di_string_resize(contents, cap);
+	}
+	if (ferror(f)) {
 		fprintf(stderr, "Can't read the file contents.\n");
-		fclose(f);
+		di_fclose(f);
 		di_cleanup(contents);
 		exit(1);
 	}
+	contents = di_string_resize(contents, len);
+	if (len > 6)
+		di_string_chars(contents)[len] = '\0';
+	return contents;
+}
+
+static di_t readfile(FILE *f) {
+	di_t contents = di_null();
+#ifdef DI_IO_MMAP
+	contents = di_mapfile(f);
+#endif
+	if (di_is_null(contents))
+		contents = di_readstream(f);
+	di_fclose(f);
 	return contents;
 }
+
+di_t di_readfile(di_t filename) {
+	return readfile(di_fopen(filename, "r", true));
+}
+
+di_t di_tryreadfile(di_t filename) {
+	FILE *f = di_fopen(filename, "r", false);
+	return f ? readfile(f) : di_null();
+}
+
+bool di_writefile(di_t filename, di_t contents) {
+	char name[4096], tmp[4096 + 64];
+	di_size_t name_len = di_string_length(filename);
+	if (name_len >= sizeof(name))
+		return false;
+	memcpy(name, di_string_chars(filename), name_len);
+	name[name_len] = '\0';
+	// The temporary file is unique to the process and the call, so concurrent
+	// writers of the same file don't write to the same temporary file.
+	static unsigned counter = 0;
+	unsigned n = __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+#ifdef DI_IO_MMAP
+	snprintf(tmp, sizeof(tmp), "%s.%ld.%u.tmp", name, (long)getpid(), n);
+#else
+	snprintf(tmp, sizeof(tmp), "%s.%u.tmp", name, n);
+#endif
+	FILE *f = fopen(tmp, "wb");
+	if (!f)
+		return false;
+	di_size_t length = di_string_length(contents);
+	bool ok = fwrite(di_string_chars(contents), 1, length, f) == length;
+	ok = !fclose(f) && ok;
+	if (!ok || rename(tmp, name)) {
+		remove(tmp);
+		return false;
+	}
+	return true;
+}
@@ -4,7 +4,17 @@
 #include "di.h"
 #include <stdio.h>
 
-/* reads an entire file into a string */
+/* reads an entire file into a string. A regular file is mapped into memory
+ * instead of copied, if possible. Other files, e.g. pipes, are read in chunks.
+ * The filename "-" means stdin. */
 di_t di_readfile(di_t filename);
 
+/* Like di_readfile, but returns null if the file can't be opened. */
+di_t di_tryreadfile(di_t filename);
+
+/* Writes a string to a file, replacing the file atomically: the string is
+ * written to a temporary file which is then renamed, so a reader never sees a
+ * partly written file. Returns false on error. Frees nothing. */
+bool di_writefile(di_t filename, di_t contents);
+
 #endif
@@ -3,6 +3,7 @@
  */
 
 #include <pcre.h>
+#include <pthread.h>
 #include <assert.h>
 #include <stdio.h>
 #include "di.h"
@@ -144,6 +145,8 @@ static di_t parse_string(const char *subject, int length) {
     return str;
 }
 
+/* Set up once by prepare_patterns() and only read after that, so lexers can run
+ * in any number of threads. */
 static pcre *word_re = NULL, *operator_re, *div_re, *regex_re, *string_re,
     *num_re, *nl_re, *spaces_re;
 static di_t keyword_dict;
@@ -173,11 +176,10 @@ static pcre *mk_re(const char *regex) {
     return re;
 }
 
-#define str(arg) di_string_from_cstring(arg)
+#define str(arg) di_atom_from_cstring(arg)
 
 static void prepare_patterns(void) {
-    if (word_re)
-        return; /* already done */
+    check_pcre_compile_flags();
     /* compile patterns */
     word_re       = mk_re("\\$?[\\w$]*");  // Conservative: "[a-z]+"
     operator_re   = mk_re("->|<=|=<|>=|≤|≥|==|!=|≠|[<>,:;=+*~@\\-{}\\[\\]()\\\\]");
@@ -196,10 +198,13 @@ static void prepare_patterns(void) {
     };
     int i;
     int n = sizeof(keywords) / sizeof(char *);
+    di_arena_t *arena = di_arena_enter(NULL); // keyword_dict lives forever
     keyword_dict = di_dict_empty();
     for (i = 0; i < n; i++) {
         keyword_dict = di_dict_set(keyword_dict, str(keywords[i]), di_null());
     }
+    keyword_dict = di_share(keyword_dict); // read by all threads
+    di_arena_enter(arena);
 }
 
 /* Adds a level to the layout stack, for automatic insertion of ";" and "end" */
@@ -211,8 +216,8 @@ void push_layout(di_t *layout_ptr, int column, di_t endop) {
 }
 
 di_t di_lexer_create(di_t source) {
-    check_pcre_compile_flags();
-    prepare_patterns();
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, prepare_patterns);
     di_t lexer = di_dict_empty();
     //assert(di_is_array(lexer)); //<-- crash for testing backtraces
     lexer = di_dict_set(lexer, str("source"), source);
@@ -226,11 +231,13 @@ di_t di_lexer_create(di_t source) {
 }
 
 /* Utility pcre_exec wrapper. Om match, returns true and sets *match_start and
- * *match_end, if provided. */
+ * *match_end, if provided. The subject must have been checked to be valid
+ * UTF-8 (see di_lexer_create). */
 static bool re_match(pcre *re, const char *subject, int len, int start,
                      int *match_start, int *match_end) {
     int ovector[3];
-    int rc = pcre_exec(re, NULL, subject, len, start, 0, ovector, 3);
+    int rc = pcre_exec(re, NULL, subject, len, start, PCRE_NO_UTF8_CHECK,
+                       ovector, 3);
     if (rc > 0) {
         if (match_start != NULL) *match_start = ovector[0];
         if (match_end   != NULL) *match_end   = ovector[1];
@@ -243,6 +250,172 @@ static bool re_match(pcre *re, const char *subject, int len, int start,
     }
 }
 
+/* Exits if the subject isn't valid UTF-8. pcre_exec does this check on the
+ * whole subject on every call, unless PCRE_NO_UTF8_CHECK is given, so it's done
+ * once per source instead. */
+static void check_utf8(const char *subject, int len) {
+    int ovector[3];
+    int rc = pcre_exec(spaces_re, NULL, subject, len, 0, 0, ovector, 3);
+    if (rc < PCRE_ERROR_NOMATCH) {
+        fprintf(stderr, "PCRE error: %d\n", rc);
+        exit(rc);
+    }
+}
+
+/* --------- scanners ---------- */
+
+/*
+ * Hand-written scanners for the regexes above. Each one returns the end of the
+ * match at start, SCAN_NOMATCH or SCAN_UNKNOWN. The latter means the input is
+ * some non-ASCII case that isn't worth handling here, so the regex is used.
+ * The scanners must match exactly what the regexes match, so that the token
+ * stream doesn't depend on which of them did the job.
+ */
+
+#define SCAN_NOMATCH (-1)
+#define SCAN_UNKNOWN (-2)
+
+typedef int (*scanner_t)(const unsigned char *s, int len, int start);
+
+static inline bool is_digit(unsigned char c) {
+    return c >= '0' && c <= '9';
+}
+
+static inline bool is_word_char(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || is_digit(c) ||
+        c == '_' || c == '$';
+}
+
+/* Returns the length of the newline sequence at i, as matched by \R, or 0. */
+static inline int newline_length(const unsigned char *s, int len, int i) {
+    switch (s[i]) {
+    case '\n': case '\v': case '\f':
+        return 1;
+    case '\r':
+        return i + 1 < len && s[i + 1] == '\n' ? 2 : 1;
+    case 0xc2: // U+0085 NEL
+        return i + 1 < len && s[i + 1] == 0x85 ? 2 : 0;
+    case 0xe2: // U+2028 LS, U+2029 PS
+        return i + 2 < len && s[i + 1] == 0x80 &&
+            (s[i + 2] == 0xa8 || s[i + 2] == 0xa9) ? 3 : 0;
+    default:
+        return 0;
+    }
+}
+
+/* nl_re: (?:(?:\#|--).*?)?\R */
+static int scan_nl(const unsigned char *s, int len, int i) {
+    int n;
+    if (s[i] == '#' || (s[i] == '-' && i + 1 < len && s[i + 1] == '-')) {
+        // A comment, if there is a newline after it. ('.' doesn't match
+        // newlines, so the first newline ends it.)
+        int j = i + (s[i] == '#' ? 1 : 2);
+        while (j < len && (n = newline_length(s, len, j)) == 0)
+            j++;
+        if (j < len)
+            return j + n;
+    }
+    n = newline_length(s, len, i);
+    return n ? i + n : SCAN_NOMATCH;
+}
+
+/* spaces_re: \h+ */
+static int scan_spaces(const unsigned char *s, int len, int i) {
+    int j = i;
+    while (j < len && (s[j] == ' ' || s[j] == '\t'))
+        j++;
+    if (j < len && s[j] >= 0x80)
+        return SCAN_UNKNOWN; // maybe a Unicode space
+    return j > i ? j : SCAN_NOMATCH;
+}
+
+/* operator_re: ->|<=|=<|>=|≤|≥|==|!=|≠|[<>,:;=+*~@\-{}\[\]()\\] */
+static int scan_operator(const unsigned char *s, int len, int i) {
+    unsigned char next = i + 1 < len ? s[i + 1] : '\0';
+    switch (s[i]) {
+    case '-': return next == '>' ? i + 2 : i + 1;
+    case '<': return next == '=' ? i + 2 : i + 1;
+    case '>': return next == '=' ? i + 2 : i + 1;
+    case '=': return next == '<' || next == '=' ? i + 2 : i + 1;
+    case '!': return next == '=' ? i + 2 : SCAN_NOMATCH;
+    case ',': case ':': case ';': case '+': case '*': case '~': case '@':
+    case '{': case '}': case '[': case ']': case '(': case ')': case '\\':
+        return i + 1;
+    default:
+        return s[i] >= 0x80 ? SCAN_UNKNOWN : SCAN_NOMATCH;
+    }
+}
+
+/* num_re: -?(?:0|[1-9][0-9]*)(?:\.[0-9]+)?(?:[eE][-+]?[0-9]+)? */
+static int scan_num(const unsigned char *s, int len, int i) {
+    int j;
+    if (s[i] == '-')
+        i++;
+    if (i >= len || !is_digit(s[i]))
+        return SCAN_NOMATCH;
+    if (s[i++] != '0')
+        while (i < len && is_digit(s[i]))
+            i++;
+    if (i + 1 < len && s[i] == '.' && is_digit(s[i + 1])) {
+        i += 2;
+        while (i < len && is_digit(s[i]))
+            i++;
+    }
+    if (i < len && (s[i] == 'e' || s[i] == 'E')) {
+        j = i + 1;
+        if (j < len && (s[j] == '-' || s[j] == '+'))
+            j++;
+        if (j < len && is_digit(s[j])) {
+            i = j + 1;
+            while (i < len && is_digit(s[i]))
+                i++;
+        }
+    }
+    return i;
+}
+
+/* string_re: "(?:\\"|[^"\n])*"
+ *
+ * A backslash followed by a quote is taken as an escaped quote. If there is no
+ * closing quote on the line, the regex backtracks to the last escaped quote
+ * and lets it close the string instead. */
+static int scan_string(const unsigned char *s, int len, int i) {
+    int last_escaped = SCAN_NOMATCH;
+    if (s[i] != '"')
+        return SCAN_NOMATCH;
+    for (i++; i < len && s[i] != '\n'; i++) {
+        if (s[i] == '"')
+            return i + 1;
+        if (s[i] == '\\' && i + 1 < len && s[i + 1] == '"')
+            last_escaped = ++i + 1;
+    }
+    return last_escaped;
+}
+
+/* word_re: \$?[\w$]* (may match the empty string) */
+static int scan_word(const unsigned char *s, int len, int i) {
+    while (i < len && is_word_char(s[i]))
+        i++;
+    if (i < len && s[i] >= 0x80)
+        return SCAN_UNKNOWN; // maybe a Unicode letter
+    return i;
+}
+
+/* Like re_match, but tries the scanner first. */
+static bool scan_match(scanner_t scan, pcre *re, const char *subject, int len,
+                       int start, int *match_start, int *match_end) {
+    int end = scan((const unsigned char *)subject, len, start);
+    if (end == SCAN_UNKNOWN)
+        return re_match(re, subject, len, start, match_start, match_end);
+    if (end == SCAN_NOMATCH)
+        return false;
+    if (match_start != NULL) *match_start = start;
+    if (match_end   != NULL) *match_end   = end;
+    return true;
+}
+
+/* --------- end of scanners ---------- */
+
 /* Sets the fields in the provided token and returns the new one */
 static di_t set_token_fields(di_t token, di_t op, di_t data,
                              int line, int column) {
@@ -266,41 +439,62 @@ di_t update_lexer_offsets(di_t lexer, int offset, int line, int column) {
     return lexer;
 }
 
-/* find a token */
-di_t di_lex(di_t * lexer_ptr, di_t old_token) {
-    di_t lexer = *lexer_ptr;
+/* A level of the layout stack: the column of the block and the op ("end" or
+ * "in") to insert when it ends. */
+typedef struct layout_frame {
+    int column;
+    di_t endop;
+} layout_frame_t;
+
+/* The position of a lexer in its source. */
+typedef struct position {
+    int offset, line, column;
+} position_t;
+
+/* A token found by next_token(). Scanning it changes the layout stack by at
+ * most one level: layout is -1 if the top frame is popped and 1 if push is
+ * pushed. */
+typedef struct scanned {
+    di_t op, data;
+    int offset, line, column;
+    int layout;
+    layout_frame_t push;
+} scanned_t;
+
+/* Finds the token at pos, which follows a token with the op prev_op (null for
+ * the first token) and moves pos past it. top is the top of the layout stack,
+ * or NULL if the stack is empty. The caller updates the stack as told by
+ * tok->layout. The op is an atom of at most 6 bytes. */
+static void next_token(const char *subject, int len, position_t *pos,
+                       di_t prev_op, const layout_frame_t *top,
+                       scanned_t *tok) {
+    bool first = di_is_null(prev_op);
     bool accept_regex = true;
-    if (di_is_dict(old_token)) {
-        di_t old_op = di_dict_get(old_token, str("op"));
-        if (di_equal(old_op, str("ident")) ||
-            di_equal(old_op, str("lit")) ||
-            di_equal(old_op, str(")")) ||
-            di_equal(old_op, str("]")) ||
-            di_equal(old_op, str("}"))) accept_regex = false; // division
-    }
-    di_t source = di_dict_get(lexer, str("source"));
-    di_t offset = di_dict_get(lexer, str("offset"));
-    di_t layout = di_dict_get(lexer, str("layout"));
-    int line   = di_to_int(di_dict_get(lexer, str("line")));
-    int column = di_to_int(di_dict_get(lexer, str("column")));
-    di_size_t len = di_string_length(source);
-    char * subject = di_string_chars(source);
-    int start = di_to_int(offset);
+    if (di_equal(prev_op, str("ident")) ||
+        di_equal(prev_op, str("lit")) ||
+        di_equal(prev_op, str(")")) ||
+        di_equal(prev_op, str("]")) ||
+        di_equal(prev_op, str("}"))) accept_regex = false; // division
+    int start  = pos->offset;
+    int line   = pos->line;
+    int column = pos->column;
     int match_start, match_end;
     di_t op;
     di_t data;
-    di_t token = di_null();
+
+    tok->layout = 0;
 
     // Consume leading whitespace and update start, line and column.
     while (start < len) {
         // Consume newline
-        if (re_match(nl_re, subject, len, start, NULL, &start)) {
+        if (scan_match(scan_nl, nl_re, subject, len, start, NULL, &start)) {
             line++;
             column = 1;
             continue;
         }
         // Consume horizontal whitespace
-        if (re_match(spaces_re, subject, len, start, &match_start, &match_end)) {
+        if (scan_match(scan_spaces, spaces_re, subject, len, start,
+                       &match_start, &match_end)) {
             start = match_end;
             int i;
             for (i = match_start; i < match_end; i++) {
@@ -319,32 +513,32 @@ di_t di_lex(di_t * lexer_ptr, di_t old_token) {
         break;
     }
 
+    tok->offset = start;
+    tok->line = line;
+    tok->column = column;
+    tok->data = di_null();
+
     // check layout stack to see if we need to insert 'end' or ';'
-    di_size_t layout_depth = di_array_length(layout);
-    if (di_is_dict(old_token) && layout_depth > 0) {
-        di_t layoutframe = di_array_get(layout, layout_depth - 1);
-        di_t layoutcol   = di_dict_get(layoutframe, str("column"));
-        assert(di_is_int(layoutcol));
-        if (column < di_to_int(layoutcol) || start >= len) {
+    if (!first && top != NULL) {
+        bool insert = false;
+        if (column < top->column || start >= len) {
             // Insert 'end' (or 'in' after 'let') and pop layout stack
-            di_t endop = di_dict_get(layoutframe, str("op"));
-            token = set_token_fields(old_token, endop, di_null(), line, column);
-            // pop the frame from the stack
-            di_cleanup(di_array_pop(&layout));
-            lexer = di_dict_set(lexer, str("layout"), layout);
-        } else if (column == di_to_int(layoutcol)) {
+            tok->op = top->endop;
+            tok->layout = -1;
+            insert = true;
+        } else if (column == top->column) {
             // insert ';' except if the previous token was ';'.
-            di_t old_op = di_dict_get(old_token, str("op"));
-            if (!di_equal(old_op, str(";"))) {
-                token = set_token_fields(old_token, str(";"), di_null(),
-                                         line, column);
+            if (!di_equal(prev_op, str(";"))) {
+                tok->op = str(";");
+                insert = true;
             }
         }
-        // If we have set token above, update lexer state and return the token.
-        if (!di_is_null(token)) {
-            lexer = update_lexer_offsets(lexer, start, line, column);
-            *lexer_ptr = lexer;
-            return token;
+        // If we have inserted a token, update the position and return it.
+        if (insert) {
+            pos->offset = start;
+            pos->line = line;
+            pos->column = column;
+            return;
         }
     }
 
@@ -352,12 +546,14 @@ di_t di_lex(di_t * lexer_ptr, di_t old_token) {
     if (start >= len) {
         op = str("eof");
         data = di_null();
+        match_start = match_end = start;
         goto found;
     }
 
     // Match tokens
-    if (re_match(operator_re, subject, len, start, &match_start, &match_end)) {
-        op = di_string_from_chars(subject + start, match_end - match_start);
+    if (scan_match(scan_operator, operator_re, subject, len, start,
+                   &match_start, &match_end)) {
+        op = di_atom(subject + start, match_end - match_start);
         // Normalize operators
         if (di_equal(op, str("≥")))
             op = str(">=");
@@ -369,13 +565,15 @@ di_t di_lex(di_t * lexer_ptr, di_t old_token) {
         goto found;
     }
 
-    if (re_match(num_re, subject, len, start, &match_start, &match_end)) {
+    if (scan_match(scan_num, num_re, subject, len, start,
+                   &match_start, &match_end)) {
         op = str("lit");
         data = parse_number(subject + start, match_end - match_start);
         goto found;
     }
 
-    if (re_match(string_re, subject, len, start, &match_start, &match_end)) {
+    if (scan_match(scan_string, string_re, subject, len, start,
+                   &match_start, &match_end)) {
         op = str("lit");
         data = parse_string(subject + start, match_end - match_start);
         goto found;
@@ -398,10 +596,16 @@ di_t di_lex(di_t * lexer_ptr, di_t old_token) {
         }
     }
 
-    if (re_match(word_re, subject, len, start, &match_start, &match_end)) {
+    // The word regex matches the empty string, which isn't a token. Lexing
+    // would never get past it.
+    if (scan_match(scan_word, word_re, subject, len, start,
+                   &match_start, &match_end) && match_end > match_start) {
+        // Only keywords are atoms. Identifiers are strings, freed with the
+        // tokens.
         data = di_string_from_chars(subject + start, match_end - match_start);
         if (di_dict_contains(keyword_dict, data)) {
-            op = data;
+            di_cleanup(data);
+            op = di_atom(subject + start, match_end - match_start);
             data = di_null();
         }
         else if (di_equal(data, str("false"))) {
@@ -432,41 +636,160 @@ di_t di_lex(di_t * lexer_ptr, di_t old_token) {
     // Here op, data, line and column are set for the found token.
 
     if ((di_equal(op, str("end")) || di_equal(op, str("in")))
-        && di_array_length(layout) > 0) {
+        && top != NULL) {
         // If token is "end" or "in", pop the layout stack if it matches, so we
         // don't insert tokens that are explicitly provided.
-        di_t layoutframe = di_array_get(layout, di_array_length(layout) - 1);
-        di_t endop = di_dict_get(layoutframe, str("op"));
-        if (di_equal(op, endop)) {
-            di_cleanup(di_array_pop(&layout));
-            lexer = di_dict_set(lexer, str("layout"), layout);
-        }
-    } else if (di_is_dict(old_token)) {
-        // If old_token is do/of/let/where, add the current column to the layout
-        // stack.
-        di_t old_op = di_dict_get(old_token, str("op"));
-        if (di_equal(old_op, str("do")) || di_equal(old_op, str("of"))
-            || di_equal(old_op, str("where"))) {
-            push_layout(&layout, column, str("end"));
-            lexer = di_dict_set(lexer, str("layout"), layout);
-        } else if (di_equal(old_op, str("let"))) {
-            push_layout(&layout, column, str("in"));
-            lexer = di_dict_set(lexer, str("layout"), layout);
+        if (di_equal(op, top->endop))
+            tok->layout = -1;
+    } else if (!first) {
+        // If the previous token is do/of/let/where, add the current column to
+        // the layout stack.
+        if (di_equal(prev_op, str("do")) || di_equal(prev_op, str("of"))
+            || di_equal(prev_op, str("where"))) {
+            tok->layout = 1;
+            tok->push.column = column;
+            tok->push.endop = str("end");
+        } else if (di_equal(prev_op, str("let"))) {
+            tok->layout = 1;
+            tok->push.column = column;
+            tok->push.endop = str("in");
         }
     }
 
-    // Create token dict
-    token = set_token_fields(old_token, op, data, line, column);
+    tok->op = op;
+    tok->data = data;
 
-    // Update lexer offsets
-    start = match_end;
-    column += match_end - match_start;
-    lexer = update_lexer_offsets(lexer, start, line, column);
-    lexer = di_dict_set(lexer, str("offset"), di_from_int(start));
-    lexer = di_dict_set(lexer, str("line"), di_from_int(line));
-    lexer = di_dict_set(lexer, str("column"), di_from_int(column));
+    // Update the position
+    pos->offset = match_end;
+    pos->line = line;
+    pos->column = column + match_end - match_start;
+}
+
+/* find a token */
+di_t di_lex(di_t * lexer_ptr, di_t old_token) {
+    di_t lexer = *lexer_ptr;
+    di_t old_op = (di_is_dict(old_token) ?
+                   di_dict_get(old_token, str("op")) : di_null());
+    di_t source = di_dict_get(lexer, str("source"));
+    di_t layout = di_dict_get(lexer, str("layout"));
+    position_t pos;
+    pos.offset = di_to_int(di_dict_get(lexer, str("offset")));
+    pos.line   = di_to_int(di_dict_get(lexer, str("line")));
+    pos.column = di_to_int(di_dict_get(lexer, str("column")));
+    di_size_t len = di_string_length(source);
+    char * subject = di_string_chars(source);
+
+    if (!di_is_dict(old_token))
+        check_utf8(subject, len); // first token
+
+    layout_frame_t top;
+    di_size_t layout_depth = di_array_length(layout);
+    if (layout_depth > 0) {
+        di_t layoutframe = di_array_get(layout, layout_depth - 1);
+        di_t layoutcol   = di_dict_get(layoutframe, str("column"));
+        assert(di_is_int(layoutcol));
+        top.column = di_to_int(layoutcol);
+        top.endop  = di_dict_get(layoutframe, str("op"));
+    }
+
+    scanned_t tok;
+    next_token(subject, len, &pos, old_op, layout_depth > 0 ? &top : NULL,
+               &tok);
+
+    if (tok.layout < 0) {
+        // pop the frame from the stack
+        di_cleanup(di_array_pop(&layout));
+        lexer = di_dict_set(lexer, str("layout"), layout);
+    } else if (tok.layout > 0) {
+        push_layout(&layout, tok.push.column, tok.push.endop);
+        lexer = di_dict_set(lexer, str("layout"), layout);
+    }
+
+    // Create token dict
+    di_t token = set_token_fields(old_token, tok.op, tok.data,
+                                  tok.line, tok.column);
 
     // Return lexer (by pointer) and token (normal return)
-    *lexer_ptr = lexer;
+    *lexer_ptr = update_lexer_offsets(lexer, pos.offset, pos.line, pos.column);
     return token;
 }
+
+/* Allocates or resizes the arrays of a token buffer to hold n tokens. */
+static void resize_tokens(di_tokens_t *tokens, di_size_t n) {
+    di_size_t old = tokens->capacity;
+#define RESIZE(field, size)                                             \
+    tokens->field = (old ? di_realloc(tokens->field, n * (size), old * (size)) \
+                     : di_alloc(n * (size)))
+    RESIZE(ops, sizeof(di_t));
+    RESIZE(offsets, sizeof(uint32_t));
+    RESIZE(lines, sizeof(uint32_t));
+    RESIZE(columns, sizeof(uint32_t));
+    RESIZE(data, sizeof(uint32_t));
+#undef RESIZE
+    tokens->capacity = n;
+}
+
+void di_lex_all(di_tokens_t *tokens, di_t source) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, prepare_patterns);
+    const char *subject = di_string_chars(source);
+    int len = di_string_length(source);
+    check_utf8(subject, len);
+
+    // A token per 4 bytes is a generous guess for most sources.
+    tokens->length = tokens->capacity = 0;
+    resize_tokens(tokens, len / 4 + 16);
+    tokens->values = di_array_empty();
+
+    // The layout stack, starting with the implicit top-level "do"
+    di_size_t depth = 1, room = 16;
+    layout_frame_t *layout = di_alloc(room * sizeof(layout_frame_t));
+    layout[0].column = 1;
+    layout[0].endop = str("end");
+
+    position_t pos = {0, 1, 1};
+    di_t prev_op = di_null();
+    scanned_t tok;
+    do {
+        next_token(subject, len, &pos, prev_op,
+                   depth > 0 ? &layout[depth - 1] : NULL, &tok);
+        if (tok.layout < 0) {
+            depth--;
+        } else if (tok.layout > 0) {
+            if (depth == room) {
+                layout = di_realloc(layout, 2 * room * sizeof(layout_frame_t),
+                                    room * sizeof(layout_frame_t));
+                room *= 2;
+            }
+            layout[depth++] = tok.push;
+        }
+        if (tokens->length == tokens->capacity)
+            resize_tokens(tokens, 2 * tokens->capacity);
+        di_size_t i = tokens->length++;
+        tokens->ops[i] = tok.op;
+        tokens->offsets[i] = (uint32_t)tok.offset;
+        tokens->lines[i] = (uint32_t)tok.line;
+        tokens->columns[i] = (uint32_t)tok.column;
+        if (di_is_null(tok.data)) {
+            tokens->data[i] = DI_NO_DATA;
+        } else {
+            tokens->data[i] = di_array_length(tokens->values);
+            di_array_push(&tokens->values, tok.data);
+        }
+        prev_op = tok.op;
+    } while (!di_equal(tok.op, str("eof")));
+
+    di_free(layout, room * sizeof(layout_frame_t));
+    di_cleanup(source);
+}
+
+void di_tokens_free(di_tokens_t *tokens) {
+    di_size_t n = tokens->capacity;
+    di_free(tokens->ops, n * sizeof(di_t));
+    di_free(tokens->offsets, n * sizeof(uint32_t));
+    di_free(tokens->lines, n * sizeof(uint32_t));
+    di_free(tokens->columns, n * sizeof(uint32_t));
+    di_free(tokens->data, n * sizeof(uint32_t));
+    di_cleanup(tokens->values);
+    tokens->length = tokens->capacity = 0;
+}
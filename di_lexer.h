@@ -1,6 +1,41 @@
+#ifndef DI_LEXER_H
+#define DI_LEXER_H
+
 #include "di.h"
 
 di_t di_lexer_create(di_t source);
 
 /* find a token */
 di_t di_lex(di_t * lexer, di_t old_token);
+
+/* The tokens of a whole source, lexed by di_lex_all(), as a struct of arrays
+ * indexed by token number. The ops are the same as in the token dicts returned
+ * by di_lex(), with the layout rule applied. They are atoms of at most 6 bytes,
+ * so they can be compared by their bit patterns. A token starts at the byte
+ * offsets[i] of the source, on line lines[i] and column columns[i]. The data of
+ * a literal, identifier or regex is in values at index data[i], which is
+ * DI_NO_DATA for other tokens and for the literal null. The last token is
+ * "eof". */
+typedef struct di_tokens {
+    di_size_t length, capacity;
+    di_t *ops;
+    uint32_t *offsets, *lines, *columns, *data;
+    di_t values;
+} di_tokens_t;
+
+#define DI_NO_DATA UINT32_MAX
+
+/* Lexes a whole source into a token buffer, which is freed by di_tokens_free.
+ * Frees the source if its refc == 0. */
+void di_lex_all(di_tokens_t *tokens, di_t source);
+
+void di_tokens_free(di_tokens_t *tokens);
+
+/* Returns the data of token i, or null if it has none. The value is borrowed
+ * from the token buffer. */
+static inline di_t di_token_data(const di_tokens_t *tokens, di_size_t i) {
+    uint32_t j = tokens->data[i];
+    return j == DI_NO_DATA ? di_null() : di_array_get(tokens->values, j);
+}
+
+#endif
@@ -3,6 +3,7 @@
 #include "di.h"
 #include "di_lexer.h"
 #include "di_parser.h"
+#include "di_regex.h"
 
 /*----------------------------------------------------------------------------
  * Parsers for some of the main levels in the syntax
@@ -10,10 +11,15 @@
 
 di_t di_parse(di_t source);
 
+/* The parser state: the tokens of the source and the current token. */
+typedef struct parser {
+    const di_tokens_t *tokens;
+    di_size_t pos;
+} parser_t;
+
 // Forward declarations
-static di_t create_parser(di_t source);
-static di_t block(di_t *p, int l, int c);
-static di_t expr(di_t *p);
+static di_t block(parser_t *p, int l, int c);
+static di_t expr(parser_t *p);
 static void validate_expr(di_t e);
 static void validate_pattern(di_t e);
 static void validate_array(di_t es, void (*validator)(di_t));
@@ -21,18 +27,24 @@ static void validate_array(di_t es, void (*validator)(di_t));
 /* Parses source code and returns parse tree. The root node is an array of
  * expressions. */
 di_t di_parse(di_t source) {
-    di_t p = create_parser(source);
-    di_t ast = block(&p, 1, 1);
-    di_cleanup(p);
+    di_tokens_t tokens;
+    di_lex_all(&tokens, source);
+    di_t ast = di_parse_tokens(&tokens);
+    di_tokens_free(&tokens);
     return ast;
 }
 
+di_t di_parse_tokens(const di_tokens_t *tokens) {
+    parser_t p = {tokens, 0};
+    return block(&p, 1, 1);
+}
+
 /*----------------------------------------------------------------------------
  * Helpers for setting parser flags, raising errors, fetching tokens, etc.
  *----------------------------------------------------------------------------*/
 
 static inline di_t str(const char *chars) {
-    return di_string_from_cstring(chars);
+    return di_atom_from_cstring(chars);
 }
 
 /* Set to true when expecting a pattern and false when expecting expr. */
@@ -45,41 +57,22 @@ static inline void error(di_t message, int line, int col) {
     exit(-1);
 }
 
-// fetches a new current token to the parser state.
-static void fetch_next_token(di_t *p) {
-    di_t token_str = str("token");
-    di_t old_token = di_dict_get(*p, token_str);
-    di_t lexer_str = str("lexer");
-    di_t lexer = di_dict_get(*p, lexer_str);
-    di_t token = di_lex(&lexer, old_token);
-    *p = di_dict_set(*p, lexer_str, lexer);
-    *p = di_dict_set(*p, token_str, token);
-}
-
-static di_t create_parser(di_t source) {
-    di_t lexer = di_lexer_create(source);
-    di_t p = di_dict_empty();
-    p = di_dict_set(p, str("lexer"), lexer);
-    p = di_dict_set(p, str("token"), di_null());
-    fetch_next_token(&p);
-    return p;
+// fetches a new current token to the parser state. The last token, eof, is
+// never passed.
+static inline void fetch_next_token(parser_t *p) {
+    if (p->pos + 1 < p->tokens->length)
+        p->pos++;
 }
 
 // Returns the op of the current token and sets line and col.
-static di_t get_token_op(const di_t *p, int *line, int *col) {
-    di_t token = di_dict_get(*p, str("token"));
-    *line = di_to_int(di_dict_get(token, str("line")));
-    *col  = di_to_int(di_dict_get(token, str("column")));
-    return  di_dict_get(token, str("op"));
+static di_t get_token_op(const parser_t *p, int *line, int *col) {
+    *line = p->tokens->lines[p->pos];
+    *col  = p->tokens->columns[p->pos];
+    return p->tokens->ops[p->pos];
 }
 
-static bool is_token(const di_t *p, const char *token_op) {
-    di_t expect = str(token_op);
-    di_t token = di_dict_get(*p, str("token"));
-    di_t op = di_dict_get(token, str("op"));
-    bool ok = di_equal(expect, op);
-    di_cleanup(expect);
-    return ok;
+static inline bool is_token(const parser_t *p, const char *token_op) {
+    return di_equal(str(token_op), p->tokens->ops[p->pos]);
 }
 
 // NULL-terminated args
@@ -98,30 +91,31 @@ static di_t mkdict(const char *k1, di_t v1, ...) {
 }
 
 // Returns the data of the current token in the parser state.
-static di_t get_token_data(di_t *p) {
-    di_t token = di_dict_get(*p, str("token"));
-    di_t data  = di_dict_get(token, str("data"));
-    return data;
+static di_t get_token_data(parser_t *p) {
+    return di_token_data(p->tokens, p->pos);
 }
 
 // Sets the position of the current token in the parser state.
-static void copy_token_pos(di_t *p, int *line, int *col) {
-    if (!line && !col) return;
-    di_t token = di_dict_get(*p, str("token"));
-    if (line) {
-        di_t l = di_dict_get(token, str("line"));
-        *line = di_to_int(l);
-    }
-    if (col) {
-        di_t c = di_dict_get(token, str("column"));
-        *col  = di_to_int(c);
-    }
+static void copy_token_pos(parser_t *p, int *line, int *col) {
+    if (line)
+        *line = p->tokens->lines[p->pos];
+    if (col)
+        *col  = p->tokens->columns[p->pos];
+}
+
+// Raises a parse error if a regex literal isn't a valid PCRE pattern.
+static void validate_regex(di_t regex, int line, int col) {
+    di_t message;
+    di_t re = di_regex_compile(di_borrow(regex), &message);
+    if (di_is_null(re))
+        error(message, line, col);
+    di_cleanup(re);
 }
 
 // if token matches, sets line and col, discards the token and returns true.
 // otherwise returns false and leaves line, col and the current token in the
 // parser state unchanged.
-static bool try_token(di_t *p, int *line, int *col, const char *token_op) {
+static bool try_token(parser_t *p, int *line, int *col, const char *token_op) {
     bool ok = is_token(p, token_op);
     if (ok) {
         copy_token_pos(p, line, col);
@@ -131,7 +125,7 @@ static bool try_token(di_t *p, int *line, int *col, const char *token_op) {
 }
 
 // consumes a token and asserts that its op is token_op.
-static void eat(di_t *p, const char *token_op) {
+static void eat(parser_t *p, const char *token_op) {
     di_t expect = str(token_op);
     int l, c; // line and col
     di_t op = get_token_op(p, &l, &c);
@@ -149,7 +143,7 @@ static void eat(di_t *p, const char *token_op) {
     error(message, l, c);
 }
 
-static void error_unexpected_token(di_t *p) {
+static void error_unexpected_token(parser_t *p) {
     int l, c; // line and col
     di_t op = get_token_op(p, &l, &c);
     di_t message = str("Unexpected ");
@@ -189,7 +183,7 @@ static di_t mkexpr(const char *op, int line, int col, ...) {
 }
 
 // [{"syntax": "clause", "pats": [pattern], "body": expr}, ...]
-static di_t case_clauses(di_t *p) {
+static di_t case_clauses(parser_t *p) {
     int l, c;
     di_t clauses = di_array_empty();
     do {
@@ -265,7 +259,7 @@ static di_t add_func_def_clause(di_t funcdefs, di_t e) {
 
 // Body of a `do expr ; ... end` construct. Expressions and function definitions
 // are partitioned.
-static di_t block(di_t *p, int l, int c) {
+static di_t block(parser_t *p, int l, int c) {
     di_t es = di_array_empty();
     di_t fs = di_dict_empty();
     do {
@@ -302,7 +296,7 @@ static di_t mkbinopexpr(const char *op_str, di_t left, di_t right) {
 // Parses a sequence of nextexpr nodes separated by any of the supplied tokens,
 // passed as an di_t array of di_t strings
 // expr -> nextexpr (binop nextexpr)*
-static di_t leftassoc_expr(di_t *p, di_t (*nextexpr)(di_t *p), ...) {
+static di_t leftassoc_expr(parser_t *p, di_t (*nextexpr)(parser_t *p), ...) {
     va_list va;
     di_t e1 = nextexpr(p);
     char const *arg;
@@ -321,14 +315,14 @@ static di_t leftassoc_expr(di_t *p, di_t (*nextexpr)(di_t *p), ...) {
     return e1;
 }
 
-static di_t expr0(di_t *p);
-static di_t expr1(di_t *p);
-static di_t expr2(di_t *p);
-static di_t expr3(di_t *p);
-static di_t expr4(di_t *p);
-static di_t expr5(di_t *p);
+static di_t expr0(parser_t *p);
+static di_t expr1(parser_t *p);
+static di_t expr2(parser_t *p);
+static di_t expr3(parser_t *p);
+static di_t expr4(parser_t *p);
+static di_t expr5(parser_t *p);
 
-static di_t expr(di_t *p) {
+static di_t expr(parser_t *p) {
     // "=" is right associative
     di_t e0 = expr0(p);
     if (try_token(p, NULL, NULL, "=")) {
@@ -338,25 +332,25 @@ static di_t expr(di_t *p) {
     return e0;
 }
 
-static di_t expr0(di_t *p) {
+static di_t expr0(parser_t *p) {
     return leftassoc_expr(p, expr1, "and", "or", NULL);
 }
 
-static di_t expr1(di_t *p) {
+static di_t expr1(parser_t *p) {
     return leftassoc_expr(p, expr2, "<", ">", "=<", ">=", "==", "!=", NULL);
 }
 
-static di_t expr2(di_t *p) {
+static di_t expr2(parser_t *p) {
     return leftassoc_expr(p, expr3, "+", "-", "~", "@", NULL);
 }
 
-static di_t expr3(di_t *p) {
+static di_t expr3(parser_t *p) {
     return leftassoc_expr(p, expr4, "*", "/", "div", "mod", NULL);
 }
 
 // expr -> expr '(' arg, arg, ... ')' (function application)
 // expr -> expr '{' key: val, ... '}' (dict update)
-static di_t expr4(di_t *p) {
+static di_t expr4(parser_t *p) {
     di_t e = expr5(p);
     int l, c;
     while (1) {
@@ -398,7 +392,7 @@ static di_t expr4(di_t *p) {
     return e;
 }
 
-static di_t expr5(di_t *p) {
+static di_t expr5(parser_t *p) {
     int l, c; // line and col
     if (try_token(p, &l, &c, "case")) {
         di_t subj = expr(p);
@@ -470,6 +464,7 @@ static di_t expr5(di_t *p) {
     } else if (is_token(p, "regex")) {
         di_t re = get_token_data(p);
         copy_token_pos(p, &l, &c);
+        validate_regex(re, l, c);
         di_t e = mkexpr("regex", l, c, "regex", re, NULL);
         fetch_next_token(p);
         return e;
@@ -2,7 +2,12 @@
 #define DI_PARSER_H
 
 #include "di.h"
+#include "di_lexer.h"
 
 di_t di_parse(di_t source);
 
+/* Parses the tokens of a source, lexed by di_lex_all(). Doesn't free the
+ * tokens. */
+di_t di_parse_tokens(const di_tokens_t *tokens);
+
 #endif
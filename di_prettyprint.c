@@ -2,114 +2,110 @@
 #include <stdbool.h>
 #include "di.h"
 #include "di_prettyprint.h"
+#include "di_regex.h"
+#include "di_writer.h"
 
 #define STEP 2 /* indentation per level */
 
+// Writes a string literal, with the chars between escapes in runs.
+static void write_string_literal(di_writer_t *w, di_t value) {
+    const char *chars = di_string_chars(value);
+    const char *end = chars + di_string_length(value);
+    di_write_char(w, '"');
+    while (chars < end) {
+        const char *run = chars;
+        // Escapes: \" \\ \/ \b \f \n \r \t \uHHHH.
+        // We don't generate \uHHHH escapes. Plain UTF-8 is fine.
+        while (chars < end && *chars != '"' && *chars != '\\' &&
+               *chars != '/' && *chars != '\b' && *chars != '\f' &&
+               *chars != '\n' && *chars != '\r' && *chars != '\t')
+            chars++;
+        di_write(w, run, chars - run);
+        if (chars == end)
+            break;
+        di_write_char(w, '\\');
+        switch (*chars) {
+        case '\b': di_write_char(w, 'b'); break;
+        case '\f': di_write_char(w, 'f'); break;
+        case '\n': di_write_char(w, 'n'); break;
+        case '\r': di_write_char(w, 'r'); break;
+        case '\t': di_write_char(w, 't'); break;
+        default: di_write_char(w, *chars);
+        }
+        chars++;
+    }
+    di_write_char(w, '"');
+}
+
 /* Value to source code. Does not free value. */
-di_t di_to_source(di_t value, int indent) {
+void di_write_source(di_writer_t *w, di_t value, int indent) {
     if (di_is_int(value)) {
-        char buf[32];
-        snprintf(buf, 32, "%d", di_to_int(value));
-        return di_string_from_cstring(buf);
+        di_write_int(w, di_to_int(value));
     } else if (di_is_double(value)) {
-        char buf[50];
-        snprintf(buf, 50, "%f", di_to_double(value));
-        return di_string_from_cstring(buf);
+        di_writef(w, "%f", di_to_double(value));
     } else if (di_is_string(value)) {
-        char *chars = di_string_chars(value);
-        di_size_t length = di_string_length(value);
-        // compute literal length;
-        di_size_t len = 2; // enclosing quotes
-        for (di_size_t i = 0; i < length; i++) {
-            char c = chars[i];
-            // Escapes: \" \\ \/ \b \f \n \r \t \uHHHH
-            if (c == '"' || c == '\\' || c == '/' || c == '\b' || c == '\f' ||
-                c == '\n' || c == '\r' || c == '\t') len += 2;
-            else len++;
-        }
-        di_t lit_str = di_string_create_presized(len);
-        char *lit = di_string_chars(lit_str);
-        lit[0] = lit[len - 1] = '"'; // enclosing quotes
-        di_size_t j = 1;             // position in lit
-        for (di_size_t i = 0; i < length; i++) {
-            char c = chars[i];
-            // Escapes: \" \\ \/ \b \f \n \r \t \uHHHH.
-            // We don't generate \uHHHH escapes. Plain UTF-8 is fine.
-            if (c == '"' || c == '\\' || c == '/' || c == '\b' || c == '\f' ||
-                c == '\n' || c == '\r' || c == '\t') {
-                lit[j++] = '\\';
-                switch (chars[i]) {
-                case '\b': lit[j++] = 'b'; break;
-                case '\f': lit[j++] = 'f'; break;
-                case '\n': lit[j++] = 'n'; break;
-                case '\r': lit[j++] = 'r'; break;
-                case '\t': lit[j++] = 't'; break;
-                default: lit[j++] = chars[i];
-                }
-            } else {
-                lit[j++] = chars[i];
-            }
-        }
-        return lit_str;
+        write_string_literal(w, value);
     } else if (di_is_null(value)) {
-        return di_string_from_cstring("null");
+        di_write_cstring(w, "null");
     } else if (di_is_false(value)) {
-        return di_string_from_cstring("false");
+        di_write_cstring(w, "false");
     } else if (di_is_true(value)) {
-        return di_string_from_cstring("true");
+        di_write_cstring(w, "true");
     } else if (di_is_array(value)) {
         int n = di_array_length(value);
-        if (n == 0)
-            return di_string_from_cstring("[]");
-        di_t str = di_string_from_cstring("[\n");
-        char buf[80];
-        snprintf(buf, 80, "%*s", indent + STEP, "");
+        if (n == 0) {
+            di_write_cstring(w, "[]");
+            return;
+        }
+        di_write_cstring(w, "[\n");
         for (int i = 0; i < n; i++) {
-            str = di_string_append_chars(str, buf, strlen(buf));
-            di_t elem = di_array_get(value, i);
-            str = di_string_concat(str, di_to_source(elem, indent + STEP));
+            di_write_spaces(w, indent + STEP);
+            di_write_source(w, di_array_get(value, i), indent + STEP);
             if (i < n - 1)
-                str = di_string_append_chars(str, ",", 1);
-            str = di_string_append_chars(str, "\n", 1);
+                di_write_char(w, ',');
+            di_write_char(w, '\n');
         }
-        snprintf(buf, 80, "%*s]", indent, "");
-        str = di_string_append_chars(str, buf, strlen(buf));
-        return str;
+        di_write_spaces(w, indent);
+        di_write_char(w, ']');
     } else if (di_is_dict(value)) {
         di_size_t n = di_dict_size(value);
-        if (n == 0)
-            return di_string_from_cstring("{}");
-        di_t str = di_string_from_cstring("{\n");
+        if (n == 0) {
+            di_write_cstring(w, "{}");
+            return;
+        }
+        di_write_cstring(w, "{\n");
         di_size_t cursor = 0, i = 0;
         di_t k, v;
-        char buf[80];
-        snprintf(buf, 80, "%*s", indent + STEP, "");
         while ((cursor = di_dict_iter(value, cursor, &k, &v)) != 0) {
-            str = di_string_append_chars(str, buf, strlen(buf));
-            di_t keystr = di_to_source(k, indent + STEP);
-            str = di_string_concat(str, keystr);
-            str = di_string_append_chars(str, ": ", 2);
-            str = di_string_concat(str, di_to_source(v, indent + STEP));
+            di_write_spaces(w, indent + STEP);
+            di_write_source(w, k, indent + STEP);
+            di_write_cstring(w, ": ");
+            di_write_source(w, v, indent + STEP);
             if (i++ < n - 1)
-                str = di_string_append_chars(str, ",", 1);
-            str = di_string_append_chars(str, "\n", 1);
+                di_write_char(w, ',');
+            di_write_char(w, '\n');
         }
-        snprintf(buf, 80, "%*s}", indent, "");
-        str = di_string_append_chars(str, buf, strlen(buf));
-        return str;
+        di_write_spaces(w, indent);
+        di_write_char(w, '}');
     } else if (di_is_undefined(value)) {
-        return di_string_from_cstring("(undefined)");
+        di_write_cstring(w, "(undefined)");
     } else if (di_is_deleted(value)) {
-        return di_string_from_cstring("(deleted)");
+        di_write_cstring(w, "(deleted)");
     } else if (di_is_empty(value)) {
-        return di_string_from_cstring("(empty)");
+        di_write_cstring(w, "(empty)");
+    } else if (di_is_regex(value)) {
+        di_write_char(w, '/');
+        di_write_string(w, di_regex_pattern(value));
+        di_write_char(w, '/');
     }
     //assert(0); // not implemented for any other types
-    return di_null();
 }
 
-static inline di_t pp_literal(di_t value) {
-    return di_to_source(value, 0);
+di_t di_to_source(di_t value, int indent) {
+    di_writer_t w;
+    di_writer_init_string(&w);
+    di_write_source(&w, value, indent);
+    return di_writer_finish_string(&w);
 }
 
 // just a shorter name for di_string_from_cstring
@@ -117,9 +113,10 @@ static inline di_t s(char * const cstring) {
     return di_string_from_cstring(cstring);
 }
 
-// prints a di string.
-static inline void ps(di_t s) {
-    printf("%.*s", di_string_length(s), di_string_chars(s));
+// Writes a newline followed by indentation.
+static inline void newline(di_writer_t *w, int indent) {
+    di_write_char(w, '\n');
+    di_write_spaces(w, indent);
 }
 
 // true iff op is a binary operator.
@@ -139,9 +136,8 @@ static inline bool is_binop(di_t pp, di_t op) {
 static di_t create_pp(void) {
     di_t pp = di_dict_empty();
     di_t binops = di_array_empty();
-    char * ops[] = {"and", "or", "<", ">", "≤", "≥", "≠", "==",
-        "=",
-        "!=", "@", "~", "+", "-", "*", "/", "mod"};
+    char * ops[] = {"and", "or", "<", ">", "=<", ">=", "==", "!=", "=",
+        "@", "~", "+", "-", "*", "/", "div", "mod"};
     int i;
     for (i = 0; i < sizeof(ops) / sizeof(char *); i++) {
         di_array_push(&binops, s(ops[i]));
@@ -150,131 +146,168 @@ static di_t create_pp(void) {
     return pp;
 }
 
-static void expr(di_t pp, di_t e, int indent);
+static void expr(di_writer_t *w, di_t pp, di_t e, int indent);
 
-static void exprs(di_t pp, di_t es, int indent) {
+// Writes the elements of an array of expressions, separated by ", ".
+static void args(di_writer_t *w, di_t pp, di_t es, int indent) {
     di_size_t n = di_array_length(es);
     for (di_size_t i = 0; i < n; i++) {
-        if (i > 0) printf("\n");
-        if (indent > 0)
-            printf("%*s", indent, "");
-        di_t e = di_array_get(es, i);
-        expr(pp, e, indent);
+        if (i > 0)
+            di_write_cstring(w, ", ");
+        expr(w, pp, di_array_get(es, i), indent);
     }
 }
 
-static void expr(di_t pp, di_t e, int indent) {
-    di_t op = di_dict_get(e, s("expr"));
+// Writes the entries of a dict or a dict update.
+static void entries(di_writer_t *w, di_t pp, di_t es, int indent) {
+    int n = di_array_length(es);
+    di_write_char(w, '{');
+    for (int i = 0; i < n; i++) {
+        di_t entry = di_array_get(es, i);
+        expr(w, pp, di_dict_get(entry, s("key")), indent + 1);
+        di_write_cstring(w, ": ");
+        expr(w, pp, di_dict_get(entry, s("value")), indent + 1);
+        if (i < n - 1) {
+            di_write_char(w, ',');
+            newline(w, indent + 1);
+        }
+    }
+    di_write_char(w, '}');
+}
+
+// Writes the function definitions and then the expressions of a block, each
+// on a line of its own.
+static void block(di_writer_t *w, di_t pp, di_t b, int indent) {
+    di_t defs = di_dict_get(b, s("defs"));
+    di_t seq = di_dict_get(b, s("seq"));
+    bool first = true;
+    if (di_is_dict(defs)) {
+        di_size_t cursor = 0;
+        di_t name, def;
+        while ((cursor = di_dict_iter(defs, cursor, &name, &def)) != 0) {
+            di_t clauses = di_dict_get(def, s("clauses"));
+            di_size_t n = di_array_length(clauses);
+            for (di_size_t i = 0; i < n; i++) {
+                di_t clause = di_array_get(clauses, i);
+                if (!first)
+                    di_write_char(w, '\n');
+                first = false;
+                di_write_spaces(w, indent);
+                di_write_string(w, name);
+                di_write_char(w, '(');
+                args(w, pp, di_dict_get(clause, s("pats")), indent);
+                di_write_cstring(w, ") = ");
+                expr(w, pp, di_dict_get(clause, s("body")), indent);
+            }
+        }
+    }
+    di_size_t n = di_array_length(seq);
+    for (di_size_t i = 0; i < n; i++) {
+        if (!first)
+            di_write_char(w, '\n');
+        first = false;
+        di_write_spaces(w, indent);
+        expr(w, pp, di_array_get(seq, i), indent);
+    }
+}
+
+static void expr(di_writer_t *w, di_t pp, di_t e, int indent) {
+    di_t op = di_dict_get(e, s("syntax"));
     if (di_equal(op, s("lit"))) {
         di_t value = di_dict_get(e, s("value"));
-        di_t src = pp_literal(value);
-        ps(src);
-        di_cleanup(src);
+        di_write_source(w, value, 0);
     } else if (di_equal(op, s("var"))) {
-        di_t name = di_dict_get(e, s("name"));
-        ps(name);
-        di_cleanup(name);
+        di_write_string(w, di_dict_get(e, s("name")));
     } else if (di_equal(op, s("regex"))) {
-        di_t regex = di_dict_get(e, s("regex"));
-        printf("/");
-        ps(regex);
-        di_cleanup(regex);
-        printf("/");
+        di_write_char(w, '/');
+        di_write_string(w, di_dict_get(e, s("regex")));
+        di_write_char(w, '/');
     } else if (di_equal(op, s("array"))) {
         di_t elems = di_dict_get(e, s("elems"));
         int n = di_array_length(elems);
         if (n == 0) {
-            printf("[]");
+            di_write_cstring(w, "[]");
         } else {
-            printf("[");
+            di_write_char(w, '[');
             for (int i = 0; i < n; i++) {
-                expr(pp, di_array_get(elems, i), indent + 1);
-                if (i < n - 1)
-                    printf(",\n%*s", indent + 1, "");
+                expr(w, pp, di_array_get(elems, i), indent + 1);
+                if (i < n - 1) {
+                    di_write_char(w, ',');
+                    newline(w, indent + 1);
+                }
             }
-            printf("]");
+            di_write_char(w, ']');
         }
     } else if (di_equal(op, s("dict"))) {
-        di_t pairs = di_dict_get(e, s("pairs"));
-        int n = di_array_length(pairs);
-        if (n == 0) {
-            printf("{}");
-        } else {
-            printf("{");
-            for (int i = 0; i < n; i++) {
-                di_t pair = di_array_get(pairs, i);
-                di_t k = di_dict_get(pair, s("key"));
-                di_t v = di_dict_get(pair, s("value"));
-                expr(pp, k, indent + 1);
-                printf(": ");
-                expr(pp, v, indent + 1);
-                if (i < n - 1)
-                    printf(",\n%*s", indent + 1, "");
-            }
-            printf("}");
-        }
+        entries(w, pp, di_dict_get(e, s("entries")), indent);
+    } else if (di_equal(op, s("dictup"))) {
+        expr(w, pp, di_dict_get(e, s("subj")), indent);
+        entries(w, pp, di_dict_get(e, s("entries")), indent);
     } else if (di_equal(op, s("apply"))) {
-        di_t func = di_dict_get(e, s("func"));
-        di_t args = di_dict_get(e, s("args"));
-        expr(pp, func, indent);
-        printf("(");
-        di_size_t n = di_array_length(args);
-        for (di_size_t i = 0; i < n; i++) {
-            if (i > 0)
-                printf(",\n%*s", indent + 4, "");
-            expr(pp, di_array_get(args, i), indent + 8);
-        }
-        printf(")");
+        expr(w, pp, di_dict_get(e, s("func")), indent);
+        di_write_char(w, '(');
+        args(w, pp, di_dict_get(e, s("args")), indent + 4);
+        di_write_char(w, ')');
     } else if (di_equal(op, s("case"))) {
-        di_t subj = di_dict_get(e, s("subj"));
-        di_t alts = di_dict_get(e, s("alts"));
-        printf("case ");
-        expr(pp, subj, indent + 5);
-        printf(" of");
-        int n = di_array_length(alts);
+        di_t clauses = di_dict_get(e, s("clauses"));
+        di_write_cstring(w, "case ");
+        expr(w, pp, di_dict_get(e, s("subj")), indent + 5);
+        di_write_cstring(w, " of");
+        int n = di_array_length(clauses);
         for (int i = 0; i < n; i++) {
-            di_t alt = di_array_get(alts, i);
-            di_t pat = di_dict_get(alt, s("pat"));
-            di_t exp = di_dict_get(alt, s("expr"));
-            printf("\n%*s", indent + 4, "");
-            expr(pp, pat, indent + 4);
-            printf(" ->\n%*s", indent + 8, "");
-            //printf(" -> ");
-            expr(pp, exp, indent + 8);
+            di_t clause = di_array_get(clauses, i);
+            newline(w, indent + 4);
+            args(w, pp, di_dict_get(clause, s("pats")), indent + 4);
+            di_write_cstring(w, " ->");
+            newline(w, indent + 8);
+            expr(w, pp, di_dict_get(clause, s("body")), indent + 8);
+        }
+    } else if (is_binop(pp, op) || di_equal(op, s("not"))) {
+        // Unary minus and not have no left operand
+        di_t left = di_dict_get(e, s("left"));
+        di_write_char(w, '(');
+        if (!di_is_null(left)) {
+            expr(w, pp, left, indent + 1);
+            di_write_char(w, ' ');
         }
-        printf("\n%*s", indent, "");
-    } else if (is_binop(pp, op)) {
-        printf("(");
-        expr(pp, di_dict_get(e, s("left")), indent + 1);
-        printf(" %.*s ", di_string_length(op), di_string_chars(op));
-        expr(pp, di_dict_get(e, s("right")), indent + 1);
-        printf(")");
+        di_write_string(w, op);
+        di_write_char(w, ' ');
+        expr(w, pp, di_dict_get(e, s("right")), indent + 1);
+        di_write_char(w, ')');
     } else if (di_equal(op, s("if"))) {
-        printf("if ");
-        expr(pp, di_dict_get(e, s("cond")), indent + 3);
-        printf("\n%*sthen ", indent + 4, "");
-        expr(pp, di_dict_get(e, s("then")), indent + 9);
-        printf("\n%*selse ", indent + 4, "");
-        expr(pp, di_dict_get(e, s("else")), indent + 9);
+        di_write_cstring(w, "if ");
+        expr(w, pp, di_dict_get(e, s("cond")), indent + 3);
+        newline(w, indent + 4);
+        di_write_cstring(w, "then ");
+        expr(w, pp, di_dict_get(e, s("then")), indent + 9);
+        newline(w, indent + 4);
+        di_write_cstring(w, "else ");
+        expr(w, pp, di_dict_get(e, s("else")), indent + 9);
     } else if (di_equal(op, s("do"))) {
-        printf("do\n");
-        exprs(pp, di_dict_get(e, s("seq")), indent + 4);
-        printf("\n");
+        di_write_cstring(w, "do\n");
+        block(w, pp, e, indent + 4);
     } else if (di_is_string(op)) {
-        printf("<unimplemented expression: ");
-        ps(op);
-        printf(">");
+        di_write_cstring(w, "<unimplemented expression: ");
+        di_write_string(w, op);
+        di_write_char(w, '>');
     } else if (di_is_null(op)) {
-        printf("<not an expression>");
+        di_write_cstring(w, "<not an expression>");
     } else {
-        printf("<unexpected type of expression type>");
+        di_write_cstring(w, "<unexpected type of expression type>");
     }
 }
 
-void di_prettyprint(di_t tree) {
-    assert(di_is_array(tree));
+void di_write_prettyprint(di_writer_t *w, di_t tree) {
+    assert(di_is_dict(tree));
     di_t pp = create_pp();
-    exprs(pp, tree, 0);
-    printf("\n");
+    block(w, pp, tree, 0);
+    di_write_char(w, '\n');
     di_cleanup(pp);
 }
+
+void di_prettyprint(di_t tree) {
+    di_writer_t w;
+    di_writer_init_file(&w, stdout);
+    di_write_prettyprint(&w, tree);
+    di_writer_finish(&w);
+}
@@ -1,11 +1,19 @@
 #ifndef DI_PRETTYPRINT_H
 #define DI_PRETTYPRINT_H
 
-/* Pretty-prints a parse tree to stdout. */
+#include "di_writer.h"
+
+/* Pretty-prints a parse tree, as returned by di_parse(), to stdout. */
 void di_prettyprint(di_t tree);
 
+/* Pretty-prints a parse tree to a writer. */
+void di_write_prettyprint(di_writer_t *w, di_t tree);
+
 /* Returns the source code of a value. Does *not* free value. (TODO: borrowed
  * pointers.) */
 di_t di_to_source(di_t value, int indent);
 
+/* Writes the source code of a value to a writer. Does not free value. */
+void di_write_source(di_writer_t *w, di_t value, int indent);
+
 #endif
@@ -0,0 +1,201 @@
+#include "di_regex.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*------------------------------------------*
+ * Dummy error handling: DIE(message) macro *
+ *------------------------------------------*/
+#define DIE(msg) do { \
+	fprintf(stderr, \
+	       "Fatal error: %s on line %d in %s\n", \
+	       msg, __LINE__, __FILE__); \
+	exit(-1); \
+} while(0)
+
+/*+-------------+*
+ *| Compilation |*
+ *+-------------+*/
+
+// Raises an error, or returns it in *error if error isn't NULL.
+static di_t compile_error(di_t *error, di_t pattern, const char *message,
+                          int offset) {
+	char buf[256];
+	snprintf(buf, sizeof(buf), "%s in regex /%.*s/ at offset %d", message,
+	         (int)di_string_length(pattern), di_string_chars(pattern), offset);
+	di_cleanup(pattern);
+	if (!error)
+		di_error(di_string_from_cstring(buf));
+	*error = di_string_from_cstring(buf);
+	return di_null();
+}
+
+di_t di_regex_compile(di_t pattern, di_t *error) {
+	assert(di_is_string(pattern));
+	// pcre_compile() takes a nul-terminated pattern.
+	di_size_t length = di_string_length(pattern);
+	di_t copy = di_null();
+	const char *chars;
+	char buf[7];
+	if (length <= 6) {
+		memcpy(buf, di_string_chars(pattern), length);
+		buf[length] = '\0';
+		chars = buf;
+	} else if (!di_string_is_terminated(pattern)) {
+		copy = di_string_from_chars(di_string_chars(pattern), length);
+		chars = di_string_chars(copy);
+	} else {
+		chars = di_string_chars(pattern);
+	}
+	const char *message;
+	int offset;
+	pcre *re = pcre_compile(chars, PCRE_UTF8, &message, &offset, NULL);
+	di_cleanup(copy);
+	if (!re)
+		return compile_error(error, pattern, message, offset);
+	int groups;
+	pcre_fullinfo(re, NULL, PCRE_INFO_CAPTURECOUNT, &groups);
+	if (groups > DI_REGEX_MAX_GROUPS) {
+		pcre_free(re);
+		return compile_error(error, pattern, "Too many groups", 0);
+	}
+	pcre_extra *extra = pcre_study(re, PCRE_STUDY_JIT_COMPILE, &message);
+	if (message) {
+		pcre_free(re);
+		return compile_error(error, pattern, message, 0);
+	}
+	di_regex_t *r = di_alloc(sizeof(di_regex_t));
+	if (!r) DIE("Out of memory");
+	di_init_tagged(&r->header, DI_REGEX);
+	r->re = re;
+	r->extra = extra;
+	r->groups = groups;
+	r->pattern = di_unborrow(pattern); // taken over or a new reference
+	di_incref(r->pattern);
+	return di_from_pointer(&r->header);
+}
+
+/*+-------+*
+ *| Cache |*
+ *+-------+*/
+
+// The cache is searched linearly, comparing the hashes of the patterns first.
+// Each entry has the value of a clock when it was last used, so the least
+// recently used entry is the one with the lowest. It's used by all threads,
+// under a lock. The regexes in it are shared and the cache holds a reference
+// to each of them.
+static struct {
+	uint64_t hash;
+	uint64_t used; // 0 for a free entry
+	di_t re;
+} cache[DI_REGEX_CACHE_SIZE];
+static uint64_t cache_clock = 0;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns the index of the entry of pattern, or -1 if there's none. Sets
+// *victim to the index of the least recently used entry. The lock must be held.
+static int cache_find(di_t pattern, uint64_t hash, int *victim) {
+	int i;
+	*victim = 0;
+	for (i = 0; i < DI_REGEX_CACHE_SIZE; i++) {
+		if (cache[i].used && cache[i].hash == hash &&
+		    di_equal(di_regex_pattern(cache[i].re), pattern))
+			return i;
+		if (cache[i].used < cache[*victim].used)
+			*victim = i;
+	}
+	return -1;
+}
+
+di_t di_regex_cached(di_t pattern) {
+	assert(di_is_string(pattern));
+	uint64_t hash = di_hash(pattern);
+	int i, victim;
+	pthread_mutex_lock(&cache_lock);
+	i = cache_find(pattern, hash, &victim);
+	if (i >= 0) {
+		di_t re = cache[i].re;
+		cache[i].used = ++cache_clock;
+		di_incref(re);
+		pthread_mutex_unlock(&cache_lock);
+		di_cleanup(pattern);
+		return re;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	// Compiled without holding the lock, from a copy of the pattern which
+	// is shared with the regex.
+	di_t re = di_regex_compile(di_string_from_chars(di_string_chars(pattern),
+	                                                di_string_length(pattern)),
+	                           NULL);
+	re = di_share(re);
+	di_t evicted = di_null();
+	pthread_mutex_lock(&cache_lock);
+	i = cache_find(pattern, hash, &victim);
+	if (i >= 0) {
+		// Another thread compiled it meanwhile.
+		evicted = re;
+		re = cache[i].re;
+	} else {
+		i = victim;
+		if (cache[i].used)
+			evicted = cache[i].re;
+		cache[i].hash = hash;
+		cache[i].re = re;
+	}
+	cache[i].used = ++cache_clock;
+	di_incref(re);
+	pthread_mutex_unlock(&cache_lock);
+	di_decref_and_free(evicted);
+	di_cleanup(pattern);
+	return re;
+}
+
+/*+----------+*
+ *| Matching |*
+ *+----------+*/
+
+// Runs re on subject and puts the offsets of the match and of its groups in
+// ovector, of size elements. Returns the number of offset pairs set, or -1 if
+// there's no match.
+static int exec(di_regex_t *r, di_t subject, int *ovector, int size) {
+	assert(di_is_string(subject));
+	int rc = pcre_exec(r->re, r->extra, di_string_chars(subject),
+	                   di_string_length(subject), 0, 0, ovector, size);
+	if (rc < PCRE_ERROR_NOMATCH) {
+		char buf[64];
+		snprintf(buf, sizeof(buf), "PCRE error %d in regex match", rc);
+		di_error(di_string_from_cstring(buf));
+	}
+	return rc;
+}
+
+bool di_regex_test(di_t re, di_t subject) {
+	int ovector[3];
+	return exec(di_to_regex(re), subject, ovector, 3) >= 0;
+}
+
+di_t di_regex_match(di_t re, di_t subject) {
+	di_regex_t *r = di_to_regex(re);
+	int ovector[3 * (DI_REGEX_MAX_GROUPS + 1)];
+	int i, n = r->groups + 1;
+	int rc = exec(r, subject, ovector, 3 * n);
+	di_t result = di_null();
+	if (rc >= 0) {
+		// The subject is kept alive until the views refer to it.
+		di_t groups[DI_REGEX_MAX_GROUPS + 1];
+		di_incref(subject);
+		for (i = 0; i < n; i++) {
+			int start = ovector[2 * i], end = ovector[2 * i + 1];
+			groups[i] = i < rc && start >= 0
+			            ? di_string_subview(subject, start, end - start)
+			            : di_null();
+		}
+		di_decref(subject);
+		result = di_array_from_values(groups, n);
+	}
+	di_cleanup(subject);
+	di_cleanup(re);
+	return result;
+}
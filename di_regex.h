@@ -0,0 +1,87 @@
+/*
+ * Compiled regular expressions for the di value system.
+ */
+#ifndef DI_REGEX_H
+#define DI_REGEX_H
+
+#include "di.h"
+#include <pcre.h>
+
+#define DI_REGEX 0x50
+
+/*
+ * A regex value is a pattern compiled once by pcre_compile() and studied by
+ * pcre_study() with JIT compilation, so each match runs the machine code, and
+ * the pattern it was compiled from. A regex is immutable, so the same one can
+ * be used by any number of threads once it's shared (see di_share()). Regexes
+ * are equal only to themselves.
+ *
+ * The regex literals in a program are compiled once when it's loaded (see
+ * di_compile.h). Patterns built at runtime are looked up in a global cache of
+ * the most recently used ones by di_regex_cached(), so a loop matching lines
+ * against the same pattern compiles it only once.
+ *
+ * Patterns and subjects are UTF-8.
+ */
+
+typedef struct di_regex {
+	di_tagged_t header;
+	pcre *re;
+	pcre_extra *extra; // the study data, with the JIT code, or NULL
+	int groups;        // the number of capture groups
+	di_t pattern;      // the string it was compiled from
+} di_regex_t;
+
+// The most capture groups a pattern can have.
+#define DI_REGEX_MAX_GROUPS 63
+
+// How many compiled patterns di_regex_cached() keeps.
+#define DI_REGEX_CACHE_SIZE 64
+
+static inline bool di_is_regex(di_t v) {
+	return di_is_pointer(v) && di_to_pointer(v)->tag == DI_REGEX;
+}
+
+static inline di_regex_t *di_to_regex(di_t v) {
+	assert(di_is_regex(v));
+	return (di_regex_t *)di_to_pointer(v);
+}
+
+// The string a regex was compiled from.
+static inline di_t di_regex_pattern(di_t re) {
+	return di_to_regex(re)->pattern;
+}
+
+// Compiles pattern, a string, to a regex. The regex takes over pattern if its
+// refc is 0. An invalid pattern is an error, reported using di_error(), unless
+// error isn't NULL, in which case null is returned and *error is set to a
+// message string, with the offset in the pattern where the error was found.
+di_t di_regex_compile(di_t pattern, di_t *error);
+
+// Returns the regex compiled from pattern, a string, from the cache if it was
+// compiled recently, or else compiles it and puts it in the cache, evicting
+// the least recently used one if the cache is full. The regexes in the cache
+// are shared between threads. Frees pattern if its refc is 0. An invalid
+// pattern is an error, reported using di_error().
+di_t di_regex_cached(di_t pattern);
+
+// True if subject, a string, contains a match of re. Doesn't free either of
+// them, like di_equal().
+bool di_regex_test(di_t re, di_t subject);
+
+// Searches subject, a string, for a match of re. Returns null if there is no
+// match, or else an array of the whole match followed by the capture groups,
+// null for a group which didn't take part in the match. The matched strings
+// are views into subject (see di_string_subview()), which they keep alive.
+// Frees re and subject if their refc is 0 and nothing refers to them.
+di_t di_regex_match(di_t re, di_t subject);
+
+// Frees a regex and its pattern. (Used internally)
+static inline void di_regex_free(di_regex_t *r) {
+	pcre_free_study(r->extra);
+	pcre_free(r->re);
+	di_decref_and_free(r->pattern);
+	di_free(r, sizeof(di_regex_t));
+}
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef DI_RT_H
+#define DI_RT_H
+
+/*
+ * Runtime support for compiled code
+ * ---------------------------------
+ * The C code generated by di_compile() (see di_compile.h) calls the functions
+ * in di.h and these helpers, which implement the operators of the language.
+ * Like the functions in di.h, they free or reuse their operands if their
+ * ref-counters are zero. Errors are reported using di_error(), prefixed with
+ * the line and column of the expression in the source.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "di.h"
+#include "di_regex.h"
+
+static inline void di_rt_error(int line, int column, const char *message) {
+	char buf[256];
+	snprintf(buf, sizeof(buf), "%d:%d: %s", line, column, message);
+	di_error(di_string_from_cstring(buf));
+}
+
+// The condition of an if, and the operands of "and", "or" and "not".
+static inline bool di_rt_truth(di_t v, int line, int column) {
+	if (!di_is_boolean(v))
+		di_rt_error(line, column, "Not a boolean");
+	return di_to_boolean(v);
+}
+
+static inline double di_rt_number(di_t v, int line, int column) {
+	if (di_is_int(v))
+		return di_to_int(v);
+	if (!di_is_double(v))
+		di_rt_error(line, column, "Not a number");
+	return di_to_double(v);
+}
+
+// An int result which doesn't fit in an int becomes a double.
+static inline di_t di_rt_from_int64(int64_t i) {
+	if (i >= INT32_MIN && i <= INT32_MAX)
+		return di_from_int((int32_t)i);
+	return di_from_double((double)i);
+}
+
+// Binary arithmetic: '+', '-', '*', '/' and 'm' for mod. Division always gives
+// a double. Mod of ints is an int.
+static inline di_t di_rt_arith(char op, di_t a, di_t b, int line, int column) {
+	if (di_is_int(a) && di_is_int(b) && op != '/') {
+		int64_t x = di_to_int(a), y = di_to_int(b);
+		switch (op) {
+		case '+': return di_rt_from_int64(x + y);
+		case '-': return di_rt_from_int64(x - y);
+		case '*': return di_rt_from_int64(x * y);
+		}
+		if (y == 0)
+			di_rt_error(line, column, "Division by zero");
+		return di_rt_from_int64(x % y);
+	}
+	double x = di_rt_number(a, line, column), y = di_rt_number(b, line, column);
+	double r;
+	switch (op) {
+	case '+': r = x + y; break;
+	case '-': r = x - y; break;
+	case '*': r = x * y; break;
+	case '/': r = x / y; break;
+	default: r = fmod(x, y);
+	}
+	return di_from_double(r == r ? r : NAN);
+}
+
+static inline di_t di_rt_negate(di_t a, int line, int column) {
+	if (di_is_int(a))
+		return di_rt_from_int64(-(int64_t)di_to_int(a));
+	return di_from_double(-di_rt_number(a, line, column));
+}
+
+// The "==" and "!=" operators.
+static inline bool di_rt_equal(di_t a, di_t b) {
+	bool equal = di_equal(a, b);
+	di_cleanup(a);
+	di_cleanup(b);
+	return equal;
+}
+
+// True if a < b. Both must be numbers or both must be strings, which are
+// compared byte by byte.
+static inline bool di_rt_less(di_t a, di_t b, int line, int column) {
+	if (di_is_string(a) && di_is_string(b)) {
+		di_size_t m = di_string_length(a), n = di_string_length(b);
+		int cmp = memcmp(di_string_chars(a), di_string_chars(b), m < n ? m : n);
+		bool less = cmp < 0 || (cmp == 0 && m < n);
+		di_cleanup(a);
+		di_cleanup(b);
+		return less;
+	}
+	return di_rt_number(a, line, column) < di_rt_number(b, line, column);
+}
+
+// The "~" operator.
+static inline di_t di_rt_string_concat(di_t a, di_t b, int line, int column) {
+	if (!di_is_string(a) || !di_is_string(b))
+		di_rt_error(line, column, "Not a string");
+	return di_string_concat(a, b);
+}
+
+// The "@" operator.
+static inline di_t di_rt_array_concat(di_t a, di_t b, int line, int column) {
+	if (!di_is_array(a) || !di_is_array(b))
+		di_rt_error(line, column, "Not an array");
+	return di_array_concat(a, b);
+}
+
+// True if a string starts (or ends, if at_end is true) with prefix, a string.
+// The "~" pattern.
+static inline bool di_rt_affix(di_t s, di_t affix, bool at_end) {
+	if (!di_is_string(s))
+		return false;
+	di_size_t m = di_string_length(s), n = di_string_length(affix);
+	return m >= n && !memcmp(di_string_chars(s) + (at_end ? m - n : 0),
+	                         di_string_chars(affix), n);
+}
+
+// A regex pattern: s is a string containing a match of re.
+static inline bool di_rt_regex(di_t re, di_t s) {
+	return di_is_string(s) && di_regex_test(re, s);
+}
+
+// The value returned by a function, which may be an argument. If it's a
+// borrowed pointer, a new reference is returned instead.
+static inline di_t di_rt_return(di_t v) {
+	if (!di_is_borrowed(v))
+		return v;
+	v = di_unborrow(v);
+	di_incref(v);
+	return v;
+}
+
+// Releases an operand which was protected by incrementing its ref-counter while
+// the operation using it was running. If the operation returned the operand
+// itself, the result takes it over.
+static inline void di_rt_unprotect(di_t operand, di_t result) {
+	if (di_is_pointer(operand) && di_is_pointer(result) &&
+	    di_to_pointer(operand) == di_to_pointer(result))
+		di_decref(operand);
+	else
+		di_decref_and_free(operand);
+}
+
+#endif
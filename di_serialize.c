@@ -0,0 +1,426 @@
+#include "di_serialize.h"
+#include <math.h>
+#include <stdio.h>
+
+/*------------------------------------------*
+ * Dummy error handling: DIE(message) macro *
+ *------------------------------------------*/
+#define DIE(msg) do { \
+	fprintf(stderr, \
+	       "Fatal error: %s on line %d in %s\n", \
+	       msg, __LINE__, __FILE__); \
+	exit(-1); \
+} while(0)
+
+enum tag {
+	TAG_NULL, TAG_FALSE, TAG_TRUE, TAG_INT, TAG_DOUBLE, TAG_STRING,
+	TAG_STRING_REF, TAG_ARRAY, TAG_DICT, TAG_ATOM, TAG_PACKED
+};
+
+static const size_t packed_width[] = {0, sizeof(int32_t), sizeof(double), 1};
+
+// Packed arrays are written as they're stored on little-endian hosts.
+static inline bool little_endian(void) {
+	const uint16_t one = 1;
+	return *(const unsigned char *)&one;
+}
+
+// The decoder is recursive, so it rejects values nested deeper than this.
+#define MAX_DEPTH 10000
+
+/*+----------+*
+ *| Encoding |*
+ *+----------+*/
+
+typedef struct encoder {
+	di_writer_t *w;
+	di_t strings; // the numbered strings => their numbers
+	di_size_t nstrings;
+} encoder_t;
+
+static void write_varint(di_writer_t *w, uint64_t n) {
+	char *p = di_writer_reserve(w, 10);
+	size_t i = 0;
+	while (n >= 0x80) {
+		p[i++] = (char)(n | 0x80);
+		n >>= 7;
+	}
+	p[i++] = (char)n;
+	w->len += i;
+}
+
+static void write_le(di_writer_t *w, uint64_t bits, int n) {
+	char *p = di_writer_reserve(w, n);
+	int i;
+	for (i = 0; i < n; i++)
+		p[i] = (char)(bits >> (8 * i));
+	w->len += n;
+}
+
+static void write_double(di_writer_t *w, double d) {
+	uint64_t bits;
+	memcpy(&bits, &d, sizeof(bits));
+	write_le(w, bits, 8);
+}
+
+// Writes a packed array, padded so that the elements are aligned relative to
+// the start of the output.
+static void write_packed(di_writer_t *w, unsigned kind, const void *data,
+                         di_size_t n) {
+	size_t width = packed_width[kind], i;
+	di_write_char(w, TAG_PACKED);
+	di_write_char(w, (char)kind);
+	write_varint(w, n);
+	size_t pad = -(di_writer_position(w) + 1) & (width - 1);
+	di_write_char(w, (char)pad);
+	for (i = 0; i < pad; i++)
+		di_write_char(w, 0);
+	if (little_endian() || width == 1) {
+		di_write(w, data, (size_t)n * width);
+	} else if (kind == DI_PACKED_INT) {
+		for (i = 0; i < n; i++)
+			write_le(w, (uint32_t)((const int32_t *)data)[i], 4);
+	} else {
+		for (i = 0; i < n; i++)
+			write_double(w, ((const double *)data)[i]);
+	}
+}
+
+static void write_string(encoder_t *e, di_t s) {
+	if (!di_is_shortstring(s)) {
+		di_t number = di_dict_get(e->strings, s);
+		if (!di_is_null(number)) {
+			di_write_char(e->w, TAG_STRING_REF);
+			write_varint(e->w, (uint32_t)di_to_int(number));
+			return;
+		}
+		e->strings = di_dict_set(e->strings, s,
+		                         di_from_int((int32_t)e->nstrings++));
+	}
+	di_size_t length = di_string_length(s);
+	di_write_char(e->w, di_is_atom(s) ? TAG_ATOM : TAG_STRING);
+	write_varint(e->w, length);
+	di_write(e->w, di_string_chars(s), length);
+	if (length > 6)
+		di_write_char(e->w, 0); // so that a decoded string can be a view
+}
+
+static bool write_value(encoder_t *e, di_t v) {
+	if (di_is_int(v)) {
+		int32_t i = di_to_int(v);
+		di_write_char(e->w, TAG_INT);
+		write_varint(e->w, ((uint32_t)i << 1) ^ (uint32_t)(i >> 31));
+	} else if (di_is_string(v)) {
+		write_string(e, v);
+	} else if (di_is_double(v)) {
+		di_write_char(e->w, TAG_DOUBLE);
+		write_double(e->w, di_to_double(v));
+	} else if (di_is_null(v)) {
+		di_write_char(e->w, TAG_NULL);
+	} else if (di_is_boolean(v)) {
+		di_write_char(e->w, di_to_boolean(v) ? TAG_TRUE : TAG_FALSE);
+	} else if (di_is_array(v)) {
+		di_size_t i, n = di_array_length(v);
+		unsigned kind;
+		const void *data = di_array_packed_data(v, &kind);
+		if (data) {
+			write_packed(e->w, kind, data, n);
+			return true;
+		}
+		di_write_char(e->w, TAG_ARRAY);
+		write_varint(e->w, n);
+		for (i = 0; i < n; i++)
+			if (!write_value(e, di_array_get(v, i)))
+				return false;
+	} else if (di_is_dict(v)) {
+		di_size_t i;
+		di_t key, value;
+		di_write_char(e->w, TAG_DICT);
+		write_varint(e->w, di_dict_size(v));
+		for (i = 0; (i = di_dict_iter(v, i, &key, &value));)
+			if (!write_value(e, key) || !write_value(e, value))
+				return false;
+	} else {
+		return false; // functions, tasks, undefined
+	}
+	return true;
+}
+
+bool di_write_serialized(di_writer_t *w, di_t value) {
+	encoder_t e = {w, di_dict_empty(), 0};
+	// The string table refers to the strings in value. It must not free value
+	// when it's freed, if it's a string with ref-counter zero.
+	di_incref(value);
+	bool ok = write_value(&e, value);
+	di_cleanup(e.strings);
+	di_decref(value);
+	return ok;
+}
+
+di_t di_serialize(di_t value) {
+	di_writer_t w;
+	di_writer_init_string(&w);
+	bool ok = di_write_serialized(&w, value);
+	di_t result = di_writer_finish_string(&w);
+	if (!ok) {
+		di_cleanup(result);
+		return di_undefined();
+	}
+	return result;
+}
+
+/*+----------+*
+ *| Decoding |*
+ *+----------+*/
+
+typedef struct decoder {
+	const unsigned char *p, *end;
+	di_t strings; // the numbered strings, in order
+	int depth;
+	bool lazy;    // if strings and packed arrays are views into owner
+	di_t owner;
+} decoder_t;
+
+static bool read_varint(decoder_t *d, uint64_t *n) {
+	uint64_t v = 0;
+	int shift;
+	for (shift = 0; d->p < d->end && shift < 64; shift += 7) {
+		unsigned char b = *d->p++;
+		v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			*n = v;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Reads a length. A length larger than the rest of the input is invalid, since
+// each element takes at least one byte.
+static bool read_length(decoder_t *d, di_size_t *n) {
+	uint64_t v;
+	if (!read_varint(d, &v) || v > (uint64_t)(d->end - d->p))
+		return false;
+	*n = (di_size_t)v;
+	return true;
+}
+
+static uint64_t get_le(const unsigned char *p, int n) {
+	uint64_t v = 0;
+	int i;
+	for (i = 0; i < n; i++)
+		v |= (uint64_t)p[i] << (8 * i);
+	return v;
+}
+
+// Doubles are read as they are, except that NaNs are made the NaN of this
+// host, since some NaNs from another source would be decoded as other values.
+static inline double make_double(uint64_t bits) {
+	double x;
+	memcpy(&x, &bits, sizeof(x));
+	return x == x ? x : NAN;
+}
+
+// Reads the contents of a packed array. It's a view if the decoder is lazy and
+// the elements are aligned and can be used as they are.
+static di_t read_packed(decoder_t *d) {
+	di_size_t i, n;
+	if (d->p == d->end)
+		return di_undefined();
+	unsigned kind = *d->p++;
+	if (kind < DI_PACKED_INT || kind > DI_PACKED_BYTE ||
+	    !read_length(d, &n) || d->p == d->end)
+		return di_undefined();
+	size_t width = packed_width[kind], pad = *d->p++;
+	if (pad >= width)
+		return di_undefined();
+	if ((uint64_t)(d->end - d->p) < pad + (uint64_t)n * width)
+		return di_undefined();
+	const unsigned char *data = d->p + pad;
+	d->p = data + (size_t)n * width;
+	if (n == 0)
+		return di_array_empty();
+	if (kind == DI_PACKED_BYTE)
+		return d->lazy ? di_array_view_bytes(d->owner, (const char *)data, n)
+		               : di_array_from_bytes((const char *)data, n);
+	bool view = d->lazy && little_endian() &&
+	            (uintptr_t)data % width == 0;
+	if (view && kind == DI_PACKED_DOUBLE) {
+		const double *x = (const double *)data;
+		for (i = 0; i < n && x[i] == x[i]; i++)
+			;
+		view = i == n; // no NaNs
+	}
+	if (view)
+		return kind == DI_PACKED_INT
+		       ? di_array_view_ints(d->owner, (const int32_t *)data, n)
+		       : di_array_view_doubles(d->owner, (const double *)data, n);
+	// Copy the elements, converted to this host.
+	di_t array;
+	if (kind == DI_PACKED_INT) {
+		int32_t *ints = malloc((size_t)n * sizeof(int32_t));
+		if (!ints) DIE("Out of memory");
+		for (i = 0; i < n; i++)
+			ints[i] = (int32_t)(uint32_t)get_le(data + 4 * (size_t)i, 4);
+		array = di_array_from_ints(ints, n);
+		free(ints);
+	} else {
+		double *doubles = malloc((size_t)n * sizeof(double));
+		if (!doubles) DIE("Out of memory");
+		for (i = 0; i < n; i++)
+			doubles[i] = make_double(get_le(data + 8 * (size_t)i, 8));
+		array = di_array_from_doubles(doubles, n);
+		free(doubles);
+	}
+	return array;
+}
+
+static di_t read_value(decoder_t *d) {
+	uint64_t n;
+	di_size_t i, length;
+	if (d->p == d->end)
+		return di_undefined();
+	switch (*d->p++) {
+	case TAG_NULL:
+		return di_null();
+	case TAG_FALSE:
+		return di_false();
+	case TAG_TRUE:
+		return di_true();
+	case TAG_INT:
+		if (!read_varint(d, &n) || n > UINT32_MAX)
+			return di_undefined();
+		return di_from_int((int32_t)((uint32_t)n >> 1 ^ -((uint32_t)n & 1)));
+	case TAG_DOUBLE: {
+		if (d->end - d->p < 8)
+			return di_undefined();
+		double x = make_double(get_le(d->p, 8));
+		d->p += 8;
+		return di_from_double(x);
+	}
+	case TAG_STRING:
+	case TAG_ATOM: {
+		bool atom = d->p[-1] == TAG_ATOM;
+		if (!read_length(d, &length))
+			return di_undefined();
+		const char *chars = (const char *)d->p;
+		d->p += length;
+		if (length > 6 && (d->p == d->end || *d->p++ != 0))
+			return di_undefined(); // not nul-terminated
+		// An atom which isn't interned in this process is decoded as a
+		// string, so the input can't add to the atom table.
+		di_t s = atom ? di_atom_find(chars, length) : di_null();
+		if (di_is_null(s))
+			s = d->lazy && length > 6
+			    ? di_string_view(d->owner, chars, length)
+			    : di_string_from_chars(chars, length);
+		if (!di_is_shortstring(s))
+			di_array_push(&d->strings, s);
+		return s;
+	}
+	case TAG_STRING_REF:
+		if (!read_varint(d, &n) || n >= di_array_length(d->strings))
+			return di_undefined();
+		return di_array_get(d->strings, (di_size_t)n);
+	case TAG_ARRAY: {
+		if (!read_length(d, &length) || ++d->depth > MAX_DEPTH)
+			return di_undefined();
+		di_t array = di_array_empty();
+		for (i = 0; i < length; i++) {
+			di_t elem = read_value(d);
+			if (di_is_undefined(elem)) {
+				di_cleanup(array);
+				return elem;
+			}
+			di_array_push(&array, elem);
+		}
+		d->depth--;
+		return array;
+	}
+	case TAG_PACKED:
+		return read_packed(d);
+	case TAG_DICT: {
+		if (!read_length(d, &length) || ++d->depth > MAX_DEPTH)
+			return di_undefined();
+		di_t dict = di_dict_empty();
+		for (i = 0; i < length; i++) {
+			di_t key = read_value(d);
+			if (di_is_undefined(key)) {
+				di_cleanup(dict);
+				return key;
+			}
+			di_t value = read_value(d);
+			if (di_is_undefined(value)) {
+				di_cleanup(key);
+				di_cleanup(dict);
+				return value;
+			}
+			dict = di_dict_set(dict, key, value);
+		}
+		d->depth--;
+		return dict;
+	}
+	default:
+		return di_undefined();
+	}
+}
+
+static di_t decode(bool lazy, di_t owner, const char *chars, di_size_t length,
+                   di_size_t *used) {
+	decoder_t d;
+	d.p = (const unsigned char *)chars;
+	d.end = d.p + length;
+	d.strings = di_array_empty();
+	d.depth = 0;
+	d.lazy = lazy;
+	d.owner = owner;
+	// The views hold references to owner, and it must not be freed when
+	// they're freed while the value is decoded.
+	di_incref(owner);
+	di_t value = read_value(&d);
+	// Like in di_write_serialized, the string table must not free value.
+	di_incref(value);
+	di_cleanup(d.strings);
+	di_decref(value);
+	if (used && !di_is_undefined(value))
+		*used = (di_size_t)((const char *)d.p - chars);
+	di_decref_and_free(owner);
+	return value;
+}
+
+di_t di_deserialize_chars(const char *chars, di_size_t length,
+                          di_size_t *used) {
+	return decode(false, di_null(), chars, length, used);
+}
+
+di_t di_deserialize_lazy_chars(di_t owner, const char *chars, di_size_t length,
+                               di_size_t *used) {
+	return decode(true, owner, chars, length, used);
+}
+
+// The value must be the whole string.
+static di_t check_used(di_t value, di_size_t used, di_size_t length) {
+	if (!di_is_undefined(value) && used != length) {
+		di_cleanup(value); // trailing garbage
+		value = di_undefined();
+	}
+	return value;
+}
+
+di_t di_deserialize(di_t data) {
+	assert(di_is_string(data));
+	di_size_t used, length = di_string_length(data);
+	di_t value = di_deserialize_chars(di_string_chars(data), length, &used);
+	di_cleanup(data);
+	return check_used(value, used, length);
+}
+
+di_t di_deserialize_lazy(di_t data) {
+	assert(di_is_string(data));
+	if (di_is_shortstring(data))
+		return di_deserialize(data); // nothing to point into
+	di_size_t used, length = di_string_length(data);
+	di_t value = di_deserialize_lazy_chars(data, di_string_chars(data), length,
+	                                       &used);
+	return check_used(value, used, length);
+}
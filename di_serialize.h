@@ -0,0 +1,76 @@
+#ifndef DI_SERIALIZE_H
+#define DI_SERIALIZE_H
+
+/*
+ * Binary serialization
+ * --------------------
+ * A compact binary encoding of values, which keeps the distinction between
+ * ints and doubles. Each value is a tag byte followed by its contents:
+ *
+ *     null, false, true    the tag only
+ *     int                  zigzag-encoded varint
+ *     double               8 bytes, little-endian
+ *     string, atom         varint length, bytes, and a nul byte if the length
+ *                          is more than 6
+ *     string reference     varint index of an earlier string
+ *     array                varint length, elements
+ *     packed array         kind byte, varint length, padding, elements
+ *     dict                 varint size, keys and values
+ *
+ * Varints are little-endian base 128, as in protobuf. Each string longer than
+ * a short string is numbered in the order it's first written, and when it's
+ * written again, only its number is written. The decoded values share the
+ * string, which makes repeated dict keys, as in parse trees, cheap to store and
+ * to decode. Atoms which are interned in the decoding process, such as the
+ * keys of parse trees, are decoded as atoms, so dicts with atom keys get the
+ * same layout as the encoded ones. Other atoms are decoded as strings, since
+ * atoms are never freed.
+ *
+ * A packed array (see di_array_from_ints()) is stored as it is in memory on a
+ * little-endian host, after a padding byte count and that many zero bytes, so
+ * that the elements are aligned relative to the start of the output. That
+ * lets the lazy decoder use them where they are.
+ *
+ * The lazy decoder doesn't copy the long strings and the packed arrays. They
+ * are views into the input (see di_string_view()), which they keep alive, and
+ * they're copied only when they're modified. Only the arrays and dicts are
+ * built. A packed array is copied anyway if it isn't aligned in memory, if a
+ * double array contains a NaN or if the host is big-endian.
+ *
+ * Functions, tasks and other values which only make sense in the running
+ * process can't be serialized.
+ */
+
+#include "di.h"
+#include "di_writer.h"
+
+// Encodes a value and returns it as a string, or undefined if it contains a
+// value which can't be serialized. Does not free value.
+di_t di_serialize(di_t value);
+
+// Encodes a value to a writer. Returns false if it contains a value which
+// can't be serialized, after writing part of it.
+bool di_write_serialized(di_writer_t *w, di_t value);
+
+// Decodes a serialized value. Returns undefined if data isn't a serialized
+// value. Frees data if its ref-counter is zero.
+di_t di_deserialize(di_t data);
+
+// Decodes the serialized value at the start of a buffer, which may be followed
+// by other data. Returns undefined if it isn't a serialized value. Otherwise,
+// if used isn't NULL, the length of the encoded value is stored in *used.
+di_t di_deserialize_chars(const char *chars, di_size_t length,
+                          di_size_t *used);
+
+// Like di_deserialize(), but lazy: the result has views into data, which the
+// views keep alive. Frees data if its ref-counter is zero and nothing in the
+// result refers to it.
+di_t di_deserialize_lazy(di_t data);
+
+// Like di_deserialize_chars(), but lazy, for a buffer in the memory of owner,
+// which the views of the result keep alive. Frees owner if its ref-counter is
+// zero and nothing in the result refers to it.
+di_t di_deserialize_lazy_chars(di_t owner, const char *chars, di_size_t length,
+                               di_size_t *used);
+
+#endif
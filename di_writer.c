@@ -0,0 +1,157 @@
+#define _POSIX_C_SOURCE 200809L // write
+#include "di_writer.h"
+
+#ifdef DI_WRITER_FD
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+static void flush_string(di_writer_t *w, size_t n) {
+	size_t cap = w->cap;
+	while (cap - w->len < n) {
+		if (cap > (di_size_t)-1 / 2) {
+			// Too large. Discard the output.
+			w->failed = true;
+			w->len = 0;
+			return;
+		}
+		cap *= 2;
+	}
+	w->string = di_string_resize(w->string, (di_size_t)cap);
+	w->buf = di_string_chars(w->string);
+	w->cap = cap;
+}
+
+static void flush_file(di_writer_t *w, size_t n) {
+	(void)n;
+	if (!w->failed && fwrite(w->buf, 1, w->len, w->file) != w->len)
+		w->failed = true;
+	w->flushed += w->len;
+	w->len = 0;
+}
+
+#ifdef DI_WRITER_FD
+static void flush_fd(di_writer_t *w, size_t n) {
+	(void)n;
+	size_t done = 0;
+	while (!w->failed && done < w->len) {
+		ssize_t written = write(w->fd, w->buf + done, w->len - done);
+		if (written < 0 && errno != EINTR)
+			w->failed = true;
+		if (written > 0)
+			done += (size_t)written;
+	}
+	w->flushed += w->len;
+	w->len = 0;
+}
+#endif
+
+void di_writer_init_string(di_writer_t *w) {
+	memset(w, 0, sizeof(di_writer_t));
+	// Larger than a short string, so the buffer is the string's own.
+	w->cap    = 64;
+	w->string = di_string_create_presized((di_size_t)w->cap);
+	w->buf    = di_string_chars(w->string);
+	w->flush  = flush_string;
+}
+
+static void init_chunked(di_writer_t *w) {
+	w->cap = DI_WRITER_CHUNK;
+	w->buf = malloc(DI_WRITER_CHUNK);
+	if (!w->buf) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+}
+
+void di_writer_init_file(di_writer_t *w, FILE *file) {
+	memset(w, 0, sizeof(di_writer_t));
+	init_chunked(w);
+	w->file  = file;
+	w->flush = flush_file;
+}
+
+#ifdef DI_WRITER_FD
+void di_writer_init_fd(di_writer_t *w, int fd) {
+	memset(w, 0, sizeof(di_writer_t));
+	init_chunked(w);
+	w->fd    = fd;
+	w->flush = flush_fd;
+}
+#endif
+
+di_t di_writer_finish_string(di_writer_t *w) {
+	assert(w->flush == flush_string);
+	if (w->failed) {
+		di_cleanup(w->string);
+		return di_undefined();
+	}
+	di_t string = di_string_resize(w->string, (di_size_t)w->len);
+	if (w->len > 6)
+		di_string_chars(string)[w->len] = '\0';
+	return string;
+}
+
+bool di_writer_finish(di_writer_t *w) {
+	assert(w->flush != flush_string);
+	w->flush(w, 0);
+	free(w->buf);
+	return !w->failed;
+}
+
+void di_write_slow(di_writer_t *w, const char *chars, size_t n) {
+	while (w->cap - w->len < n) {
+		size_t room = w->cap - w->len;
+		memcpy(w->buf + w->len, chars, room);
+		w->len += room;
+		chars += room;
+		n -= room;
+		w->flush(w, n);
+	}
+	memcpy(w->buf + w->len, chars, n);
+	w->len += n;
+}
+
+void di_write_spaces(di_writer_t *w, int n) {
+	while (n > 0) {
+		size_t k = n < 64 ? (size_t)n : 64;
+		memset(di_writer_reserve(w, k), ' ', k);
+		w->len += k;
+		n -= (int)k;
+	}
+}
+
+void di_write_int(di_writer_t *w, int32_t i) {
+	char tmp[11], *p = tmp + sizeof(tmp);
+	uint32_t u = i < 0 ? 0u - (uint32_t)i : (uint32_t)i;
+	do {
+		*--p = (char)('0' + u % 10);
+		u /= 10;
+	} while (u);
+	if (i < 0)
+		*--p = '-';
+	di_write(w, p, (size_t)(tmp + sizeof(tmp) - p));
+}
+
+void di_writef(di_writer_t *w, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	di_vwritef(w, format, args);
+	va_end(args);
+}
+
+void di_vwritef(di_writer_t *w, const char *format, va_list args) {
+	va_list again;
+	va_copy(again, args);
+	size_t room = w->cap - w->len;
+	int n = vsnprintf(w->buf + w->len, room, format, args);
+	if (n >= 0 && (size_t)n >= room) {
+		// Didn't fit, including the nul terminator. Try again.
+		assert((size_t)n < DI_WRITER_CHUNK);
+		vsnprintf(di_writer_reserve(w, (size_t)n + 1), (size_t)n + 1,
+		          format, again);
+	}
+	va_end(again);
+	if (n >= 0)
+		w->len += (size_t)n;
+}
@@ -0,0 +1,110 @@
+#ifndef DI_WRITER_H
+#define DI_WRITER_H
+
+/*
+ * Writers
+ * -------
+ * A writer collects output in a buffer. When the buffer is full, it is either
+ * grown, when writing to a string (which is then the buffer itself), or
+ * written to a file and reused. Output is thus produced in a single pass,
+ * without intermediate strings.
+ *
+ * Errors are sticky: After a write error, the rest of the output is discarded
+ * and di_writer_finish() returns false.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include "di.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define DI_WRITER_FD 1
+#endif
+
+// The buffer size when writing to a file.
+#define DI_WRITER_CHUNK (64 * 1024)
+
+typedef struct di_writer {
+	char *buf;
+	size_t len, cap;
+	size_t flushed; // the number of bytes written to the file so far
+	// Makes room for n more bytes, by growing the string or by writing the
+	// buffer to the file. Sets failed on error.
+	void (*flush)(struct di_writer *w, size_t n);
+	bool failed;
+	di_t string;
+	FILE *file;
+	int fd;
+} di_writer_t;
+
+// Initializes a writer which writes to a new string.
+void di_writer_init_string(di_writer_t *w);
+
+// Initializes a writer which writes to a file.
+void di_writer_init_file(di_writer_t *w, FILE *file);
+
+#ifdef DI_WRITER_FD
+// Initializes a writer which writes to a file descriptor.
+void di_writer_init_fd(di_writer_t *w, int fd);
+#endif
+
+// Finishes writing to a string and returns it, or undefined on error.
+di_t di_writer_finish_string(di_writer_t *w);
+
+// Finishes writing to a file, by writing what is left in the buffer. Returns
+// false if any write failed. The file is not closed.
+bool di_writer_finish(di_writer_t *w);
+
+// Helper for di_write, when the data doesn't fit in the buffer.
+void di_write_slow(di_writer_t *w, const char *chars, size_t n);
+
+static inline void di_write(di_writer_t *w, const char *chars, size_t n) {
+	if (w->cap - w->len >= n) {
+		memcpy(w->buf + w->len, chars, n);
+		w->len += n;
+	} else {
+		di_write_slow(w, chars, n);
+	}
+}
+
+// Returns the number of bytes written to the writer so far.
+static inline size_t di_writer_position(const di_writer_t *w) {
+	return w->flushed + w->len;
+}
+
+static inline void di_write_char(di_writer_t *w, char c) {
+	if (w->cap == w->len)
+		w->flush(w, 1);
+	w->buf[w->len++] = c;
+}
+
+static inline void di_write_cstring(di_writer_t *w, const char *s) {
+	di_write(w, s, strlen(s));
+}
+
+// Writes the contents of a string.
+static inline void di_write_string(di_writer_t *w, di_t string) {
+	di_write(w, di_string_chars(string), di_string_length(string));
+}
+
+// Returns a pointer to n contiguous bytes in the buffer, where n is at most
+// DI_WRITER_CHUNK. Add the number of bytes actually written to w->len.
+static inline char *di_writer_reserve(di_writer_t *w, size_t n) {
+	if (w->cap - w->len < n)
+		w->flush(w, n);
+	return w->buf + w->len;
+}
+
+// Writes n spaces.
+void di_write_spaces(di_writer_t *w, int n);
+
+// Writes an int in decimal.
+void di_write_int(di_writer_t *w, int32_t i);
+
+// Writes formatted output, like printf, of at most DI_WRITER_CHUNK - 1 bytes.
+void di_writef(di_writer_t *w, const char *format, ...);
+
+// Like di_writef(), with the arguments in a va_list.
+void di_vwritef(di_writer_t *w, const char *format, va_list args);
+
+#endif
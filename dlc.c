@@ -1,11 +1,21 @@
+#define _POSIX_C_SOURCE 200809L // clock_gettime, getrusage
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
 #include "di.h"
+#include "di_fun.h"
 #include "di_lexer.h"
 #include "di_parser.h"
 #include "di_annotate.h"
 #include "di_prettyprint.h"
 #include "di_io.h"
 #include "di_debug.h"
+#include "di_writer.h"
+#include "di_cache.h"
+#include "di_compile.h"
+#include "json.h"
 
 /*
 
@@ -13,67 +23,482 @@ Lexer -> Parser -> Type and variable access annotator -> Compiler
 
 */
 
+enum command { SOURCE, LEX, PARSE, ANNOTATE, PP, INTERFACE, COMPILE };
+
+static const char *commands[] = {"source", "lex", "parse", "annotate", "pp",
+                                 "interface", "compile"};
+
+#define NUM_COMMANDS (int)(sizeof(commands) / sizeof(commands[0]))
+
+static int find_command(const char *name) {
+	int i;
+	for (i = 0; i < NUM_COMMANDS; i++)
+		if (!strcmp(commands[i], name))
+			return i;
+	return -1;
+}
+
+static inline di_t str(const char *chars) {
+	return di_atom_from_cstring(chars);
+}
+
+/*
+ * Timing (--time)
+ * ---------------
+ * The phases of a run are timed per file, in wall time and in CPU time of the
+ * thread running it. The bytes allocated in each phase are counted too if dlc
+ * is built with DI_STATS (make STATS=1). The source is lexed into a token
+ * buffer in the "lex" phase, which the parser reads in the "parse" phase. A
+ * tree loaded from the cache isn't lexed or parsed.
+ */
+enum phase { T_READ, T_LEX, T_PARSE, T_ANNOTATE, T_CACHE, T_OUTPUT };
+
+static const char *phases[] = {"read", "lex", "parse", "annotate", "cache",
+                               "output"};
+
+#define NUM_PHASES (int)(sizeof(phases) / sizeof(phases[0]))
+
+typedef struct timing {
+	bool ran[NUM_PHASES];
+	double wall[NUM_PHASES], cpu[NUM_PHASES];
+	unsigned long long bytes[NUM_PHASES];
+	di_size_t length, tokens, nodes;
+	enum phase phase; // the current one, started at these:
+	double wall0, cpu0;
+	unsigned long long bytes0;
+} timing_t;
+
+static double seconds(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned long long allocated_bytes(void) {
+#ifdef DI_STATS
+	return di_thread_stats.bytes;
+#else
+	return 0;
+#endif
+}
+
+// Starts a phase. Does nothing if t is NULL, i.e. if the run isn't timed.
+static void phase_begin(timing_t *t, enum phase phase) {
+	if (!t)
+		return;
+	t->phase = phase;
+	t->wall0 = seconds(CLOCK_MONOTONIC);
+	t->cpu0 = seconds(CLOCK_THREAD_CPUTIME_ID);
+	t->bytes0 = allocated_bytes();
+}
+
+static void phase_end(timing_t *t) {
+	if (!t)
+		return;
+	t->ran[t->phase] = true;
+	t->wall[t->phase] += seconds(CLOCK_MONOTONIC) - t->wall0;
+	t->cpu[t->phase] += seconds(CLOCK_THREAD_CPUTIME_ID) - t->cpu0;
+	t->bytes[t->phase] += allocated_bytes() - t->bytes0;
+}
+
+// The number of nodes (dicts) in a tree.
+static di_size_t count_nodes(di_t tree) {
+	di_size_t i, n = 0;
+	di_t key, value;
+	if (di_is_array(tree)) {
+		for (i = 0; i < di_array_length(tree); i++)
+			n += count_nodes(di_array_get(tree, i));
+	} else if (di_is_dict(tree)) {
+		n = 1;
+		for (i = 0; (i = di_dict_iter(tree, i, &key, &value));)
+			n += count_nodes(value);
+	}
+	return n;
+}
+
+// A count as a number. Counts which don't fit in an int are doubles.
+static di_t count(unsigned long long n) {
+	return n <= INT32_MAX ? di_from_int((int32_t)n) : di_from_double(n);
+}
+
+// Returns the timing of a run as a dict. Frees the filename if its refc == 0.
+static di_t timing_dict(di_t filename, const timing_t *t) {
+	di_t d = di_dict_empty(), ps = di_dict_empty();
+	d = di_dict_set(d, str("file"), filename);
+	d = di_dict_set(d, str("bytes"), count(t->length));
+	d = di_dict_set(d, str("tokens"), count(t->tokens));
+	d = di_dict_set(d, str("nodes"), count(t->nodes));
+	d = di_dict_set(d, str("tokens_per_sec"),
+	                t->ran[T_LEX] && t->wall[T_LEX] > 0
+	                ? di_from_double(t->tokens / t->wall[T_LEX]) : di_null());
+	int i;
+	for (i = 0; i < NUM_PHASES; i++) {
+		if (!t->ran[i])
+			continue;
+		di_t p = di_dict_empty();
+		p = di_dict_set(p, str("wall"), di_from_double(t->wall[i]));
+		p = di_dict_set(p, str("cpu"), di_from_double(t->cpu[i]));
+#ifdef DI_STATS
+		p = di_dict_set(p, str("alloc_bytes"), count(t->bytes[i]));
+#else
+		p = di_dict_set(p, str("alloc_bytes"), di_null());
+#endif
+		ps = di_dict_set(ps, str(phases[i]), p);
+	}
+	return di_dict_set(d, str("phases"), ps);
+}
+
+static double number(di_t v) {
+	return di_is_int(v) ? di_to_int(v) : di_is_double(v) ? di_to_double(v) : 0;
+}
+
+// Prints the timings of the files and the totals to stderr, as text or as JSON.
+static void print_timing(di_t files, double wall, double cpu, bool json) {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	di_writer_t w;
+	di_writer_init_file(&w, stderr);
+	if (json) {
+		di_t d = di_dict_empty();
+		d = di_dict_set(d, str("files"), files);
+		d = di_dict_set(d, str("wall"), di_from_double(wall));
+		d = di_dict_set(d, str("cpu"), di_from_double(cpu));
+		d = di_dict_set(d, str("peak_rss_kb"), count(usage.ru_maxrss));
+		json_write(&w, d);
+		di_write_char(&w, '\n');
+		di_writer_finish(&w);
+		di_cleanup(d);
+		return;
+	}
+	di_size_t i;
+	int j;
+	for (i = 0; i < di_array_length(files); i++) {
+		di_t f = di_array_get(files, i), name = di_dict_get(f, str("file"));
+		di_writef(&w, "%.*s: %.0f bytes, %.0f tokens", di_string_length(name),
+		          di_string_chars(name), number(di_dict_get(f, str("bytes"))),
+		          number(di_dict_get(f, str("tokens"))));
+		di_t rate = di_dict_get(f, str("tokens_per_sec"));
+		if (!di_is_null(rate))
+			di_writef(&w, " (%.0f tokens/s)", number(rate));
+		di_writef(&w, ", %.0f nodes\n", number(di_dict_get(f, str("nodes"))));
+		di_writef(&w, "  %-10s %10s %10s %14s\n", "phase", "wall ms",
+		          "cpu ms", "alloc bytes");
+		di_t ps = di_dict_get(f, str("phases"));
+		for (j = 0; j < NUM_PHASES; j++) {
+			di_t p = di_dict_get(ps, str(phases[j]));
+			if (di_is_null(p))
+				continue;
+			di_t bytes = di_dict_get(p, str("alloc_bytes"));
+			di_writef(&w, "  %-10s %10.3f %10.3f ", phases[j],
+			          1e3 * number(di_dict_get(p, str("wall"))),
+			          1e3 * number(di_dict_get(p, str("cpu"))));
+			if (di_is_null(bytes))
+				di_writef(&w, "%14s\n", "-");
+			else
+				di_writef(&w, "%14.0f\n", number(bytes));
+		}
+	}
+	di_writef(&w, "Total: %.3f ms wall, %.3f ms cpu, peak RSS %ld KB\n",
+	          1e3 * wall, 1e3 * cpu, (long)usage.ru_maxrss);
+	di_writer_finish(&w);
+	di_cleanup(files);
+}
 
 /**
  * Like any di function, frees the token if its refc == 0.
  */
-static inline void debug_dump(const char *label, di_t token) {
-	printf("%s", label);
-	di_dump(token, 0);
-	printf("\n");
+static inline void debug_dump(di_writer_t *w, const char *label, di_t token) {
+	di_write_cstring(w, label);
+	di_write_dump(w, token, 0);
+	di_write_char(w, '\n');
 }
 
-int main(int argc, char **argv) {
-	if (argc < 2) {
-		fprintf(stderr, "Usage: %s [COMMAND] FILENAME\n", argv[0]);
-		fprintf(stderr, "Commands: source, lex, parse, annotate, pp\n");
-		exit(1);
+// The directory of the front-end cache, if it's used. See di_cache.h.
+static const char *cache_dir = NULL;
+
+// Lexes and parses a source, timing it if t isn't NULL. Frees the source if its
+// refc == 0.
+static di_t parse_source(di_t source, timing_t *t) {
+	di_tokens_t tokens;
+	phase_begin(t, T_LEX);
+	di_lex_all(&tokens, source);
+	phase_end(t);
+	phase_begin(t, T_PARSE);
+	di_t tree = di_parse_tokens(&tokens);
+	phase_end(t);
+	if (t) {
+		t->tokens = tokens.length;
+		t->nodes = count_nodes(tree);
 	}
-	char *cmd, *fn;
-	if (argc == 2) {
-		cmd = "lex";
-		fn = argv[1];
-	} else {
-		cmd = argv[1];
-		fn = argv[2];
+	di_tokens_free(&tokens);
+	return tree;
+}
+
+// Prints the warnings of the annotator, an array of strings, and frees them.
+static void print_warnings(di_t warnings) {
+	di_size_t i;
+	for (i = 0; i < di_array_length(warnings); i++) {
+		di_t message = di_array_get(warnings, i);
+		fprintf(stderr, "%.*s\n", (int)di_string_length(message),
+		        di_string_chars(message));
+	}
+	di_cleanup(warnings);
+}
+
+/**
+ * Returns the annotated parse tree of a source, from the cache if it's there.
+ * Otherwise, the source is parsed and annotated and the result is added to the
+ * cache. If interface isn't NULL, the module interface is stored in it. The
+ * phases are timed if t isn't NULL.
+ */
+static di_t annotate_source(di_t source, di_t *interface, timing_t *t) {
+	di_t tree, warnings;
+	if (cache_dir) {
+		phase_begin(t, T_CACHE);
+		tree = di_cache_load(cache_dir, source, interface, &warnings);
+		phase_end(t);
+		if (!di_is_undefined(tree)) {
+			print_warnings(warnings);
+			di_cleanup(source);
+			if (t)
+				t->nodes = count_nodes(tree);
+			return tree;
+		}
+	}
+	di_incref(source); // for the cache
+	tree = parse_source(source, t);
+	phase_begin(t, T_ANNOTATE);
+	warnings = di_array_empty();
+	tree = di_annotate_warnings(tree, &warnings);
+	phase_end(t);
+	di_decref(source);
+	if (cache_dir || interface) {
+		phase_begin(t, T_CACHE);
+		di_t iface = di_module_interface(tree);
+		if (cache_dir &&
+		    !di_cache_store(cache_dir, source, tree, iface, warnings))
+			fprintf(stderr, "Can't write to the cache in %s\n", cache_dir);
+		if (interface)
+			*interface = iface;
+		else
+			di_cleanup(iface);
+		phase_end(t);
 	}
-	di_t filename = di_string_from_cstring(fn);
+	print_warnings(warnings);
+	di_cleanup(source);
+	return tree;
+}
+
+/**
+ * Runs a command on a file and writes the output. Frees the filename if its
+ * refc == 0. The writer must not be allocated in an arena. If t isn't NULL, the
+ * phases are timed and the tokens and nodes are counted.
+ */
+static void run(di_writer_t *w, enum command cmd, di_t filename, timing_t *t) {
+	// Everything is allocated in an arena which is destroyed at the end, so
+	// the values don't need to be freed one by one.
+	di_arena_t *arena = di_arena_create();
+	di_arena_t *prev = di_arena_enter(arena);
+	phase_begin(t, T_READ);
 	di_t source = di_readfile(filename);
-        di_cleanup(filename);
-	if (!strcmp("source", cmd)) {
-		debug_dump("Source: ", source);
-	} else if (!strcmp("lex", cmd)) {
+	phase_end(t);
+	di_cleanup(filename);
+	if (t)
+		t->length = di_string_length(source);
+	di_t tree = di_null(), interface = di_undefined();
+	if (cmd == PARSE || cmd == PP) {
+		tree = parse_source(source, t);
+	} else if (cmd == ANNOTATE || cmd == COMPILE) {
+		tree = annotate_source(source, NULL, t);
+	} else if (cmd == INTERFACE) {
+		if (cache_dir) {
+			phase_begin(t, T_CACHE);
+			interface = di_cache_load_interface(cache_dir, source);
+			phase_end(t);
+		}
+		if (di_is_undefined(interface))
+			di_cleanup(annotate_source(source, &interface, t));
+		else
+			di_cleanup(source);
+	}
+	phase_begin(t, T_OUTPUT);
+	if (cmd == SOURCE) {
+		debug_dump(w, "Source: ", source);
+	} else if (cmd == LEX) {
 		di_t lexer = di_lexer_create(source);
-		debug_dump("Lexer: ", lexer);
+		debug_dump(w, "Lexer: ", lexer);
 		di_t token = di_null();
 		di_t op;
 		do {
 			token = di_lex(&lexer, token);
 			op = di_dict_get(token, di_string_from_cstring("op"));
-			debug_dump("Token: ", token);
+			debug_dump(w, "Token: ", token);
+			if (t)
+				t->tokens++;
 		} while (!di_equal(op, di_string_from_cstring("eof")));
-                di_cleanup(token);
-                di_cleanup(lexer);
-	} else if (!strcmp("parse", cmd)) {
-		di_t tree = di_parse(source);
-		printf("Parsing done.\n");
-		debug_dump("Parse tree: ", tree);
-                di_cleanup(tree);
-	} else if (!strcmp("annotate", cmd)) {
-		di_t tree = di_parse(source);
-		printf("Parsing done.\n");
-                tree = di_annotate(tree);
-		printf("Annotation done.\n");
-		debug_dump("Annotated parse tree: ", tree);
-                di_cleanup(tree);
-	} else if (!strcmp("pp", cmd)) {
-		di_t tree = di_parse(source);
-		di_prettyprint(tree);
-                di_cleanup(tree);
+	} else if (cmd == PARSE) {
+		di_write_cstring(w, "Parsing done.\n");
+		debug_dump(w, "Parse tree: ", tree);
+	} else if (cmd == ANNOTATE) {
+		di_write_cstring(w, "Parsing done.\n");
+		di_write_cstring(w, "Annotation done.\n");
+		debug_dump(w, "Annotated parse tree: ", tree);
+	} else if (cmd == INTERFACE) {
+		di_write_source(w, interface, 0);
+		di_write_char(w, '\n');
+	} else if (cmd == COMPILE) {
+		di_compile(w, tree);
 	} else {
-		fprintf(stderr, "Bad command: %s\n", cmd);
-		exit(1);
+		di_write_prettyprint(w, tree);
 	}
+	phase_end(t);
+	di_arena_enter(prev);
+	di_arena_destroy(arena);
+}
 
+/**
+ * The task run for a file when several are run in parallel. Returns an array
+ * of the output, as a string, and the timing as a dict if timed is true, or
+ * null.
+ */
+static di_t run_task(di_t cmd, di_t filename, di_t timed) {
+	di_writer_t w;
+	timing_t t = {{false}};
+	di_writer_init_string(&w);
+	di_incref(filename);
+	run(&w, (enum command)di_to_int(cmd), filename,
+	    di_is_true(timed) ? &t : NULL);
+	di_decref(filename);
+	di_t result = di_array_empty();
+	di_array_push(&result, di_writer_finish_string(&w));
+	di_array_push(&result, di_is_true(timed) ? timing_dict(filename, &t)
+	                                         : di_null());
+	if (!di_is_true(timed))
+		di_cleanup(filename);
+	return result;
+}
+
+// Prints the statistics of the run, all files included, to stderr.
+static void print_stats(void) {
+	di_t stats = di_stats();
+	if (di_is_null(stats)) {
+		fprintf(stderr, "No statistics; dlc is built without DI_STATS "
+		                "(make STATS=1)\n");
+		return;
+	}
+	di_writer_t w;
+	di_writer_init_file(&w, stderr);
+	di_write_cstring(&w, "Statistics: ");
+	di_write_source(&w, stats, 0);
+	di_write_char(&w, '\n');
+	di_writer_finish(&w);
+	di_cleanup(stats);
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [OPTIONS] [COMMAND] FILENAME...\n", prog);
+	fprintf(stderr, "Commands: source, lex, parse, annotate, pp, interface, "
+	                "compile\n");
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  -j N          Run up to N files in parallel, or one "
+	                "per CPU if N is 0\n");
+	fprintf(stderr, "  --cache DIR   Keep annotated parse trees and "
+	                "interfaces in DIR\n");
+	fprintf(stderr, "  --stats       Print allocation and copy-on-write "
+	                "statistics to stderr\n");
+	fprintf(stderr, "  --time[=json] Print the time of each phase per file "
+	                "to stderr, as text or JSON\n");
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	int i = 1;
+	unsigned jobs = 1;
+	bool stats = false;
+	bool timed = false, json_time = false;
+	for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+		if (!strncmp(argv[i], "-j", 2)) {
+			const char *n = argv[i][2] ? &argv[i][2] : argv[++i];
+			char *end;
+			if (!n || (jobs = strtoul(n, &end, 10), *end || end == n))
+				usage(argv[0]);
+		} else if (!strcmp(argv[i], "--cache") && i + 1 < argc) {
+			cache_dir = argv[++i];
+		} else if (!strcmp(argv[i], "--stats")) {
+			stats = true;
+		} else if (!strcmp(argv[i], "--time")) {
+			timed = true;
+		} else if (!strcmp(argv[i], "--time=json")) {
+			timed = json_time = true;
+		} else {
+			usage(argv[0]);
+		}
+	}
+	// The command can be omitted if there's only one file.
+	int cmd = LEX;
+	if (argc - i > 1) {
+		cmd = find_command(argv[i]);
+		if (cmd < 0) {
+			fprintf(stderr, "Bad command: %s\n", argv[i]);
+			exit(1);
+		}
+		i++;
+	}
+	if (i == argc)
+		usage(argv[0]);
+	int nfiles = argc - i;
+	char **files = &argv[i];
+
+	di_writer_t out;
+	di_writer_init_file(&out, stdout);
+	di_t timings = di_array_empty();
+	double wall = seconds(CLOCK_MONOTONIC);
+	double cpu = seconds(CLOCK_PROCESS_CPUTIME_ID);
+	if (jobs == 1 || nfiles == 1) {
+		for (i = 0; i < nfiles; i++) {
+			timing_t t = {{false}};
+			run(&out, cmd, di_string_from_cstring(files[i]),
+			    timed ? &t : NULL);
+			if (timed)
+				di_array_push(&timings,
+				              timing_dict(di_string_from_cstring(files[i]),
+				                          &t));
+		}
+	} else {
+		// The files are lexed, parsed and annotated by the workers and the
+		// output is written in the order of the files.
+		di_tasks_start(jobs == 0 || jobs < (unsigned)nfiles ? jobs
+		                                                    : (unsigned)nfiles);
+		DI_FUN_STATIC(run_fun, run_task, 3);
+		di_t fun = di_from_static_fun(&run_fun);
+		di_t tasks = di_array_empty();
+		for (i = 0; i < nfiles; i++) {
+			di_t args = di_array_empty();
+			di_array_push(&args, di_from_int(cmd));
+			di_array_push(&args, di_string_from_cstring(files[i]));
+			di_array_push(&args, di_from_boolean(timed));
+			di_array_push(&tasks, di_spawn(fun, args));
+		}
+		for (i = 0; i < nfiles; i++) {
+			di_t result = di_wait(di_array_get(tasks, i));
+			di_write_string(&out, di_array_get(result, 0));
+			if (timed)
+				di_array_push(&timings, di_array_get(result, 1));
+			di_cleanup(result);
+		}
+		di_cleanup(tasks);
+		di_tasks_stop();
+	}
+	if (!di_writer_finish(&out)) {
+		fprintf(stderr, "Write error\n");
+		exit(1);
+	}
+	if (timed)
+		print_timing(timings, seconds(CLOCK_MONOTONIC) - wall,
+		             seconds(CLOCK_PROCESS_CPUTIME_ID) - cpu, json_time);
+	else
+		di_cleanup(timings);
+	if (stats)
+		print_stats();
 	return 0;
 }
@@ -54,16 +54,16 @@ static inline char * dynstr_chars(dynstr_t * const s) {
 	return s->chars;
 }
 
-// Frees the memory.
-static inline void dynstr_destroy(dynstr_t * s) {
-	DYNSTR_FREE(s, dynstr_sizeof(s->cap));
-}
-
 // Memory size of a string with capacity cap. Used internally.
 static inline DYNSTR_SIZE_T dynstr_sizeof(DYNSTR_SIZE_T const cap) {
 	return (DYNSTR_SIZE_T)sizeof(dynstr_t) + cap + 1;
 }
 
+// Frees the memory.
+static inline void dynstr_destroy(dynstr_t * s) {
+	DYNSTR_FREE(s, dynstr_sizeof(s->cap));
+}
+
 // Creates a string with an initial capacity.
 static inline dynstr_t * dynstr_create(DYNSTR_SIZE_T const capacity) {
 	dynstr_t * s = (dynstr_t *)DYNSTR_ALLOC(dynstr_sizeof(capacity));
@@ -0,0 +1,103 @@
+/*
+ * Dict key hashing benchmark. Compile and link with di.c:
+ *
+ *     make hash-bench && ./hash-bench [NUM_KEYS]
+ *
+ * Reports the probe lengths of string keys in a dict with NUM_KEYS (default
+ * 100000) keys of JSON-like names, for the previous length-only hash and for
+ * di_hash(). The probe lengths are computed by inserting the hashes into a slot
+ * table of the capacity the dict ends up with, using the same linear probing
+ * as oaht.h. Then the time of di_dict_set() and di_dict_get() is measured.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "di.h"
+
+// The hash used for strings in dicts before di_hash().
+static uint64_t length_hash(di_t key) {
+	return di_string_length(key) * 0x479 + 0xff98823;
+}
+
+// The capacity of an oaht after inserting n keys (OAHT_MIN_CAPACITY 4, grown
+// to the next power of 2 of 4 * used when 2/3 full).
+static di_size_t dict_capacity(di_size_t n) {
+	di_size_t cap = 4, used;
+	for (used = 1; used <= n; used++) {
+		if (used * 3 >= cap * 2) {
+			di_size_t min_size = (used > 50000 ? 2 : 4) * used;
+			while (cap < min_size)
+				cap *= 2;
+		}
+	}
+	return cap;
+}
+
+static void report_probes(const char *name, di_t *keys, di_size_t n,
+                          uint64_t (*hash)(di_t)) {
+	di_size_t cap = dict_capacity(n), mask = cap - 1, i;
+	char *used = calloc(cap, 1);
+	unsigned long long total = 0, max = 0;
+	for (i = 0; i < n; i++) {
+		di_size_t pos = hash(keys[i]) & mask, probes = 1;
+		while (used[pos]) {
+			// Skip the occupied run quickly
+			char *free_slot = memchr(&used[pos], 0, cap - pos);
+			if (free_slot) {
+				probes += free_slot - &used[pos];
+				pos = free_slot - used;
+			} else {
+				probes += cap - pos;
+				pos = 0;
+			}
+		}
+		used[pos] = 1;
+		total += probes;
+		if (probes > max)
+			max = probes;
+	}
+	printf("%-12s capacity %u, avg probe length %.2f, max probe length %llu\n",
+	       name, cap, (double)total / n, max);
+	free(used);
+}
+
+static double seconds(void) {
+	return (double)clock() / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char **argv) {
+	di_size_t n = argc > 1 ? (di_size_t)atol(argv[1]) : 100000, i;
+	const char *fields[] = {"id", "name", "created_at", "user", "value",
+	                        "attributes", "type"};
+	di_t *keys = malloc(sizeof(di_t) * n);
+	char buf[64];
+	for (i = 0; i < n; i++) {
+		snprintf(buf, sizeof(buf), "%s_%u", fields[i % 7], i);
+		keys[i] = di_string_from_cstring(buf);
+		di_incref(keys[i]);
+	}
+	printf("%u string keys\n", n);
+	report_probes("length hash", keys, n, length_hash);
+	report_probes("di_hash", keys, n, di_hash);
+
+	double t0 = seconds();
+	di_t d = di_dict_empty();
+	for (i = 0; i < n; i++)
+		d = di_dict_set(d, keys[i], di_from_int(i));
+	double t1 = seconds();
+	for (i = 0; i < n; i++)
+		if (di_to_int(di_dict_get(d, keys[i])) != (int32_t)i)
+			return 1;
+	double t2 = seconds();
+	printf("di_dict_set  %.1f ns/op\n", (t1 - t0) * 1e9 / n);
+	printf("di_dict_get  %.1f ns/op\n", (t2 - t1) * 1e9 / n);
+
+	di_cleanup(d);
+	for (i = 0; i < n; i++)
+		di_decref_and_free(keys[i]);
+	free(keys);
+	return 0;
+}
@@ -4,7 +4,7 @@
 #include "json.h"
 
 /*
- * gcc -Wall json-test.c json.c di.c -lyajl -o json-test
+ * make json-dump
  */
 
 int main(int argc, char ** argv) {
@@ -4,7 +4,7 @@
 #include "json.h"
 
 /*
- * gcc -Wall -I/opt/local/include json-test.c json.c di.c -lyajl -o json-test
+ * make json-test
  */
 
 int main(int argc, char ** argv) {
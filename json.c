@@ -1,255 +1,586 @@
 #include "json.h"
 #include <assert.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
-#include <yajl/yajl_parse.h>
-#include <yajl/yajl_gen.h>
+#include <stdlib.h>
+#include <string.h>
 
-/**
- * Parser state
+/*
+ * Word-wide bit tricks (SWAR) used for scanning strings 8 bytes at a time.
+ * WORD_NEEDS_ESCAPE(w) is non-zero iff any byte in w is '"', '\\' or a control
+ * character. (Which bits are set is not exact, only whether any bit is set.)
  */
-struct parser_state {
-    /**
-     * The root value.
-     */
-    di_t root;
-
-    /**
-     * Used while parsing objects. The key is stored here until the value
-     * arrives. Then the key-value pair is added to the object on the stack.
-     */
-    di_t keys;
-
-    /**
-     * A parser stack. Each frame is either an array or an object.
-     */
-    di_t stack;
-};
+#define ONES  0x0101010101010101ull
+#define HIGHS 0x8080808080808080ull
+#define HAS_ZERO_BYTE(w) (((w) - ONES) & ~(w) & HIGHS)
+#define WORD_NEEDS_ESCAPE(w) (HAS_ZERO_BYTE((w) ^ (ONES * '"')) |  \
+                              HAS_ZERO_BYTE((w) ^ (ONES * '\\')) | \
+                              (((w) - ONES * 0x20) & ~(w) & HIGHS))
 
-/**
- * Adds a value to the array or object currency being parsed. Special case for top level.
+/*
+ * Decoder
  *
- * Returns non-zero on failure.
+ * A single pass over the input without recursion. Each parsed value is pushed
+ * on a value stack. When an array or an object is closed, its elements (or its
+ * keys and values) are on top of the stack, so the container is created from
+ * them with the right size at once and pushed in their place. No container is
+ * grown or cloned while parsing.
  */
-static inline int add_value(void * ctx, di_t value) {
-    struct parser_state * s = (struct parser_state *)ctx;
-    if (di_array_length(s->stack) == 0) {
-        s->root = value;
-    }
-    else {
-        di_size_t top_index = di_array_length(s->stack) - 1;
-        di_t top = di_array_get(s->stack, top_index);
-        if (di_is_array(top)) {
-            di_array_push(&top, value);
-        } else if (di_is_dict(top)) {
-            // Pop the key from the key stack
-            di_t key = di_array_pop(&s->keys);
-            top = di_dict_set(top, key, value);
-        } else {
-            // Undexpected junk on the stack. Shouldn't happen.
-            assert(false);
-            return 0;
-        }
-        // Destructively update the stack
-        s->stack = di_array_set(s->stack, top_index, top);
+
+struct decoder_frame {
+    di_size_t base; // index in the value stack of the first element
+    char close;     // ']' or '}'
+};
+
+struct decoder {
+    const char *p, *end;
+    di_t *values;
+    di_size_t nvalues, values_cap;
+    struct decoder_frame *frames;
+    di_size_t nframes, frames_cap;
+};
+
+static void *grow_stack(void *stack, di_size_t *cap, size_t elem_size) {
+    *cap = *cap ? *cap * 2 : 64;
+    stack = realloc(stack, *cap * elem_size);
+    if (!stack) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
     }
-    return 1; // OK
+    return stack;
 }
 
-static int got_null(void * ctx) {
-    return add_value(ctx, di_null());
+static inline void push_value(struct decoder *d, di_t value) {
+    if (d->nvalues == d->values_cap)
+        d->values = grow_stack(d->values, &d->values_cap, sizeof(di_t));
+    d->values[d->nvalues++] = value;
 }
 
-static int got_boolean(void * ctx, int boolean) {
-    return add_value(ctx, di_from_boolean(boolean != 0));
+static inline void push_frame(struct decoder *d, char close) {
+    if (d->nframes == d->frames_cap)
+        d->frames = grow_stack(d->frames, &d->frames_cap,
+                               sizeof(struct decoder_frame));
+    d->frames[d->nframes].base  = d->nvalues;
+    d->frames[d->nframes].close = close;
+    d->nframes++;
 }
 
-/*
-// This can be used instead of int and double to parse numbers separately.
-static int got_number(void * ctx, const char * s, size_t l) {
-    yajl_gen g = (yajl_gen) ctx;
-    return yajl_gen_status_ok == yajl_gen_number(g, s, l);
+// Replaces the values of the innermost open container with the container.
+static void close_container(struct decoder *d) {
+    struct decoder_frame *frame = &d->frames[--d->nframes];
+    di_t *values = &d->values[frame->base];
+    di_size_t n = d->nvalues - frame->base;
+    di_t container = frame->close == ']'
+                   ? di_array_from_values(values, n)
+                   : di_dict_from_entries(values, n / 2);
+    d->nvalues = frame->base;
+    push_value(d, container);
+}
+
+static inline void skip_whitespace(struct decoder *d) {
+    while (d->p < d->end &&
+           (*d->p == ' ' || *d->p == '\n' || *d->p == '\r' || *d->p == '\t'))
+        d->p++;
+}
+
+// Checks a word for bytes which end the fast path of string scanning: '"',
+// '\\', control characters and non-ASCII bytes.
+static inline bool word_is_plain(uint64_t w) {
+    return !(WORD_NEEDS_ESCAPE(w) | (w & HIGHS));
+}
+
+// Skips ASCII bytes other than '"', '\\' and control characters.
+static inline const char *skip_plain(const char *p, const char *end) {
+    uint64_t w;
+    while (end - p >= 8) {
+        memcpy(&w, p, 8);
+        if (!word_is_plain(w))
+            break;
+        p += 8;
+    }
+    while (p < end && (unsigned char)*p >= 0x20 && (unsigned char)*p < 0x80 &&
+           *p != '"' && *p != '\\')
+        p++;
+    return p;
+}
+
+// Returns the length of the valid UTF-8 sequence at p, or 0 if it's invalid.
+// Overlong encodings, surrogates and code points above U+10FFFF are invalid.
+static di_size_t utf8_sequence_length(const char *p, const char *end) {
+    const unsigned char *s = (const unsigned char *)p;
+    di_size_t n = (di_size_t)(end - p);
+    if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+        if (n >= 2 && (s[1] & 0xc0) == 0x80)
+            return 2;
+    } else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+        if (n >= 3 && (s[1] & 0xc0) == 0x80 && (s[2] & 0xc0) == 0x80 &&
+            (s[0] != 0xe0 || s[1] >= 0xa0) &&  // overlong
+            (s[0] != 0xed || s[1] < 0xa0))     // surrogate
+            return 3;
+    } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+        if (n >= 4 && (s[1] & 0xc0) == 0x80 && (s[2] & 0xc0) == 0x80 &&
+            (s[3] & 0xc0) == 0x80 &&
+            (s[0] != 0xf0 || s[1] >= 0x90) &&  // overlong
+            (s[0] != 0xf4 || s[1] < 0x90))     // above U+10FFFF
+            return 4;
+    }
+    return 0;
 }
-*/
 
-static int got_int(void * ctx, long long intVal) {
-    // FIXME: handle overflow (to double, to bigint or fail)
-    return add_value(ctx, di_from_int((int32_t)intVal));
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
 }
 
-static int got_double(void * ctx, double doubleVal) {
-    return add_value(ctx, di_from_double(doubleVal));
+// Parses the 4 hex digits after "\u". Returns -1 on error.
+static long parse_hex4(const char *p, const char *end) {
+    long code = 0;
+    int i;
+    if (end - p < 4)
+        return -1;
+    for (i = 0; i < 4; i++) {
+        int digit = hex_digit(p[i]);
+        if (digit < 0)
+            return -1;
+        code = code * 16 + digit;
+    }
+    return code;
 }
 
-static int got_string(void * ctx, const unsigned char * stringVal,
-                           size_t stringLen) {
-    return add_value(ctx, di_string_from_chars((char *)stringVal, (di_size_t)stringLen));
+static char *encode_utf8(char *out, long code) {
+    if (code < 0x80) {
+        *out++ = (char)code;
+    } else if (code < 0x800) {
+        *out++ = (char)(0xc0 | (code >> 6));
+        *out++ = (char)(0x80 | (code & 0x3f));
+    } else if (code < 0x10000) {
+        *out++ = (char)(0xe0 | (code >> 12));
+        *out++ = (char)(0x80 | ((code >> 6) & 0x3f));
+        *out++ = (char)(0x80 | (code & 0x3f));
+    } else {
+        *out++ = (char)(0xf0 | (code >> 18));
+        *out++ = (char)(0x80 | ((code >> 12) & 0x3f));
+        *out++ = (char)(0x80 | ((code >> 6) & 0x3f));
+        *out++ = (char)(0x80 | (code & 0x3f));
+    }
+    return out;
 }
 
-static int got_map_key(void * ctx, const unsigned char * stringVal,
-                       size_t stringLen) {
-    struct parser_state * s = (struct parser_state *)ctx;
-    di_t key = di_string_from_chars((char *)stringVal, (di_size_t)stringLen);
-    di_array_push(&s->keys, key);
-    return 1;
+// Decodes the contents of a string with escapes, from p to the closing quote
+// at end, which has already been found. Returns false on error. No escape
+// sequence is shorter than what it decodes to, so the result fits in a string
+// of length end - p.
+static bool unescape_string(const char *p, const char *end, di_t *result) {
+    di_t string = di_string_create_presized((di_size_t)(end - p));
+    char *start = di_string_chars(string), *out = start;
+    while (p < end) {
+        if (*p != '\\') {
+            *out++ = *p++;
+            continue;
+        }
+        p++;
+        switch (*p++) {
+        case '"':  *out++ = '"';  break;
+        case '\\': *out++ = '\\'; break;
+        case '/':  *out++ = '/';  break;
+        case 'b':  *out++ = '\b'; break;
+        case 'f':  *out++ = '\f'; break;
+        case 'n':  *out++ = '\n'; break;
+        case 'r':  *out++ = '\r'; break;
+        case 't':  *out++ = '\t'; break;
+        case 'u': {
+            long code = parse_hex4(p, end);
+            p += 4;
+            if (code >= 0xd800 && code <= 0xdbff) {
+                // A high surrogate must be followed by a low surrogate.
+                long low = end - p >= 6 && p[0] == '\\' && p[1] == 'u'
+                         ? parse_hex4(p + 2, end) : -1;
+                if (low < 0xdc00 || low > 0xdfff)
+                    goto error;
+                code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                p += 6;
+            } else if (code < 0 || (code >= 0xdc00 && code <= 0xdfff)) {
+                goto error;
+            }
+            out = encode_utf8(out, code);
+            break;
+        }
+        default:
+            goto error;
+        }
+    }
+    *result = di_string_resize(string, (di_size_t)(out - start));
+    if (out - start > 6)
+        di_string_chars(*result)[out - start] = '\0';
+    return true;
+error:
+    di_cleanup(string);
+    return false;
 }
 
-static int got_start_map(void * ctx) {
-    struct parser_state * s = (struct parser_state *)ctx;
-    di_t dict = di_dict_empty();
-    di_array_push(&s->stack, dict);
-    return 1;
+// Parses a string starting at the opening quote and pushes it.
+static bool parse_string(struct decoder *d) {
+    const char *start = ++d->p, *p = start;
+    bool escaped = false;
+    for (;;) {
+        p = skip_plain(p, d->end);
+        if (p == d->end)
+            return false;
+        if (*p == '"')
+            break;
+        if (*p == '\\') {
+            if (d->end - p < 2)
+                return false;
+            escaped = true;
+            p += 2; // The escape is validated by unescape_string
+        } else if ((unsigned char)*p < 0x20) {
+            return false;
+        } else {
+            di_size_t n = utf8_sequence_length(p, d->end);
+            if (!n)
+                return false;
+            p += n;
+        }
+    }
+    d->p = p + 1;
+    if (!escaped) {
+        push_value(d, di_string_from_chars((char *)start,
+                                           (di_size_t)(p - start)));
+        return true;
+    }
+    di_t string;
+    if (!unescape_string(start, p, &string))
+        return false;
+    push_value(d, string);
+    return true;
 }
 
-static int got_end_map(void * ctx) {
-    struct parser_state * s = (struct parser_state *)ctx;
-    di_t dict = di_array_pop(&s->stack);
-    add_value(ctx, dict);
-    return 1;
+// Parses an object key and the colon after it.
+static bool parse_key(struct decoder *d) {
+    if (d->p == d->end || *d->p != '"' || !parse_string(d))
+        return false;
+    skip_whitespace(d);
+    if (d->p == d->end || *d->p != ':')
+        return false;
+    d->p++;
+    return true;
 }
 
-static int got_start_array(void * ctx) {
-    struct parser_state * s = (struct parser_state *)ctx;
-    di_t a = di_array_empty();
-    di_array_push(&s->stack, a);
-    return 1;
+static inline bool is_digit(const char *p, const char *end) {
+    return p < end && *p >= '0' && *p <= '9';
 }
 
-static int got_end_array(void * ctx) {
-    struct parser_state * s = (struct parser_state *)ctx;
-    di_t a = di_array_pop(&s->stack);
-    add_value(ctx, a);
-    return 1;
+// Parses a number and pushes it. Integers which fit in an int are stored as
+// ints. Other numbers are stored as doubles, so integers are exact up to 2^53.
+static bool parse_number(struct decoder *d) {
+    const char *start = d->p, *p = d->p, *end = d->end;
+    bool is_integer = true;
+    if (p < end && *p == '-')
+        p++;
+    if (!is_digit(p, end))
+        return false;
+    if (*p == '0')
+        p++;
+    else
+        while (is_digit(p, end))
+            p++;
+    if (p < end && *p == '.') {
+        is_integer = false;
+        p++;
+        if (!is_digit(p, end))
+            return false;
+        while (is_digit(p, end))
+            p++;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        is_integer = false;
+        p++;
+        if (p < end && (*p == '+' || *p == '-'))
+            p++;
+        if (!is_digit(p, end))
+            return false;
+        while (is_digit(p, end))
+            p++;
+    }
+    d->p = p;
+    size_t len = (size_t)(p - start);
+    if (is_integer && len <= 18) {
+        // At most 18 characters, so it doesn't overflow.
+        const char *q = start + (*start == '-');
+        int64_t n = 0;
+        while (q < p)
+            n = n * 10 + (*q++ - '0');
+        if (*start == '-')
+            n = -n;
+        push_value(d, n >= INT32_MIN && n <= INT32_MAX
+                      ? di_from_int((int32_t)n) : di_from_double((double)n));
+        return true;
+    }
+    // strtod needs a nul-terminated string.
+    char buf[64];
+    char *s = len < sizeof(buf) ? buf : malloc(len + 1);
+    if (!s) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    memcpy(s, start, len);
+    s[len] = '\0';
+    push_value(d, di_from_double(strtod(s, NULL)));
+    if (s != buf)
+        free(s);
+    return true;
 }
 
-static yajl_callbacks callbacks = {
-    got_null,
-    got_boolean,
-    got_int,
-    got_double,
-    NULL, //got_number,
-    got_string,
-    got_start_map,
-    got_map_key,
-    got_end_map,
-    got_start_array,
-    got_end_array
-};
+static bool parse_literal(struct decoder *d, const char *word, size_t len,
+                          di_t value) {
+    if ((size_t)(d->end - d->p) < len || memcmp(d->p, word, len))
+        return false;
+    d->p += len;
+    push_value(d, value);
+    return true;
+}
+
+// Parses a value. The start of an array or an object opens a frame and
+// parses its first key, if any. Returns false on error.
+static bool parse_value(struct decoder *d) {
+    skip_whitespace(d);
+    if (d->p == d->end)
+        return false;
+    switch (*d->p) {
+    case '[':
+        d->p++;
+        push_frame(d, ']');
+        return true;
+    case '{':
+        d->p++;
+        push_frame(d, '}');
+        skip_whitespace(d);
+        return d->p < d->end && (*d->p == '}' || parse_key(d));
+    case '"':
+        return parse_string(d);
+    case 't':
+        return parse_literal(d, "true", 4, di_true());
+    case 'f':
+        return parse_literal(d, "false", 5, di_false());
+    case 'n':
+        return parse_literal(d, "null", 4, di_null());
+    default:
+        return parse_number(d);
+    }
+}
+
+// Decodes a value. Returns undefined if the input isn't a valid JSON text.
+static di_t decode(struct decoder *d) {
+    while (parse_value(d)) {
+        // After a value, or right after an opening bracket. Close containers
+        // until there's a comma, which means that another value follows.
+        for (;;) {
+            skip_whitespace(d);
+            if (d->nframes == 0) {
+                if (d->p != d->end)
+                    goto error;
+                assert(d->nvalues == 1);
+                d->nvalues = 0;
+                return d->values[0];
+            }
+            struct decoder_frame *frame = &d->frames[d->nframes - 1];
+            if (frame->close == '}' && (d->nvalues - frame->base) % 2)
+                break; // The value of a key follows.
+            if (d->p == d->end)
+                goto error;
+            if (*d->p == frame->close) {
+                d->p++;
+                close_container(d);
+                continue;
+            }
+            if (d->nvalues == frame->base)
+                break; // The first element of an array follows.
+            if (*d->p != ',')
+                goto error;
+            d->p++;
+            if (frame->close == '}') {
+                skip_whitespace(d);
+                if (!parse_key(d))
+                    goto error;
+            }
+            break;
+        }
+    }
+error:
+    #ifdef JSON_DEBUG
+    printf("JSON parse error.\n");
+    #endif
+    while (d->nvalues > 0)
+        di_cleanup(d->values[--d->nvalues]);
+    return di_undefined();
+}
 
 di_t json_decode(di_t json) {
     assert(di_is_string(json));
-    char * json_chars = di_string_chars(json);
-    size_t json_len   = di_string_length(json);
-    struct parser_state s;
-    s.keys  = di_array_empty();
-    s.stack = di_array_empty();
-    yajl_handle parser = yajl_alloc(&callbacks, NULL, &s);
-    //yajl_status status;
-    if (yajl_parse(parser, (unsigned char *)json_chars, json_len) != yajl_status_ok
-        || yajl_complete_parse(parser) != yajl_status_ok) {
-        // Parse error. Return undefined.
-		#ifdef JSON_DEBUG
-        printf("JSON parse error.\n");
-		#endif
-        s.root = di_undefined();
-    }
-    else {
-        // These should both be emtpy after successful parse.
-        assert(di_array_length(s.keys) == 0);
-        assert(di_array_length(s.stack) == 0);
-    }
-    di_cleanup(s.keys);
-    di_cleanup(s.stack);
-    yajl_free(parser);
+    struct decoder d = {0};
+    d.p   = di_string_chars(json);
+    d.end = d.p + di_string_length(json);
+    di_t result = decode(&d);
+    free(d.values);
+    free(d.frames);
     di_cleanup(json);
-    return s.root;
+    return result;
 }
 
-/**
- * recursive helper for json_encode. Returns 1 on success, 0 on failure.
+/*
+ * Encoder
  */
-int encode_rec(yajl_gen g, di_t v) {
-    yajl_gen_status status;
-    if (di_is_null(v)) {
-        status = yajl_gen_null(g);
-    } else if (di_is_boolean(v)) {
-        status = yajl_gen_bool(g, di_to_boolean(v));
+
+// Skips bytes which don't need to be escaped.
+static inline const char *skip_unescaped(const char *p, const char *end) {
+    uint64_t w;
+    while (end - p >= 8) {
+        memcpy(&w, p, 8);
+        if (WORD_NEEDS_ESCAPE(w))
+            break;
+        p += 8;
+    }
+    while (p < end && (unsigned char)*p >= 0x20 && *p != '"' && *p != '\\')
+        p++;
+    return p;
+}
+
+static void encode_string(di_writer_t *w, const char *p, size_t n) {
+    static const char hex[] = "0123456789abcdef";
+    const char *end = p + n;
+    di_write_char(w, '"');
+    while (p < end) {
+        const char *run = p;
+        p = skip_unescaped(p, end);
+        di_write(w, run, (size_t)(p - run));
+        if (p == end)
+            break;
+        char *out = di_writer_reserve(w, 6), c = *p++;
+        *out++ = '\\';
+        switch (c) {
+        case '"':  *out++ = '"';  break;
+        case '\\': *out++ = '\\'; break;
+        case '\b': *out++ = 'b';  break;
+        case '\f': *out++ = 'f';  break;
+        case '\n': *out++ = 'n';  break;
+        case '\r': *out++ = 'r';  break;
+        case '\t': *out++ = 't';  break;
+        default:
+            memcpy(out, "u00", 3);
+            out[3] = hex[(unsigned char)c >> 4];
+            out[4] = hex[c & 0xf];
+            out += 5;
+        }
+        w->len = (size_t)(out - w->buf);
+    }
+    di_write_char(w, '"');
+}
+
+// Writes the shortest of %.15g, %.16g and %.17g which reads back as the same
+// double, with ".0" appended if it looks like an integer.
+static bool encode_double(di_writer_t *w, double d) {
+    char tmp[32];
+    int n, precision;
+    if (!isfinite(d))
+        return false; // JSON has no NaN or infinity
+    for (precision = 15; precision <= 17; precision++) {
+        n = snprintf(tmp, sizeof(tmp), "%.*g", precision, d);
+        if (precision == 17 || strtod(tmp, NULL) == d)
+            break;
+    }
+    if (strspn(tmp, "0123456789-") == (size_t)n) {
+        memcpy(tmp + n, ".0", 2);
+        n += 2;
+    }
+    di_write(w, tmp, (size_t)n);
+    return true;
+}
+
+bool json_write(di_writer_t *w, di_t v) {
+    if (di_is_shortstring(v)) {
+        // The chars and the length are in the value itself.
+        encode_string(w, di_shortstring_chars(&v), di_shortstring_length(v));
     } else if (di_is_int(v)) {
-        status = yajl_gen_integer(g, di_to_int(v));
-    } else if (di_is_double(v)) {
-        status = yajl_gen_double(g, di_to_double(v));
+        di_write_int(w, di_to_int(v));
     } else if (di_is_string(v)) {
-        status = yajl_gen_string(g, (unsigned char *)di_string_chars(v), di_string_length(v));
-        if (!di_is_string(v)) printf("Not string anymore!!!!!\n");
+        encode_string(w, di_string_chars(v), di_string_length(v));
+    } else if (di_is_double(v)) {
+        return encode_double(w, di_to_double(v));
+    } else if (di_is_null(v)) {
+        di_write(w, "null", 4);
+    } else if (di_is_boolean(v)) {
+        if (di_to_boolean(v))
+            di_write(w, "true", 4);
+        else
+            di_write(w, "false", 5);
     } else if (di_is_array(v)) {
-        di_size_t i;
-        di_size_t n = di_array_length(v);
-        status = yajl_gen_array_open(g);
-        if (status != yajl_gen_status_ok)
-            //return 0;
-            di_error(di_string_from_cstring("Failed to open array with '['\n"));
+        di_size_t i, n = di_array_length(v);
+        di_write_char(w, '[');
         for (i = 0; i < n; i++) {
-            if (!encode_rec(g, di_array_get(v, i))) {
-                //return 0;
-                printf("Array elem %u of %u\n", i, n);
-                di_error(di_string_from_cstring("Failed to stringify value in array\n"));
-            }
+            if (i > 0)
+                di_write_char(w, ',');
+            if (!json_write(w, di_array_get(v, i)))
+                return false;
         }
-        status = yajl_gen_array_close(g);
+        di_write_char(w, ']');
     } else if (di_is_dict(v)) {
         di_size_t i;
         di_t k, val;
-        status = yajl_gen_map_open(g);
-        if (status != yajl_gen_status_ok)
-            di_error(di_string_from_cstring("Failed to open map with '{'"));
-            //return 0;
+        bool first = true;
+        di_write_char(w, '{');
         for (i = 0; (i = di_dict_iter(v, i, &k, &val));) {
             if (!di_is_string(k)) {
-            	di_error(di_string_from_cstring("Non-string key found in dict -"
-            	                                " can't convert to JSON"));
-            	//exit(1);
-            }
-            assert(di_is_string(k));
-            status = yajl_gen_string(g, (unsigned char *)di_string_chars(k), di_string_length(k));
-            if (status != yajl_gen_status_ok) {
-                //return 0;
-                di_error(di_string_from_cstring("Failed to stringify key in dict\n"));
+                #ifdef JSON_DEBUG
+                printf("Non-string key found in dict.\n");
+                #endif
+                return false;
             }
-            if (!encode_rec(g, val))
-                return 0;
+            if (!first)
+                di_write_char(w, ',');
+            first = false;
+            json_write(w, k);
+            di_write_char(w, ':');
+            if (!json_write(w, val))
+                return false;
         }
-        status = yajl_gen_map_close(g);
-    }
-    else {
+        di_write_char(w, '}');
+    } else {
         // Type not serializable in JSON
-        //assert(false);
-        printf("Non-serializable value %p\n", (void*)(v.as_int64));
         #ifdef JSON_DEBUG
-		printf("Type not JSON serializable.\n");
+        printf("Type not JSON serializable.\n");
         #endif
-        return 0;
+        return false;
     }
-    if (status != yajl_gen_status_ok)
-    	printf("YAJL gen status: %d\n", status);
-    return status == yajl_gen_status_ok;
-}
-
-/** a callback used for "printing" the results. */
-void print_callback(void * ctx, const char * str, size_t len) {
-    di_t *s = (di_t *)ctx;
-    *s = di_string_append_chars(*s, str, len);
+    return true;
 }
 
 di_t json_encode(di_t value) {
-    yajl_gen g = yajl_gen_alloc(NULL);
-    di_t result = di_string_empty();
-    yajl_gen_config(g, yajl_gen_print_callback, print_callback, &result);
-    int success = encode_rec(g, value);
-    yajl_gen_free(g);
-    if (!success) {
-        // json_encode failed
-        // TODO: handle in a better way
+    di_writer_t w;
+    di_writer_init_string(&w);
+    bool ok = json_write(&w, value);
+    di_t result = di_writer_finish_string(&w);
+    if (!ok) {
         di_cleanup(result);
         return di_undefined();
     }
     return result;
 }
+
+bool json_encode_file(di_t value, FILE *file) {
+    di_writer_t w;
+    di_writer_init_file(&w, file);
+    bool ok = json_write(&w, value);
+    return di_writer_finish(&w) && ok;
+}
+
+#ifdef DI_WRITER_FD
+bool json_encode_fd(di_t value, int fd) {
+    di_writer_t w;
+    di_writer_init_fd(&w, fd);
+    bool ok = json_write(&w, value);
+    return di_writer_finish(&w) && ok;
+}
+#endif
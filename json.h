@@ -1,9 +1,31 @@
 #ifndef DI_JSON_H
 #define DI_JSON_H
 
+#include <stdio.h>
 #include "di.h"
+#include "di_writer.h"
 
+// Decodes a JSON text. Returns undefined if it's not valid JSON. Frees json
+// if its ref-counter is zero.
 di_t json_decode(di_t json);
+
+// Encodes a value as JSON and returns it as a string, or undefined if the
+// value can't be represented in JSON (such as a dict with a non-string key,
+// a NaN or a type which doesn't exist in JSON).
 di_t json_encode(di_t value);
 
+// Encodes a value as JSON and writes it to a file. The output is written in
+// chunks while encoding. Returns false if the value can't be represented in
+// JSON or if writing fails, after writing part of the output.
+bool json_encode_file(di_t value, FILE *file);
+
+#ifdef DI_WRITER_FD
+// Like json_encode_file but the output is written to a file descriptor.
+bool json_encode_fd(di_t value, int fd);
+#endif
+
+// Encodes a value as JSON to a writer. Returns false if the value can't be
+// represented in JSON, after writing part of it.
+bool json_write(di_writer_t *w, di_t value);
+
 #endif
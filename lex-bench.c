@@ -0,0 +1,49 @@
+/*
+ * Lexer benchmark. Compile and link with di.c and di_lexer.c:
+ *
+ *     make lex-bench && ./lex-bench FILE...
+ *
+ * Lexes each file with di_lex() until eof, like "dlc lex" but without dumping
+ * the tokens, and reports the total number of tokens and tokens per second.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "di.h"
+#include "di_lexer.h"
+#include "di_io.h"
+
+static double seconds(void) {
+	return (double)clock() / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s FILE...\n", argv[0]);
+		exit(1);
+	}
+	unsigned long long tokens = 0, bytes = 0;
+	double total = 0;
+	int i;
+	for (i = 1; i < argc; i++) {
+		di_t source = di_readfile(di_string_from_cstring(argv[i]));
+		bytes += di_string_length(source);
+		double t0 = seconds();
+		di_t lexer = di_lexer_create(source);
+		di_t token = di_null();
+		di_t op;
+		do {
+			token = di_lex(&lexer, token);
+			op = di_dict_get(token, di_string_from_cstring("op"));
+			tokens++;
+		} while (!di_equal(op, di_string_from_cstring("eof")));
+		di_cleanup(token);
+		di_cleanup(lexer);
+		total += seconds() - t0;
+	}
+	printf("%d files, %llu bytes, %llu tokens in %.3f s, %.0f tokens/s\n",
+	       argc - 1, bytes, tokens, total, tokens / total);
+	return 0;
+}
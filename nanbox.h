@@ -235,6 +235,9 @@ typedef union NANBOX_NAME(_u) NANBOX_T;
  *     Deleted:   0x05
  *
  * All of these except Empty have bit 0 or bit 1 set.
+ *
+ * Bit 2 of a pointer is used to mark it as 'borrowed' (see nanbox_borrow
+ * below). This requires the objects pointed to to be 8-byte aligned.
  */
 
 #define NANBOX_VALUE_EMPTY       0x0llu
@@ -267,6 +270,9 @@ typedef union NANBOX_NAME(_u) NANBOX_T;
 // NANBOX_MASK_POINTER defines the allowed non-zero bits in a pointer.
 #define NANBOX_MASK_POINTER         0x0000fffffffffffcllu
 
+// The 'borrowed' flag of a pointer.
+#define NANBOX_BORROWED_BIT         0x4llu
+
 // The 'empty' value is guarranteed to consist of a repeated single byte,
 // so that it should be easy to memset an array of nanboxes to 'empty' using
 // NANBOX_EMPTY_BYTE as the value for every byte.
@@ -353,6 +359,7 @@ static inline bool NANBOX_NAME(_is_pointer)(NANBOX_T val) {
 }
 static inline NANBOX_POINTER_TYPE NANBOX_NAME(_to_pointer)(NANBOX_T val) {
 	assert(NANBOX_NAME(_is_pointer)(val));
+	val.as_int64 &= ~NANBOX_BORROWED_BIT;
 	return val.pointer;
 }
 static inline NANBOX_T NANBOX_NAME(_from_pointer)(NANBOX_POINTER_TYPE pointer) {
@@ -362,6 +369,24 @@ static inline NANBOX_T NANBOX_NAME(_from_pointer)(NANBOX_POINTER_TYPE pointer) {
 	return val;
 }
 
+// A borrowed pointer is a pointer with the 'borrowed' flag set. It points to
+// the same object as the pointer it was made from. Borrowing or unborrowing a
+// value which is not a pointer returns it unchanged.
+static inline bool NANBOX_NAME(_is_borrowed)(NANBOX_T val) {
+	return NANBOX_NAME(_is_pointer)(val) &&
+	       (val.as_int64 & NANBOX_BORROWED_BIT);
+}
+static inline NANBOX_T NANBOX_NAME(_borrow)(NANBOX_T val) {
+	if (NANBOX_NAME(_is_pointer)(val))
+		val.as_int64 |= NANBOX_BORROWED_BIT;
+	return val;
+}
+static inline NANBOX_T NANBOX_NAME(_unborrow)(NANBOX_T val) {
+	if (NANBOX_NAME(_is_pointer)(val))
+		val.as_int64 &= ~NANBOX_BORROWED_BIT;
+	return val;
+}
+
 static inline bool NANBOX_NAME(_is_aux)(NANBOX_T val) {
 	return val.as_int64 >= NANBOX_MIN_AUX &&
 	       val.as_int64 <= NANBOX_MAX_AUX;
@@ -450,7 +475,7 @@ static inline bool NANBOX_NAME(_is_aux)(NANBOX_T val) {
 }
 
 // Define nanbox_is_yyy, nanbox_to_yyy and nanbox_from_yyy for
-// boolean, int, pointer and aux1-aux5
+// boolean and int
 #define NANBOX_TAGGED_VALUE_FUNCTIONS(NAME, TYPE, TAG) \
 	static inline bool NANBOX_NAME(_is_##NAME)(NANBOX_T val) { \
 		return val.as_bits.tag == TAG; \
@@ -468,7 +493,38 @@ static inline bool NANBOX_NAME(_is_aux)(NANBOX_T val) {
 
 NANBOX_TAGGED_VALUE_FUNCTIONS(boolean, bool, NANBOX_BOOLEAN_TAG)
 NANBOX_TAGGED_VALUE_FUNCTIONS(int, int32_t, NANBOX_INT_TAG)
-NANBOX_TAGGED_VALUE_FUNCTIONS(pointer, NANBOX_POINTER_TYPE, NANBOX_POINTER_TAG)
+
+// Bit 2 of the payload of a pointer is the 'borrowed' flag. This requires the
+// objects pointed to to be 8-byte aligned.
+#define NANBOX_BORROWED_BIT 0x4
+
+static inline bool NANBOX_NAME(_is_pointer)(NANBOX_T val) {
+	return val.as_bits.tag == NANBOX_POINTER_TAG;
+}
+static inline NANBOX_POINTER_TYPE NANBOX_NAME(_to_pointer)(NANBOX_T val) {
+	assert(val.as_bits.tag == NANBOX_POINTER_TAG);
+	return (NANBOX_POINTER_TYPE)(val.as_bits.payload & ~NANBOX_BORROWED_BIT);
+}
+static inline NANBOX_T NANBOX_NAME(_from_pointer)(NANBOX_POINTER_TYPE a) {
+	NANBOX_T val;
+	val.as_bits.tag = NANBOX_POINTER_TAG;
+	val.as_bits.payload = (int32_t)a;
+	return val;
+}
+static inline bool NANBOX_NAME(_is_borrowed)(NANBOX_T val) {
+	return val.as_bits.tag == NANBOX_POINTER_TAG &&
+	       (val.as_bits.payload & NANBOX_BORROWED_BIT);
+}
+static inline NANBOX_T NANBOX_NAME(_borrow)(NANBOX_T val) {
+	if (val.as_bits.tag == NANBOX_POINTER_TAG)
+		val.as_bits.payload |= NANBOX_BORROWED_BIT;
+	return val;
+}
+static inline NANBOX_T NANBOX_NAME(_unborrow)(NANBOX_T val) {
+	if (val.as_bits.tag == NANBOX_POINTER_TAG)
+		val.as_bits.payload &= ~NANBOX_BORROWED_BIT;
+	return val;
+}
 
 static inline NANBOX_T NANBOX_NAME(_true)(void) {
 	return NANBOX_NAME(_from_boolean)(true);
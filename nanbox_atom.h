@@ -0,0 +1,60 @@
+#ifndef NANBOX_ATOM_H
+#define NANBOX_ATOM_H
+/*
+ * Atoms
+ * -----
+ * A pointer to an immortal object can be stored in a NANBOX_T in 'auxillary
+ * space', right after the space used by short strings. On 64-bit platforms,
+ * the space used is (NANBOX_MIN_AUX + 3 * 2^48)..(NANBOX_MIN_AUX + 4 * 2^48 - 1)
+ * and the payload is a 48-bit pointer. On 32-bit platforms, the tag is
+ * NANBOX_MIN_AUX_TAG + 0x00030000 and the payload is a 32-bit pointer.
+ *
+ * Atoms are not reference-counted, so the objects they point to must never be
+ * freed. Two atoms are the same iff their bit patterns are the same.
+ *
+ * Define NANBOX_ATOM_TYPE to the pointer type of the objects. Defaults to void*.
+ */
+
+#include "nanbox.h"
+
+#ifndef NANBOX_ATOM_TYPE
+#define NANBOX_ATOM_TYPE void*
+#endif
+
+#define NANBOX_ATOM_TAG (NANBOX_MIN_AUX_TAG + 0x00030000)
+
+#if defined(NANBOX_64)
+
+static inline bool NANBOX_NAME(_is_atom)(NANBOX_T val) {
+	return (val.as_bits.tag & 0xffff0000) == NANBOX_ATOM_TAG;
+}
+static inline NANBOX_ATOM_TYPE NANBOX_NAME(_to_atom)(NANBOX_T val) {
+	assert(NANBOX_NAME(_is_atom)(val));
+	return (NANBOX_ATOM_TYPE)(uintptr_t)(val.as_int64 & 0x0000ffffffffffffllu);
+}
+static inline NANBOX_T NANBOX_NAME(_from_atom)(NANBOX_ATOM_TYPE pointer) {
+	NANBOX_T val;
+	val.as_int64 = ((uint64_t)NANBOX_ATOM_TAG << 32) | (uintptr_t)pointer;
+	assert(NANBOX_NAME(_is_atom)(val));
+	return val;
+}
+
+#else
+
+static inline bool NANBOX_NAME(_is_atom)(NANBOX_T val) {
+	return val.as_bits.tag == NANBOX_ATOM_TAG;
+}
+static inline NANBOX_ATOM_TYPE NANBOX_NAME(_to_atom)(NANBOX_T val) {
+	assert(NANBOX_NAME(_is_atom)(val));
+	return (NANBOX_ATOM_TYPE)(uintptr_t)val.as_bits.payload;
+}
+static inline NANBOX_T NANBOX_NAME(_from_atom)(NANBOX_ATOM_TYPE pointer) {
+	NANBOX_T val;
+	val.as_bits.tag = NANBOX_ATOM_TAG;
+	val.as_bits.payload = (uint32_t)(uintptr_t)pointer;
+	return val;
+}
+
+#endif
+
+#endif
@@ -24,6 +24,11 @@
 
 /*
  * oaht.h - A generic open addressing hash table
+ *
+ * There are two layouts. By default, the entries are stored in the slots of
+ * the table. If OAHT_COMPACT is defined, the entries are stored in insertion
+ * order in a dense array and the slots are small indices into it. See the
+ * compact layout below.
  */
 
 #ifndef OAHT_H
@@ -125,6 +130,8 @@
 #undef OAHT_NAME
 #define OAHT_NAME(name) OAHT_XNAME(OAHT_PREFIX, name)
 
+#ifndef OAHT_COMPACT
+
 /* A key-value pair */
 struct OAHT_NAME(_entry) {
 	#ifndef OAHT_NO_STORE_HASH
@@ -158,6 +165,12 @@ OAHT_NAME(_sizeof)(OAHT_SIZE_T mask) {
 		mask * sizeof(struct OAHT_NAME(_entry));
 }
 
+/* The size of the memory of a table. */
+static inline size_t
+OAHT_NAME(_bytes)(struct OAHT_PREFIX *a) {
+	return OAHT_NAME(_sizeof)(a->mask);
+}
+
 /* Create a duplicate */
 static inline struct OAHT_PREFIX *
 OAHT_NAME(_clone)(struct OAHT_PREFIX *a) {
@@ -280,14 +293,12 @@ OAHT_NAME(_lookup_helper)(struct OAHT_PREFIX *a, OAHT_KEY_T key, OAHT_HASH_T has
 	while (1) {
 		if (OAHT_IS_EMPTY_KEY(a->els[pos].key))
 			return freeslot ? freeslot : &a->els[pos];
-		if (OAHT_KEY_EQUALS(a->els[pos].key, key)
-		    || (
-		    	#ifndef OAHT_NO_STORE_HASH
-		    	a->els[pos].hash == hash &&
-		    	#endif
-		        !OAHT_IS_DELETED_KEY(a->els[pos].key) &&
-		        OAHT_KEY_EQUALS(a->els[pos].key, key)
-		       )
+		if (
+		    #ifndef OAHT_NO_STORE_HASH
+		    a->els[pos].hash == hash &&
+		    #endif
+		    !OAHT_IS_DELETED_KEY(a->els[pos].key) &&
+		    OAHT_KEY_EQUALS(a->els[pos].key, key)
 		   )
 			return &a->els[pos];
 		if (OAHT_IS_DELETED_KEY(a->els[pos].key) && !freeslot)
@@ -296,6 +307,17 @@ OAHT_NAME(_lookup_helper)(struct OAHT_PREFIX *a, OAHT_KEY_T key, OAHT_HASH_T has
 	}
 }
 
+/*
+ * Finds the entry of a key. Returns a pointer to it, which can be used to
+ * replace the value, or NULL if the key is not in the table. The pointer is
+ * valid until the table is modified.
+ */
+static inline struct OAHT_NAME(_entry) *
+OAHT_NAME(_find)(struct OAHT_PREFIX *a, OAHT_KEY_T key, OAHT_HASH_T hash) {
+	struct OAHT_NAME(_entry) *e = OAHT_NAME(_lookup_helper)(a, key, hash);
+	return OAHT_IS_EMPTY_KEY(e->key) || OAHT_IS_DELETED_KEY(e->key) ? NULL : e;
+}
+
 /*
  * Allocate and copy the contents to a new memory area. Returns a pointer to
  * the new memory. Used internally.
@@ -322,7 +344,7 @@ OAHT_NAME(_resize)(struct OAHT_PREFIX *a, OAHT_SIZE_T min_size) {
 		memcpy(eb, ea, sizeof(struct OAHT_NAME(_entry)));
 	}
 	/* Free the memory of the old table */
-	OAHT_FREE(a, OAHT_SIZEOF(a->mask));
+	OAHT_FREE(a, OAHT_NAME(_sizeof)(a->mask));
 	return b;
 }
 
@@ -427,5 +449,386 @@ OAHT_NAME(_delete)(struct OAHT_PREFIX *a, OAHT_KEY_T key) {
 	return a;
 }
 
+#else /* OAHT_COMPACT */
+
+/*
+ * The compact layout. The entries are stored in insertion order in a dense
+ * array, with their hashes. The open addressing is done in an index, a small
+ * array of 8, 16 or 32-bit entry numbers (plus one, so that zero is EMPTY),
+ * depending on the size of the index. Iterating, cloning and freeing only
+ * touch the entries, a resize doesn't rehash any key and the index costs 1-4
+ * bytes per slot instead of a whole entry. A deleted entry stays in the array,
+ * with the key DELETED, until the table is resized. Its index slot works like
+ * a deleted entry in the other layout.
+ *
+ * The index and the entries are allocated in-place, the index first, so the
+ * entries array can grow by reallocating the table. It grows up to the
+ * number of entries the index has room for.
+ */
+
+#ifdef OAHT_NO_VALUE
+	#error "OAHT_COMPACT doesn't support OAHT_NO_VALUE"
+#endif
+
+#include <stdint.h>
+
+/* A key-value pair with its hash */
+struct OAHT_NAME(_entry) {
+	OAHT_HASH_T hash;
+	OAHT_KEY_T key;
+	OAHT_VALUE_T value;
+};
+
+struct OAHT_PREFIX {
+	#ifdef OAHT_HEADER
+	OAHT_HEADER
+	#endif
+	OAHT_SIZE_T fill;   /* num used + deleted entries */
+	OAHT_SIZE_T used;   /* the number of used entries */
+	OAHT_SIZE_T mask;   /* number of slots in the index - 1 */
+	OAHT_SIZE_T cap;    /* allocated length of the entries array */
+	uint32_t index[];   /* index, then entries, allocated in-place */
+};
+
+/* The max number of entries in a table with mask mask. Less than 2/3 of the
+ * slots are used, so there is always at least one EMPTY slot. Used
+ * internally. */
+static inline OAHT_SIZE_T
+OAHT_NAME(_limit)(OAHT_SIZE_T mask) {
+	return (OAHT_SIZE_T)(((size_t)mask + 1) * 2 / 3);
+}
+
+/* The offset of the entries array in a table, after the index. Used
+ * internally. */
+static inline size_t
+OAHT_NAME(_entries_offset)(OAHT_SIZE_T mask) {
+	size_t width = mask < 0x100 ? 1 : mask < 0x10000 ? 2 : 4;
+	size_t end = offsetof(struct OAHT_PREFIX, index) + width * ((size_t)mask + 1);
+	return (end + 7) & ~(size_t)7;
+}
+
+/* Size to allocate for a struct oaht with mask mask and room for cap entries.
+ * Used internally. */
+static inline size_t
+OAHT_NAME(_sizeof)(OAHT_SIZE_T mask, OAHT_SIZE_T cap) {
+	return OAHT_NAME(_entries_offset)(mask) +
+		(size_t)cap * sizeof(struct OAHT_NAME(_entry));
+}
+
+/* The size of the memory of a table. */
+static inline size_t
+OAHT_NAME(_bytes)(struct OAHT_PREFIX *a) {
+	return OAHT_NAME(_sizeof)(a->mask, a->cap);
+}
+
+/* The entries array, in insertion order. Deleted entries have the key
+ * DELETED. */
+static inline struct OAHT_NAME(_entry) *
+OAHT_NAME(_entries)(struct OAHT_PREFIX *a) {
+	return (struct OAHT_NAME(_entry) *)
+		((char *)a + OAHT_NAME(_entries_offset)(a->mask));
+}
+
+/* The entry number plus one in a slot of the index, or 0 if it's EMPTY. Used
+ * internally. */
+static inline OAHT_SIZE_T
+OAHT_NAME(_slot)(struct OAHT_PREFIX *a, OAHT_SIZE_T pos) {
+	if (a->mask < 0x100)
+		return ((uint8_t *)a->index)[pos];
+	if (a->mask < 0x10000)
+		return ((uint16_t *)a->index)[pos];
+	return a->index[pos];
+}
+
+static inline void
+OAHT_NAME(_set_slot)(struct OAHT_PREFIX *a, OAHT_SIZE_T pos, OAHT_SIZE_T n) {
+	if (a->mask < 0x100)
+		((uint8_t *)a->index)[pos] = (uint8_t)n;
+	else if (a->mask < 0x10000)
+		((uint16_t *)a->index)[pos] = (uint16_t)n;
+	else
+		a->index[pos] = (uint32_t)n;
+}
+
+/* Creates a table with mask mask and room for cap entries. Used
+ * internally. */
+static inline struct OAHT_PREFIX *
+OAHT_NAME(_create_sized)(OAHT_SIZE_T mask, OAHT_SIZE_T cap) {
+	size_t offset = OAHT_NAME(_entries_offset)(mask);
+	struct OAHT_PREFIX *a = (struct OAHT_PREFIX *)
+		OAHT_ALLOC(offset + (size_t)cap * sizeof(struct OAHT_NAME(_entry)));
+	if (!a) OAHT_OOM();
+	memset(a, 0, offset); /* the header and the index */
+	a->mask = mask;
+	a->cap = cap;
+	return a;
+}
+
+/* The smallest mask of an index of a power of 2 slots >= min_size. Used
+ * internally. */
+static inline OAHT_SIZE_T
+OAHT_NAME(_mask_for)(OAHT_SIZE_T min_size) {
+	OAHT_SIZE_T size = OAHT_MIN_CAPACITY;
+	assert(OAHT_MIN_CAPACITY > 0);
+	while (size < min_size) {
+		size *= 2;
+		if (size < OAHT_MIN_CAPACITY) OAHT_OOM(); /* overflow */
+	}
+	return size - 1;
+}
+
+/*
+ * Creates an empty hashtable of a given initial size. As in the other layout,
+ * the size is the number of slots, and the entries array is allocated for as
+ * many entries as they have room for.
+ */
+static inline struct OAHT_PREFIX *
+OAHT_NAME(_create_presized)(OAHT_SIZE_T min_size) {
+	OAHT_SIZE_T mask = OAHT_NAME(_mask_for)(min_size);
+	return OAHT_NAME(_create_sized)(mask, OAHT_NAME(_limit)(mask));
+}
+
+/*
+ * Creates an empty hashtable with the minimum initial size.
+ */
+static inline struct OAHT_PREFIX *
+OAHT_NAME(_create)(void) {
+	return OAHT_NAME(_create_presized)(OAHT_MIN_CAPACITY);
+}
+
+/* Create a duplicate */
+static inline struct OAHT_PREFIX *
+OAHT_NAME(_clone)(struct OAHT_PREFIX *a) {
+	size_t size = OAHT_NAME(_bytes)(a);
+	struct OAHT_PREFIX *clone = (struct OAHT_PREFIX *)OAHT_ALLOC(size);
+	return memcpy(clone, a, size);
+}
+
+/*
+ * Frees the memory.
+ */
+static inline void
+OAHT_NAME(_destroy)(struct OAHT_PREFIX *a) {
+	OAHT_FREE(a, OAHT_NAME(_bytes)(a));
+}
+
+/*
+ * Returns the number of entries in the hashtable.
+ */
+static inline OAHT_SIZE_T
+OAHT_NAME(_len)(struct OAHT_PREFIX *a) {
+	return a->used;
+}
+
+/*
+ * A function to iterate over the keys and values in insertion order. Start by
+ * passing pos = 0. Pass the return value as i to get the next entry. When 0 is
+ * returned, there is no more entry to get.
+ *
+ * If a non-zero value is returned, k and v are assigned to point to a key and
+ * a value in the hashtable.
+ */
+static inline OAHT_SIZE_T
+OAHT_NAME(_iter)(struct OAHT_PREFIX *a, OAHT_SIZE_T pos, OAHT_KEY_T *k, OAHT_VALUE_T *v) {
+	struct OAHT_NAME(_entry) *entries = OAHT_NAME(_entries)(a);
+	for (; pos < a->fill; pos++) {
+		if (OAHT_IS_DELETED_KEY(entries[pos].key))
+			continue;
+		if (k) *k = entries[pos].key;
+		if (v) *v = entries[pos].value;
+		return pos + 1;
+	}
+	/* There are no more entries. */
+	return 0;
+}
+
+/*
+ * Looks up a key. Returns the slot in the index where the key is, or where it
+ * is to be inserted if it's not in the table, which is the first slot pointing
+ * to a deleted entry on the way or else the EMPTY slot where the probing
+ * stopped. *entry is set to the entry number, or to -1 if the key is not in the
+ * table. Used internally.
+ */
+static inline OAHT_SIZE_T
+OAHT_NAME(_probe)(struct OAHT_PREFIX *a, OAHT_KEY_T key, OAHT_HASH_T hash,
+                  OAHT_SIZE_T *entry) {
+	struct OAHT_NAME(_entry) *entries = OAHT_NAME(_entries)(a);
+	OAHT_SIZE_T pos = hash & a->mask; /* initial probe */
+	OAHT_SIZE_T freeslot = (OAHT_SIZE_T)-1;
+	assert(!OAHT_IS_EMPTY_KEY(key));
+	assert(!OAHT_IS_DELETED_KEY(key));
+	/* This will always terminate as there is always one empty slot */
+	while (1) {
+		OAHT_SIZE_T n = OAHT_NAME(_slot)(a, pos);
+		struct OAHT_NAME(_entry) *e;
+		if (n == 0) {
+			*entry = (OAHT_SIZE_T)-1;
+			return freeslot != (OAHT_SIZE_T)-1 ? freeslot : pos;
+		}
+		e = &entries[n - 1];
+		if (OAHT_IS_DELETED_KEY(e->key)) {
+			if (freeslot == (OAHT_SIZE_T)-1)
+				freeslot = pos;
+		} else if (e->hash == hash && OAHT_KEY_EQUALS(e->key, key)) {
+			*entry = n - 1;
+			return pos;
+		}
+		pos = (pos + 1) & a->mask;
+	}
+}
+
+/* The probing loop of _find for an index of a given type. A deleted entry
+ * never matches, since its key is DELETED. Used internally. */
+#undef OAHT_FIND_IN
+#define OAHT_FIND_IN(type) do { \
+		const type *index = (const type *)a->index; \
+		while (1) { \
+			OAHT_SIZE_T n = index[pos]; \
+			if (n == 0) \
+				return NULL; \
+			e = &entries[n - 1]; \
+			if (e->hash == hash && OAHT_KEY_EQUALS(e->key, key)) \
+				return e; \
+			pos = (pos + 1) & a->mask; \
+		} \
+	} while (0)
+
+/*
+ * Finds the entry of a key. Returns a pointer to it, which can be used to
+ * replace the value, or NULL if the key is not in the table. The pointer is
+ * valid until the table is modified.
+ */
+static inline struct OAHT_NAME(_entry) *
+OAHT_NAME(_find)(struct OAHT_PREFIX *a, OAHT_KEY_T key, OAHT_HASH_T hash) {
+	struct OAHT_NAME(_entry) *entries = OAHT_NAME(_entries)(a), *e;
+	OAHT_SIZE_T pos = hash & a->mask; /* initial probe */
+	assert(!OAHT_IS_EMPTY_KEY(key));
+	assert(!OAHT_IS_DELETED_KEY(key));
+	/* This will always terminate as there is always one empty slot */
+	if (a->mask < 0x100)
+		OAHT_FIND_IN(uint8_t);
+	else if (a->mask < 0x10000)
+		OAHT_FIND_IN(uint16_t);
+	else
+		OAHT_FIND_IN(uint32_t);
+}
+
+/*
+ * Allocate a table with an index of at least min_size slots and copy the
+ * entries to it, leaving out the deleted ones. The keys are not rehashed.
+ * Returns a pointer to the new memory. Used internally.
+ */
+static inline struct OAHT_PREFIX *
+OAHT_NAME(_resize)(struct OAHT_PREFIX *a, OAHT_SIZE_T min_size) {
+	OAHT_SIZE_T mask = OAHT_NAME(_mask_for)(min_size);
+	OAHT_SIZE_T cap = OAHT_NAME(_limit)(mask);
+	/* Leave some room to grow, but not all of it. */
+	if (cap > 2 * a->used + OAHT_MIN_CAPACITY)
+		cap = 2 * a->used + OAHT_MIN_CAPACITY;
+	struct OAHT_PREFIX *b = OAHT_NAME(_create_sized)(mask, cap);
+	struct OAHT_NAME(_entry) *ea = OAHT_NAME(_entries)(a);
+	struct OAHT_NAME(_entry) *eb = OAHT_NAME(_entries)(b);
+	OAHT_SIZE_T i, n = 0;
+	assert(a->used < cap);
+	/* copy user-defined header data */
+	#ifdef OAHT_HEADER
+	memcpy(b, a, offsetof(struct OAHT_PREFIX, fill));
+	#endif
+	/* copy the entries and index them by their stored hashes */
+	for (i = 0; i < a->fill; i++) {
+		OAHT_SIZE_T pos;
+		if (OAHT_IS_DELETED_KEY(ea[i].key))
+			continue;
+		eb[n] = ea[i];
+		pos = ea[i].hash & mask;
+		while (OAHT_NAME(_slot)(b, pos) != 0)
+			pos = (pos + 1) & mask;
+		OAHT_NAME(_set_slot)(b, pos, ++n);
+	}
+	b->used = b->fill = n;
+	/* Free the memory of the old table */
+	OAHT_FREE(a, OAHT_NAME(_bytes)(a));
+	return b;
+}
+
+/*
+ * Check if a key exists. Returns 1 if it does, 0 if it doesn't.
+ */
+static inline int
+OAHT_NAME(_contains)(struct OAHT_PREFIX *a, OAHT_KEY_T key) {
+	return OAHT_NAME(_find)(a, key, OAHT_HASH(key)) != NULL;
+}
+
+/*
+ * Fetch a value by its key. If it's not defined, default_value is returned.
+ */
+static inline OAHT_VALUE_T
+OAHT_NAME(_get)(struct OAHT_PREFIX *a, OAHT_KEY_T key, OAHT_VALUE_T default_value) {
+	struct OAHT_NAME(_entry) *entry = OAHT_NAME(_find)(a, key, OAHT_HASH(key));
+	return entry ? entry->value : default_value;
+}
+
+/*
+ * Insert or replace the element at the given key. Returns a pointer to the same
+ * memory location or to a new memory location if the memory has been
+ * reallocated. (If the hash tables has been reallocated, the old memory has
+ * been free'd.) A new key is added last in the iteration order.
+ */
+static inline struct OAHT_PREFIX *
+OAHT_NAME(_set)(struct OAHT_PREFIX *a, OAHT_KEY_T key, OAHT_VALUE_T value) {
+	OAHT_HASH_T hash = OAHT_HASH(key);
+	OAHT_SIZE_T entry;
+	OAHT_SIZE_T pos = OAHT_NAME(_probe)(a, key, hash, &entry);
+	struct OAHT_NAME(_entry) *e;
+	if (entry != (OAHT_SIZE_T)-1) {
+		e = &OAHT_NAME(_entries)(a)[entry];
+		e->key   = key;
+		e->value = value;
+		return a;
+	}
+	if (a->fill == OAHT_NAME(_limit)(a->mask)) {
+		/* The index is full. Make a bigger one. */
+		a = OAHT_NAME(_resize)(a, (a->used > 50000 ? 2 : 4) * (a->used + 1));
+		pos = OAHT_NAME(_probe)(a, key, hash, &entry);
+	} else if (a->fill == a->cap) {
+		/* Grow the entries array. The index doesn't move. */
+		OAHT_SIZE_T cap = 2 * a->cap + 1;
+		if (cap > OAHT_NAME(_limit)(a->mask))
+			cap = OAHT_NAME(_limit)(a->mask);
+		a = (struct OAHT_PREFIX *)OAHT_REALLOC(a,
+			OAHT_NAME(_sizeof)(a->mask, cap), OAHT_NAME(_bytes)(a));
+		if (!a) OAHT_OOM();
+		a->cap = cap;
+	}
+	e = &OAHT_NAME(_entries)(a)[a->fill];
+	e->hash  = hash;
+	e->key   = key;
+	e->value = value;
+	OAHT_NAME(_set_slot)(a, pos, ++a->fill);
+	a->used++;
+	return a;
+}
+
+/*
+ * Delete the given key from the hashtable. Returns a pointer to the same
+ * memory location or to a new memory location if the memory has been
+ * reallocated. (If the hash tables has been reallocated, the old memory has
+ * been free'd.) When most of the entries are deleted, the table is shrunk, so a
+ * sparse table doesn't cost more to iterate than a dense one.
+ */
+static inline struct OAHT_PREFIX *
+OAHT_NAME(_delete)(struct OAHT_PREFIX *a, OAHT_KEY_T key) {
+	struct OAHT_NAME(_entry) *entry = OAHT_NAME(_find)(a, key, OAHT_HASH(key));
+	if (entry) {
+		entry->key = OAHT_DELETED_KEY;
+		a->used--;
+		if (a->fill >= 4 * OAHT_MIN_CAPACITY && a->used * 4 < a->fill)
+			return OAHT_NAME(_resize)(a, 4 * a->used + 1);
+	}
+	return a;
+}
+
+#endif /* OAHT_COMPACT */
+
 #define OAHT_H
 #endif